@@ -0,0 +1,125 @@
+#pragma once
+
+/*	Brownian bridge construction
+	Init with the times of the Brownian increments consumed by the model, t_0 > 0 is implicitly preceded by 0
+	Transform a vector of independent Gaussians into another vector of independent Gaussians
+		such that the first inputs drive the coarsest features of the Brownian path:
+		input 0 makes the terminal point, input 1 the mid point, then the quarter points, etc.
+	The output is the normalized increments (W(t_i) - W(t_i-1)) / sqrt(t_i - t_i-1),
+		to be consumed by the model's SDE in place of the original Gaussians
+	Used with low discrepancy sequences, whose first dimensions are the best distributed */
+
+#include <vector>
+#include <queue>
+#include <cmath>
+using namespace std;
+
+class BrownianBridge
+{
+	size_t				myDim;
+
+	//	Construction order: point myIdx[k] is built from input k
+	//		out of left point myLeft[k] (-1 for time 0) and right point myRight[k] (-1 for none)
+	vector<size_t>		myIdx;
+	vector<int>			myLeft;
+	vector<int>			myRight;
+	vector<double>		myLeftWeight;
+	vector<double>		myRightWeight;
+	vector<double>		myStd;
+
+	//	1 / sqrt(t_i - t_i-1)
+	vector<double>		myInvSqrtDt;
+
+	//	Work space, Brownian path
+	vector<double>		myPath;
+
+public:
+
+	BrownianBridge() : myDim(0) {}
+
+	void init(const vector<double>& times)
+	{
+		myDim = times.size();
+		myIdx.resize(myDim);
+		myLeft.resize(myDim);
+		myRight.resize(myDim);
+		myLeftWeight.resize(myDim);
+		myRightWeight.resize(myDim);
+		myStd.resize(myDim);
+		myInvSqrtDt.resize(myDim);
+		myPath.resize(myDim);
+
+		if (!myDim) return;
+
+		for (size_t i = 0; i<myDim; ++i)
+		{
+			myInvSqrtDt[i] = 1.0 / sqrt(times[i] - (i ? times[i - 1] : 0.0));
+		}
+
+		//	Terminal point first
+		myIdx[0] = myDim - 1;
+		myLeft[0] = -1;
+		myRight[0] = -1;
+		myLeftWeight[0] = myRightWeight[0] = 0.0;
+		myStd[0] = sqrt(times[myDim - 1]);
+
+		//	Then break intervals in the middle, breadth first
+		//	Interval (l, r) with l, r already built and all points strictly between to be built
+		queue<pair<int, int>> intervals;
+		intervals.push(make_pair(-1, int(myDim) - 1));
+		size_t k = 1;
+		while (!intervals.empty())
+		{
+			const int l = intervals.front().first, r = intervals.front().second;
+			intervals.pop();
+
+			if (r - l < 2) continue;
+
+			const int m = l + (r - l) / 2;
+			const double tl = l >= 0 ? times[l] : 0.0, tm = times[m], tr = times[r];
+
+			myIdx[k] = m;
+			myLeft[k] = l;
+			myRight[k] = r;
+			myLeftWeight[k] = (tr - tm) / (tr - tl);
+			myRightWeight[k] = (tm - tl) / (tr - tl);
+			myStd[k] = sqrt((tm - tl) * (tr - tm) / (tr - tl));
+			++k;
+
+			intervals.push(make_pair(l, m));
+			intervals.push(make_pair(m, r));
+		}
+	}
+
+	size_t dim() const
+	{
+		return myDim;
+	}
+
+	//	Gaussians in, bridged normalized increments out, both of dimension dim()
+	void transform(const vector<double>& gaussIn, vector<double>& gaussOut)
+	{
+		transform(gaussIn.data(), gaussOut.data());
+	}
+
+	//	Same with raw pointers, for example into a block of paths
+	void transform(const double* gaussIn, double* gaussOut)
+	{
+		if (!myDim) return;
+
+		//	Build the path in bridge order
+		myPath[myIdx[0]] = myStd[0] * gaussIn[0];
+		for (size_t k = 1; k<myDim; ++k)
+		{
+			const double wl = myLeft[k] >= 0 ? myPath[myLeft[k]] : 0.0;
+			myPath[myIdx[k]] = myLeftWeight[k] * wl + myRightWeight[k] * myPath[myRight[k]] + myStd[k] * gaussIn[k];
+		}
+
+		//	Normalized increments
+		gaussOut[0] = myPath[0] * myInvSqrtDt[0];
+		for (size_t i = 1; i<myDim; ++i)
+		{
+			gaussOut[i] = (myPath[i] - myPath[i - 1]) * myInvSqrtDt[i];
+		}
+	}
+};
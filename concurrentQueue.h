@@ -0,0 +1,96 @@
+#pragma once
+
+//  Basic thread safe queue, used by the thread pool to dispatch tasks
+//  Pop waits until an element is available or the queue is interrupted
+//  TryPop never waits
+
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
+
+template <class T>
+class ConcurrentQueue
+{
+    queue<T>                myQueue;
+    mutable mutex           myMutex;
+    condition_variable      myCV;
+
+    //  Interruption flag, when set, waiting threads return from pop
+    bool                    myInterrupt;
+
+public:
+
+    ConcurrentQueue() : myInterrupt(false) {}
+    ~ConcurrentQueue() { interrupt(); }
+
+    bool empty() const
+    {
+        lock_guard<mutex> lk(myMutex);
+        return myQueue.empty();
+    }
+
+    //  Pop into t if not empty, returns true on success, never waits
+    bool tryPop(T& t)
+    {
+        lock_guard<mutex> lk(myMutex);
+        if (myQueue.empty()) return false;
+
+        //  Move, not copy
+        t = move(myQueue.front());
+        myQueue.pop();
+
+        return true;
+    }
+
+    //  Pop into t, wait until the queue is not empty or interrupted
+    //  Returns false on interruption
+    bool pop(T& t)
+    {
+        unique_lock<mutex> lk(myMutex);
+
+        //  Wait until the queue is not empty or interrupted, release the lock while waiting
+        while (!myInterrupt && myQueue.empty()) myCV.wait(lk);
+
+        //  Interrupted
+        if (myInterrupt) return false;
+
+        t = move(myQueue.front());
+        myQueue.pop();
+
+        return true;
+    }
+
+    //  Push, notify one waiting thread
+    void push(T t)
+    {
+        {
+            lock_guard<mutex> lk(myMutex);
+            myQueue.push(move(t));
+        }
+        //  Release the lock before notifying
+        myCV.notify_one();
+    }
+
+    //  Wake up all waiting threads so they return from pop
+    void interrupt()
+    {
+        {
+            lock_guard<mutex> lk(myMutex);
+            myInterrupt = true;
+        }
+        myCV.notify_all();
+    }
+
+    void resetInterrupt()
+    {
+        lock_guard<mutex> lk(myMutex);
+        myInterrupt = false;
+    }
+
+    void clear()
+    {
+        lock_guard<mutex> lk(myMutex);
+        while (!myQueue.empty()) myQueue.pop();
+    }
+};
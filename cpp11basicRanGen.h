@@ -7,8 +7,10 @@
 	Each coordinate is an independent Normal( 0, 1) */
 
 #include <random>
+#include <stdexcept>
 #include <vector>
 #include <memory>
+#include <algorithm>
 using namespace std;
 
 struct randomgen_error : public runtime_error
@@ -21,6 +23,8 @@ class RandomGen
 {
 public:
 
+    virtual ~RandomGen() {}
+
     //  Initialise for a given dimension
     virtual void init( const size_t dim) = 0;
 
@@ -30,6 +34,19 @@ public:
     //  Access Gaussian vector byRef
     virtual const vector<double>& getNorm() const = 0;
 
+    //  Generate the next nPaths random points in one call, into out[path * dim + i]
+    //  Same numbers as nPaths successive calls to genNextNormVec()
+    //  Concrete generators override with vectorized implementations
+    virtual void genNextNormBlock( const size_t nPaths, double* out)
+    {
+        for (size_t p = 0; p<nPaths; ++p)
+        {
+            genNextNormVec();
+            const vector<double>& norm = getNorm();
+            copy(norm.begin(), norm.end(), out + p * norm.size());
+        }
+    }
+
     //  Clone
     virtual unique_ptr<RandomGen> clone() const = 0;
 
@@ -38,6 +55,12 @@ public:
 	{
 		throw randomgen_error("Concrete random generator cannot be used for parallel simulations");
 	}
+
+	//	Random access: the next point generated is the one with the given path index
+	virtual void setPath(const size_t)
+	{
+		throw randomgen_error("Concrete random generator does not support random access");
+	}
 };
 
 //  Basic C++11
@@ -81,4 +104,12 @@ public:
     {
         return unique_ptr<RandomGen>(new BasicRanGen(*this));
     }
+
+	//	Skip ahead by generating and discarding skip points
+	//	Linear in skip: reproduces the serial sequence exactly, 
+	//		but a generator with fast skip ahead should be preferred for parallel simulations
+	void skipAhead(const long skip) override
+	{
+		for (long i = 0; i<skip; ++i) genNextNormVec();
+	}
 };
\ No newline at end of file
@@ -3,10 +3,750 @@
 #include "scriptingVarIndexer.h"
 #include "scriptingEvaluator.h"
 #include "scriptingScenarios.h"
+#include "scriptingProduct.h"
+#include "scriptingModel.h"
+#include <cstdio>
+#include <algorithm>
+#include <set>
 
-int main() {
+// Check that compiled scripts produce the same results as the tree evaluator
+// on all compiled backends, including the SIMD lanes, for the outputs, all variables by default,
+// returns the number of mismatches
+int checkCompiled(
+    const std::string& what, 
+    const std::vector<std::map<Date, std::string>>& scripts, 
+    const std::vector<std::string>& outputs = std::vector<std::string>()) {
+    const double spots[] = { 80.0, 95.0, 100.0, 105.0, 120.0 };
+
+    int bad = 0;
+    for (const auto& events : scripts) {
+        Product prd;
+        prd.parseEvents(events.begin(), events.end());
+        prd.preProcess(false, false);
+        prd.compile(std::vector<double>(), false, 0.0, outputs);
+
+        const std::vector<size_t>& vars = prd.outputVars();
+        const std::vector<size_t>& slots = prd.outputSlots();
+        Evaluator<double> eval = prd.buildEvaluator<double>();
+        EvalState<double> compiled(prd.compiledStateSize()), decoded(prd.compiledStateSize()), registers(prd.numRegisters());
+        std::unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
+
+        // All the spots on the SIMD lanes, by path then event
+        const size_t numSpots = sizeof(spots) / sizeof(spots[0]), numEvents = scen->size();
+        std::vector<double> blockSpots, blockNumeraires(numSpots * numEvents, 1.0), blockVals;
+        for (const double spot : spots) {
+            for (size_t i = 0; i < numEvents; ++i) blockSpots.push_back(spot * (1.0 + 0.1 * i));
+        }
+        const ScenarioBlock<double> block = { numSpots, blockSpots.data(), 1, numEvents, blockNumeraires.data(), 1, numEvents };
+        EvalStateLanes lanes(prd.compiledStateSize());
+        for (size_t first = 0; first < numSpots; first += lanes.width()) {
+            const size_t n = std::min(lanes.width(), numSpots - first);
+            prd.evaluateCompiledBlock(block.subBlock(first, n), lanes);
+            for (size_t p = 0; p < n; ++p) {
+                for (const size_t s : slots) blockVals.push_back(lanes.varVals(s)[p]);
+            }
+        }
+
+        for (size_t p = 0; p < numSpots; ++p) {
+            const double spot = spots[p];
+            for (size_t i = 0; i < numEvents; ++i) {
+                (*scen)[i].spot = spot * (1.0 + 0.1 * i);
+                (*scen)[i].numeraire = 1.0;
+            }
+            prd.evaluate(*scen, eval);
+            prd.evaluateCompiled(*scen, compiled);
+            prd.evaluateDecoded(*scen, decoded);
+            prd.evaluateRegisters(*scen, registers);
+
+            for (size_t v = 0; v < slots.size(); ++v) {
+                const double expected = eval.varVals()[vars[v]];
+                const size_t s = slots[v];
+                const double lane = blockVals[p * slots.size() + v];
+                if (compiled.variables[s] != expected || decoded.variables[s] != expected
+                    || registers.variables[s] != expected || lane != expected) {
+                    std::cout << what << " mismatch on " << prd.varNames()[vars[v]] << " spot " << spot
+                        << ": " << expected << " " << compiled.variables[s] << " "
+                        << decoded.variables[s] << " " << registers.variables[s] << " " << lane << std::endl;
+                    ++bad;
+                }
+            }
+        }
+    }
+    return bad;
+}
+
+// Number of instructions op in the compiled code of a script
+size_t countCompiled(const std::map<Date, std::string>& events, const int op) {
+    Product prd;
+    prd.parseEvents(events.begin(), events.end());
+    prd.preProcess(false, false);
+    prd.compile();
+
+    const std::vector<int>& code = prd.program().nodeStream;
+    size_t count = 0;
+    for (size_t i = 0; i < code.size(); i += compiledLength(code.data(), i)) {
+        if (code[i] == op) ++count;
+    }
+    return count;
+}
+
+// Check that compiled FOR loops produce the same results as the tree evaluator
+// on all compiled backends, returns the number of mismatches
+int checkCompiledFor() {
+    return checkCompiled("FOR", {
+        // Constant values, nested loop and if inside the body
+        { { 1, "FOR K IN [90, 100, 110] THEN IF SPOT() > K THEN C = C + SPOT() - K ELSE P = P + K - SPOT() ENDIF ENDFOR" },
+          { 2, "FOR I IN [1, 2] THEN FOR J IN [10, 20, 30] THEN S = S + I * J + SPOT() ENDFOR ENDFOR X PAYS S" } },
+        // Loop inside if-true and if-false statements, loop variable read after the loop
+        { { 1, "IF SPOT() > 100 THEN FOR K IN [1, 2, 3] THEN A = A * 2 + K ENDFOR ELSE FOR K IN [4, 5] THEN A = A - K ENDFOR ENDIF B = K" } },
+        // Non constant values are unrolled
+        { { 1, "Y = 1 FOR K IN [SPOT(), Y + 1, 3] THEN Y = Y + K ENDFOR" } },
+    });
+}
+
+// Check that optimized scripts produce the same results as the tree evaluator
+// on all compiled backends, and that the optimizer removed what it should,
+// returns the number of mismatches
+int checkOptimizer() {
+    // Script, and an instruction left in its code only without the optimization, -1 if none
+    const std::vector<std::pair<std::map<Date, std::string>, int>> scripts = {
+        // Constant and copy propagation, folded into the constant forms of the operations
+        { { { 1, "A = 2 B = A C = B * SPOT() + A" } }, Var },
+        { { { 1, "A = 2" }, { 2, "B = A D = B - 1 C = SPOT() / B + D" } }, Var },
+        // Comparisons of constants folded into True and False, then the dead branches
+        { { { 1, "N = 3" }, { 2, "IF N > 2 THEN X = SPOT() ELSE X = 1 ENDIF IF N < 0 THEN Y = SPOT() ELSE Y = 2 ENDIF" } }, IfElse },
+        { { { 1, "N = 0" }, { 2, "IF N = 0 THEN X = SPOT() ENDIF IF N >= 0 AND SPOT() > 100 THEN Y = 1 ENDIF" } }, -1 },
+        // Dead stores, with the computation of their values
+        { { { 1, "T = SPOT() * 2 T = SPOT() X = T" } }, Mult },
+        { { { 1, "T = SPOT() * 2" }, { 2, "T = 1 X = T + SPOT()" } }, Mult },
+        // If-false statements made empty by dead store elimination, IfElse rewritten into If
+        { { { 1, "IF SPOT() > 100 THEN X = 1 ELSE T = 2 ENDIF T = 3" } }, IfElse },
+        // Facts that do not hold: values assigned on one path, in loops, copies of reassigned variables
+        { { { 1, "A = 1 IF SPOT() > 100 THEN A = 2 ENDIF X = A * 3" } }, -1 },
+        { { { 1, "A = 1 FOR K IN [1, 2, 3] THEN X = X + A A = A + K ENDFOR" } }, -1 },
+        { { { 1, "B = SPOT() A = B B = 1 X = A + B" } }, -1 },
+        // Stores read in later events, and payments, are not dead
+        { { { 1, "T = SPOT()" }, { 2, "X = T T = 0" } }, -1 },
+        { { { 1, "Y PAYS 1 Y PAYS SPOT()" } }, -1 },
+    };
+
+    std::vector<std::map<Date, std::string>> events;
+    for (const auto& script : scripts) events.push_back(script.first);
+    int bad = checkCompiled("Optimizer", events);
+
+    for (const auto& script : scripts) {
+        if (script.second >= 0 && countCompiled(script.first, script.second)) {
+            std::cout << "Not optimized: " << script.first.begin()->second << std::endl;
+            ++bad;
+        }
+    }
+    return bad;
+}
+
+// Check that scripts with common subexpressions produce the same results as the tree evaluator
+// on all compiled backends, and that the subexpressions are computed as many times as they should,
+// returns the number of mismatches
+int checkCommonSubexpressions() {
+    struct Script {
+        std::map<Date, std::string> events;
+        int op;
+        size_t count;
+    };
+    // Script, an instruction and the number of times it is left in the code
+    const std::vector<Script> scripts = {
+        // Shared subexpressions, computed once into hidden slots and read back
+        { { { 1, "X = MAX(SPOT() - 100, 0) * 2 + LOG(SPOT() + 1) Y = MAX(SPOT() - 100, 0) * 2 - LOG(SPOT() + 1) "
+                 "Z = MAX(SPOT() - 100, 0) * 2 * LOG(SPOT() + 1)" } }, Log, 1 },
+        // Recomputed after an operand is reassigned, unconditionally or in a branch
+        { { { 1, "A = SPOT() X = SQRT(A * A + 1) + SQRT(A * A + 1) A = A + 1 Y = SQRT(A * A + 1) + SQRT(A * A + 1)" } }, Sqrt, 2 },
+        { { { 1, "A = SPOT() X = SQRT(A * A + 1) IF SPOT() > 100 THEN A = 1 ENDIF Y = SQRT(A * A + 1) Z = SQRT(A * A + 1)" } }, Sqrt, 2 },
+        // Only available in the branch, loop body or lazy argument where computed
+        { { { 1, "IF SPOT() > 100 THEN X = LOG(SPOT() * 3 + 1) + LOG(SPOT() * 3 + 1) ELSE X = 2 ENDIF "
+                 "Y = LOG(SPOT() * 3 + 1) * 2 Z = LOG(SPOT() * 3 + 1)" } }, Log, 2 },
+        { { { 1, "FOR K IN [1, 2] THEN X = X + LOG(SPOT() + 5) ENDFOR Y = LOG(SPOT() + 5) Z = LOG(SPOT() + 5)" } }, Log, 2 },
+        { { { 1, "FOR K IN [1, 2, 3] THEN X = X + SQRT(SPOT() * K) Y = Y + SQRT(SPOT() * K) ENDFOR Z = SQRT(SPOT() * K)" } }, Sqrt, 2 },
+        { { { 1, "X = SMOOTH(SPOT() - 100, LOG(SPOT() + 7) * 2, 0, 1) Y = LOG(SPOT() + 7) * 2 Z = LOG(SPOT() + 7) * 2" } }, Log, 2 },
+        // Not shared across events
+        { { { 1, "X = LOG(SPOT() + 1) * 2 Y = LOG(SPOT() + 1) * 2" }, { 2, "Z = LOG(SPOT() + 1) * 2" } }, Log, 2 },
+        // Hidden slot stored in a branch and never read back: Assign s, Var s removed by the optimizer
+        { { { 1, "IF SPOT() > 100 THEN X = LOG(SPOT() * 3 + 1) ENDIF Y = LOG(SPOT() * 3 + 1)" } }, Assign, 2 },
+    };
+
+    std::vector<std::map<Date, std::string>> events;
+    for (const auto& script : scripts) events.push_back(script.events);
+    int bad = checkCompiled("Common subexpression", events);
+
+    for (const auto& script : scripts) {
+        const size_t count = countCompiled(script.events, script.op);
+        if (count != script.count) {
+            std::cout << "Common subexpression computed " << count << " times instead of " << script.count 
+                << ": " << script.events.begin()->second << std::endl;
+            ++bad;
+        }
+    }
+    return bad;
+}
+
+// Check that scripts compiled for a subset of their variables produce the same results as the tree evaluator
+// on all compiled backends, in outputSlots(), that the variables share slots when they can,
+// and that only the slots read before written are zeroed, returns the number of mismatches
+int checkOutputs() {
+    struct Script {
+        std::map<Date, std::string> events;
+        std::vector<std::string> outputs;
+        size_t maxSlots;
+        size_t numZeroed;
+    };
+    // Script, outputs, maximum number of slots and number of zeroed slots
+    const std::vector<Script> scripts = {
+        // Intermediate variables with disjoint lives share a slot
+        { { { 1, "A = SPOT() + 1 X = A * A B = SPOT() + 2 Y = B * B C = SPOT() + 3 Z = C * C" } }, { "X", "Y", "Z" }, 4, 0 },
+        { { { 1, "A = SPOT() * 2 B = A + 1 C = B * B D = SPOT() - 100 X = MAX(D, 0) Y = C + X" } }, { "Y" }, 2, 0 },
+        { { { 1, "A = SPOT() * 2 B = A + 1 C = B * B D = SPOT() - 100 X = MAX(D, 0) Y = C + X" } }, { "A", "X" }, 3, 0 },
+        // Accumulated across events, the initial 0 is propagated into the first event: nothing to zero
+        { { { 1, "S = S + SPOT() T = SPOT()" }, { 2, "S = S + SPOT() T = T + SPOT()" }, { 3, "S = S + SPOT()" } }, { "S" }, 1, 0 },
+        // Outputs read before written: assigned conditionally, or accumulated in a loop
+        { { { 1, "A = SPOT() * 2 IF A > 200 THEN X = A ENDIF Y = A + 1" } }, { "X" }, 2, 1 },
+        { { { 1, "A = SPOT()" }, { 2, "FOR K IN [1, 2, 3] THEN B = B + A * K ENDFOR X = B" } }, { "X" }, 4, 1 },
+    };
+
+    int bad = 0;
+    for (const auto& script : scripts) {
+        bad += checkCompiled("Outputs", { script.events }, script.outputs);
+
+        Product prd;
+        prd.parseEvents(script.events.begin(), script.events.end());
+        prd.preProcess(false, false);
+        prd.compile(std::vector<double>(), false, 0.0, script.outputs);
+        if (prd.compiledStateSize() > script.maxSlots || prd.numZeroedSlots() != script.numZeroed) {
+            std::cout << "Outputs in " << prd.compiledStateSize() << " slots, " << prd.numZeroedSlots() << " zeroed, instead of "
+                << script.maxSlots << " and " << script.numZeroed << ": " << script.events.begin()->second << std::endl;
+            ++bad;
+        }
+    }
+    return bad;
+}
+
+// Check that products nested deeper than the register machine, loops or conditions,
+// are evaluated on the stack code by the register, JIT and native backends,
+// as the Evaluator on the tree and in line with the closed form of X, returns the number of mismatches
+int checkDeepNesting() {
+    // Loops: X = SPOT() + the value of the innermost loop
+    const int numLoops = REGMAXLOOPS + 1;
+    std::string loops;
+    for (int k = 0; k < numLoops; ++k) loops += "FOR K" + std::to_string(k) + " IN [" + std::to_string(k) + "] THEN ";
+    loops += "X = SPOT() + K" + std::to_string(numLoops - 1) + " ";
+    for (int k = 0; k < numLoops; ++k) loops += "ENDFOR ";
+
+    // Conditions: SPOT() > 0 AND (SPOT() > 1 OR (SPOT() > 2 AND (...))), 
+    // every short-circuit holds its lhs until the rhs is evaluated
+    const int numConds = REGMAXBOOLS + 2;
+    std::string conds;
+    for (int k = 0; k < numConds; ++k) conds += (k == 0 ? "(" : k % 2 ? " AND (" : " OR (") + std::string("SPOT() > ") + std::to_string(k);
+    conds = "IF " + conds + std::string(numConds, ')') + " THEN X = 1 ELSE X = 0 ENDIF";
+    auto condsVal = [numConds](const double spot) {
+        bool res = spot > numConds - 1;
+        for (int k = numConds - 2; k >= 0; --k) res = (k + 1) % 2 ? spot > k && res : spot > k || res;
+        return res ? 1.0 : 0.0;
+    };
+
+    const double spots[] = { 0.5, 10.5, 100.0 };
+
+    int bad = 0;
+    for (const bool isLoops : { true, false }) {
+        const std::map<Date, std::string> events = { { 1, isLoops ? loops : conds } };
+        Product prd;
+        prd.parseEvents(events.begin(), events.end());
+        prd.preProcess(false, false);
+        prd.compile();
+        if (!prd.regCode().empty() || prd.compileJit()) {
+            std::cout << "Register code for a product nested too deep" << std::endl;
+            ++bad;
+        }
+        prd.compileNative();
+
+        // The tree evaluators refuse scripts this deep, but the sharp Evaluator never holds
+        // more than one value on its stacks in these, run it directly over the statements
+        const size_t xIdx = std::find(prd.varNames().begin(), prd.varNames().end(), "X") - prd.varNames().begin();
+        const size_t x = prd.outputSlots()[xIdx];
+        Evaluator<double> eval(prd.varNames().size());
+        EvalState<double> compiled(prd.compiledStateSize()), registers(prd.numRegisters()), 
+            jit(prd.numRegisters()), native(prd.numRegisters());
+        std::unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
+
+        for (const double spot : spots) {
+            (*scen)[0].spot = spot;
+            (*scen)[0].numeraire = 1.0;
+            eval.init();
+            eval.setScenario(scen.get());
+            eval.setCurEvt(0);
+            prd.visit(eval);
+            prd.evaluateCompiled(*scen, compiled);
+            prd.evaluateRegisters(*scen, registers);
+            prd.evaluateJit(*scen, jit);
+            prd.evaluateNative(*scen, native);
+
+            const double expected = eval.varVals()[xIdx];
+            const double closedForm = isLoops ? spot + numLoops - 1 : condsVal(spot);
+            if (expected != closedForm || compiled.variables[x] != expected || registers.variables[x] != expected 
+                || jit.variables[x] != expected || native.variables[x] != expected) {
+                std::cout << "Deep nesting mismatch, " << (isLoops ? "loops" : "conditions") << " spot " << spot
+                    << ": " << closedForm << " " << expected << " " << compiled.variables[x] << " " 
+                    << registers.variables[x] << " " << jit.variables[x] << " " << native.variables[x] << std::endl;
+                ++bad;
+            }
+        }
+    }
+    return bad;
+}
+
+// Scripts over all the instructions of the register code but loops, see checkJit() and checkNative()
+std::vector<std::map<Date, std::string>> registerScripts() {
+    return {
+        // Arithmetic, with registers and constants on either side, and its superinstructions
+        { { 1, "A = SPOT() * 2 B = A + SPOT() C = SPOT() + 1 D = A - SPOT() E = SPOT() - 100 F = 100 - SPOT() "
+               "G = A * B H = A / B I = SPOT() / 4 J = 3 / SPOT() K = -SPOT() L = K + SPOT() / 8 M = SPOT() * 3 / 4" } },
+        // Functions
+        { { 1, "A = SPOT() / 100 B = A ^ A C = SPOT() ^ 0.5 D = 2 ^ A E = LOG(SPOT()) F = SQRT(SPOT()) "
+               "G = MAX(A, C) H = MAX(SPOT(), 90) I = MIN(A, C) J = MIN(SPOT(), 110) K = MAX(E, SPOT() - 100) L = MAX(SPOT() - 100, 0)" } },
+        // Comparisons, alone and as conditions, short-circuits and their combinations
+        { { 1, "A = SPOT() B = SPOT() / 2 "
+               "IF A > 100 THEN X = 1 ELSE X = 0 ENDIF IF A >= 100 THEN Y = A ENDIF IF A = 100 THEN Z = 1 ENDIF "
+               "IF A < 100 THEN U = 1 ENDIF IF A <= 100 THEN V = 1 ENDIF IF A != 100 THEN W = 1 ENDIF "
+               "IF A > B THEN P = 1 ENDIF IF A >= B THEN Q = 1 ENDIF IF A = B THEN R = 1 ENDIF "
+               "IF A > 90 AND A < 110 THEN S = 1 ENDIF IF A < 90 OR A > 110 THEN T = 1 ENDIF "
+               "IF (A > 90 AND A < 110) OR A > 115 THEN C = 1 ENDIF IF (A < 90 OR A > 110) AND A < 115 THEN D = 1 ENDIF "
+               "IF A > 150 OR (A > B AND A < 2 * B) THEN E = 1 ENDIF IF (A >= B OR A = B) AND (A >= 95 OR A <= 80) THEN F = 1 ENDIF "
+               "IF (A = 95 OR A = B) AND A < 115 THEN G = 1 ENDIF" } },
+        // Comparisons of constants, folded into True and False
+        { { 1, "N = 3" }, { 2, "IF (SPOT() > 100 OR N > 2) AND SPOT() < 130 THEN X = 1 ENDIF "
+                               "IF (SPOT() > 100 AND N < 2) OR SPOT() < 90 THEN Y = 1 ENDIF" } },
+        // Smooth, payments over events
+        { { 1, "X = SMOOTH(SPOT() - 100, SPOT(), 100, 10) Z = SMOOTH(SPOT() - 100, SPOT() * 2, LOG(SPOT()), 10) Y PAYS SPOT() - 100" },
+          { 2, "Y PAYS 2 * SPOT() Y PAYS 5 IF SPOT() > 100 THEN Y PAYS X ENDIF" } },
+    };
+}
+
+// Check that JIT compiled scripts produce the same results as the register machine and the tree evaluator,
+// sharp, with and without the numeraires folded into the code, and fuzzy, where evaluateJit() runs the stack code,
+// over all the instructions that the JIT translates, returns the number of mismatches
+int checkJit() {
+    const std::vector<std::map<Date, std::string>> scripts = registerScripts();
+    // Instructions translated by compileJit(), each one must be in the register code of a script,
+    // but IfAnd, never fused as the And after a short-circuit is always the target of its AndJump
+    const int jitOps[] = { Add, AddConst, Sub, SubConst, ConstSub, Mult, MultConst, Div, DivConst, ConstDiv,
+        Max2, Max2Const, Min2, Min2Const, Pow, PowConst, ConstPow, Log, Sqrt, Uminus, Spot, Assign, AssignConst,
+        Pays, PaysConst, PaysScaled, PaysScaledConst, MultConstPaysScaled, If, AndJump, OrJump, Jump,
+        Equal, Sup, SupEqual, SubConstSup, SubConstSupEqual, SubConstEqual, ConstSubSup, ConstSubSupEqual,
+        IfSubConstSup, IfSubConstSupEqual, IfSubConstEqual, IfConstSubSup, IfConstSubSupEqual, And, Or, Not, True, False,
+        SmoothBegin, SmoothMid, Smooth, DivConstAdd, MultConstDivConst, SubConstMax2, SubConstMax2Const, Halt };
+    const double spots[] = { 80.0, 95.0, 100.0, 105.0, 120.0 };
+    const double defEps = 1.0;
+
+    int bad = 0;
+    std::set<int> covered;
+    for (const auto& events : scripts) {
+        for (const int mode : { 0, 1, 2 }) {
+            // Sharp, sharp with numeraires folded, fuzzy
+            const bool fuzzy = mode == 2;
+            Product prd;
+            prd.parseEvents(events.begin(), events.end());
+            const size_t maxNestedIfs = prd.preProcess(fuzzy, false);
+            std::unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
+            const size_t numEvents = scen->size();
+            std::vector<double> numeraires;
+            for (size_t i = 0; i < numEvents; ++i) numeraires.push_back(1.0 + 0.05 * i);
+            prd.compile(mode == 1 ? numeraires : std::vector<double>(), fuzzy, defEps);
+
+            if (!fuzzy) {
+                for (const auto& ins : prd.regCode()) covered.insert(ins.op);
+#ifdef SCRIPTING_JIT
+                if (!prd.compileJit()) {
+                    std::cout << "Not JIT compiled: " << events.begin()->second << std::endl;
+                    ++bad;
+                }
+#endif
+            }
+
+            const std::vector<size_t>& vars = prd.outputVars();
+            const std::vector<size_t>& slots = prd.outputSlots();
+            Evaluator<double> eval = prd.buildEvaluator<double>();
+            FuzzyEvaluator<double> fuzzyEval = prd.buildFuzzyEvaluator<double>(maxNestedIfs, defEps);
+            EvalState<double> compiled(prd.compiledStateSize()), registers(prd.numRegisters()), jit(prd.numRegisters());
+
+            for (const double spot : spots) {
+                for (size_t i = 0; i < numEvents; ++i) {
+                    (*scen)[i].spot = spot * (1.0 + 0.1 * i);
+                    (*scen)[i].numeraire = numeraires[i];
+                }
+                if (fuzzy) prd.evaluate(*scen, fuzzyEval);
+                else prd.evaluate(*scen, eval);
+                const std::vector<double>& treeVals = fuzzy ? fuzzyEval.varVals() : eval.varVals();
+                prd.evaluateCompiled(*scen, compiled);
+                prd.evaluateRegisters(*scen, registers);
+                prd.evaluateJit(*scen, jit);
+
+                for (size_t v = 0; v < slots.size(); ++v) {
+                    const size_t s = slots[v];
+                    // Folded numeraires scale payments by their inverse, as the stack code does
+                    const double expected = mode == 1 ? compiled.variables[s] : treeVals[vars[v]];
+                    if (registers.variables[s] != expected || jit.variables[s] != expected) {
+                        std::cout << "JIT mismatch, mode " << mode << ", on " << prd.varNames()[vars[v]] << " spot " << spot
+                            << ": " << expected << " " << registers.variables[s] << " " << jit.variables[s] << std::endl;
+                        ++bad;
+                    }
+                }
+            }
+        }
+    }
+
+    for (const int op : jitOps) {
+        if (!covered.count(op)) {
+            std::cout << "JIT instruction " << op << " not covered" << std::endl;
+            ++bad;
+        }
+    }
+
+    // IfAnd on hand written register code: X = 1 if 90 < SPOT() < 110, X in register 0, spot in register 1
+    const std::vector<RegInstr> ifAnd = {
+        { Spot, 1, 0, 0, 0, 0, 0.0, 0.0 },
+        { SubConstSup, 0, 1, 0, 0, 0, 90.0, 0.0 },
+        { ConstSubSup, 1, 1, 0, 0, 0, 110.0, 0.0 },
+        { IfAnd, 0, 0, 5, 0, 1, 0.0, 0.0 },
+        { AssignConst, 0, 0, 0, 0, 0, 1.0, 0.0 },
+        { Halt, 0, 0, 0, 0, 0, 0.0, 0.0 } };
+    const std::unique_ptr<JitCode> ifAndJit = compileJit(ifAnd, { 0, ifAnd.size() });
+    Scenario<double> path(1);
+    const Scenario<double>& scen = path;
+    for (const double spot : spots) {
+        path[0].spot = spot;
+        path[0].numeraire = 1.0;
+        EvalState<double> registers(2), jit(2);
+        registers.init(2);
+        jit.init(2);
+        evalRegisters(ifAnd, scen[0], registers);
+        if (ifAndJit) ifAndJit->function()(&scen.spot(0), scen.spotStride(), &scen.numeraire(0), scen.numStride(), jit.variables.data());
+        const double expected = spot > 90.0 && spot < 110.0 ? 1.0 : 0.0;
+        if (registers.variables[0] != expected || (ifAndJit && jit.variables[0] != expected)) {
+            std::cout << "JIT mismatch on IfAnd spot " << spot << ": " << expected << " " 
+                << registers.variables[0] << " " << jit.variables[0] << std::endl;
+            ++bad;
+        }
+    }
+#ifdef SCRIPTING_JIT
+    if (!ifAndJit) {
+        std::cout << "IfAnd not JIT compiled" << std::endl;
+        ++bad;
+    }
+#endif
+
+    return bad;
+}
+
+// Check that native code, built in the background and waited for, produces the same results
+// as the register machine and the tree evaluator, with and without the numeraires folded into the code,
+// returns the number of mismatches
+int checkNative() {
+    std::vector<std::map<Date, std::string>> scripts = registerScripts();
+    // Loops, in native code but not in JIT code
+    scripts.push_back({ { 1, "FOR K IN [90, 100, 110] THEN IF SPOT() > K THEN C = C + SPOT() - K ELSE P = P + K - SPOT() ENDIF ENDFOR" },
+                        { 2, "FOR I IN [1, 2] THEN FOR J IN [10, 20, 30] THEN S = S + I * J + SPOT() ENDFOR ENDFOR X PAYS S" } });
+    const double spots[] = { 80.0, 95.0, 100.0, 105.0, 120.0 };
+    NativeOptions options;
+    options.cacheDir = "scripting_test_native";
+
+    // All the products compile at the same time, at most NATIVEMAXBUILDS of them at once
+    std::vector<std::unique_ptr<Product>> products;
+    std::vector<std::vector<double>> numeraires;
+    for (const auto& events : scripts) {
+        for (const bool folded : { false, true }) {
+            products.emplace_back(new Product);
+            Product& prd = *products.back();
+            prd.parseEvents(events.begin(), events.end());
+            prd.preProcess(false, false);
+            numeraires.emplace_back();
+            for (size_t i = 0; i < events.size(); ++i) numeraires.back().push_back(1.0 + 0.05 * i);
+            prd.compile(folded ? numeraires.back() : std::vector<double>());
+            prd.compileNative(options);
+        }
+    }
+
+    int bad = 0;
+    for (size_t k = 0; k < products.size(); ++k) {
+        Product& prd = *products[k];
+        prd.waitNative();
+        if (!prd.nativeReady()) {
+            std::cout << "Native code not available: " << prd.nativeError() << std::endl;
+            ++bad;
+            continue;
+        }
+
+        const std::vector<size_t>& vars = prd.outputVars();
+        const std::vector<size_t>& slots = prd.outputSlots();
+        Evaluator<double> eval = prd.buildEvaluator<double>();
+        EvalState<double> compiled(prd.compiledStateSize()), registers(prd.numRegisters()), native(prd.numRegisters());
+        std::unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
+
+        for (const double spot : spots) {
+            for (size_t i = 0; i < scen->size(); ++i) {
+                (*scen)[i].spot = spot * (1.0 + 0.1 * i);
+                (*scen)[i].numeraire = numeraires[k][i];
+            }
+            prd.evaluate(*scen, eval);
+            prd.evaluateCompiled(*scen, compiled);
+            prd.evaluateRegisters(*scen, registers);
+            prd.evaluateNative(*scen, native);
+
+            for (size_t v = 0; v < slots.size(); ++v) {
+                const size_t s = slots[v];
+                // Folded numeraires scale payments by their inverse, as the stack code does
+                const double expected = prd.foldedNumeraires() ? compiled.variables[s] : eval.varVals()[vars[v]];
+                if (registers.variables[s] != expected || native.variables[s] != expected) {
+                    std::cout << "Native mismatch on " << prd.varNames()[vars[v]] << " spot " << spot
+                        << ": " << expected << " " << registers.variables[s] << " " << native.variables[s] << std::endl;
+                    ++bad;
+                }
+            }
+        }
+    }
+    return bad;
+}
+
+// Check that products written to an image, mapped back and valued with imageMcVal
+// give the same results as scriptMcVal on the product, sharp and fuzzy,
+// that images refuse models with other numeraires than those folded into their code,
+// and that inconsistent images are rejected on load, returns the number of failures
+int checkImages() {
+    const std::map<Date, std::string> events = {
+        { 365, "IF SPOT() > 100 THEN X = SPOT() - 100 ELSE X = 0 ENDIF FOR K IN [90, 110] THEN Y = Y + MAX(SPOT() - K, 0) ENDFOR" },
+        { 548, "IF SPOT() > 90 AND SPOT() < 110 OR X > 5 THEN IF SPOT() > 100 THEN Z = SQRT(SPOT()) ELSE Z = LOG(SPOT()) ENDIF ENDIF "
+               "S = SMOOTH(SPOT() - 100, SPOT(), 100, 1)" },
+        { 730, "C PAYS X + Y + Z + S * 0.01" } };
+    const std::string path = "scripting_test_images.bin";
+    const SimpleBlackScholes<double> model(0, 100.0, 0.2, 0.02);
+
+    int bad = 0;
+    for (const bool fuzzy : { false, true }) {
+        Product prd;
+        prd.parseEvents(events.begin(), events.end());
+        const size_t maxNestedIfs = prd.preProcess(fuzzy, false);
+        compileForModel(prd, model, fuzzy, 1.0);
+
+        std::vector<double> expected, actual;
+        scriptMcVal(prd, model, Mrg32k3a(), false, 1000, false, fuzzy, maxNestedIfs, 1.0, true, expected);
+
+        writeProductImages(path, prd);
+        {
+            ProductBook book(path);
+            imageMcVal(book[0], model, Mrg32k3a(), false, 1000, false, actual);
+            if (actual != expected) {
+                std::cout << "Image mismatch, fuzzy " << fuzzy << std::endl;
+                ++bad;
+            }
+
+            // Numeraires folded into the code
+            try {
+                imageMcVal(book[0], SimpleBlackScholes<double>(0, 100.0, 0.2, 0.05), Mrg32k3a(), false, 1000, false, actual);
+                std::cout << "Image valued with other numeraires, fuzzy " << fuzzy << std::endl;
+                ++bad;
+            }
+            catch (const std::runtime_error&) {}
+        }
+
+        // More zeroed slots than the state holds
+        std::vector<char> buf;
+        {
+            std::ifstream ifs(path, std::ios::binary);
+            buf.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+        ImageProductHeader* hdr = reinterpret_cast<ImageProductHeader*>(&buf[sizeof(ImageFileHeader) + sizeof(uint64_t)]);
+        hdr->numZeroed = hdr->compiledStateSize + 1;
+        {
+            std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+            ofs.write(buf.data(), buf.size());
+        }
+        try {
+            ProductBook book(path);
+            std::cout << "Inconsistent image loaded, fuzzy " << fuzzy << std::endl;
+            ++bad;
+        }
+        catch (const std::runtime_error&) {}
+    }
+
+    std::remove(path.c_str());
+    return bad;
+}
+
+// Check that a generator gives the same Gaussians as generated path by path from the start:
+// by blocks of paths, from any path with setPath(), and after skipAhead(), returns the number of mismatches
+int checkRanGen(const std::string& what, const RandomGen& proto) {
+    const size_t numPaths = 300;
+    // Blocks of all sizes, summing to numPaths
+    const size_t blocks[] = { 1, 2, 37, 64, 96, 100 };
+    const size_t paths[] = { 0, 1, 2, 63, 64, 150, 299 };
+
+    int bad = 0;
+    for (const size_t dim : { 1, 7 }) {
+        std::unique_ptr<RandomGen> seq = proto.clone();
+        seq->init(dim);
+        std::vector<std::vector<double>> expected;
+        for (size_t p = 0; p < numPaths; ++p) {
+            seq->genNextNormVec();
+            expected.push_back(seq->getNorm());
+        }
+        auto check = [&](const double* gaussians, const size_t path, const char* how) {
+            if (!std::equal(gaussians, gaussians + dim, expected[path].begin())) {
+                std::cout << what << " mismatch " << how << ", dimension " << dim << " path " << path << std::endl;
+                ++bad;
+            }
+        };
+
+        std::unique_ptr<RandomGen> block = proto.clone();
+        block->init(dim);
+        std::vector<double> gaussians;
+        size_t first = 0;
+        for (const size_t n : blocks) {
+            gaussians.resize(n * dim);
+            block->genNextNormBlock(n, gaussians.data());
+            for (size_t p = 0; p < n; ++p) check(gaussians.data() + p * dim, first + p, "by block");
+            first += n;
+        }
+
+        for (const size_t path : paths) {
+            std::unique_ptr<RandomGen> random = proto.clone();
+            random->init(dim);
+            random->setPath(path);
+            random->genNextNormVec();
+            check(random->getNorm().data(), path, "after setPath");
+        }
+
+        std::unique_ptr<RandomGen> skip = proto.clone();
+        skip->init(dim);
+        size_t next = 0;
+        for (const size_t n : blocks) {
+            skip->skipAhead(long(n));
+            next += n;
+            if (next >= numPaths) break;
+            skip->genNextNormVec();
+            check(skip->getNorm().data(), next++, "after skipAhead");
+        }
+    }
+    return bad;
+}
+
+// Check the Mrg32k3a generator, default and seeded, see checkRanGen()
+int checkMrg32k3a() {
+    return checkRanGen("Mrg32k3a", Mrg32k3a()) + checkRanGen("Mrg32k3a seeded", Mrg32k3a(42));
+}
+
+// Check the Sobol generator, plain and scrambled, see checkRanGen()
+int checkSobol() {
+    return checkRanGen("Sobol", Sobol()) + checkRanGen("Sobol scrambled", Sobol(42));
+}
+
+// Check the Philox generator, default and seeded, see checkRanGen()
+int checkPhilox() {
+    return checkRanGen("Philox", Philox()) + checkRanGen("Philox seeded", Philox(42));
+}
+
+// Check that invNormalCdfBlock() gives the same Gaussians as invNormalCdf(),
+// on a grid of uniforms and around the bounds of its central region, returns the number of mismatches
+int checkGaussians() {
+    std::vector<double> uniforms;
+    const size_t numGrid = 10000;
+    for (size_t i = 0; i < numGrid; ++i) uniforms.push_back((i + 0.5) / numGrid);
+    for (const double p : { 0.08, 0.92, 0.5 }) {
+        uniforms.push_back(std::nextafter(p, 0.0));
+        uniforms.push_back(p);
+        uniforms.push_back(std::nextafter(p, 1.0));
+    }
+    for (const double p : { 1.0e-300, 1.0e-16, 1.0e-15, 1.0e-10 }) {
+        uniforms.push_back(p);
+        uniforms.push_back(1.0 - p);
+    }
+
+    std::vector<double> gaussians(uniforms.size());
+    invNormalCdfBlock(uniforms.data(), gaussians.data(), uniforms.size());
+
+    int bad = 0;
+    for (size_t i = 0; i < uniforms.size(); ++i) {
+        if (gaussians[i] != invNormalCdf(uniforms[i])) {
+            std::cout << "Gaussian mismatch on " << uniforms[i] << ": " << invNormalCdf(uniforms[i]) << " " << gaussians[i] << std::endl;
+            ++bad;
+        }
+    }
+    return bad;
+}
+
+// Check that parallel valuations give the same values as serial ones, bit for bit,
+// with every random generator in every evaluation mode, returns the number of mismatches
+int checkParallel() {
+    const std::map<Date, std::string> events = {
+        { 365, "IF SPOT() > 100 THEN X = SPOT() - 100 ELSE X = 0 ENDIF FOR K IN [90, 110] THEN Y = Y + MAX(SPOT() - K, 0) ENDFOR" },
+        { 548, "IF SPOT() > 90 AND SPOT() < 110 OR X > 5 THEN Z = SQRT(SPOT()) ELSE Z = LOG(SPOT()) ENDIF" },
+        { 730, "C PAYS X + Y + Z" } };
+    const SimpleBlackScholes<double> model(0, 100.0, 0.2, 0.02);
+    // More batches than threads
+    const size_t numSim = 10 * BATCHSIZE + 100;
+    const std::pair<RanGenType, const char*> ranGens[] = {
+        { RanGenMrg32k3a, "Mrg32k3a" }, { RanGenSobol, "Sobol" }, { RanGenPhilox, "Philox" } };
+    struct Mode {
+        const char* name;
+        bool compile, fuzzy, batch, jit, native;
+    };
+    const Mode modes[] = {
+        { "tree", false, false, false, false, false },
+        { "batched tree", false, false, true, false, false },
+        { "fuzzy tree", false, true, false, false, false },
+        { "register machine", true, false, false, false, false },
+        { "JIT", true, false, false, true, false },
+        { "native", true, false, false, true, true },
+        { "SIMD lanes", true, false, true, false, false },
+        { "compiled fuzzy", true, true, false, false, false } };
+    NativeOptions options;
+    options.cacheDir = "scripting_test_native";
+
+    // A few threads on any machine, only the first start has an effect
+    ThreadPool::getInstance()->start(std::max(3u, std::thread::hardware_concurrency()));
+
+    int bad = 0;
+    for (const auto& ranGen : ranGens) {
+        const std::unique_ptr<RandomGen> random = makeRanGen(ranGen.first, 0);
+        for (const Mode& mode : modes) {
+            Product prd;
+            prd.parseEvents(events.begin(), events.end());
+            const size_t maxNestedIfs = prd.preProcess(mode.fuzzy, false);
+            if (mode.compile) compileForModel(prd, model, mode.fuzzy, 1.0);
+            if (mode.jit) prd.compileJit();
+            if (mode.native) {
+                prd.compileNative(options);
+                prd.waitNative();
+            }
+
+            std::vector<double> serial, parallel;
+            const bool brownianBridge = ranGen.first == RanGenSobol;
+            scriptMcVal(prd, model, *random, brownianBridge, numSim, false, mode.fuzzy, maxNestedIfs, 1.0, mode.compile, serial, mode.batch);
+            scriptMcVal(prd, model, *random, brownianBridge, numSim, true, mode.fuzzy, maxNestedIfs, 1.0, mode.compile, parallel, mode.batch);
+            if (parallel != serial) {
+                std::cout << "Parallel mismatch, " << ranGen.second << ", " << mode.name << std::endl;
+                ++bad;
+            }
+        }
+    }
+    return bad;
+}
+
+// Check of the test driver: name on the command line, title in the report,
+// and function returning its number of mismatches
+struct Check {
+    const char* name;
+    const char* title;
+    int (*run)();
+};
+
+int main(int argc, char** argv) {
     // Simple one-line script using the provided language
-    const std::string script = "VALUE PAYS SPOT;";
+    const std::string script = "VALUE PAYS SPOT()";
 
     // Parse the script into an event (list of statements)
     Event evt = parse(script);
@@ -38,5 +778,36 @@ int main() {
         std::cout << varNames[i] << " = " << vals[i] << std::endl;
     }
 
-    return 0;
+    // Checks, by name on the command line, all of them by default
+    const Check checks[] = {
+        { "for", "Compiled FOR loops", checkCompiledFor },
+        { "optimizer", "Optimizer", checkOptimizer },
+        { "cse", "Common subexpressions", checkCommonSubexpressions },
+        { "outputs", "Output subsets", checkOutputs },
+        { "images", "Product images", checkImages },
+        { "deep", "Deep nesting", checkDeepNesting },
+        { "jit", "JIT", checkJit },
+        { "native", "Native code", checkNative },
+        { "mrg32k3a", "Mrg32k3a", checkMrg32k3a },
+        { "sobol", "Sobol", checkSobol },
+        { "philox", "Philox", checkPhilox },
+        { "gaussians", "Inverse normal", checkGaussians },
+        { "parallel", "Parallel valuation", checkParallel },
+    };
+
+    int bad = 0;
+    bool found = false;
+    for (const auto& check : checks) {
+        if (argc > 1 && argv[1] != std::string(check.name)) continue;
+        found = true;
+        const int mismatches = check.run();
+        std::cout << check.title << ": " << (mismatches ? "MISMATCH" : "OK") << std::endl;
+        if (mismatches) ++bad;
+    }
+    if (!found) {
+        std::cout << "Unknown check " << argv[1] << std::endl;
+        return 1;
+    }
+
+    return bad ? 1 : 0;
 }
@@ -0,0 +1,181 @@
+#pragma once
+
+/*	L'Ecuyer's MRG32k3a combined multiple recursive generator
+	Period ~2^191, fast and exact skip ahead, hence suitable for parallel simulations
+	Uniforms are turned into Gaussians by inverse CDF, one uniform per Gaussian,
+		so skipping n paths is skipping exactly n * dim() numbers in the sequence
+	Skip ahead is O(log n) by exponentiation of the transition matrices */
+
+#include "cpp11basicRanGen.h"
+#include "gaussians.h"
+
+#include <cstdint>
+
+class Mrg32k3a : public RandomGen
+{
+	//	Constants
+	static constexpr int64_t	m1 = 4294967087;
+	static constexpr int64_t	m2 = 4294944443;
+	static constexpr int64_t	a12 = 1403580;
+	static constexpr int64_t	a13 = 810728;
+	static constexpr int64_t	a21 = 527612;
+	static constexpr int64_t	a23 = 1370589;
+
+	//	State of the 2 components, newest first: x[0] = x(n-1), x[1] = x(n-2), x[2] = x(n-3)
+	int64_t					myX[3];
+	int64_t					myY[3];
+
+	//	Initial state, for random access
+	int64_t					myX0[3];
+	int64_t					myY0[3];
+
+	size_t					myDim;
+
+	vector<double>			myNormVec;
+
+	//	Work space, uniforms
+	vector<double>			myUnifBlock;
+
+	//	3x3 matrices mod m, for skip ahead
+	using Mat = int64_t[3][3];
+
+	//	c = a * b mod m, entries of a and b are in [0, m) with m < 2^32 so products fit on 64 bits
+	static void matMult(const Mat a, const Mat b, Mat c, const int64_t m)
+	{
+		Mat res;
+		for (size_t i = 0; i<3; ++i) for (size_t j = 0; j<3; ++j)
+		{
+			uint64_t s = 0;
+			for (size_t k = 0; k<3; ++k)
+			{
+				s += uint64_t(a[i][k]) * uint64_t(b[k][j]) % m;
+			}
+			res[i][j] = int64_t(s % m);
+		}
+		for (size_t i = 0; i<3; ++i) for (size_t j = 0; j<3; ++j) c[i][j] = res[i][j];
+	}
+
+	//	v = a^n * v mod m, by binary exponentiation
+	static void matPowVec(const Mat a, uint64_t n, int64_t v[3], const int64_t m)
+	{
+		Mat p, r = { {1,0,0}, {0,1,0}, {0,0,1} };
+		for (size_t i = 0; i<3; ++i) for (size_t j = 0; j<3; ++j) p[i][j] = a[i][j];
+
+		while (n)
+		{
+			if (n & 1) matMult(r, p, r, m);
+			matMult(p, p, p, m);
+			n >>= 1;
+		}
+
+		int64_t res[3];
+		for (size_t i = 0; i<3; ++i)
+		{
+			uint64_t s = 0;
+			for (size_t k = 0; k<3; ++k)
+			{
+				s += uint64_t(r[i][k]) * uint64_t(v[k]) % m;
+			}
+			res[i] = int64_t(s % m);
+		}
+		for (size_t i = 0; i<3; ++i) v[i] = res[i];
+	}
+
+	//	Next uniform in (0,1)
+	double nextUniform()
+	{
+		//	First component
+		int64_t x = (a12 * myX[1] - a13 * myX[2]) % m1;
+		if (x < 0) x += m1;
+		myX[2] = myX[1];
+		myX[1] = myX[0];
+		myX[0] = x;
+
+		//	Second component
+		int64_t y = (a21 * myY[0] - a23 * myY[2]) % m2;
+		if (y < 0) y += m2;
+		myY[2] = myY[1];
+		myY[1] = myY[0];
+		myY[0] = y;
+
+		//	Combination
+		return x > y
+			? double(x - y) / double(m1 + 1)
+			: double(x - y + m1) / double(m1 + 1);
+	}
+
+public:
+
+	//	Seed 0 = default
+	Mrg32k3a(const unsigned seed = 0)
+	{
+		const int64_t s = seed > 0 ? seed : 12345;
+		for (size_t i = 0; i<3; ++i)
+		{
+			myX[i] = myX0[i] = s % m1;
+			myY[i] = myY0[i] = s % m2;
+		}
+	}
+
+	void init(const size_t dim) override
+	{
+		myDim = dim;
+		myNormVec.resize(dim);
+	}
+
+	void genNextNormVec() override
+	{
+		genNextNormBlock(1, myNormVec.data());
+	}
+
+	//	The recursion is sequential, but the inverse CDF is vectorized over the block
+	void genNextNormBlock(const size_t nPaths, double* out) override
+	{
+		const size_t n = nPaths * myDim;
+		if (myUnifBlock.size() < n) myUnifBlock.resize(n);
+
+		for (size_t i = 0; i<n; ++i)
+		{
+			myUnifBlock[i] = nextUniform();
+		}
+
+		invNormalCdfBlock(myUnifBlock.data(), out, n);
+	}
+
+	const vector<double>& getNorm() const override
+	{
+		return myNormVec;
+	}
+
+	//  Clone
+	unique_ptr<RandomGen> clone() const override
+	{
+		return unique_ptr<RandomGen>(new Mrg32k3a(*this));
+	}
+
+	//	Skip ahead skip points of dimension dim(), in O(log(skip * dim))
+	void skipAhead(const long skip) override
+	{
+		if (skip <= 0) return;
+
+		const uint64_t n = uint64_t(skip) * myDim;
+
+		//	Transition matrices, negative coefficients taken mod m
+		static const Mat A1 = { { 0, a12, m1 - a13 }, { 1, 0, 0 }, { 0, 1, 0 } };
+		static const Mat A2 = { { a21, 0, m2 - a23 }, { 1, 0, 0 }, { 0, 1, 0 } };
+
+		matPowVec(A1, n, myX, m1);
+		matPowVec(A2, n, myY, m2);
+	}
+
+	//	Random access: restart from the initial state and skip path points
+	void setPath(const size_t path) override
+	{
+		for (size_t i = 0; i<3; ++i)
+		{
+			myX[i] = myX0[i];
+			myY[i] = myY0[i];
+		}
+		skipAhead(long(path));
+	}
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <type_traits>
+
 //  Compile time check if a type is part of a pack
 //  Use as follows:
 
@@ -10,20 +12,14 @@
 template <typename... Vs>
 struct Pack;
 
-template <typename V>
-struct Pack <typename V>
+template <>
+struct Pack <>
 {
     template <class T>
     static constexpr bool includes()
     {
         return false;
     }
-
-    template <>
-    static constexpr bool includes<V>()
-    {
-        return true;
-    }
 };
 
 template <typename V, typename... Vs>
@@ -32,6 +28,6 @@ struct Pack <V, Vs...>
     template <class T>
     static constexpr bool includes()
     {
-        return Pack<V>::includes<T>() || Pack<Vs...>::includes<T>();
+        return std::is_same<T, V>::value || Pack<Vs...>::template includes<T>();
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+/*	Philox4x32-10 counter based generator (Salmon et al., Random123)
+	Stateless: the i-th Gaussian of path k is a pure function of (seed, k, i)
+		computed by encrypting the counter (i/4, 0, k) with the seed as key
+	Hence any path can be generated directly in O(dim),
+		skipAhead() and setPath() are O(1) and results never depend on scheduling
+	Gaussians are obtained by inverse CDF, one 32 bit uniform each */
+
+#include "cpp11basicRanGen.h"
+#include "gaussians.h"
+
+#include <cstdint>
+
+class Philox : public RandomGen
+{
+	//	Key
+	uint32_t				myKey[2];
+
+	//	Index of the next path
+	uint64_t				myPath;
+
+	size_t					myDim;
+
+	vector<double>			myNormVec;
+
+	//	Work space, uniforms
+	vector<double>			myUnifBlock;
+
+	//	Counters are encrypted in chunks of CHUNK in structure of arrays layout,
+	//		so the compiler vectorizes the rounds across counters
+	static constexpr size_t	CHUNK = 64;
+
+	//	One round of the Philox bijection
+	static void round(uint32_t ctr[4], const uint32_t key[2])
+	{
+		const uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+		const uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+
+		const uint32_t c1 = ctr[1], c3 = ctr[3];
+		ctr[0] = uint32_t(p1 >> 32) ^ c1 ^ key[0];
+		ctr[1] = uint32_t(p1);
+		ctr[2] = uint32_t(p0 >> 32) ^ c3 ^ key[1];
+		ctr[3] = uint32_t(p0);
+	}
+
+public:
+
+	//	Encrypt counter in place with key, 10 rounds
+	static void philox4x32(uint32_t ctr[4], const uint32_t key[2])
+	{
+		uint32_t k[2] = { key[0], key[1] };
+		for (size_t r = 0; r<10; ++r)
+		{
+			if (r)
+			{
+				k[0] += 0x9E3779B9;
+				k[1] += 0xBB67AE85;
+			}
+			round(ctr, k);
+		}
+	}
+
+	//	Encrypt n <= CHUNK counters in place, ctr[k][j] = word k of counter j
+	static void philox4x32(const size_t n, uint32_t ctr[4][CHUNK], const uint32_t key[2])
+	{
+		uint32_t k0 = key[0], k1 = key[1];
+		for (size_t r = 0; r<10; ++r)
+		{
+			if (r)
+			{
+				k0 += 0x9E3779B9;
+				k1 += 0xBB67AE85;
+			}
+			for (size_t j = 0; j<n; ++j)
+			{
+				const uint64_t p0 = uint64_t(0xD2511F53) * ctr[0][j];
+				const uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2][j];
+
+				const uint32_t c1 = ctr[1][j], c3 = ctr[3][j];
+				ctr[0][j] = uint32_t(p1 >> 32) ^ c1 ^ k0;
+				ctr[1][j] = uint32_t(p1);
+				ctr[2][j] = uint32_t(p0 >> 32) ^ c3 ^ k1;
+				ctr[3][j] = uint32_t(p0);
+			}
+		}
+	}
+
+	//	Seed 0 = default
+	Philox(const unsigned seed = 0) : myPath(0), myDim(0)
+	{
+		myKey[0] = seed > 0 ? seed : 12345;
+		myKey[1] = 0x5C6E1A6B;
+	}
+
+	void init(const size_t dim) override
+	{
+		myDim = dim;
+		myNormVec.resize(dim);
+		myPath = 0;
+	}
+
+	void genNextNormVec() override
+	{
+		genNextNormBlock(1, myNormVec.data());
+	}
+
+	//	Counter (i/4, 0, path) gives coordinates i to i+3 of path
+	void genNextNormBlock(const size_t nPaths, double* out) override
+	{
+		static const double ONEOVER2POW32 = 1.0 / 4294967296.0;
+
+		const size_t n = nPaths * myDim;
+		if (myUnifBlock.size() < n) myUnifBlock.resize(n);
+
+		//	Counters per path and in total
+		const size_t nCtr = (myDim + 3) / 4, nTotal = nPaths * nCtr;
+
+		uint32_t ctr[4][CHUNK];
+		for (size_t first = 0; first<nTotal; first += CHUNK)
+		{
+			const size_t m = nTotal - first < CHUNK ? nTotal - first : CHUNK;
+
+			for (size_t j = 0; j<m; ++j)
+			{
+				const uint64_t path = myPath + (first + j) / nCtr;
+				ctr[0][j] = uint32_t((first + j) % nCtr);
+				ctr[1][j] = 0;
+				ctr[2][j] = uint32_t(path);
+				ctr[3][j] = uint32_t(path >> 32);
+			}
+
+			philox4x32(m, ctr, myKey);
+
+			for (size_t j = 0; j<m; ++j)
+			{
+				const size_t p = (first + j) / nCtr, i = 4 * ((first + j) % nCtr);
+				const size_t l = myDim - i < 4 ? myDim - i : 4;
+				double* unif = myUnifBlock.data() + p * myDim + i;
+				for (size_t k = 0; k<l; ++k)
+				{
+					unif[k] = (ctr[k][j] + 0.5) * ONEOVER2POW32;
+				}
+			}
+		}
+
+		invNormalCdfBlock(myUnifBlock.data(), out, n);
+
+		myPath += nPaths;
+	}
+
+	const vector<double>& getNorm() const override
+	{
+		return myNormVec;
+	}
+
+	//  Clone
+	unique_ptr<RandomGen> clone() const override
+	{
+		return unique_ptr<RandomGen>(new Philox(*this));
+	}
+
+	void skipAhead(const long skip) override
+	{
+		if (skip > 0) myPath += skip;
+	}
+
+	void setPath(const size_t path) override
+	{
+		myPath = path;
+	}
+};
@@ -273,4 +273,81 @@ public:
     {
         return mySp < 0;
     }
-};
\ No newline at end of file
+};
+//  Same as staticStack, with a capacity set at construction, on the heap
+//  For stacks whose maximum depth is only known at run time, see withEvalStacks() in scriptingCompiler.h
+template <class T>
+class heapStack
+{
+
+private:
+
+    vector<T>       myData;
+    int			    mySp = -1;
+
+public:
+
+    heapStack(const size_t capacity = 0) : myData(capacity) {}
+
+    template <typename T2>
+    inline void push(T2&& value)
+    {
+        myData[++mySp] = forward<T2>(value);
+    }
+
+    inline T& top()
+    {
+        return myData[mySp];
+    }
+
+    inline const T& top() const
+    {
+        return myData[mySp];
+    }
+
+    //	Random access
+    inline T& operator[](const int i)
+    {
+        return myData[mySp - i];
+    }
+
+    inline const T& operator[](const int i) const
+    {
+        return myData[mySp - i];
+    }
+
+    inline T topAndPop()
+    {
+        return move(myData[mySp--]);
+    }
+
+    void pop()
+    {
+        --mySp;
+    }
+
+    void pop(const int n)
+    {
+        mySp -= n;
+    }
+
+    void reset()
+    {
+        mySp = -1;
+    }
+
+    size_t size() const
+    {
+        return static_cast<size_t>((mySp+1));
+    }
+
+    size_t capacity() const
+    {
+        return myData.size();
+    }
+
+    bool empty() const
+    {
+        return mySp < 0;
+    }
+};
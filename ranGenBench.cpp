@@ -0,0 +1,106 @@
+/*	Throughput micro-benchmark of the random generators
+	Compares path by path generation (genNextNormVec) with block generation (genNextNormBlock)
+	and the scalar inverse Gaussian CDF with its block version
+	Usage: rangen_bench [dim] [numPaths] [blockSize]
+	The block timings depend on vectorization, configure with -DRANGEN_BENCH_NATIVE=ON
+	to build with -O3 -march=native (see CMakeLists.txt) */
+
+#include "cpp11basicRanGen.h"
+#include "mrg32k3a.h"
+#include "sobol.h"
+#include "philox.h"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+
+//	Seconds elapsed in f()
+template <class F>
+double timeIt(F f)
+{
+	const auto start = chrono::high_resolution_clock::now();
+	f();
+	return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+void report(const string& name, const size_t numbers, const double seconds, const double check)
+{
+	cout << left << setw(28) << name << right << setw(10) << fixed << setprecision(1)
+		<< numbers / seconds * 1.0e-6 << " M/s   checksum " << setprecision(6) << check << endl;
+}
+
+void benchGen(const string& name, const RandomGen& proto, const size_t dim, const size_t numPaths, const size_t blockSize)
+{
+	//	Path by path
+	unique_ptr<RandomGen> gen = proto.clone();
+	gen->init(dim);
+	double sum1 = 0.0;
+	const double t1 = timeIt([&]()
+	{
+		for (size_t p = 0; p<numPaths; ++p)
+		{
+			gen->genNextNormVec();
+			const vector<double>& g = gen->getNorm();
+			for (size_t i = 0; i<dim; ++i) sum1 += g[i];
+		}
+	});
+	report(name + " path", numPaths * dim, t1, sum1);
+
+	//	By block
+	gen = proto.clone();
+	gen->init(dim);
+	vector<double> block(blockSize * dim);
+	double sum2 = 0.0;
+	const double t2 = timeIt([&]()
+	{
+		for (size_t p = 0; p<numPaths; p += blockSize)
+		{
+			const size_t n = numPaths - p < blockSize ? numPaths - p : blockSize;
+			gen->genNextNormBlock(n, block.data());
+			for (size_t i = 0; i<n * dim; ++i) sum2 += block[i];
+		}
+	});
+	report(name + " block", numPaths * dim, t2, sum2);
+}
+
+int main(int argc, char* argv[])
+{
+	const size_t dim = argc > 1 ? atoi(argv[1]) : 64;
+	const size_t numPaths = argc > 2 ? atoi(argv[2]) : 65536;
+	const size_t blockSize = argc > 3 ? atoi(argv[3]) : 256;
+
+	cout << "dim " << dim << ", " << numPaths << " paths, blocks of " << blockSize << " paths" << endl;
+
+	//	Inverse CDF alone
+	{
+		const size_t n = dim * numPaths;
+		vector<double> u(n), g(n);
+		mt19937_64 eng(1234);
+		uniform_real_distribution<> dist;
+		for (auto& x : u) x = dist(eng);
+
+		double sum1 = 0.0;
+		const double t1 = timeIt([&]()
+		{
+			for (size_t i = 0; i<n; ++i) g[i] = invNormalCdf(u[i]);
+		});
+		for (double x : g) sum1 += x;
+		report("invNormalCdf scalar", n, t1, sum1);
+
+		double sum2 = 0.0;
+		const double t2 = timeIt([&]()
+		{
+			invNormalCdfBlock(u.data(), g.data(), n);
+		});
+		for (double x : g) sum2 += x;
+		report("invNormalCdf block", n, t2, sum2);
+	}
+
+	benchGen("C++11 normal_distribution", BasicRanGen(1234), dim, numPaths, blockSize);
+	benchGen("MRG32k3a", Mrg32k3a(1234), dim, numPaths, blockSize);
+	benchGen("Sobol", Sobol(), dim, numPaths, blockSize);
+	benchGen("Philox4x32-10", Philox(1234), dim, numPaths, blockSize);
+
+	return 0;
+}
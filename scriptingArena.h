@@ -0,0 +1,166 @@
+#pragma once
+
+//  Arena allocation of the nodes of the trees of a product
+//  The nodes, and the arrays of their arguments, are allocated by bumping a pointer in large blocks,
+//      so the trees of a product are laid out contiguously, in the order of the parser, depth first,
+//      and their memory is released in one shot with the arena, see Product
+//  Allocations go to the current arena of the thread, set with NodeArena::Scope,
+//      or to the heap when there is none, so trees built outside of a product are unchanged
+//  Every allocation is preceded by a tag telling whether it comes from an arena or from the heap:
+//      deallocation of arena memory does nothing, the nodes are still destroyed in place
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+using namespace std;
+
+class NodeArena
+{
+    //  Blocks, the last one is current
+    vector<unique_ptr<char[]>>  myBlocks;
+    size_t                      myBlockSize;
+    char*                       myNext = nullptr;
+    size_t                      myLeft = 0;
+    //  Bytes allocated so far
+    size_t                      myBytes = 0;
+
+    //  Size of the tags, keeps allocations aligned
+    static constexpr size_t     tagSize = alignof(max_align_t);
+    enum Tag : size_t { HeapTag = 0, ArenaTag = 1 };
+
+    static NodeArena*& current()
+    {
+        static thread_local NodeArena* arena = nullptr;
+        return arena;
+    }
+
+    //  Bump allocation, aligned
+    void* bump(const size_t bytes)
+    {
+        const size_t size = (bytes + tagSize - 1) / tagSize * tagSize;
+        if (size > myLeft)
+        {
+            //  Oversized requests get their own block, the current block stays current
+            if (size > myBlockSize / 4)
+            {
+                myBlocks.emplace_back(new char[size]);
+                myBytes += size;
+                return myBlocks.back().get();
+            }
+            myBlocks.emplace_back(new char[myBlockSize]);
+            myNext = myBlocks.back().get();
+            myLeft = myBlockSize;
+        }
+        void* p = myNext;
+        myNext += size;
+        myLeft -= size;
+        myBytes += size;
+        return p;
+    }
+
+public:
+
+    explicit NodeArena(const size_t blockSize = 64 * 1024) : myBlockSize(blockSize) {}
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    //  The moved from arena is left empty, it must not point into blocks it no longer owns
+    NodeArena(NodeArena&& rhs) noexcept
+        : myBlocks(move(rhs.myBlocks)), myBlockSize(rhs.myBlockSize), myNext(rhs.myNext), myLeft(rhs.myLeft), myBytes(rhs.myBytes)
+    {
+        rhs.myBlocks.clear();
+        rhs.myNext = nullptr;
+        rhs.myLeft = 0;
+        rhs.myBytes = 0;
+    }
+    //  Swaps, so the blocks of this arena are released with rhs, 
+    //      after the trees they hold, which are moved over or destroyed later in a member wise move, see Product
+    NodeArena& operator=(NodeArena&& rhs) noexcept
+    {
+        swap(myBlocks, rhs.myBlocks);
+        swap(myBlockSize, rhs.myBlockSize);
+        swap(myNext, rhs.myNext);
+        swap(myLeft, rhs.myLeft);
+        swap(myBytes, rhs.myBytes);
+        return *this;
+    }
+
+    //  Bytes allocated in the arena
+    size_t bytes() const
+    {
+        return myBytes;
+    }
+
+    //  Allocate bytes in the current arena of the thread, or on the heap
+    static void* allocate(const size_t bytes)
+    {
+        NodeArena* arena = current();
+        char* p = static_cast<char*>(arena ? arena->bump(tagSize + bytes) : ::operator new(tagSize + bytes));
+        *reinterpret_cast<size_t*>(p) = arena ? ArenaTag : HeapTag;
+        return p + tagSize;
+    }
+
+    //  Free memory from allocate(), only heap memory is freed, arena memory goes with its arena
+    static void deallocate(void* ptr)
+    {
+        if (!ptr) return;
+        char* p = static_cast<char*>(ptr) - tagSize;
+        if (*reinterpret_cast<size_t*>(p) == HeapTag) ::operator delete(p);
+    }
+
+    //  Current arena of the thread while in scope
+    class Scope
+    {
+        NodeArena*  myPrevious;
+
+    public:
+
+        explicit Scope(NodeArena& arena) : myPrevious(current())
+        {
+            current() = &arena;
+        }
+        ~Scope()
+        {
+            current() = myPrevious;
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+};
+
+//  Standard allocator on NodeArena, for the arrays of arguments of the nodes
+template <class T>
+struct NodeAllocator
+{
+    using value_type = T;
+
+    NodeAllocator() = default;
+    template <class U>
+    NodeAllocator(const NodeAllocator<U>&) {}
+
+    T* allocate(const size_t n)
+    {
+        return static_cast<T*>(NodeArena::allocate(n * sizeof(T)));
+    }
+    void deallocate(T* p, const size_t)
+    {
+        NodeArena::deallocate(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const NodeAllocator<T>&, const NodeAllocator<U>&)
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const NodeAllocator<T>&, const NodeAllocator<U>&)
+{
+    return false;
+}
@@ -0,0 +1,424 @@
+#pragma once
+
+//  Lane-batched evaluator
+//  Walks the trees once for a block of paths, each path being a lane,
+//      so the cost of the visitor dispatch is divided by the number of lanes
+//  Stack slots and variables hold one value per lane,
+//      and loops over lanes are innermost, so the compiler vectorizes them
+//  Expressions are evaluated on all lanes, instructions write under the mask of active lanes:
+//      if statements restrict the mask to the lanes that take the branch,
+//      and skip the branch when no lane takes it
+//  Same results as the Evaluator, path by path
+
+#include "scriptingNodes.h"
+#include "scriptingScenarios.h"
+
+#include <vector>
+#include <algorithm>
+
+template <class T>
+class BatchEvaluator : public constVisitor<BatchEvaluator<T>>
+{
+    //  Maximum number of lanes, and current number of lanes
+    size_t                      myWidth;
+    size_t                      myLanes;
+
+	//	State, variable i on lane l in myVariables[i * myWidth + l]
+	vector<T>				    myVariables;
+
+	//	Stacks, one slot = myWidth lanes
+    vector<T>                   myDstack;
+    size_t                      myDtop;
+    vector<char>                myBstack;
+    size_t                      myBtop;
+
+    //  Stack of masks of active lanes, the top one is current
+    vector<char>                myMasks;
+    size_t                      myMtop;
+
+	//	Reference to current scenarios
+	const ScenarioBlock<T>*		myScenario;
+
+	//	Index of current event
+	size_t					    myCurEvt;
+
+    //  Stack helpers, slot i from the top
+    //  Pointers are invalidated by pushes
+
+    T* pushD()
+    {
+        if ((myDtop + 1) * myWidth > myDstack.size()) myDstack.resize(2 * (myDtop + 1) * myWidth);
+        return &myDstack[myDtop++ * myWidth];
+    }
+    T* dSlot(const size_t i = 0)
+    {
+        return &myDstack[(myDtop - 1 - i) * myWidth];
+    }
+    void popD(const size_t n = 1)
+    {
+        myDtop -= n;
+    }
+
+    char* pushB()
+    {
+        if ((myBtop + 1) * myWidth > myBstack.size()) myBstack.resize(2 * (myBtop + 1) * myWidth);
+        return &myBstack[myBtop++ * myWidth];
+    }
+    char* bSlot(const size_t i = 0)
+    {
+        return &myBstack[(myBtop - 1 - i) * myWidth];
+    }
+    void popB()
+    {
+        --myBtop;
+    }
+
+    char* pushMask()
+    {
+        if ((myMtop + 1) * myWidth > myMasks.size()) myMasks.resize(2 * (myMtop + 1) * myWidth);
+        return &myMasks[myMtop++ * myWidth];
+    }
+    char* mask(const size_t i = 0)
+    {
+        return &myMasks[(myMtop - 1 - i) * myWidth];
+    }
+    void popMask()
+    {
+        --myMtop;
+    }
+
+    //  Lanes of simulated data, path stride 0 (deterministic data) is broadcast
+    void pushScenario(const T* data, const size_t evtStride, const size_t pathStride)
+    {
+        T* x = pushD();
+        const T* d = data + myCurEvt * evtStride;
+        if (pathStride == 0) fill(x, x + myLanes, *d);
+        else if (pathStride == 1) copy(d, d + myLanes, x);
+        else for (size_t l = 0; l<myLanes; ++l) x[l] = d[l * pathStride];
+    }
+
+public:
+
+    using constVisitor<BatchEvaluator<T>>::visit;
+    using constVisitor<BatchEvaluator<T>>::visitNode;
+
+	//	Constructor, nVar = number of variables, width = maximum number of lanes
+	BatchEvaluator( const size_t nVar, const size_t width)
+        : myWidth( width), myLanes( 0), myVariables( nVar * width),
+        myDtop( 0), myBtop( 0), myMtop( 0), myScenario( nullptr), myCurEvt( 0) {}
+
+	//	(Re-)initialize before evaluation in each block of scenarios
+	void init()
+	{
+        myLanes = myScenario->numPaths;
+		for( auto& varIt : myVariables) varIt = 0.0;
+        myDtop = myBtop = myMtop = 0;
+
+        //  All lanes active
+        char* m = pushMask();
+        fill(m, m + myWidth, char(0));
+        fill(m, m + myLanes, char(1));
+	}
+
+	//	Accessors
+
+    //  Maximum number of lanes
+    size_t width() const
+    {
+        return myWidth;
+    }
+
+	//	Values of variable i on all lanes, after evaluation
+	const T* varVals( const size_t i) const
+	{
+		return &myVariables[i * myWidth];
+	}
+
+	//	Set block of scenarios, at most width() paths
+	void setScenarioBlock( const ScenarioBlock<T>* scen)
+	{
+		myScenario = scen;
+	}
+
+	//	Set index of current event
+	void setCurEvt( const size_t curEvt)
+	{
+		myCurEvt = curEvt;
+	}
+
+	//	Visitors
+
+	//	Expressions
+
+	//	Binaries
+
+    template<class OP>
+    void visitBinary(const exprNode& node, OP op)
+    {
+        visitNode(*node.arguments[0]);
+        visitNode(*node.arguments[1]);
+        T* x = dSlot(1);
+        const T* y = dSlot();
+        for (size_t l = 0; l<myLanes; ++l) op(x[l], y[l]);
+        popD();
+    }
+
+	void visit(const NodeAdd& node)
+	{
+        visitBinary(node, [](T& x, const T y) { x += y; });
+	}
+	void visit(const NodeSub& node)
+	{
+        visitBinary(node, [](T& x, const T y) { x -= y; });
+    }
+	void visit(const NodeMult& node)
+	{
+        visitBinary(node, [](T& x, const T y) { x *= y; });
+    }
+	void visit(const NodeDiv& node)
+	{
+        visitBinary(node, [](T& x, const T y) { x /= y; });
+    }
+	void visit(const NodePow& node)
+	{
+        visitBinary(node, [](T& x, const T y) { x = pow(x, y); });
+    }
+    void visit(const NodeMax& node)
+    {
+        visitBinary(node, [](T& x, const T y) { x = x < y ? y : x; });
+    }
+    void visit(const NodeMin& node)
+    {
+        visitBinary(node, [](T& x, const T y) { x = x > y ? y : x; });
+    }
+
+	//	Unaries
+    template<class OP>
+    void visitUnary(const exprNode& node, OP op)
+    {
+        visitNode(*node.arguments[0]);
+        T* x = dSlot();
+        for (size_t l = 0; l<myLanes; ++l) op(x[l]);
+    }
+
+	void visit(const NodeUplus& node)
+    {
+        visitNode(*node.arguments[0]);
+    }
+	void visit(const NodeUminus& node)
+    {
+        visitUnary(node, [](T& x) { x = -x; });
+    }
+
+	//	Functions
+	void visit(const NodeLog& node)
+	{
+        visitUnary(node, [](T& x) { x = log(x); });
+    }
+	void visit(const NodeSqrt& node)
+	{
+        visitUnary(node, [](T& x) { x = sqrt(x); });
+    }
+
+    //  Multies
+    //  Both sides are evaluated on all lanes, then picked lane by lane
+    void visit(const NodeSmooth& node)
+	{
+        visitNode(*node.arguments[0]);
+        visitNode(*node.arguments[3]);
+        visitNode(*node.arguments[1]);
+        visitNode(*node.arguments[2]);
+
+        T* x = dSlot(3);
+        const T* eps = dSlot(2);
+        const T* vPos = dSlot(1);
+        const T* vNeg = dSlot();
+        for (size_t l = 0; l<myLanes; ++l)
+        {
+            const T halfEps = 0.5 * eps[l];
+            x[l] = x[l] < -halfEps ? vNeg[l]
+                : x[l] > halfEps ? vPos[l]
+                : vNeg[l] + 0.5 * (vPos[l] - vNeg[l]) / halfEps * (x[l] + halfEps);
+        }
+        popD(3);
+	}
+
+	//	Conditions
+    template<class OP>
+    void visitCondition(const boolNode& node, OP op)
+    {
+        visitNode(*node.arguments[0]);
+        char* b = pushB();
+        const T* x = dSlot();
+        for (size_t l = 0; l<myLanes; ++l) b[l] = op(x[l]);
+        popD();
+    }
+
+	void visit(const NodeEqual& node)
+	{
+        visitCondition(node, [](const T x) { return x == 0; });
+    }
+	void visit(const NodeSup& node)
+	{
+        visitCondition(node, [](const T x) { return x > 0; });
+    }
+	void visit(const NodeSupEqual& node)
+	{
+        visitCondition(node, [](const T x) { return x >= 0; });
+    }
+
+    //  Conditions have no side effects, so both sides are evaluated on all lanes
+	void visit(const NodeAnd& node)
+	{
+        visitNode(*node.arguments[0]);
+        visitNode(*node.arguments[1]);
+        char* b = bSlot(1);
+        const char* c = bSlot();
+        for (size_t l = 0; l<myLanes; ++l) b[l] = b[l] && c[l];
+        popB();
+    }
+	void visit(const NodeOr& node)
+	{
+        visitNode(*node.arguments[0]);
+        visitNode(*node.arguments[1]);
+        char* b = bSlot(1);
+        const char* c = bSlot();
+        for (size_t l = 0; l<myLanes; ++l) b[l] = b[l] || c[l];
+        popB();
+    }
+    void visit(const NodeNot& node)
+    {
+        visitNode(*node.arguments[0]);
+        char* b = bSlot();
+        for (size_t l = 0; l<myLanes; ++l) b[l] = !b[l];
+    }
+
+	//	Instructions
+	void visit(const NodeIf& node)
+	{
+		//	Eval the condition
+        visitNode(*node.arguments[0]);
+
+        //  Mask of the branch, lanes active and taking the branch
+        //  Slots are accessed by index, since nested statements may reallocate the stacks
+        const size_t bIdx = myBtop - 1, mIdx = myMtop;
+        pushMask();
+        auto branchMask = [&](const bool taken)
+        {
+            char* m = &myMasks[mIdx * myWidth];
+            const char* cur = &myMasks[(mIdx - 1) * myWidth];
+            const char* b = &myBstack[bIdx * myWidth];
+            char any = 0;
+            for (size_t l = 0; l<myLanes; ++l)
+            {
+                m[l] = cur[l] && (b[l] != 0) == taken;
+                any |= m[l];
+            }
+            return any != 0;
+        };
+
+		//	Evaluate the statements in the lanes that take each branch
+        if (branchMask(true))
+		{
+			const auto lastTrue = node.firstElse == -1? node.arguments.size()-1: node.firstElse-1;
+			for(unsigned i=1; i<=lastTrue; ++i)
+			{
+                visitNode(*node.arguments[i]);
+            }
+		}
+		if( node.firstElse != -1 && branchMask(false))
+		{
+            const size_t n = node.arguments.size();
+			for(unsigned i=node.firstElse; i<n; ++i)
+			{
+                visitNode(*node.arguments[i]);
+            }
+		}
+
+        popMask();
+        popB();
+	}
+
+	void visit(const NodeAssign& node)
+	{
+        const auto varIdx = downcast<NodeVar>(node.arguments[0])->index;
+
+		//	Visit the RHS expression
+        visitNode(*node.arguments[1]);
+
+		//	Write result into variable, on active lanes
+        T* v = &myVariables[varIdx * myWidth];
+        const T* x = dSlot();
+        const char* m = mask();
+        for (size_t l = 0; l<myLanes; ++l) v[l] = m[l] ? x[l] : v[l];
+		popD();
+	}
+
+    void visit(const NodePays& node)
+    {
+        const auto varIdx = downcast<NodeVar>(node.arguments[0])->index;
+
+        //	Visit the RHS expression
+        visitNode(*node.arguments[1]);
+
+        //  Numeraires
+        pushScenario(myScenario->numeraires, myScenario->numEvtStride, myScenario->numPathStride);
+
+        //	Write result into variable, on active lanes
+        T* v = &myVariables[varIdx * myWidth];
+        const T* x = dSlot(1);
+        const T* num = dSlot();
+        const char* m = mask();
+        for (size_t l = 0; l<myLanes; ++l) v[l] = m[l] ? v[l] + x[l] / num[l] : v[l];
+        popD(2);
+    }
+
+    void visit(const NodeFor& node)
+    {
+        const auto varIdx = downcast<NodeVar>(node.arguments[0])->index;
+        const NodeList* lst = downcast<NodeList>(node.arguments[1]);
+        for(const auto& valExpr : lst->arguments)
+        {
+            visitNode(*valExpr);
+            T* v = &myVariables[varIdx * myWidth];
+            const T* x = dSlot();
+            const char* m = mask();
+            for (size_t l = 0; l<myLanes; ++l) v[l] = m[l] ? x[l] : v[l];
+            popD();
+            for(size_t i=2;i<node.arguments.size();++i)
+            {
+                visitNode(*node.arguments[i]);
+            }
+        }
+    }
+
+	//	Variables and constants
+	void visit(const NodeVar& node)
+	{
+        const T* v = &myVariables[node.index * myWidth];
+        copy(v, v + myLanes, pushD());
+	}
+
+	void visit(const NodeConst& node)
+	{
+        T* x = pushD();
+        fill(x, x + myLanes, T(node.constVal));
+	}
+
+    void visit(const NodeTrue&)
+    {
+        char* b = pushB();
+        fill(b, b + myLanes, char(1));
+    }
+    void visit(const NodeFalse&)
+    {
+        char* b = pushB();
+        fill(b, b + myLanes, char(0));
+    }
+
+	//	Scenario related
+	void visit(const NodeSpot&)
+	{
+        pushScenario(myScenario->spots, myScenario->spotEvtStride, myScenario->spotPathStride);
+	}
+};
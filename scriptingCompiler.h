@@ -28,6 +28,11 @@ As long as this comment is preserved at the top of the file
 
 #include <functional>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <typeinfo>
+#include <cstring>
+#include <cmath>
 
 template <class T>
 struct EvalState
@@ -43,6 +48,12 @@ struct EvalState
     {
         for (auto& var : variables) var = 0.0;
     }
+
+    //  Same, only the first n entries, the others are written before they are read
+    void init(const size_t n)
+    {
+        for (size_t i = 0; i < n; ++i) variables[i] = 0.0;
+    }
 };
 
 enum NodeType
@@ -71,6 +82,8 @@ enum NodeType
     AssignConst,
     Pays,
     PaysConst,
+    PaysScaled,
+    PaysScaledConst,
     If,
     IfElse,
     Equal,
@@ -84,10 +97,103 @@ enum NodeType
     Not,
     Uminus,
     True,
-    False
+    False,
+    //  Loops
+    ForBegin,
+    ForNext,
+    //  Short-circuits of And and Or, lazy branches of Smooth
+    AndJump,
+    OrJump,
+    SmoothBegin,
+    SmoothMid,
+    SmoothEnd,
+    //  Back edge of loops, and jumps of pre-decoded code, see scriptingDecoded.h
+    Jump,
+    //  Pre-decoded code only
+    Halt,
+    //  Register code only, superinstructions, see fuseRegisters() in scriptingRegisters.h
+    SubConstSup,
+    SubConstSupEqual,
+    SubConstEqual,
+    ConstSubSup,
+    ConstSubSupEqual,
+    IfSubConstSup,
+    IfSubConstSupEqual,
+    IfSubConstEqual,
+    IfConstSubSup,
+    IfConstSubSupEqual,
+    IfAnd,
+    DivConstAdd,
+    MultConstDivConst,
+    SubConstMax2,
+    SubConstMax2Const,
+    MultConstPaysScaled,
+    //  Fuzzy code only, evalCompiled() only
+    CallSpread,
+    CallSpreadLR,
+    Butterfly,
+    ButterflyLR,
+    FuzzyAnd,
+    FuzzyOr,
+    FuzzyNot,
+    FuzzyIf
 };
 
 #define EPS 1.0e-12
+#define ONEMINUSEPS 0.999999999999
+
+//  Size of the stacks of the interpreters when not sized from the code, see withEvalStacks()
+#define EVALSTACKSIZE 64
+
+//  Maximum depths of the data, boolean and loop counter stacks reached by compiled code
+struct StackDepths
+{
+    int data = 0;
+    int bools = 0;
+    int loops = 0;
+
+    //  Deepest of the stacks
+    int deepest() const
+    {
+        return max(data, max(bools, loops));
+    }
+
+    //  Expand to the maximum depths of both
+    void expand(const StackDepths& rhs)
+    {
+        data = max(data, rhs.data);
+        bools = max(bools, rhs.bools);
+        loops = max(loops, rhs.loops);
+    }
+};
+
+//  Compiled product: the code of all events linked into one program,
+//      one stream of instructions, one pool of constants and one stream of data,
+//      jump targets and constant indices are positions in the program
+//  The code of event i is nodeStream[entries[i]] to nodeStream[entries[i + 1]] (excluded)
+struct CompiledProgram
+{
+    vector<int>         nodeStream;
+    vector<double>      constStream;
+    vector<const void*> dataStream;
+    //  Entry points of the events, then the end of the program
+    vector<size_t>      entries;
+    //  Maximum depths of the stacks in the code of every event, computed by the Compiler
+    vector<StackDepths> depths;
+
+    size_t numEvents() const
+    {
+        return entries.empty() ? 0 : entries.size() - 1;
+    }
+
+    //  Maximum depths over all events, the events of a path share one set of stacks
+    StackDepths maxDepths() const
+    {
+        StackDepths res;
+        for (const auto& d : depths) res.expand(d);
+        return res;
+    }
+};
 
 class Compiler : public constVisitor<Compiler>
 {
@@ -96,10 +202,332 @@ class Compiler : public constVisitor<Compiler>
     vector<double> myConstStream;
     vector<const void*> myDataStream;
 
+    //  Numeraire of the event if deterministic, folded into the code, nullptr otherwise
+    const double*       myNumeraire;
+
+    //  Entry points of the events compiled so far
+    vector<size_t>      myEntries;
+
+    //  Fuzzy code: conditions push degrees of truth on the stack and ifs blend their branches, 
+    //      as in the FuzzyEvaluator, with default smoothing factor myDefEps
+    const bool          myFuzzy;
+    const double        myDefEps;
+
+    //  Fuzzy ifs save the affected variables in the state, after the variables
+    //  Next free slot, and size of the state
+    size_t              myStoreTop;
+    size_t              myStateSize;
+
+    //  Current depths of the stacks after the code compiled so far, 
+    //      the same on all paths into any instruction,
+    //      maximum depths of the whole code, and of the code of every event
+    StackDepths         myDepth;
+    StackDepths         myMaxDepth;
+    vector<StackDepths> myDepths;
+
+    //  Common subexpressions, sharp code only
+    //  When an event starts, its expression subtrees are hash-consed into value numbers, 
+    //      keyed on the opcode, the value numbers of the arguments, the constants and the variable indices
+    //  A subtree repeated often enough in the event is computed once into a hidden slot of the state, 
+    //      after the variables, and read back from there while available: 
+    //      until a variable it reads is assigned, and only within the branch, loop body or lazy argument
+    //      where it was computed
+
+    //  Value numbers of the expression nodes of the event
+    unordered_map<const Node*, int> myNumbers;
+    //  Value numbers by key
+    map<vector<int>, int>           myKeys;
+    //  By value number: variables read, sorted, and cost in instructions
+    vector<vector<int>>             myReads;
+    vector<int>                     myCosts;
+    //  Number of assignments of every variable so far in the event: 
+    //      a value number, with the numbers of assignments of the variables it reads, is one value
+    vector<int>                     myVersions;
+    //  Number of evaluations of every value in the event
+    map<vector<int>, int>           myUses;
+    //  Available subexpressions: value number to slot, and value numbers in the order they were computed
+    map<int, int>                   myAvailable;
+    vector<int>                     myComputed;
+    //  Next free hidden slot
+    size_t                          myTempTop;
+
+    //  Record the effect of an emitted instruction on the stacks
+    //  Conditional jumps are recorded with the effect on their fall-through path, 
+    //      except the exit of loops, recorded with the back edge
+    void track(const int data, const int bools = 0, const int loops = 0)
+    {
+        myDepth.data += data;
+        myDepth.bools += bools;
+        myDepth.loops += loops;
+        myMaxDepth.expand(myDepth);
+        if (!myDepths.empty()) myDepths.back().expand(myDepth);
+    }
+
+    //  Opcode of an expression node, for its value number, -1 for other nodes
+    static int opcodeOf(const Node& node)
+    {
+        const type_info& t = typeid(node);
+        if (t == typeid(NodeAdd)) return Add;
+        if (t == typeid(NodeSub)) return Sub;
+        if (t == typeid(NodeMult)) return Mult;
+        if (t == typeid(NodeDiv)) return Div;
+        if (t == typeid(NodePow)) return Pow;
+        if (t == typeid(NodeMax)) return Max2;
+        if (t == typeid(NodeMin)) return Min2;
+        if (t == typeid(NodeUminus)) return Uminus;
+        if (t == typeid(NodeLog)) return Log;
+        if (t == typeid(NodeSqrt)) return Sqrt;
+        if (t == typeid(NodeSmooth)) return Smooth;
+        if (t == typeid(NodeSpot)) return Spot;
+        if (t == typeid(NodeVar)) return Var;
+        if (t == typeid(NodeConst)) return Const;
+        return -1;
+    }
+
+    //  Value number of an expression node, after its subtrees, -1 for other nodes, whose arguments are numbered
+    int number(const Node& node)
+    {
+        //  Unary plus is compiled as its argument
+        if (typeid(node) == typeid(NodeUplus)) return number(*node.arguments[0]);
+
+        const int op = opcodeOf(node);
+        if (op < 0)
+        {
+            for (const auto& arg : node.arguments) number(*arg);
+            return -1;
+        }
+
+        const exprNode& expr = static_cast<const exprNode&>(node);
+        vector<int> key;
+        vector<int> reads;
+        int cost = 1;
+        if (expr.isConst)
+        {
+            int bits[2];
+            memcpy(bits, &expr.constVal, sizeof(double));
+            key = { Const, bits[0], bits[1] };
+        }
+        else if (op == Var)
+        {
+            const int idx = int(static_cast<const NodeVar&>(node).index);
+            key = { Var, idx };
+            reads.push_back(idx);
+        }
+        else
+        {
+            key.push_back(op);
+            for (const auto& arg : node.arguments)
+            {
+                const int num = number(*arg);
+                key.push_back(num);
+                const vector<int>& argReads = myReads[num];
+                vector<int> merged;
+                set_union(reads.begin(), reads.end(), argReads.begin(), argReads.end(), back_inserter(merged));
+                reads.swap(merged);
+                //  Constant operands of binaries are folded into the operation
+                if (!downcast<exprNode>(arg)->isConst || node.arguments.size() != 2) cost += myCosts[num];
+            }
+        }
+
+        auto it = myKeys.find(key);
+        int num;
+        if (it == myKeys.end())
+        {
+            num = int(myReads.size());
+            myKeys[key] = num;
+            myReads.push_back(reads);
+            myCosts.push_back(cost);
+        }
+        else num = it->second;
+
+        myNumbers[&node] = num;
+        return num;
+    }
+
+    //  Assignment of a variable
+    void bumpVersion(const size_t var)
+    {
+        if (var >= myVersions.size()) myVersions.resize(var + 1, 0);
+        ++myVersions[var];
+    }
+
+    //  Value of a value number, at this point of the code
+    vector<int> valueOf(const int num) const
+    {
+        vector<int> val(1, num);
+        for (const auto var : myReads[num]) val.push_back(size_t(var) < myVersions.size() ? myVersions[var] : 0);
+        return val;
+    }
+
+    //  Whether a value is worth a slot: 
+    //      computed once, plus a store and a load, then read back, instead of computed every time
+    bool worthSharing(const int num, const int uses) const
+    {
+        return uses >= 2 && (uses - 1) * (myCosts[num] - 1) > 2;
+    }
+
+    //  Count the evaluations of the values in a statement or expression, in the order of the code
+    //  The arguments of the values shared as per shared are only evaluated the first time
+    void countUses(const Node& node, map<vector<int>, int>& uses, const map<vector<int>, int>* shared)
+    {
+        const type_info& t = typeid(node);
+        if (t == typeid(NodeAssign) || t == typeid(NodePays))
+        {
+            countUses(*node.arguments[1], uses, shared);
+            bumpVersion(downcast<NodeVar>(node.arguments[0])->index);
+            return;
+        }
+        if (t == typeid(NodeFor))
+        {
+            vector<size_t> assigned;
+            assignedVars(node, assigned);
+            for (const auto var : assigned) bumpVersion(var);
+        }
+
+        auto it = myNumbers.find(&node);
+        if (it != myNumbers.end())
+        {
+            const vector<int> val = valueOf(it->second);
+            if (++uses[val] > 1 && shared)
+            {
+                auto sh = shared->find(val);
+                if (sh != shared->end() && worthSharing(it->second, sh->second)) return;
+            }
+        }
+        for (const auto& arg : node.arguments) countUses(*arg, uses, shared);
+    }
+
+    //  Number the subexpressions of an event and count the evaluations of their values
+    void numberEvent(const Event& event)
+    {
+        for (const auto& stat : event) number(*stat);
+
+        //  Count all evaluations, then only the ones left when the repeated values are shared
+        map<vector<int>, int> all;
+        for (const auto& stat : event) countUses(*stat, all, nullptr);
+        myVersions.clear();
+        for (const auto& stat : event) countUses(*stat, myUses, &all);
+        myVersions.clear();
+    }
+
+    //  Read back a common subexpression computed before, returns false if not available
+    bool readCommon(const Node& node)
+    {
+        auto num = myNumbers.find(&node);
+        if (num == myNumbers.end()) return false;
+        auto slot = myAvailable.find(num->second);
+        if (slot == myAvailable.end()) return false;
+
+        myNodeStream.push_back(Var);
+        myNodeStream.push_back(slot->second);
+        track(1);
+        return true;
+    }
+
+    //  After the code of an expression: keep the value in a hidden slot, if shared
+    void writeCommon(const Node& node)
+    {
+        auto num = myNumbers.find(&node);
+        if (num == myNumbers.end()) return;
+        auto uses = myUses.find(valueOf(num->second));
+        if (uses == myUses.end() || !worthSharing(num->second, uses->second)) return;
+
+        const int slot = int(myTempTop++);
+        myStateSize = max(myStateSize, myTempTop);
+
+        myNodeStream.push_back(Assign);
+        myNodeStream.push_back(slot);
+        track(-1);
+        myNodeStream.push_back(Var);
+        myNodeStream.push_back(slot);
+        track(1);
+
+        myAvailable[num->second] = slot;
+        myComputed.push_back(num->second);
+    }
+
+    //  Assignment of a variable: the subexpressions that read it are no longer available
+    void invalidate(const size_t var)
+    {
+        bumpVersion(var);
+        for (auto it = myAvailable.begin(); it != myAvailable.end();)
+        {
+            const vector<int>& reads = myReads[it->first];
+            if (binary_search(reads.begin(), reads.end(), int(var))) it = myAvailable.erase(it);
+            else ++it;
+        }
+    }
+
+    //  Variables assigned by statements, including nested
+    static void assignedVars(const Node& node, vector<size_t>& vars)
+    {
+        const type_info& t = typeid(node);
+        if (t == typeid(NodeAssign) || t == typeid(NodePays) || t == typeid(NodeFor))
+        {
+            vars.push_back(downcast<NodeVar>(node.arguments[0])->index);
+        }
+        if (opcodeOf(node) < 0) for (const auto& arg : node.arguments) assignedVars(*arg, vars);
+    }
+
+    //  Code compiled conditionally: the subexpressions computed there are only available there
+    size_t enterScope() const
+    {
+        return myComputed.size();
+    }
+    void leaveScope(const size_t scope)
+    {
+        while (myComputed.size() > scope)
+        {
+            myAvailable.erase(myComputed.back());
+            myComputed.pop_back();
+        }
+    }
+
 public:
 
     using constVisitor<Compiler>::visit;
 
+    //  Deterministic numeraire of the compiled event, if any
+    //  Fuzzy code with default smoothing factor defEps if fuzzy, for nVar variables
+    Compiler(const double* numeraire = nullptr, const bool fuzzy = false, const double defEps = 0.0, const size_t nVar = 0) 
+        : myNumeraire(numeraire), myFuzzy(fuzzy), myDefEps(defEps), myStoreTop(nVar), myStateSize(nVar), myTempTop(nVar) {}
+
+    //  Start the code of the next event, with its deterministic numeraire if any, 
+    //      when all events are compiled into one program
+    //  Common subexpressions of the statements of the event, if provided, are computed once, sharp code only
+    void nextEvent(const double* numeraire = nullptr, const Event* event = nullptr)
+    {
+        myNumeraire = numeraire;
+        myEntries.push_back(myNodeStream.size());
+        myDepths.push_back(StackDepths());
+
+        //  Subexpressions are not shared across events
+        myNumbers.clear();
+        myKeys.clear();
+        myReads.clear();
+        myCosts.clear();
+        myVersions.clear();
+        myUses.clear();
+        myAvailable.clear();
+        myComputed.clear();
+        myTempTop = myStoreTop;
+
+        if (event && !myFuzzy) numberEvent(*event);
+    }
+
+    //  Linked program of all events, after traversal
+    CompiledProgram program() const
+    {
+        CompiledProgram prg;
+        prg.nodeStream = myNodeStream;
+        prg.constStream = myConstStream;
+        prg.dataStream = myDataStream;
+        prg.entries = myEntries;
+        prg.entries.push_back(myNodeStream.size());
+        prg.depths = myDepths;
+        return prg;
+    }
+
     //	Accessors
 
     //	Access the streams after traversal
@@ -115,6 +543,16 @@ public:
     {
         return myDataStream;
     }
+    //  Size of the state required by the code: the variables, then the work space of fuzzy ifs
+    size_t stateSize() const
+    {
+        return myStateSize;
+    }
+    //  Maximum depths of the stacks in the code compiled so far
+    const StackDepths& maxDepths() const
+    {
+        return myMaxDepth;
+    }
 
     //	Visitors
 
@@ -125,11 +563,15 @@ public:
     template<NodeType IfBin, NodeType IfConstLeft, NodeType IfConstRight>
     void visitBinary(const exprNode& node)
     {
+        //  Common subexpression computed before
+        if (readCommon(node)) return;
+
         if (node.isConst)
         {
             myNodeStream.push_back(Const);
             myNodeStream.push_back(int(myConstStream.size()));
             myConstStream.push_back(node.constVal);
+            track(1);
         }
         else
         {
@@ -155,7 +597,10 @@ public:
                 node.arguments[0]->accept(*this);
                 node.arguments[1]->accept(*this);
                 myNodeStream.push_back(IfBin);
+                track(-1);
             }
+
+            writeCommon(node);
         }
     }
 
@@ -194,16 +639,22 @@ public:
     template<NodeType NT>
     void visitUnary(const exprNode& node)
     {
+        //  Common subexpression computed before
+        if (readCommon(node)) return;
+
         if (node.isConst)
         {
             myNodeStream.push_back(Const);
             myNodeStream.push_back(int(myConstStream.size()));
             myConstStream.push_back(node.constVal);
+            track(1);
         }
         else
         {
             node.arguments[0]->accept(*this);
             myNodeStream.push_back(NT);
+
+            writeCommon(node);
         }
     }
 
@@ -229,21 +680,66 @@ public:
 
     void visit(const NodeSmooth& node)
     {
+        //  Common subexpression computed before
+        if (readCommon(node)) return;
+
         //  Const?
         if (node.isConst)
         {
             myNodeStream.push_back(Const);
             myNodeStream.push_back(int(myConstStream.size()));
             myConstStream.push_back(node.constVal);
+            track(1);
         }
-        else
+        //  Both values are cheap: eval all arguments
+        else if (isLeaf(node.arguments[1]) && isLeaf(node.arguments[2]))
         {
-            //  Must come back to optimize that one
             visitArguments(node);
             myNodeStream.push_back(Smooth);
+            track(-3);
+
+            writeCommon(node);
+        }
+        //  Eval only the value(s) needed:
+        //      x, epsilon, SmoothBegin (left: jump to value if negative), 
+        //      value if positive, SmoothMid (right: done, jump to end), 
+        //      value if negative, SmoothEnd
+        else
+        {
+            node.arguments[0]->accept(*this);
+            node.arguments[3]->accept(*this);
+
+            const size_t beginSpace = myNodeStream.size();
+            myNodeStream.push_back(SmoothBegin);
+            myNodeStream.push_back(0);
+
+            const size_t scope = enterScope();
+            node.arguments[1]->accept(*this);
+            leaveScope(scope);
+
+            const size_t midSpace = myNodeStream.size();
+            myNodeStream.push_back(SmoothMid);
+            myNodeStream.push_back(0);
+
+            myNodeStream[beginSpace + 1] = int(myNodeStream.size());
+            node.arguments[2]->accept(*this);
+            leaveScope(scope);
+
+            myNodeStream.push_back(SmoothEnd);
+            track(-3);
+            myNodeStream[midSpace + 1] = int(myNodeStream.size());
+
+            writeCommon(node);
         }
     }
 
+    //  Arguments that compile into a single push, no point skipping them
+    static bool isLeaf(const unique_ptr<Node>& arg)
+    {
+        return downcast<exprNode>(arg)->isConst
+            || dynamic_cast<const NodeVar*>(arg.get()) || dynamic_cast<const NodeSpot*>(arg.get());
+    }
+
     //	Conditions
 
     template<NodeType NT, typename OP>
@@ -254,49 +750,119 @@ public:
         if (arg->isConst)
         {
             myNodeStream.push_back(op(arg->constVal) ? True : False);
+            track(0, 1);
 
         }
         else
         {
             node.arguments[0]->accept(*this);
             myNodeStream.push_back(NT);
+            track(-1, 1);
+        }
+    }
+
+    //  Fuzzy conditions, with precomputed inverses
+    //  Butterfly for equalities, call spread for inequalities, 
+    //      between lb and rb in the discrete case, in (-eps/2, eps/2) otherwise
+    void visitFuzzyCondition(const compNode& node, const bool butterfly)
+    {
+        node.arguments[0]->accept(*this);
+
+        if (node.discrete)
+        {
+            myNodeStream.push_back(butterfly ? ButterflyLR : CallSpreadLR);
+            myNodeStream.push_back(int(myConstStream.size()));
+            myConstStream.push_back(node.lb);
+            myConstStream.push_back(node.rb);
+            if (butterfly)
+            {
+                myConstStream.push_back(1.0 / node.lb);
+                myConstStream.push_back(1.0 / node.rb);
+            }
+            else
+            {
+                myConstStream.push_back(1.0 / (node.rb - node.lb));
+            }
+        }
+        else
+        {
+            const double eps = node.eps < 0 ? myDefEps : node.eps;
+            const double halfEps = 0.5 * eps;
+
+            myNodeStream.push_back(butterfly ? Butterfly : CallSpread);
+            myNodeStream.push_back(int(myConstStream.size()));
+            myConstStream.push_back(halfEps);
+            myConstStream.push_back(butterfly ? 1.0 / halfEps : 1.0 / eps);
         }
     }
 
     void visit(const NodeEqual& node)
     {
-        visitCondition<Equal>(node, [](const double x) {return x == 0.0; });
+        if (myFuzzy) visitFuzzyCondition(node, true);
+        else visitCondition<Equal>(node, [](const double x) {return x == 0.0; });
     }
 
     void visit(const NodeSup& node)
     {
-        visitCondition<Sup>(node, [](const double x) {return x > 0.0; });
+        if (myFuzzy) visitFuzzyCondition(node, false);
+        else visitCondition<Sup>(node, [](const double x) {return x > 0.0; });
     }
     void visit(const NodeSupEqual& node)
     {
-        visitCondition<SupEqual>(node, [](const double x) {return x > -EPS; });
+        if (myFuzzy) visitFuzzyCondition(node, false);
+        else visitCondition<SupEqual>(node, [](const double x) {return x > -EPS; });
     }
 
     //  And/Or/Not
 
-    void visit(const NodeAnd& node)
+    //  Sharp: short-circuit, lhs, AndJump (false: jump to end), rhs, And
+    //      and the same with OrJump (true: jump to end) for Or
+    //  And and Or are still executed after the rhs, so all paths leave the same stacks
+
+    template<NodeType NT, NodeType JT>
+    void visitShortCircuit(const boolNode& node)
     {
         node.arguments[0]->accept(*this);
+
+        const size_t thisSpace = myNodeStream.size();
+        myNodeStream.push_back(JT);
+        myNodeStream.push_back(0);
+
+        const size_t scope = enterScope();
         node.arguments[1]->accept(*this);
-        myNodeStream.push_back(And);
+        leaveScope(scope);
+        myNodeStream.push_back(NT);
+        track(0, -1);
+
+        myNodeStream[thisSpace + 1] = int(myNodeStream.size());
+    }
+
+    void visit(const NodeAnd& node)
+    {
+        if (myFuzzy)
+        {
+            visitArguments(node);
+            myNodeStream.push_back(FuzzyAnd);
+            track(-1);
+        }
+        else visitShortCircuit<And, AndJump>(node);
     }
 
     void visit(const NodeOr& node)
     {
-        node.arguments[0]->accept(*this);
-        node.arguments[1]->accept(*this);
-        myNodeStream.push_back(Or);
+        if (myFuzzy)
+        {
+            visitArguments(node);
+            myNodeStream.push_back(FuzzyOr);
+            track(-1);
+        }
+        else visitShortCircuit<Or, OrJump>(node);
     }
 
     void visit(const NodeNot& node)
     {
         node.arguments[0]->accept(*this);
-        myNodeStream.push_back(Not);
+        myNodeStream.push_back(myFuzzy ? FuzzyNot : Not);
     }
 
     //  Assign, pays
@@ -316,8 +882,11 @@ public:
         {
             node.arguments[1]->accept(*this);
             myNodeStream.push_back(Assign);
+            track(-1);
         }
         myNodeStream.push_back(int(var->index));
+
+        invalidate(var->index);
     }
 
     void visit(const NodePays& node)
@@ -325,7 +894,25 @@ public:
         const NodeVar* var = downcast<NodeVar>(node.arguments[0]);
         const exprNode* rhs = downcast<exprNode>(node.arguments[1]);
 
-        if (rhs->isConst)
+        //  Deterministic numeraire: pre-scale
+        if (myNumeraire)
+        {
+            if (rhs->isConst)
+            {
+                myNodeStream.push_back(PaysScaledConst);
+                myNodeStream.push_back(int(myConstStream.size()));
+                myConstStream.push_back(rhs->constVal / *myNumeraire);
+            }
+            else
+            {
+                node.arguments[1]->accept(*this);
+                myNodeStream.push_back(PaysScaled);
+                myNodeStream.push_back(int(myConstStream.size()));
+                myConstStream.push_back(1.0 / *myNumeraire);
+                track(-1);
+            }
+        }
+        else if (rhs->isConst)
         {
             myNodeStream.push_back(PaysConst);
             myNodeStream.push_back(int(myConstStream.size()));
@@ -335,8 +922,11 @@ public:
         {
             node.arguments[1]->accept(*this);
             myNodeStream.push_back(Pays);
+            track(-1);
         }
         myNodeStream.push_back(int(var->index));
+
+        invalidate(var->index);
     }
 
     //  Leaves
@@ -345,6 +935,7 @@ public:
     {
         myNodeStream.push_back(Var);
         myNodeStream.push_back(int(node.index));
+        track(1);
     }
 
     void visit(const NodeConst& node)
@@ -352,32 +943,65 @@ public:
         myNodeStream.push_back(Const);
         myNodeStream.push_back(int(myConstStream.size()));
         myConstStream.push_back(node.constVal);
+        track(1);
     }
 
+    //  Degrees of truth 1 and 0 when fuzzy
     void visit(const NodeTrue& node)
     {
-        myNodeStream.push_back(True);
+        if (myFuzzy)
+        {
+            myNodeStream.push_back(Const);
+            myNodeStream.push_back(int(myConstStream.size()));
+            myConstStream.push_back(1.0);
+            track(1);
+        }
+        else
+        {
+            myNodeStream.push_back(True);
+            track(0, 1);
+        }
     }
 
     void visit(const NodeFalse& node)
     {
-        myNodeStream.push_back(False);
+        if (myFuzzy)
+        {
+            myNodeStream.push_back(Const);
+            myNodeStream.push_back(int(myConstStream.size()));
+            myConstStream.push_back(0.0);
+            track(1);
+        }
+        else
+        {
+            myNodeStream.push_back(False);
+            track(0, 1);
+        }
     }
 
     //	Scenario related
     void visit(const NodeSpot& node)
     {
         myNodeStream.push_back(Spot);
+        track(1);
     }
 
     //	Instructions
     void visit(const NodeIf& node)
     {
+        if (myFuzzy)
+        {
+            visitFuzzyIf(node);
+            return;
+        }
+
         //  Visit condition
         node.arguments[0]->accept(*this);
 
         //  Mark instruction
         myNodeStream.push_back(node.firstElse == -1 ? If : IfElse);
+        //  IfElse pops the condition after its if-true statements, If before
+        if (node.firstElse == -1) track(0, -1);
         //  Record space
         const size_t thisSpace = myNodeStream.size() - 1;
         //  Make 2 spaces for last if-true and last if-false
@@ -385,11 +1009,13 @@ public:
         if (node.firstElse != -1) myNodeStream.push_back(0);
 
         //  Visit if-true statements
+        const size_t scope = enterScope();
         const auto lastTrue = node.firstElse == -1 ? node.arguments.size() - 1 : node.firstElse - 1;
         for (size_t i = 1; i <= lastTrue; ++i)
         {
             node.arguments[i]->accept(*this);
         }
+        leaveScope(scope);
         //  Record last if-true space
         myNodeStream[thisSpace + 1] = int(myNodeStream.size());
 
@@ -397,33 +1023,226 @@ public:
         const size_t n = node.arguments.size();
         if (node.firstElse != -1)
         {
+            track(0, -1);
+
             for (size_t i = node.firstElse; i < n; ++i)
             {
                 {
                     node.arguments[i]->accept(*this);
                 }
             }
+            leaveScope(scope);
             //  Record last if-false space
             myNodeStream[thisSpace + 2] = int(myNodeStream.size());
         }
     }
+
+    //  Fuzzy if: FuzzyIf, last if-true, last if-false, first slot of the work space, 
+    //      number of affected variables, affected variables, 
+    //      then the if-true and the if-false statements
+    //  The affected variables are saved in the work space, 
+    //      and nested fuzzy ifs use the slots after them
+    void visitFuzzyIf(const NodeIf& node)
+    {
+        //  Visit condition
+        node.arguments[0]->accept(*this);
+
+        const size_t nAffected = node.affectedVars.size();
+        const size_t thisSpace = myNodeStream.size();
+        myNodeStream.push_back(FuzzyIf);
+        track(-1);
+        myNodeStream.push_back(0);
+        myNodeStream.push_back(0);
+        myNodeStream.push_back(int(myStoreTop));
+        myNodeStream.push_back(int(nAffected));
+        for (const auto idx : node.affectedVars) myNodeStream.push_back(int(idx));
+
+        //  Reserve work space
+        myStoreTop += nAffected;
+        myStateSize = max(myStateSize, myStoreTop);
+
+        //  Visit if-true statements
+        const size_t n = node.arguments.size();
+        const size_t lastTrue = node.firstElse == -1 ? n - 1 : node.firstElse - 1;
+        for (size_t i = 1; i <= lastTrue; ++i)
+        {
+            node.arguments[i]->accept(*this);
+        }
+        //  Record last if-true space
+        myNodeStream[thisSpace + 1] = int(myNodeStream.size());
+
+        //  Visit if-false statements
+        if (node.firstElse != -1)
+        {
+            for (size_t i = node.firstElse; i < n; ++i)
+            {
+                node.arguments[i]->accept(*this);
+            }
+        }
+        //  Record last if-false space
+        myNodeStream[thisSpace + 2] = int(myNodeStream.size());
+
+        //  Release work space
+        myStoreTop -= nAffected;
+    }
+
+    //  Loops over constant values: 
+    //      ForBegin starts a counter, 
+    //      ForNext assigns the next value from the constant table to the loop variable, 
+    //          or exits the loop after the last one,
+    //      and Jump after the body goes back to ForNext
+    //  Loops over non-constant values are unrolled
+    void visit(const NodeFor& node)
+    {
+        const NodeVar* var = downcast<NodeVar>(node.arguments[0]);
+        const NodeList* lst = downcast<NodeList>(node.arguments[1]);
+        const size_t n = node.arguments.size();
+
+        bool constValues = true;
+        for (const auto& valExpr : lst->arguments)
+        {
+            if (!downcast<exprNode>(valExpr)->isConst) constValues = false;
+        }
+
+        if (constValues)
+        {
+            //  The subexpressions that read variables assigned in the loop are recomputed in the body
+            vector<size_t> assigned;
+            assignedVars(node, assigned);
+            for (const auto idx : assigned) invalidate(idx);
+            const size_t scope = enterScope();
+
+            myNodeStream.push_back(ForBegin);
+            track(0, 0, 1);
+
+            //  ForNext, variable, table, number of values, space for the end of the loop
+            const size_t thisSpace = myNodeStream.size();
+            myNodeStream.push_back(ForNext);
+            myNodeStream.push_back(int(var->index));
+            myNodeStream.push_back(int(myConstStream.size()));
+            myNodeStream.push_back(int(lst->arguments.size()));
+            myNodeStream.push_back(0);
+            for (const auto& valExpr : lst->arguments)
+            {
+                myConstStream.push_back(downcast<exprNode>(valExpr)->constVal);
+            }
+
+            //  Visit body
+            for (size_t i = 2; i < n; ++i)
+            {
+                node.arguments[i]->accept(*this);
+            }
+
+            leaveScope(scope);
+
+            //  Back edge
+            myNodeStream.push_back(Jump);
+            myNodeStream.push_back(int(thisSpace));
+            track(0, 0, -1);
+
+            //  Record end of loop
+            myNodeStream[thisSpace + 4] = int(myNodeStream.size());
+        }
+        else
+        {
+            for (const auto& valExpr : lst->arguments)
+            {
+                const exprNode* val = downcast<exprNode>(valExpr);
+                if (val->isConst)
+                {
+                    myNodeStream.push_back(AssignConst);
+                    myNodeStream.push_back(int(myConstStream.size()));
+                    myConstStream.push_back(val->constVal);
+                }
+                else
+                {
+                    valExpr->accept(*this);
+                    myNodeStream.push_back(Assign);
+                    track(-1);
+                }
+                myNodeStream.push_back(int(var->index));
+                invalidate(var->index);
+
+                for (size_t i = 2; i < n; ++i)
+                {
+                    node.arguments[i]->accept(*this);
+                }
+            }
+        }
+    }
+};
+
+//  Stacks of the interpreter, shared by the nested calls and by all the events of a path
+//  Of size N, or on the heap for N = 0, sized from the depths computed by the Compiler, see withEvalStacks()
+template <class T, size_t N = EVALSTACKSIZE>
+struct EvalStacks
+{
+    staticStack<T, N> dStack;
+    staticStack<char, N> bStack;
+    //  Loop counters
+    staticStack<int, N> lStack;
+
+    EvalStacks(const StackDepths& = StackDepths()) {}
 };
 
 template <class T>
+struct EvalStacks<T, 0>
+{
+    heapStack<T> dStack;
+    heapStack<char> bStack;
+    //  Loop counters
+    heapStack<int> lStack;
+
+    EvalStacks(const StackDepths& depths) : dStack(depths.data), bStack(depths.bools), lStack(depths.loops) {}
+};
+
+//  Call f(stacks) with the smallest stacks that fit the depths of compiled code: 
+//      on the stack of the machine up to EVALSTACKSIZE, on the heap beyond
+//  f is called with an EvalStacks<T, N>&, so it is typically a generic lambda
+template <class T, class F>
+inline void withEvalStacks(const StackDepths& depths, F f)
+{
+    const int deepest = depths.deepest();
+    if (deepest <= 8)
+    {
+        EvalStacks<T, 8> stacks;
+        f(stacks);
+    }
+    else if (deepest <= 16)
+    {
+        EvalStacks<T, 16> stacks;
+        f(stacks);
+    }
+    else if (deepest <= EVALSTACKSIZE)
+    {
+        EvalStacks<T, EVALSTACKSIZE> stacks;
+        f(stacks);
+    }
+    else
+    {
+        EvalStacks<T, 0> stacks(depths);
+        f(stacks);
+    }
+}
+
+//  The streams are accessed by pointer, so they may live in vectors or in mapped memory, see scriptingImage.h
+//  The stacks must fit the depths of the code, see withEvalStacks()
+template <class T, size_t N>
 inline void evalCompiled(
     //  Stream to eval
-    const vector<int>&          nodeStream,
-    const vector<double>&       constStream,
-    const vector<const void*>&  dataStream,
+    const int*                  nodeStream,
+    const double*               constStream,
+    const void* const*          dataStream,
     //  Scenario
-    const SimulData<T>&         scen,
+    const SimulDataRef<const T> scen,
     //  State
     EvalState<T>&               state,
     //  First (included), last (excluded)
-    const size_t                first = 0,
-    const size_t                last = 0)
+    const size_t                first,
+    const size_t                last,
+    //  Stacks, empty on entry and on exit
+    EvalStacks<T, N>&           stacks)
 {
-    const size_t n = last ? last : nodeStream.size();
     size_t i = first;
 
     //  Work space
@@ -431,11 +1250,13 @@ inline void evalCompiled(
     size_t idx;
 
     //  Stacks
-    staticStack<T> dStack;
-    staticStack<char> bStack;
+    auto& dStack = stacks.dStack;
+    auto& bStack = stacks.bStack;
+    //  Loop counters
+    auto& lStack = stacks.lStack;
 
     //  Loop on instructions
-    while (i < n)
+    while (i < last)
     {
         //  Big switch
         switch (nodeStream[i])
@@ -631,6 +1452,25 @@ inline void evalCompiled(
             ++i;
             break;
 
+        case PaysScaled:
+
+            x = constStream[nodeStream[++i]];
+            idx = nodeStream[++i];
+            state.variables[idx] += dStack.top() * x;
+            dStack.pop();
+
+            ++i;
+            break;
+
+        case PaysScaledConst:
+
+            x = constStream[nodeStream[++i]];
+            idx = nodeStream[++i];
+            state.variables[idx] += x;
+
+            ++i;
+            break;
+
         case If:
 
             if (bStack.top())
@@ -655,7 +1495,7 @@ inline void evalCompiled(
             else
             {
                 //  Cannot avoid nested call here
-                evalCompiled(nodeStream, constStream, dataStream, scen, state, i + 3, nodeStream[i + 1]);
+                evalCompiled(nodeStream, constStream, dataStream, scen, state, i + 3, nodeStream[i + 1], stacks);
                 i = nodeStream[i + 2];
             }
 
@@ -723,7 +1563,7 @@ inline void evalCompiled(
             if (x < -y) dStack.top() = t;
 
             //	Right
-            if (x < -y) dStack.top() = z;
+            else if (x > y) dStack.top() = z;
 
             //	Fuzzy
             else
@@ -775,6 +1615,273 @@ inline void evalCompiled(
 
             ++i;
             break;
+
+        case ForBegin:
+
+            lStack.push(0);
+
+            ++i;
+            break;
+
+        case ForNext:
+
+            //  Done
+            if (lStack.top() == nodeStream[i + 3])
+            {
+                lStack.pop();
+                i = nodeStream[i + 4];
+            }
+            //  Next value
+            else
+            {
+                state.variables[nodeStream[i + 1]] = constStream[nodeStream[i + 2] + lStack.top()];
+                ++lStack.top();
+                i += 5;
+            }
+
+            break;
+
+        //  Short-circuits: jump over the rhs, and the And or Or, when the lhs decides
+        case AndJump:
+
+            if (bStack.top()) i += 2;
+            else i = nodeStream[i + 1];
+
+            break;
+
+        case OrJump:
+
+            if (bStack.top()) i = nodeStream[i + 1];
+            else i += 2;
+
+            break;
+
+        //  Lazy smooth, x and epsilon on the stack
+        //  Left: push a placeholder for the value if positive, jump to the value if negative
+        case SmoothBegin:
+
+            if (dStack[1] < -0.5 * dStack.top())
+            {
+                dStack.push(dStack.top());
+                i = nodeStream[i + 1];
+            }
+            else i += 2;
+
+            break;
+
+        //  Right: replace x and epsilon with the value if positive, jump to the end
+        case SmoothMid:
+
+            if (dStack[2] > 0.5 * dStack[1])
+            {
+                dStack[2] = dStack.top();
+                dStack.pop(2);
+                i = nodeStream[i + 1];
+            }
+            else i += 2;
+
+            break;
+
+        //  Left or fuzzy, x, epsilon, value if positive and value if negative on the stack
+        case SmoothEnd:
+
+            x = dStack[3];
+            y = 0.5*dStack[2];
+            z = dStack[1];
+            t = dStack.top();
+
+            dStack.pop(3);
+
+            //	Left
+            if (x < -y) dStack.top() = t;
+
+            //	Fuzzy
+            else
+            {
+                dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+            }
+
+            ++i;
+            break;
+
+        case Jump:
+
+            i = nodeStream[i + 1];
+
+            break;
+
+        //  Fuzzy conditions: degrees of truth on the stack, see FuzzyEvaluator
+
+        //  Call spread (-eps/2, eps/2): eps/2, 1/eps
+        case CallSpread:
+
+            x = dStack.top();
+            idx = nodeStream[++i];
+            y = constStream[idx];
+            if (x < -y) dStack.top() = 0.0;
+            else if (x > y) dStack.top() = 1.0;
+            else dStack.top() = (x + y) * constStream[idx + 1];
+
+            ++i;
+            break;
+
+        //  Call spread (lb, rb): lb, rb, 1/(rb - lb)
+        case CallSpreadLR:
+
+            x = dStack.top();
+            idx = nodeStream[++i];
+            if (x < constStream[idx]) dStack.top() = 0.0;
+            else if (x > constStream[idx + 1]) dStack.top() = 1.0;
+            else dStack.top() = (x - constStream[idx]) * constStream[idx + 2];
+
+            ++i;
+            break;
+
+        //  Butterfly (-eps/2, eps/2): eps/2, 2/eps
+        case Butterfly:
+
+            x = dStack.top();
+            idx = nodeStream[++i];
+            y = constStream[idx];
+            if (x < -y || x > y) dStack.top() = 0.0;
+            else dStack.top() = (y - fabs(x)) * constStream[idx + 1];
+
+            ++i;
+            break;
+
+        //  Butterfly (lb, 0, rb): lb, rb, 1/lb, 1/rb
+        case ButterflyLR:
+
+            x = dStack.top();
+            idx = nodeStream[++i];
+            if (x < constStream[idx] || x > constStream[idx + 1]) dStack.top() = 0.0;
+            else if (x < 0.0) dStack.top() = 1.0 - x * constStream[idx + 2];
+            else dStack.top() = 1.0 - x * constStream[idx + 3];
+
+            ++i;
+            break;
+
+        case FuzzyAnd:
+
+            dStack[1] *= dStack.top();
+            dStack.pop();
+
+            ++i;
+            break;
+
+        case FuzzyOr:
+
+            x = dStack[1];
+            y = dStack.top();
+            dStack.pop();
+            dStack.top() = x + y - x * y;
+
+            ++i;
+            break;
+
+        case FuzzyNot:
+
+            dStack.top() = 1.0 - dStack.top();
+
+            ++i;
+            break;
+
+        case FuzzyIf:
+        {
+            //  Degree of truth
+            const T dt = dStack.top();
+            dStack.pop();
+
+            const size_t lastTrue = nodeStream[i + 1], lastFalse = nodeStream[i + 2];
+            const size_t nAffected = nodeStream[i + 4];
+            const int* affected = &nodeStream[i + 5];
+            const size_t firstTrue = i + 5 + nAffected;
+
+            //  Absolutely true
+            if (dt > ONEMINUSEPS)
+            {
+                evalCompiled(nodeStream, constStream, dataStream, scen, state, firstTrue, lastTrue, stacks);
+            }
+            //  Absolutely false
+            else if (dt < EPS)
+            {
+                if (lastFalse > lastTrue)
+                {
+                    evalCompiled(nodeStream, constStream, dataStream, scen, state, lastTrue, lastFalse, stacks);
+                }
+            }
+            //  Fuzzy
+            else
+            {
+                T* store = state.variables.data() + nodeStream[i + 3];
+
+                //  Record values of variables to be changed
+                for (size_t k = 0; k < nAffected; ++k) store[k] = state.variables[affected[k]];
+
+                //  Eval if-true statements
+                evalCompiled(nodeStream, constStream, dataStream, scen, state, firstTrue, lastTrue, stacks);
+
+                //  Record and reset values of variables to be changed
+                for (size_t k = 0; k < nAffected; ++k) swap(store[k], state.variables[affected[k]]);
+
+                //  Eval if-false statements, if any
+                if (lastFalse > lastTrue)
+                {
+                    evalCompiled(nodeStream, constStream, dataStream, scen, state, lastTrue, lastFalse, stacks);
+                }
+
+                //  Set values of variables to fuzzy values
+                for (size_t k = 0; k < nAffected; ++k)
+                {
+                    T& var = state.variables[affected[k]];
+                    var = dt * store[k] + (1.0 - dt) * var;
+                }
+            }
+
+            i = lastFalse;
+            break;
+        }
         }
     }
+}
+
+//  Evaluate instructions first to last (excluded), to the end of the stream if last is 0
+//  With stacks of the default size EVALSTACKSIZE, the code must not be deeper
+template <class T>
+inline void evalCompiled(
+    //  Stream to eval
+    const vector<int>&          nodeStream,
+    const vector<double>&       constStream,
+    const vector<const void*>&  dataStream,
+    //  Scenario
+    const SimulDataRef<const T> scen,
+    //  State
+    EvalState<T>&               state,
+    //  First (included), last (excluded)
+    const size_t                first = 0,
+    const size_t                last = 0)
+{
+    EvalStacks<T> stacks;
+    evalCompiled(nodeStream.data(), constStream.data(), dataStream.data(), scen, state, first, last ? last : nodeStream.size(), stacks);
+}
+
+//  Evaluate a linked program on a path, in one call with one set of stacks, 
+//      event i on scen[i]
+template <class T>
+inline void evalCompiled(
+    //  Program to eval
+    const CompiledProgram&      prg,
+    //  Scenario
+    const Scenario<T>&          scen,
+    //  State
+    EvalState<T>&               state)
+{
+    withEvalStacks<T>(prg.maxDepths(), [&](auto& stacks)
+    {
+        for (size_t i = 0; i < prg.numEvents(); ++i)
+        {
+            evalCompiled(prg.nodeStream.data(), prg.constStream.data(), prg.dataStream.data(), scen[i], state, 
+                prg.entries[i], prg.entries[i + 1], stacks);
+        }
+    });
 }
\ No newline at end of file
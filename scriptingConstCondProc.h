@@ -108,7 +108,7 @@ public:
             size_t lastTrueStat = node.firstElse == -1? node.arguments.size()-1: node.firstElse-1;
 			
 			//	Move arguments, destroy node
-			vector<ExprTree> args = move( node.arguments);
+			Arguments args = move( node.arguments);
 			myCurrent->reset( new NodeCollect);
 			
 			for(size_t i=1; i<=lastTrueStat; ++i)
@@ -125,7 +125,7 @@ public:
 			int firstElseStatement = node.firstElse;
 
 			//	Move arguments, destroy node
-			vector<ExprTree> args = move( node.arguments);
+			Arguments args = move( node.arguments);
 			myCurrent->reset( new NodeCollect);
 
 			if( firstElseStatement != -1)
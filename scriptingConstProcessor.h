@@ -58,6 +58,20 @@ protected:
         return true;
     }
 
+    //  Mark all the variables assigned in a statement as non const
+    void markAssigned(const Node& node)
+    {
+        if (dynamic_cast<const NodeAssign*>(&node) || dynamic_cast<const NodePays*>(&node) 
+            || dynamic_cast<const NodeFor*>(&node))
+        {
+            myVarConst[downcast<const NodeVar>(node.arguments[0])->index] = false;
+        }
+        for (const auto& arg : node.arguments)
+        {
+            markAssigned(*arg);
+        }
+    }
+
 public:
 
     using Visitor<ConstProcessor>::visit;
@@ -221,6 +235,35 @@ public:
         }
     }
 
+    //  For loop
+    //  The body runs once per value, so its statements may read the values assigned on the previous iterations: 
+    //      the loop variable and all the variables assigned in the body are non const before the body is visited, 
+    //      and the body is visited as conditional
+    void visit(NodeFor& node)
+    {
+        myVarConst[downcast<const NodeVar>(node.arguments[0])->index] = false;
+        for (size_t i = 2; i < node.arguments.size(); ++i)
+        {
+            markAssigned(*node.arguments[i]);
+        }
+
+        //  Visit values
+        node.arguments[1]->accept(*this);
+
+        //  Mark conditional
+        bool nested = myInConditional;
+        if (!nested) myInConditional = true;
+
+        //  Visit body
+        for (size_t i = 2; i < node.arguments.size(); ++i)
+        {
+            node.arguments[i]->accept(*this);
+        }
+
+        //  Reset (unless nested)
+        if (!nested) myInConditional = false;
+    }
+
     void visit(NodePays& node) 
     {
         //  A payment is always non constant because it is normalized by a possibly stochastic numeraire
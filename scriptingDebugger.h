@@ -23,7 +23,7 @@ As long as this comment is preserved at the top of the file
 class Debugger : public constVisitor<Debugger>
 {
 	string					myPrefix;
-	staticStack<string>		myStack;
+	quickStack<string>		myStack;
 
 	//	The main function call from every node visitor
 	void debug( const Node& node, const string& nodeId)
@@ -0,0 +1,602 @@
+#pragma once
+
+//  Pre-decoded compiled scripts
+//  The node and constant streams of the Compiler are decoded once into an array of instructions
+//      that carry the address of their handler in the interpreter and their operands inline:
+//      constants by value, variable indices and jump targets
+//  IfElse is decoded into a conditional jump over the if-true statements
+//      followed by an unconditional jump over the if-false statements, so there is no nested call
+//  On GCC and Clang, the interpreter uses computed goto, each handler jumping directly to the next one,
+//      so the indirect branches are spread across the handlers and predicted from the previous instruction
+//  Elsewhere, it falls back to a switch on the opcode, still without the decoding work of evalCompiled()
+//  Same results as evalCompiled()
+
+#include "scriptingCompiler.h"
+#include "quickStack.h"
+
+#include <vector>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SCRIPTING_THREADED
+#endif
+
+//  One pre-decoded instruction
+struct DecodedInstr
+{
+    //  Handler in the interpreter with computed goto, nullptr otherwise
+    const void*     handler;
+    //  Inline constant
+    double          constVal;
+    //  NodeType
+    int             op;
+    //  Variable index, or jump target = index of the instruction in the decoded code
+    int             arg;
+};
+
+//  Interpreter of the decoded code
+//  Called with code = nullptr, returns the table of handlers, indexed by NodeType (nullptr without computed goto)
+template <class T>
+inline const void* const* runDecoded(
+    //  Code to eval, from entry to the next Halt
+    const DecodedInstr*             code,
+    //  Scenario
+    const SimulDataRef<const T>*    scen,
+    //  State
+    EvalState<T>*                   state,
+    //  Index of the first instruction
+    const size_t                    entry = 0)
+{
+#ifdef SCRIPTING_THREADED
+
+    //  In NodeType order
+    static const void* const handlers[] =
+    {
+        &&LAdd, &&LAddConst, &&LSub, &&LSubConst, &&LConstSub, &&LMult, &&LMultConst,
+        &&LDiv, &&LDivConst, &&LConstDiv, &&LPow, &&LPowConst, &&LConstPow,
+        &&LMax2, &&LMax2Const, &&LMin2, &&LMin2Const, &&LSpot, &&LVar, &&LConst,
+        &&LAssign, &&LAssignConst, &&LPays, &&LPaysConst, &&LPaysScaled, &&LPaysScaledConst,
+        //  IfElse is decoded into If
+        &&LIf, &&LIf,
+        &&LEqual, &&LSup, &&LSupEqual, &&LAnd, &&LOr, &&LSmooth, &&LSqrt, &&LLog, &&LNot, &&LUminus,
+        &&LTrue, &&LFalse, &&LForBegin, &&LForNext, 
+        &&LAndJump, &&LOrJump, &&LSmoothBegin, &&LSmoothMid, &&LSmoothEnd, &&LJump, &&LHalt
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == Halt + 1, "Handler table out of sync with NodeType");
+
+    if (!code) return handlers;
+
+#define DECODED_OP(OP)          L##OP:
+#define DECODED_NEXT            goto *(++ip)->handler
+#define DECODED_GOTO(TARGET)    ip = code + (TARGET); goto *ip->handler
+#define DECODED_BEGIN           goto *ip->handler;
+#define DECODED_END
+
+#else
+
+    if (!code) return nullptr;
+
+#define DECODED_OP(OP)          case OP:
+#define DECODED_NEXT            ++ip; continue
+#define DECODED_GOTO(TARGET)    ip = code + (TARGET); continue
+#define DECODED_BEGIN           for (;;) switch (ip->op) {
+#define DECODED_END             }
+
+#endif
+
+    const DecodedInstr* ip = code + entry;
+    vector<T>& variables = state->variables;
+
+    //  Work space
+    T x, y, z, t;
+
+    //  Stacks, deeper code is not decoded, see Product::compile()
+    staticStack<T, EVALSTACKSIZE> dStack;
+    staticStack<char, EVALSTACKSIZE> bStack;
+    //  Loop counters
+    staticStack<int, EVALSTACKSIZE> lStack;
+
+    DECODED_BEGIN
+
+    DECODED_OP(Add)
+        dStack[1] += dStack.top();
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(AddConst)
+        dStack.top() += ip->constVal;
+        DECODED_NEXT;
+
+    DECODED_OP(Sub)
+        dStack[1] -= dStack.top();
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(SubConst)
+        dStack.top() -= ip->constVal;
+        DECODED_NEXT;
+
+    DECODED_OP(ConstSub)
+        dStack.top() = ip->constVal - dStack.top();
+        DECODED_NEXT;
+
+    DECODED_OP(Mult)
+        dStack[1] *= dStack.top();
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(MultConst)
+        dStack.top() *= ip->constVal;
+        DECODED_NEXT;
+
+    DECODED_OP(Div)
+        dStack[1] /= dStack.top();
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(DivConst)
+        dStack.top() /= ip->constVal;
+        DECODED_NEXT;
+
+    DECODED_OP(ConstDiv)
+        dStack.top() = ip->constVal / dStack.top();
+        DECODED_NEXT;
+
+    DECODED_OP(Pow)
+        dStack[1] = pow(dStack[1], dStack.top());
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(PowConst)
+        dStack.top() = pow(dStack.top(), ip->constVal);
+        DECODED_NEXT;
+
+    DECODED_OP(ConstPow)
+        dStack.top() = pow(ip->constVal, dStack.top());
+        DECODED_NEXT;
+
+    DECODED_OP(Max2)
+        y = dStack.top();
+        if (y > dStack[1]) dStack[1] = y;
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(Max2Const)
+        y = ip->constVal;
+        if (y > dStack.top()) dStack.top() = y;
+        DECODED_NEXT;
+
+    DECODED_OP(Min2)
+        y = dStack.top();
+        if (y < dStack[1]) dStack[1] = y;
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(Min2Const)
+        y = ip->constVal;
+        if (y < dStack.top()) dStack.top() = y;
+        DECODED_NEXT;
+
+    DECODED_OP(Spot)
+        dStack.push(scen->spot);
+        DECODED_NEXT;
+
+    DECODED_OP(Var)
+        dStack.push(variables[ip->arg]);
+        DECODED_NEXT;
+
+    DECODED_OP(Const)
+        dStack.push(ip->constVal);
+        DECODED_NEXT;
+
+    DECODED_OP(Assign)
+        variables[ip->arg] = dStack.top();
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(AssignConst)
+        variables[ip->arg] = ip->constVal;
+        DECODED_NEXT;
+
+    DECODED_OP(Pays)
+        variables[ip->arg] += dStack.top() / scen->numeraire;
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(PaysConst)
+        variables[ip->arg] += ip->constVal / scen->numeraire;
+        DECODED_NEXT;
+
+    DECODED_OP(PaysScaled)
+        variables[ip->arg] += dStack.top() * ip->constVal;
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(PaysScaledConst)
+        variables[ip->arg] += ip->constVal;
+        DECODED_NEXT;
+
+    //  Jump to the target when false
+    DECODED_OP(If)
+        if (bStack.top())
+        {
+            bStack.pop();
+            DECODED_NEXT;
+        }
+        else
+        {
+            bStack.pop();
+            DECODED_GOTO(ip->arg);
+        }
+
+    DECODED_OP(Equal)
+        bStack.push(dStack.top() == 0);
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(Sup)
+        bStack.push(dStack.top() > 0);
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(SupEqual)
+        bStack.push(dStack.top() >= 0);
+        dStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(And)
+        if (bStack[1])
+        {
+            bStack[1] = bStack.top();
+        }
+        bStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(Or)
+        if (!bStack[1])
+        {
+            bStack[1] = bStack.top();
+        }
+        bStack.pop();
+        DECODED_NEXT;
+
+    DECODED_OP(Smooth)
+        //	Eval the condition
+        x = dStack[3];
+        y = 0.5*dStack.top();
+        z = dStack[2];
+        t = dStack[1];
+
+        dStack.pop(3);
+
+        //	Left
+        if (x < -y) dStack.top() = t;
+
+        //	Right
+        else if (x > y) dStack.top() = z;
+
+        //	Fuzzy
+        else
+        {
+            dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+        }
+        DECODED_NEXT;
+
+    DECODED_OP(Sqrt)
+        dStack.top() = sqrt(dStack.top());
+        DECODED_NEXT;
+
+    DECODED_OP(Log)
+        dStack.top() = log(dStack.top());
+        DECODED_NEXT;
+
+    DECODED_OP(Not)
+        bStack.top() = !bStack.top();
+        DECODED_NEXT;
+
+    DECODED_OP(Uminus)
+        dStack.top() = -dStack.top();
+        DECODED_NEXT;
+
+    DECODED_OP(True)
+        bStack.push(true);
+        DECODED_NEXT;
+
+    DECODED_OP(False)
+        bStack.push(false);
+        DECODED_NEXT;
+
+    DECODED_OP(ForBegin)
+        lStack.push(0);
+        DECODED_NEXT;
+
+    //  Followed by the variable and the table of values, see decodeCompiled()
+    DECODED_OP(ForNext)
+        //  Done
+        if (lStack.top() == int(ip->constVal))
+        {
+            lStack.pop();
+            DECODED_GOTO(ip->arg);
+        }
+        //  Next value, then skip the variable and the table
+        variables[ip[1].arg] = ip[2 + lStack.top()].constVal;
+        ++lStack.top();
+        ip += 1 + int(ip->constVal);
+        DECODED_NEXT;
+
+    //  Short-circuits, see evalCompiled()
+    DECODED_OP(AndJump)
+        if (bStack.top())
+        {
+            DECODED_NEXT;
+        }
+        DECODED_GOTO(ip->arg);
+
+    DECODED_OP(OrJump)
+        if (!bStack.top())
+        {
+            DECODED_NEXT;
+        }
+        DECODED_GOTO(ip->arg);
+
+    //  Lazy smooth, see evalCompiled()
+    DECODED_OP(SmoothBegin)
+        if (dStack[1] < -0.5 * dStack.top())
+        {
+            dStack.push(dStack.top());
+            DECODED_GOTO(ip->arg);
+        }
+        DECODED_NEXT;
+
+    DECODED_OP(SmoothMid)
+        if (dStack[2] > 0.5 * dStack[1])
+        {
+            dStack[2] = dStack.top();
+            dStack.pop(2);
+            DECODED_GOTO(ip->arg);
+        }
+        DECODED_NEXT;
+
+    DECODED_OP(SmoothEnd)
+        x = dStack[3];
+        y = 0.5*dStack[2];
+        z = dStack[1];
+        t = dStack.top();
+
+        dStack.pop(3);
+
+        //	Left
+        if (x < -y) dStack.top() = t;
+
+        //	Fuzzy
+        else
+        {
+            dStack.top() = t + 0.5 * (z - t) / y * (x + y);
+        }
+        DECODED_NEXT;
+
+    DECODED_OP(Jump)
+        DECODED_GOTO(ip->arg);
+
+    DECODED_OP(Halt)
+        return nullptr;
+
+    DECODED_END
+
+#undef DECODED_OP
+#undef DECODED_NEXT
+#undef DECODED_GOTO
+#undef DECODED_BEGIN
+#undef DECODED_END
+
+    return nullptr;
+}
+
+//  Decode the output of the Compiler for the interpreter of type T
+//  The events start at positions entries[0] (= 0), entries[1], ... in the node stream, 
+//      the last entry is the end of the stream, see CompiledProgram
+//  Every event ends with Halt, decodedEntries gets the index of the first decoded instruction of each event, 
+//      and the size of the code
+template <class T>
+inline vector<DecodedInstr> decodeCompiled(
+    const vector<int>&          nodeStream,
+    const vector<double>&       constStream,
+    const vector<size_t>&       entries,
+    vector<size_t>&             decodedEntries)
+{
+    const void* const* handlers = runDecoded<T>(nullptr, nullptr, nullptr);
+
+    const size_t n = nodeStream.size();
+
+    vector<DecodedInstr> code;
+    code.reserve(n + entries.size());
+    decodedEntries.resize(entries.size());
+    size_t nextEvt = 0;
+
+    //  Index of the first decoded instruction for every position in the node stream
+    vector<size_t> posToInstr(n + 1);
+
+    //  Unconditional jumps to insert at the end of the if-true statements of IfElse, by position, to position
+    vector<vector<size_t>> jumpsAt(n + 1);
+
+    //  Jump targets to resolve once all positions are known:
+    //      instruction, position of the target, skip the jumps inserted there
+    struct Fixup
+    {
+        size_t      instr;
+        size_t      pos;
+        bool        skipJumps;
+    };
+    vector<Fixup> fixups;
+
+    auto make = [&](const int op)
+    {
+        DecodedInstr ins;
+        ins.handler = handlers ? handlers[op] : nullptr;
+        ins.constVal = 0.0;
+        ins.op = op;
+        ins.arg = 0;
+        return ins;
+    };
+
+    size_t i = 0;
+    for (;;)
+    {
+        posToInstr[i] = code.size();
+
+        //  End of if-true statements, jump over if-false statements
+        for (const size_t target : jumpsAt[i])
+        {
+            fixups.push_back({ code.size(), target, false });
+            code.push_back(make(Jump));
+        }
+
+        //  End of the previous event, start of the next one(s)
+        while (nextEvt + 1 < entries.size() && entries[nextEvt] == i)
+        {
+            if (nextEvt) code.push_back(make(Halt));
+            decodedEntries[nextEvt++] = code.size();
+        }
+
+        if (i == n) break;
+
+        const int op = nodeStream[i];
+        DecodedInstr ins = make(op);
+
+        switch (op)
+        {
+
+        //  Op, const
+        case AddConst:
+        case SubConst:
+        case ConstSub:
+        case MultConst:
+        case DivConst:
+        case ConstDiv:
+        case PowConst:
+        case ConstPow:
+        case Max2Const:
+        case Min2Const:
+        case Const:
+
+            ins.constVal = constStream[nodeStream[i + 1]];
+            i += 2;
+            break;
+
+        //  Op, var
+        case Var:
+        case Assign:
+        case Pays:
+
+            ins.arg = nodeStream[i + 1];
+            i += 2;
+            break;
+
+        //  Op, const, var
+        case AssignConst:
+        case PaysConst:
+        case PaysScaled:
+        case PaysScaledConst:
+
+            ins.constVal = constStream[nodeStream[i + 1]];
+            ins.arg = nodeStream[i + 2];
+            i += 3;
+            break;
+
+        //  Op, last if-true
+        case If:
+
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+            i += 2;
+            break;
+
+        //  Op, target
+        case Jump:
+        case AndJump:
+        case OrJump:
+        case SmoothBegin:
+        case SmoothMid:
+
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+            i += 2;
+            break;
+
+        //  Op, var, first const, number of consts, end of loop
+        //  Decoded into ForNext with the end of the loop and the number of values,
+        //      followed by data slots, never executed: the variable, then the values
+        case ForNext:
+        {
+            const int nVal = nodeStream[i + 3];
+            ins.constVal = nVal;
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 4]), false });
+            code.push_back(ins);
+
+            DecodedInstr data = make(Const);
+            data.arg = nodeStream[i + 1];
+            code.push_back(data);
+            data.arg = 0;
+            for (int k = 0; k < nVal; ++k)
+            {
+                data.constVal = constStream[nodeStream[i + 2] + k];
+                code.push_back(data);
+            }
+
+            i += 5;
+            continue;
+        }
+
+        //  Op, last if-true, last if-false
+        //  Jump to the if-false statements, after the jump over them, when false
+        case IfElse:
+
+            ins = make(If);
+            jumpsAt[nodeStream[i + 1]].push_back(nodeStream[i + 2]);
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), true });
+            i += 3;
+            break;
+
+        //  Op
+        default:
+
+            ++i;
+            break;
+        }
+
+        code.push_back(ins);
+    }
+
+    code.push_back(make(Halt));
+    decodedEntries.back() = code.size();
+
+    //  Resolve jump targets
+    for (const auto& fix : fixups)
+    {
+        code[fix.instr].arg = int(posToInstr[fix.pos] + (fix.skipJumps ? jumpsAt[fix.pos].size() : 0));
+    }
+
+    return code;
+}
+
+//  Decode one event
+template <class T>
+inline vector<DecodedInstr> decodeCompiled(
+    const vector<int>&          nodeStream,
+    const vector<double>&       constStream)
+{
+    vector<size_t> decodedEntries;
+    return decodeCompiled<T>(nodeStream, constStream, { 0, nodeStream.size() }, decodedEntries);
+}
+
+//  Evaluate decoded code, from entry to the next Halt
+template <class T>
+inline void evalDecoded(
+    //  Code to eval
+    const vector<DecodedInstr>& code,
+    //  Scenario
+    const SimulDataRef<const T> scen,
+    //  State
+    EvalState<T>&               state,
+    //  Index of the first instruction
+    const size_t                entry = 0)
+{
+    runDecoded(code.data(), &scen, &state, entry);
+}
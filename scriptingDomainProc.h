@@ -54,7 +54,7 @@ class DomainProcessor : public Visitor<DomainProcessor>
 	vector<Domain>			myVarDomains;
 
 	//	Stack of domains for expressions
-	staticStack<Domain>		myDomStack;
+	quickStack<Domain>		myDomStack;
 
 	//	Stack of always true/false properties for conditions
 	enum CondProp
@@ -63,7 +63,7 @@ class DomainProcessor : public Visitor<DomainProcessor>
 		alwaysFalse,
 		trueOrFalse
 	};
-	staticStack<CondProp>	myCondStack;
+	quickStack<CondProp>	myCondStack;
 
 	//	LHS variable being visited?
 	bool					myLhsVar;
@@ -22,6 +22,7 @@ As long as this comment is preserved at the top of the file
 #include "scriptingScenarios.h"
 
 #include <vector>
+#include <cmath>
 #include "quickStack.h"
 
 template <class T, template <typename> class EVAL>
@@ -303,7 +304,7 @@ public:
         visitNode(*node.arguments[1]);
 
         //	Write result into variable
-        myVariables[varIdx] += myDstack.top() / (*myScenario)[myCurEvt].numeraire;
+        myVariables[varIdx] += myDstack.top() / myScenario->numeraire(myCurEvt);
         myDstack.pop();
         }
 
@@ -347,7 +348,7 @@ public:
 	//	Scenario related
 	void visit(const NodeSpot& node)
 	{
-		myDstack.push( (*myScenario)[myCurEvt].spot);
+		myDstack.push( myScenario->spot(myCurEvt));
 	}
 };
 
@@ -277,7 +277,7 @@ public:
 	}
 	
 	//	Negation
-	void visitNot(const NodeNot& node)
+	void visit(const NodeNot& node)
 	{
         visitNode(*node.arguments[0]);
         myFuzzyStack.top() = 1.0 - myFuzzyStack.top();
@@ -34,7 +34,7 @@ class IfProcessor : public Visitor<IfProcessor>
 {
 	//	Top of the stack: current (possibly nested) if being processed
 	//	Each element in stack: set of indices of variables modified by the corresponding if and nested ifs
-	staticStack<set<size_t>>    myVarStack;
+	quickStack<set<size_t>>     myVarStack;
 
 	//	Nested if level, 0: not in an if, 1: in the outermost if, 2: if nested in another if, etc.
     size_t					    myNestedIfLvl;
@@ -0,0 +1,1066 @@
+#pragma once
+
+//  Binary images of processed and compiled products
+//  A book of products is written once into a file, then mapped read-only in memory at startup,
+//      products are evaluated directly from the mapped pages: no parsing, no processing, no copies
+//  The image of a product holds its event dates, variable names, outputs and their slots, compiled streams, register code,
+//      and processing metadata: maximum number of nested ifs, fuzzy compilation and default smoothing factor,
+//      the numeraires of the model folded into the code, if any, see compileForModel(),
+//      and the maximum depths of the stacks of the compiled code
+//  Images are raw memory: only valid on machines with the byte order, type sizes and version of the writer,
+//      which are checked on load
+//  Loading also checks that the sections fit in the file, that every operand of the compiled code, 
+//      slot, constant or register, and every jump target, is in range, 
+//      and that the stacks never get deeper than the depths in the file, see checkImageCode() and checkImageRegCode()
+//  Trees are not part of the image, products loaded from images are evaluated compiled only
+
+#include "scriptingProduct.h"
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//  Version of the format, incremented on any change of the layout or of the compiled code
+#define IMAGEVERSION 5
+//  Magic number at the start of the file
+#define IMAGEMAGIC "SCRIMAGE"
+//  Byte order mark
+#define IMAGEBYTEORDER 0x01020304u
+
+//  Header of the file, followed by the offsets of the products from the start of the file
+struct ImageFileHeader
+{
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    byteOrder;
+    uint32_t    sizeOfInstr;
+    uint32_t    sizeOfDate;
+    uint64_t    numProducts;
+    uint64_t    fileSize;
+};
+
+//  Header of a product, followed by its sections, 8 bytes aligned
+struct ImageProductHeader
+{
+    //  Sizes
+    uint64_t    numEvents;
+    uint64_t    numVars;
+    uint64_t    nodeStreamSize;
+    uint64_t    constStreamSize;
+    uint64_t    regCodeSize;
+    uint64_t    numRegisters;
+    uint64_t    compiledStateSize;
+    uint64_t    numZeroed;
+    uint64_t    numOutputs;
+
+    //  Metadata
+    uint64_t    maxNestedIfs;
+    double      defEps;
+    uint32_t    fuzzy;
+    uint32_t    foldedNumeraires;
+    //  Maximum depths of the stacks over all events, see StackDepths
+    uint32_t    dataDepth;
+    uint32_t    boolDepth;
+    uint32_t    loopDepth;
+    uint32_t    padding;
+
+    //  Offsets of the sections from the start of the product header:
+    //      event dates, offsets of the names of the variables in the block of names (numVars + 1),
+    //      block of null terminated names, indices of the outputs, slots of the outputs, node stream, const stream,
+    //      entry points of the events in the node stream (numEvents + 1),
+    //      register code, entry points of the events in the register code (numEvents + 1),
+    //      numeraires folded into the code (numEvents if foldedNumeraires, none otherwise)
+    uint64_t    eventDates;
+    uint64_t    varNameOffsets;
+    uint64_t    varNames;
+    uint64_t    outputVars;
+    uint64_t    outputSlots;
+    uint64_t    nodeStream;
+    uint64_t    constStream;
+    uint64_t    entries;
+    uint64_t    regCode;
+    uint64_t    regEntries;
+    uint64_t    numeraires;
+};
+
+//  Append raw bytes to a buffer, padded to 8 bytes, returns the offset of the bytes from base
+inline uint64_t imageAppend(vector<char>& buf, const size_t base, const void* data, const size_t bytes)
+{
+    const uint64_t offset = buf.size() - base;
+    const char* p = static_cast<const char*>(data);
+    buf.insert(buf.end(), p, p + bytes);
+    buf.resize((buf.size() + 7) & ~size_t(7), 0);
+    return offset;
+}
+
+//  Append the image of a compiled product to a buffer
+inline void writeProductImage(vector<char>& buf, const Product& prd)
+{
+    const CompiledProgram& prg = prd.program();
+    if (prg.entries.empty()) throw runtime_error("Product images require a compiled product");
+
+    //  Header first, sections next
+    const size_t base = buf.size();
+    ImageProductHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    imageAppend(buf, base, &hdr, sizeof(hdr));
+
+    hdr.numEvents = prd.eventDates().size();
+    hdr.numVars = prd.varNames().size();
+    hdr.nodeStreamSize = prg.nodeStream.size();
+    hdr.constStreamSize = prg.constStream.size();
+    hdr.regCodeSize = prd.regCode().size();
+    hdr.numRegisters = prd.numRegisters();
+    hdr.compiledStateSize = prd.compiledStateSize();
+    hdr.numZeroed = prd.numZeroedSlots();
+    hdr.numOutputs = prd.outputVars().size();
+    hdr.maxNestedIfs = prd.maxNestedIfs();
+    hdr.defEps = prd.defEps();
+    hdr.fuzzy = prd.compiledFuzzy();
+    hdr.foldedNumeraires = prd.foldedNumeraires();
+    const StackDepths depths = prg.maxDepths();
+    hdr.dataDepth = depths.data;
+    hdr.boolDepth = depths.bools;
+    hdr.loopDepth = depths.loops;
+
+    hdr.eventDates = imageAppend(buf, base, prd.eventDates().data(), hdr.numEvents * sizeof(Date));
+
+    vector<uint64_t> nameOffsets;
+    string names;
+    for (const auto& name : prd.varNames())
+    {
+        nameOffsets.push_back(names.size());
+        names += name;
+        names += '\0';
+    }
+    nameOffsets.push_back(names.size());
+    hdr.varNameOffsets = imageAppend(buf, base, nameOffsets.data(), nameOffsets.size() * sizeof(uint64_t));
+    hdr.varNames = imageAppend(buf, base, names.data(), names.size());
+
+    const vector<uint64_t> outputVars(prd.outputVars().begin(), prd.outputVars().end());
+    hdr.outputVars = imageAppend(buf, base, outputVars.data(), outputVars.size() * sizeof(uint64_t));
+    const vector<uint64_t> outputSlots(prd.outputSlots().begin(), prd.outputSlots().end());
+    hdr.outputSlots = imageAppend(buf, base, outputSlots.data(), outputSlots.size() * sizeof(uint64_t));
+
+    hdr.nodeStream = imageAppend(buf, base, prg.nodeStream.data(), prg.nodeStream.size() * sizeof(int));
+    hdr.constStream = imageAppend(buf, base, prg.constStream.data(), prg.constStream.size() * sizeof(double));
+    const vector<uint64_t> entries(prg.entries.begin(), prg.entries.end());
+    hdr.entries = imageAppend(buf, base, entries.data(), entries.size() * sizeof(uint64_t));
+
+    //  No register code for fuzzy products
+    hdr.regCode = imageAppend(buf, base, prd.regCode().data(), prd.regCode().size() * sizeof(RegInstr));
+    vector<uint64_t> regEntries(prd.regEntries().begin(), prd.regEntries().end());
+    if (regEntries.empty()) regEntries.assign(hdr.numEvents + 1, 0);
+    hdr.regEntries = imageAppend(buf, base, regEntries.data(), regEntries.size() * sizeof(uint64_t));
+
+    hdr.numeraires = imageAppend(buf, base, prd.numeraires().data(), prd.numeraires().size() * sizeof(double));
+
+    memcpy(&buf[base], &hdr, sizeof(hdr));
+}
+
+//  Write a book of compiled products into a file
+inline void writeProductImages(const string& path, const vector<const Product*>& products)
+{
+    vector<char> buf;
+
+    ImageFileHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGEMAGIC, 8);
+    hdr.version = IMAGEVERSION;
+    hdr.byteOrder = IMAGEBYTEORDER;
+    hdr.sizeOfInstr = sizeof(RegInstr);
+    hdr.sizeOfDate = sizeof(Date);
+    hdr.numProducts = products.size();
+    imageAppend(buf, 0, &hdr, sizeof(hdr));
+
+    //  Offsets, set as products are written
+    vector<uint64_t> offsets(products.size());
+    const size_t offsetsPos = imageAppend(buf, 0, offsets.data(), offsets.size() * sizeof(uint64_t));
+
+    for (size_t i = 0; i < products.size(); ++i)
+    {
+        offsets[i] = buf.size();
+        writeProductImage(buf, *products[i]);
+    }
+
+    hdr.fileSize = buf.size();
+    memcpy(&buf[0], &hdr, sizeof(hdr));
+    if (!offsets.empty()) memcpy(&buf[offsetsPos], offsets.data(), offsets.size() * sizeof(uint64_t));
+
+    ofstream ofs(path, ios::binary | ios::trunc);
+    ofs.write(buf.data(), buf.size());
+    if (!ofs) throw runtime_error("Could not write product images to " + path);
+}
+
+//  Same, one product
+inline void writeProductImages(const string& path, const Product& prd)
+{
+    writeProductImages(path, vector<const Product*>(1, &prd));
+}
+
+//  Depths of the stacks along the compiled code of an image, see checkImageCode()
+//  One forward pass over every region of code: an event, or the branches of an IfElse or a FuzzyIf,
+//      which the interpreter runs in nested calls
+//  The depths into every instruction must be the same on all the paths into it, 
+//      and cover what the instruction pops or reads
+//  Jumps must stay in their region, only Jump goes backwards, to a ForNext met before with the same depths
+struct ImageStackCheck
+{
+    const int*                  code;
+    const vector<size_t>&       length;
+    StackDepths                 maxDepth;
+
+    static void corrupt()
+    {
+        throw runtime_error("Corrupt product image");
+    }
+
+    static bool same(const StackDepths& lhs, const StackDepths& rhs)
+    {
+        return lhs.data == rhs.data && lhs.bools == rhs.bools && lhs.loops == rhs.loops;
+    }
+
+    //  Minimum depth of the data stack for an instruction
+    static int dataNeeds(const int op)
+    {
+        switch (op)
+        {
+        case Add: case Sub: case Mult: case Div: case Pow: case Max2: case Min2:
+        case FuzzyAnd: case FuzzyOr: case SmoothBegin:
+            return 2;
+        case SmoothMid:
+            return 3;
+        case Smooth: case SmoothEnd:
+            return 4;
+        case AddConst: case SubConst: case ConstSub: case MultConst: case DivConst: case ConstDiv:
+        case PowConst: case ConstPow: case Max2Const: case Min2Const:
+        case Assign: case Pays: case PaysScaled: case Equal: case Sup: case SupEqual:
+        case Sqrt: case Log: case Uminus:
+        case CallSpread: case CallSpreadLR: case Butterfly: case ButterflyLR: case FuzzyNot: case FuzzyIf:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    //  Minimum depth of the boolean stack for an instruction
+    static int boolNeeds(const int op)
+    {
+        switch (op)
+        {
+        case And: case Or:
+            return 2;
+        case If: case IfElse: case Not: case AndJump: case OrJump:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    //  Check the region [first, last) entered with depths, returns the depths at last
+    StackDepths region(const size_t first, const size_t last, StackDepths depth)
+    {
+        //  Depths of the forward jumps into the region, and of the ForNext met so far
+        map<size_t, StackDepths> incoming, loops;
+        bool live = true;
+
+        size_t i = first;
+        auto jump = [&](const size_t target, StackDepths d)
+        {
+            maxDepth.expand(d);
+            if (target <= i)
+            {
+                auto it = loops.find(target);
+                if (code[i] != Jump || it == loops.end() || !same(it->second, d)) corrupt();
+            }
+            else
+            {
+                if (target > last) corrupt();
+                auto it = incoming.find(target);
+                if (it == incoming.end()) incoming[target] = d;
+                else if (!same(it->second, d)) corrupt();
+            }
+        };
+
+        for (;;)
+        {
+            auto it = incoming.find(i);
+            if (it != incoming.end())
+            {
+                if (live && !same(depth, it->second)) corrupt();
+                depth = it->second;
+                live = true;
+                incoming.erase(it);
+            }
+            if (i == last) break;
+            if (i > last) corrupt();
+
+            //  Unreachable
+            if (!live)
+            {
+                i += length[i];
+                continue;
+            }
+
+            const int op = code[i];
+            if (depth.data < dataNeeds(op) || depth.bools < boolNeeds(op)) corrupt();
+
+            if (op == IfElse)
+            {
+                //  If-true in a nested call with the condition on the stack, then to the end of if-false, popped
+                const size_t lastTrue = size_t(code[i + 1]), lastFalse = size_t(code[i + 2]);
+                if (lastFalse > last) corrupt();
+                StackDepths d = region(i + 3, lastTrue, depth);
+                --d.bools;
+                jump(lastFalse, d);
+                //  If-false popped
+                --depth.bools;
+                i = lastTrue;
+                continue;
+            }
+            if (op == FuzzyIf)
+            {
+                //  Both branches in nested calls, after the degree of truth is popped
+                --depth.data;
+                const size_t nAffected = size_t(code[i + 4]);
+                const size_t lastTrue = size_t(code[i + 1]), lastFalse = size_t(code[i + 2]);
+                if (lastFalse > last) corrupt();
+                if (!same(region(i + 5 + nAffected, lastTrue, depth), depth)
+                    || !same(region(lastTrue, lastFalse, depth), depth)) corrupt();
+                i = lastFalse;
+                continue;
+            }
+
+            switch (op)
+            {
+            case Equal: case Sup: case SupEqual: case True: case False:
+                ++depth.bools;
+                break;
+            case And: case Or:
+                --depth.bools;
+                break;
+            case If:
+                --depth.bools;
+                jump(size_t(code[i + 1]), depth);
+                break;
+            case AndJump: case OrJump:
+                jump(size_t(code[i + 1]), depth);
+                break;
+            case SmoothBegin:
+            {
+                StackDepths d = depth;
+                ++d.data;
+                jump(size_t(code[i + 1]), d);
+                break;
+            }
+            case SmoothMid:
+            {
+                StackDepths d = depth;
+                d.data -= 2;
+                jump(size_t(code[i + 1]), d);
+                break;
+            }
+            case FuzzyAnd: case FuzzyOr:
+                --depth.data;
+                break;
+            case ForBegin:
+                ++depth.loops;
+                break;
+            case ForNext:
+            {
+                if (depth.loops < 1) corrupt();
+                loops[i] = depth;
+                StackDepths d = depth;
+                --d.loops;
+                jump(size_t(code[i + 4]), d);
+                break;
+            }
+            case Jump:
+                jump(size_t(code[i + 1]), depth);
+                live = false;
+                break;
+            }
+            if (op < CallSpread) depth.data += compiledDataEffect(op);
+
+            maxDepth.expand(depth);
+            i += length[i];
+        }
+
+        //  Jumps into nested regions, or nowhere
+        if (!incoming.empty() || !live) corrupt();
+
+        return depth;
+    }
+};
+
+//  Check the compiled code of an image, throws if an instruction is unknown, does not fit in its event, 
+//      has an operand out of range: slot of the state, index of a constant,
+//      a jump target that is not the start of an instruction, or the end, of its event,
+//      or if the stacks get deeper than depths, see ImageStackCheck
+//  Fuzzy instructions are only allowed if fuzzy
+inline void checkImageCode(
+    const int*          code,
+    const size_t        size,
+    const uint64_t*     entries,
+    const size_t        numEvents,
+    const size_t        numConsts,
+    const size_t        stateSize,
+    const bool          fuzzy,
+    const StackDepths&  depths)
+{
+    auto corrupt = []() { throw runtime_error("Corrupt product image"); };
+
+    //  Starts of instructions, and their lengths
+    vector<bool> start(size + 1, false);
+    vector<size_t> length(size, 0);
+
+    for (size_t e = 0; e < numEvents; ++e)
+    {
+        const size_t first = size_t(entries[e]), last = size_t(entries[e + 1]);
+        start[first] = true;
+
+        size_t i = first;
+        while (i < last)
+        {
+            start[i] = true;
+            const int op = code[i];
+            size_t len;
+            if (op >= Add && op <= Jump) len = compiledLength(code, i);
+            else if (fuzzy && (op == CallSpread || op == CallSpreadLR || op == Butterfly || op == ButterflyLR)) len = 2;
+            else if (fuzzy && (op == FuzzyAnd || op == FuzzyOr || op == FuzzyNot)) len = 1;
+            else if (fuzzy && op == FuzzyIf)
+            {
+                if (last - i < 5 || code[i + 4] < 0 || size_t(code[i + 4]) > last - i - 5) corrupt();
+                len = 5 + size_t(code[i + 4]);
+            }
+            else
+            {
+                corrupt();
+                return;
+            }
+            if (len > last - i) corrupt();
+            length[i] = len;
+            i += len;
+        }
+        start[last] = true;
+    }
+
+    for (size_t e = 0; e < numEvents; ++e)
+    {
+        const size_t first = size_t(entries[e]), last = size_t(entries[e + 1]);
+
+        //  Operand k of the instruction at i, checked below bound
+        size_t i = first;
+        auto operand = [&](const size_t k, const size_t bound)
+        {
+            const int v = code[i + k];
+            if (v < 0 || size_t(v) >= bound) corrupt();
+            return size_t(v);
+        };
+        //  Jump target in operand k, at or after from
+        auto target = [&](const size_t k, const size_t from)
+        {
+            const size_t t = operand(k, last + 1);
+            if (t < from || !start[t]) corrupt();
+            return t;
+        };
+
+        while (i < last)
+        {
+            switch (code[i])
+            {
+            case AddConst:
+            case SubConst:
+            case ConstSub:
+            case MultConst:
+            case DivConst:
+            case ConstDiv:
+            case PowConst:
+            case ConstPow:
+            case Max2Const:
+            case Min2Const:
+            case Const:
+                operand(1, numConsts);
+                break;
+            case Var:
+            case Assign:
+            case Pays:
+                operand(1, stateSize);
+                break;
+            case AssignConst:
+            case PaysConst:
+            case PaysScaled:
+            case PaysScaledConst:
+                operand(1, numConsts);
+                operand(2, stateSize);
+                break;
+            case If:
+            case Jump:
+            case AndJump:
+            case OrJump:
+            case SmoothBegin:
+            case SmoothMid:
+                target(1, first);
+                break;
+            case IfElse:
+                target(2, target(1, i + 3));
+                break;
+            case ForNext:
+            {
+                operand(1, stateSize);
+                const size_t values = operand(3, numConsts + 1);
+                if (operand(2, numConsts + 1) > numConsts - values) corrupt();
+                target(4, first);
+                break;
+            }
+            case CallSpread:
+            case Butterfly:
+                if (operand(1, numConsts) + 2 > numConsts) corrupt();
+                break;
+            case CallSpreadLR:
+                if (operand(1, numConsts) + 3 > numConsts) corrupt();
+                break;
+            case ButterflyLR:
+                if (operand(1, numConsts) + 4 > numConsts) corrupt();
+                break;
+            case FuzzyIf:
+            {
+                const size_t nAffected = size_t(code[i + 4]);
+                target(2, target(1, i + 5 + nAffected));
+                if (nAffected > stateSize || operand(3, stateSize + 1) > stateSize - nAffected) corrupt();
+                for (size_t k = 0; k < nAffected; ++k) operand(5 + k, stateSize);
+                break;
+            }
+            }
+
+            i += length[i];
+        }
+    }
+
+    //  Stacks, empty at the start and at the end of every event
+    ImageStackCheck check{ code, length, StackDepths() };
+    for (size_t e = 0; e < numEvents; ++e)
+    {
+        if (!ImageStackCheck::same(check.region(size_t(entries[e]), size_t(entries[e + 1]), StackDepths()), StackDepths())) 
+            corrupt();
+    }
+    if (check.maxDepth.data > depths.data || check.maxDepth.bools > depths.bools || check.maxDepth.loops > depths.loops) 
+        corrupt();
+}
+
+//  Check the register code of an image, throws if an instruction is unknown or has an operand out of range:
+//      register, boolean register, or a jump target that is not an instruction of its event, 
+//      or if the loops nest deeper than the loop counters of the register machine
+//  Every event must end with Halt, and only Jump goes backwards, to a ForNext met before in the same loops
+inline void checkImageRegCode(
+    const RegInstr*     code,
+    const size_t        size,
+    const uint64_t*     entries,
+    const size_t        numEvents,
+    const size_t        numRegisters)
+{
+    auto corrupt = []() { throw runtime_error("Corrupt product image"); };
+
+    //  Instructions, as opposed to the values of the loops
+    vector<bool> start(size, false);
+    for (size_t e = 0; e < numEvents; ++e)
+    {
+        const size_t first = size_t(entries[e]), last = size_t(entries[e + 1]);
+        if (first == last || code[last - 1].op != Halt) corrupt();
+        for (size_t i = first; i < last; ++i)
+        {
+            start[i] = true;
+            //  The values are followed by an instruction
+            if (code[i].op == ForNext)
+            {
+                if (code[i].a < 0 || size_t(code[i].a) + 1 >= last - i) corrupt();
+                i += code[i].a;
+            }
+        }
+        if (!start[last - 1]) corrupt();
+    }
+
+    for (size_t e = 0; e < numEvents; ++e)
+    {
+        const size_t first = size_t(entries[e]), last = size_t(entries[e + 1]);
+
+        //  Depth of the loop counters: of the forward jumps into the instructions, of the ForNext met so far
+        map<size_t, int> incoming, loops;
+        int depth = 0;
+        bool live = true;
+
+        for (size_t i = first; i < last; ++i)
+        {
+            const RegInstr& ins = code[i];
+
+            auto reg = [&](const int r) { if (r < 0 || size_t(r) >= numRegisters) corrupt(); };
+            auto bit = [&](const int r) { if (r < 0 || r >= REGMAXBOOLS) corrupt(); };
+            auto target = [&](const int t, const int d) 
+            { 
+                if (t < int(first) || size_t(t) >= last || !start[t]) corrupt();
+                if (size_t(t) <= i)
+                {
+                    auto it = loops.find(size_t(t));
+                    if (ins.op != Jump || it == loops.end() || it->second != d) corrupt();
+                }
+                else
+                {
+                    auto it = incoming.find(size_t(t));
+                    if (it == incoming.end()) incoming[size_t(t)] = d;
+                    else if (it->second != d) corrupt();
+                }
+            };
+
+            auto it = incoming.find(i);
+            if (it != incoming.end())
+            {
+                if (live && depth != it->second) corrupt();
+                depth = it->second;
+                live = true;
+                incoming.erase(it);
+            }
+
+            switch (ins.op)
+            {
+            case Add:
+            case Sub:
+            case Mult:
+            case Div:
+            case Pow:
+            case Max2:
+            case Min2:
+            case DivConstAdd:
+            case SubConstMax2:
+                reg(ins.dst); reg(ins.a); reg(ins.b);
+                break;
+            case AddConst:
+            case SubConst:
+            case ConstSub:
+            case MultConst:
+            case DivConst:
+            case ConstDiv:
+            case PowConst:
+            case ConstPow:
+            case Max2Const:
+            case Min2Const:
+            case Assign:
+            case Pays:
+            case PaysScaled:
+            case Sqrt:
+            case Log:
+            case Uminus:
+            case MultConstDivConst:
+            case SubConstMax2Const:
+            case MultConstPaysScaled:
+                reg(ins.dst); reg(ins.a);
+                break;
+            case Spot:
+            case AssignConst:
+            case PaysConst:
+            case PaysScaledConst:
+                reg(ins.dst);
+                break;
+            case If:
+            case AndJump:
+            case OrJump:
+                bit(ins.a); target(ins.b, depth);
+                break;
+            case IfAnd:
+                bit(ins.a); bit(ins.d); target(ins.b, depth);
+                break;
+            case Jump:
+                target(ins.b, depth);
+                live = false;
+                break;
+            case ForBegin:
+                if (++depth > REGMAXLOOPS) corrupt();
+                break;
+            case Halt:
+                live = false;
+                break;
+            case ForNext:
+                if (depth < 1) corrupt();
+                reg(ins.dst); target(ins.b, depth - 1);
+                loops[i] = depth;
+                i += ins.a;
+                break;
+            case SmoothBegin:
+                reg(ins.a); reg(ins.d); target(ins.b, depth);
+                break;
+            case SmoothMid:
+                reg(ins.dst); reg(ins.a); reg(ins.c); reg(ins.d); target(ins.b, depth);
+                break;
+            case Smooth:
+                reg(ins.dst); reg(ins.a); reg(ins.b); reg(ins.c); reg(ins.d);
+                break;
+            case Equal:
+            case Sup:
+            case SupEqual:
+            case SubConstSup:
+            case SubConstSupEqual:
+            case SubConstEqual:
+            case ConstSubSup:
+            case ConstSubSupEqual:
+                bit(ins.dst); reg(ins.a);
+                break;
+            case IfSubConstSup:
+            case IfSubConstSupEqual:
+            case IfSubConstEqual:
+            case IfConstSubSup:
+            case IfConstSubSupEqual:
+                reg(ins.a); target(ins.b, depth);
+                break;
+            case And:
+            case Or:
+                bit(ins.dst); bit(ins.a); bit(ins.b);
+                break;
+            case Not:
+                bit(ins.dst); bit(ins.a);
+                break;
+            case True:
+            case False:
+                bit(ins.dst);
+                break;
+            default:
+                corrupt();
+            }
+        }
+    }
+}
+
+//  View of the image of a product in memory, typically mapped from a file, see ProductBook
+//  The memory must outlive the view
+//  Same evaluation API as Product, for the compiled forms
+class ProductImage
+{
+    const ImageProductHeader*   myHeader;
+    const Date*                 myEventDates;
+    const uint64_t*             myVarNameOffsets;
+    const char*                 myVarNames;
+    const uint64_t*             myOutputVars;
+    const uint64_t*             myOutputSlots;
+    const int*                  myNodeStream;
+    const double*               myConstStream;
+    const uint64_t*             myEntries;
+    const RegInstr*             myRegCode;
+    const uint64_t*             myRegEntries;
+    const double*               myNumeraires;
+
+public:
+
+    //  Image at data, of at most size bytes, throws if the image does not fit or is inconsistent
+    ProductImage(const char* data, const size_t size)
+    {
+        if (size < sizeof(ImageProductHeader)) throw runtime_error("Truncated product image");
+        myHeader = reinterpret_cast<const ImageProductHeader*>(data);
+        const ImageProductHeader& h = *myHeader;
+
+        auto section = [&](const uint64_t offset, const uint64_t count, const size_t elemSize) -> const char*
+        {
+            if (offset > size || count > (size - offset) / elemSize) throw runtime_error("Truncated product image");
+            if (offset % 8) throw runtime_error("Corrupt product image");
+            return data + offset;
+        };
+
+        //  Every event and variable takes at least one byte, so counts + 1 do not overflow
+        if (h.numEvents >= size || h.numVars >= size) throw runtime_error("Corrupt product image");
+
+        myEventDates = reinterpret_cast<const Date*>(section(h.eventDates, h.numEvents, sizeof(Date)));
+        myVarNameOffsets = reinterpret_cast<const uint64_t*>(section(h.varNameOffsets, h.numVars + 1, sizeof(uint64_t)));
+        myVarNames = section(h.varNames, myVarNameOffsets[h.numVars], 1);
+        myOutputVars = reinterpret_cast<const uint64_t*>(section(h.outputVars, h.numOutputs, sizeof(uint64_t)));
+        myOutputSlots = reinterpret_cast<const uint64_t*>(section(h.outputSlots, h.numOutputs, sizeof(uint64_t)));
+        myNodeStream = reinterpret_cast<const int*>(section(h.nodeStream, h.nodeStreamSize, sizeof(int)));
+        myConstStream = reinterpret_cast<const double*>(section(h.constStream, h.constStreamSize, sizeof(double)));
+        myEntries = reinterpret_cast<const uint64_t*>(section(h.entries, h.numEvents + 1, sizeof(uint64_t)));
+        myRegCode = reinterpret_cast<const RegInstr*>(section(h.regCode, h.regCodeSize, sizeof(RegInstr)));
+        myRegEntries = reinterpret_cast<const uint64_t*>(section(h.regEntries, h.numEvents + 1, sizeof(uint64_t)));
+        myNumeraires = reinterpret_cast<const double*>(section(h.numeraires, h.foldedNumeraires ? h.numEvents : 0, sizeof(double)));
+
+        auto check = [](const bool ok) { if (!ok) throw runtime_error("Corrupt product image"); };
+
+        //  State: only register code has more registers than slots, the zeroed slots are in both
+        //  Hidden slots and temporary registers are written by an instruction each, pushes on the stacks too
+        check(h.numZeroed <= h.compiledStateSize && h.compiledStateSize <= h.numVars + h.nodeStreamSize);
+        check(h.compiledStateSize <= h.numRegisters && h.numRegisters <= h.compiledStateSize + 1 + h.regCodeSize);
+        check(h.dataDepth <= h.nodeStreamSize && h.boolDepth <= h.nodeStreamSize && h.loopDepth <= h.nodeStreamSize);
+
+        //  Events, at least one, in order
+        check(h.numEvents > 0);
+        for (size_t i = 1; i < h.numEvents; ++i) check(myEventDates[i - 1] < myEventDates[i]);
+
+        //  Names, null terminated, in order
+        for (size_t i = 0; i < h.numVars; ++i)
+        {
+            check(myVarNameOffsets[i] < myVarNameOffsets[i + 1] && myVarNameOffsets[i + 1] <= myVarNameOffsets[h.numVars]
+                && myVarNames[myVarNameOffsets[i + 1] - 1] == '\0');
+        }
+
+        for (size_t i = 0; i < h.numOutputs; ++i)
+        {
+            check(myOutputVars[i] < h.numVars && myOutputSlots[i] < h.compiledStateSize);
+        }
+
+        //  Entry points, in order
+        for (size_t i = 0; i < h.numEvents; ++i)
+        {
+            check(myEntries[i] <= myEntries[i + 1] && myRegEntries[i] <= myRegEntries[i + 1]);
+        }
+        check(myEntries[0] == 0 && myEntries[h.numEvents] <= h.nodeStreamSize);
+        check(myRegEntries[0] == 0 && myRegEntries[h.numEvents] <= h.regCodeSize);
+
+        //  Code
+        checkImageCode(myNodeStream, size_t(h.nodeStreamSize), myEntries, size_t(h.numEvents),
+            size_t(h.constStreamSize), size_t(h.compiledStateSize), h.fuzzy != 0, maxDepths());
+        if (h.regCodeSize)
+        {
+            checkImageRegCode(myRegCode, size_t(h.regCodeSize), myRegEntries, size_t(h.numEvents), size_t(h.numRegisters));
+        }
+    }
+
+    //	Accessors
+
+    size_t numEvents() const
+    {
+        return size_t(myHeader->numEvents);
+    }
+
+    //  Copy of the event dates
+    vector<Date> eventDates() const
+    {
+        return vector<Date>(myEventDates, myEventDates + numEvents());
+    }
+
+    size_t numVariables() const
+    {
+        return size_t(myHeader->numVars);
+    }
+
+    //  Name of variable i, null terminated
+    const char* varName(const size_t i) const
+    {
+        return myVarNames + myVarNameOffsets[i];
+    }
+
+    //  Copy of the names of the variables
+    vector<string> varNames() const
+    {
+        vector<string> names;
+        for (size_t i = 0; i < numVariables(); ++i) names.push_back(varName(i));
+        return names;
+    }
+
+    //  Copy of the indices of the outputs, see Product::outputVars()
+    vector<size_t> outputVars() const
+    {
+        return vector<size_t>(myOutputVars, myOutputVars + myHeader->numOutputs);
+    }
+
+    //  Copy of the slots of the outputs, see Product::outputSlots()
+    vector<size_t> outputSlots() const
+    {
+        return vector<size_t>(myOutputSlots, myOutputSlots + myHeader->numOutputs);
+    }
+
+    size_t numRegisters() const
+    {
+        return size_t(myHeader->numRegisters);
+    }
+
+    size_t compiledStateSize() const
+    {
+        return size_t(myHeader->compiledStateSize);
+    }
+
+    size_t numZeroedSlots() const
+    {
+        return size_t(myHeader->numZeroed);
+    }
+
+    size_t maxNestedIfs() const
+    {
+        return size_t(myHeader->maxNestedIfs);
+    }
+
+    bool compiledFuzzy() const
+    {
+        return myHeader->fuzzy != 0;
+    }
+
+    double defEps() const
+    {
+        return myHeader->defEps;
+    }
+
+    bool foldedNumeraires() const
+    {
+        return myHeader->foldedNumeraires != 0;
+    }
+
+    //  Copy of the numeraires folded into the code, by event, empty if none, see Product::numeraires()
+    vector<double> numeraires() const
+    {
+        return foldedNumeraires() ? vector<double>(myNumeraires, myNumeraires + numEvents()) : vector<double>();
+    }
+
+    StackDepths maxDepths() const
+    {
+        StackDepths depths;
+        depths.data = int(myHeader->dataDepth);
+        depths.bools = int(myHeader->boolDepth);
+        depths.loops = int(myHeader->loopDepth);
+        return depths;
+    }
+
+    //	Scenario factory
+    template<class T>
+    unique_ptr<Scenario<T>> buildScenario() const
+    {
+        return unique_ptr<Scenario<T>>(new Scenario<T>(numEvents()));
+    }
+
+    //	Evaluate all compiled statements in all events, see Product::evaluateCompiled()
+    template <class T>
+    void evaluateCompiled(
+        const Scenario<T>&  scen,
+        EvalState<T>&       state) const
+    {
+        //	Initialize state
+        state.init(numZeroedSlots());
+
+        withEvalStacks<T>(maxDepths(), [&](auto& stacks)
+        {
+            for (size_t i = 0; i < numEvents(); ++i)
+            {
+                evalCompiled(myNodeStream, myConstStream, static_cast<const void* const*>(nullptr), scen[i], state,
+                    size_t(myEntries[i]), size_t(myEntries[i + 1]), stacks);
+            }
+        });
+    }
+
+    //	Evaluate all statements in all events on the register machine, see Product::evaluateRegisters()
+    //  On the stack code for images without register code: fuzzy, or nested too deep for the register machine
+    void evaluateRegisters(
+        const Scenario<double>& scen,
+        EvalState<double>&      state) const
+    {
+        if (!myHeader->regCodeSize)
+        {
+            evaluateCompiled(scen, state);
+            return;
+        }
+
+        //	Initialize state
+        state.init(numZeroedSlots());
+
+        for (size_t i = 0; i < numEvents(); ++i)
+        {
+            evalRegisters(myRegCode, scen[i], state, size_t(myRegEntries[i]));
+        }
+    }
+};
+
+//  Book of product images mapped read-only from a file written by writeProductImages()
+//  Throws if the file cannot be read or was written with another version or on an incompatible machine
+class ProductBook
+{
+    const char*             myData = nullptr;
+    size_t                  mySize = 0;
+#ifdef _WIN32
+    //  No mapping, the file is read in a buffer, 8 bytes aligned
+    vector<uint64_t>        myBuffer;
+#endif
+    vector<ProductImage>    myProducts;
+
+public:
+
+    explicit ProductBook(const string& path)
+    {
+#ifndef _WIN32
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("Could not open product images " + path);
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            throw runtime_error("Could not open product images " + path);
+        }
+        mySize = size_t(st.st_size);
+        void* data = mmap(nullptr, mySize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) throw runtime_error("Could not map product images " + path);
+        myData = static_cast<const char*>(data);
+#else
+        ifstream ifs(path, ios::binary | ios::ate);
+        if (!ifs) throw runtime_error("Could not open product images " + path);
+        mySize = size_t(ifs.tellg());
+        myBuffer.resize((mySize + 7) / 8);
+        ifs.seekg(0);
+        ifs.read(reinterpret_cast<char*>(myBuffer.data()), mySize);
+        myData = reinterpret_cast<const char*>(myBuffer.data());
+#endif
+
+        try
+        {
+            if (mySize < sizeof(ImageFileHeader)) throw runtime_error("Truncated product images " + path);
+            const ImageFileHeader& hdr = *reinterpret_cast<const ImageFileHeader*>(myData);
+            if (memcmp(hdr.magic, IMAGEMAGIC, 8) != 0) throw runtime_error("Not a file of product images " + path);
+            if (hdr.version != IMAGEVERSION || hdr.byteOrder != IMAGEBYTEORDER
+                || hdr.sizeOfInstr != sizeof(RegInstr) || hdr.sizeOfDate != sizeof(Date))
+                throw runtime_error("Incompatible product images " + path);
+            if (hdr.fileSize != mySize
+                || hdr.numProducts > (mySize - sizeof(ImageFileHeader)) / sizeof(uint64_t))
+                throw runtime_error("Truncated product images " + path);
+
+            const uint64_t* offsets = reinterpret_cast<const uint64_t*>(myData + sizeof(ImageFileHeader));
+            myProducts.reserve(size_t(hdr.numProducts));
+            for (size_t i = 0; i < hdr.numProducts; ++i)
+            {
+                if (offsets[i] > mySize || offsets[i] % 8) throw runtime_error("Corrupt product images " + path);
+                myProducts.emplace_back(myData + offsets[i], mySize - size_t(offsets[i]));
+            }
+        }
+        catch (...)
+        {
+            unmap();
+            throw;
+        }
+    }
+
+    ~ProductBook()
+    {
+        unmap();
+    }
+
+    ProductBook(const ProductBook&) = delete;
+    ProductBook& operator=(const ProductBook&) = delete;
+
+    size_t size() const
+    {
+        return myProducts.size();
+    }
+
+    const ProductImage& operator[](const size_t i) const
+    {
+        return myProducts[i];
+    }
+
+private:
+
+    void unmap()
+    {
+#ifndef _WIN32
+        if (myData) munmap(const_cast<char*>(myData), mySize);
+#endif
+        myData = nullptr;
+    }
+};
@@ -0,0 +1,598 @@
+#pragma once
+
+//  In-process JIT for compiled scripts
+//  The register code of a product is translated into x86-64 machine code in executable pages,
+//      in microseconds and without an external compiler, see scriptingNative.h for the optimizing alternative
+//  Each instruction becomes a few scalar SSE2 instructions:
+//      registers and constants are addressed relative to base registers, r15 and r14,
+//      boolean registers live on the machine stack,
+//      conditions and jumps become native branches
+//  Same entry point as native code, see NativeFunc, the register file is the state
+//  Same results as evalRegisters(): same operations in the same order, log and pow call the C library
+//  Loops are not supported, code with ForBegin is not translated and runs on the register machine
+//  x86-64 System V only (Linux, macOS), elsewhere the register machine is always used
+
+#include "scriptingRegisters.h"
+#include "scriptingNative.h"
+
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define SCRIPTING_JIT
+#include <sys/mman.h>
+#endif
+
+//  Emitter of x86-64 machine code, the small subset used by the JIT
+//  Memory operands are always [base + disp32]
+struct X64Emitter
+{
+    //  Integer registers
+    enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+        R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15 };
+
+    //  Condition codes of jcc and setcc
+    enum { CB = 0x2, CAE = 0x3, CE = 0x4, CNE = 0x5, CBE = 0x6, CA = 0x7, CP = 0xA, CNP = 0xB };
+
+    vector<uint8_t> code;
+
+    void byte(const uint8_t b)
+    {
+        code.push_back(b);
+    }
+
+    void dword(const uint32_t d)
+    {
+        for (int i = 0; i < 4; ++i) byte(uint8_t(d >> (8 * i)));
+    }
+
+    void qword(const uint64_t q)
+    {
+        for (int i = 0; i < 8; ++i) byte(uint8_t(q >> (8 * i)));
+    }
+
+    //  REX prefix if any bit is set
+    void rex(const bool w, const int reg, const int base)
+    {
+        const uint8_t r = uint8_t(0x40 | (w ? 8 : 0) | ((reg >> 3) << 2) | (base >> 3));
+        if (r != 0x40) byte(r);
+    }
+
+    //  ModRM for [base + disp32], with the SIB byte required by rsp and r12
+    void mem(const int reg, const int base, const int disp)
+    {
+        byte(uint8_t(0x80 | ((reg & 7) << 3) | (base & 7)));
+        if ((base & 7) == RSP) byte(0x24);
+        dword(uint32_t(disp));
+    }
+
+    //  Scalar double instruction xmm, [base + disp], with mandatory prefix 0xF2 or 0x66
+    void sseMem(const uint8_t prefix, const uint8_t op, const int xmm, const int base, const int disp)
+    {
+        byte(prefix);
+        rex(false, xmm, base);
+        byte(0x0F);
+        byte(op);
+        mem(xmm, base, disp);
+    }
+
+    //  Scalar double instruction xmm, xmm
+    void sseReg(const uint8_t prefix, const uint8_t op, const int dst, const int src)
+    {
+        byte(prefix);
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(op);
+        byte(uint8_t(0xC0 | ((dst & 7) << 3) | (src & 7)));
+    }
+
+    //  SSE2 opcodes
+    enum { MOVSDLOAD = 0x10, MOVSDSTORE = 0x11, SQRTSD = 0x51, ADDSD = 0x58, MULSD = 0x59,
+        SUBSD = 0x5C, MINSD = 0x5D, DIVSD = 0x5E, MAXSD = 0x5F, UCOMISD = 0x2E, XORPD = 0x57 };
+
+    void sdMem(const uint8_t op, const int xmm, const int base, const int disp) { sseMem(0xF2, op, xmm, base, disp); }
+    void sdReg(const uint8_t op, const int dst, const int src) { sseReg(0xF2, op, dst, src); }
+
+    //  ucomisd xmm, xmm
+    void ucomisd(const int x, const int y) { sseReg(0x66, UCOMISD, x, y); }
+    //  xorpd xmm, xmm
+    void xorpd(const int x, const int y) { sseReg(0x66, XORPD, x, y); }
+
+    //  Byte operations on [base + disp], al is the register operand
+
+    //  mov al, [m]
+    void loadByte(const int base, const int disp) { rex(false, 0, base); byte(0x8A); mem(RAX, base, disp); }
+    //  mov [m], al
+    void storeByte(const int base, const int disp) { rex(false, 0, base); byte(0x88); mem(RAX, base, disp); }
+    //  and al, [m]
+    void andByte(const int base, const int disp) { rex(false, 0, base); byte(0x22); mem(RAX, base, disp); }
+    //  or al, [m]
+    void orByte(const int base, const int disp) { rex(false, 0, base); byte(0x0A); mem(RAX, base, disp); }
+    //  mov byte [m], imm8
+    void storeByteImm(const int base, const int disp, const uint8_t imm) { rex(false, 0, base); byte(0xC6); mem(0, base, disp); byte(imm); }
+    //  cmp byte [m], 0
+    void testByte(const int base, const int disp) { rex(false, 0, base); byte(0x80); mem(7, base, disp); byte(0); }
+
+    //  setcc al, or cl
+    void setcc(const uint8_t cc, const int reg = RAX) { byte(0x0F); byte(uint8_t(0x90 | cc)); byte(uint8_t(0xC0 | reg)); }
+    //  and al, cl
+    void andAlCl() { byte(0x20); byte(0xC8); }
+    //  xor al, 1
+    void notAl() { byte(0x34); byte(0x01); }
+
+    //  64 bit register operations
+
+    //  mov dst, src
+    void mov(const int dst, const int src) { rex(true, src, dst); byte(0x89); byte(uint8_t(0xC0 | ((src & 7) << 3) | (dst & 7))); }
+    //  add dst, src
+    void add(const int dst, const int src) { rex(true, src, dst); byte(0x01); byte(uint8_t(0xC0 | ((src & 7) << 3) | (dst & 7))); }
+    //  shl reg, imm8
+    void shl(const int reg, const uint8_t imm) { rex(true, 0, reg); byte(0xC1); byte(uint8_t(0xE0 | (reg & 7))); byte(imm); }
+    //  mov reg, imm64
+    void movImm(const int reg, const uint64_t imm) { rex(true, 0, reg); byte(uint8_t(0xB8 | (reg & 7))); qword(imm); }
+    //  sub rsp, imm32 / add rsp, imm32
+    void subRsp(const uint32_t imm) { byte(0x48); byte(0x81); byte(0xEC); dword(imm); }
+    void addRsp(const uint32_t imm) { byte(0x48); byte(0x81); byte(0xC4); dword(imm); }
+    void push(const int reg) { rex(false, 0, reg); byte(uint8_t(0x50 | (reg & 7))); }
+    void pop(const int reg) { rex(false, 0, reg); byte(uint8_t(0x58 | (reg & 7))); }
+    //  call reg
+    void call(const int reg) { rex(false, 0, reg); byte(0xFF); byte(uint8_t(0xD0 | (reg & 7))); }
+    void ret() { byte(0xC3); }
+
+    //  Jumps with 32 bit displacement, return the position of the displacement, patched with patch()
+    size_t jcc(const uint8_t cc) { byte(0x0F); byte(uint8_t(0x80 | cc)); dword(0); return code.size() - 4; }
+    size_t jmp() { byte(0xE9); dword(0); return code.size() - 4; }
+
+    //  Set the displacement at pos to jump to target
+    void patch(const size_t pos, const size_t target)
+    {
+        const uint32_t rel = uint32_t(int32_t(int64_t(target) - int64_t(pos + 4)));
+        memcpy(&code[pos], &rel, 4);
+    }
+};
+
+//  JIT compiled code of a product, executable pages and pool of constants
+class JitCode
+{
+    void*               myPages = nullptr;
+    size_t              mySize = 0;
+    vector<double>      myConsts;
+    NativeFunc          myFunc = nullptr;
+
+public:
+
+    JitCode() {}
+
+    ~JitCode()
+    {
+#ifdef SCRIPTING_JIT
+        if (myPages) munmap(myPages, mySize);
+#endif
+    }
+
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+
+    //  Entry point
+    NativeFunc function() const
+    {
+        return myFunc;
+    }
+
+    //  Copy machine code into executable pages, 
+    //      after patching the address of the pool of constants as the 64 bit immediate at constsPos
+    //  Returns false if the pages cannot be allocated or made executable
+    bool load(vector<uint8_t> code, const size_t constsPos, vector<double>&& consts)
+    {
+#ifdef SCRIPTING_JIT
+        myConsts = move(consts);
+        const uint64_t constsAddr = uint64_t(reinterpret_cast<uintptr_t>(myConsts.data()));
+        memcpy(&code[constsPos], &constsAddr, 8);
+
+        mySize = code.size();
+        void* pages = mmap(nullptr, mySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pages == MAP_FAILED) return false;
+        memcpy(pages, code.data(), code.size());
+        if (mprotect(pages, mySize, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(pages, mySize);
+            return false;
+        }
+        myPages = pages;
+        myFunc = reinterpret_cast<NativeFunc>(pages);
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+//  Translate register code into machine code, see compileRegisters()
+//  The entry points of the events are not needed, the machine code runs all the events in one call,
+//      moving to the next spot and numeraire on every Halt
+//  Returns null when the code cannot be translated: loops, other architectures, or no executable memory
+//  The state of the entry point is the register file, its registers read before written must be initialized to 0
+inline unique_ptr<JitCode> compileJit(
+    const vector<RegInstr>& code,
+    const vector<size_t>&)
+{
+#ifdef SCRIPTING_JIT
+
+    typedef X64Emitter E;
+    E e;
+
+    //  Base registers, callee-saved so calls to the C library preserve them:
+    //      rbx: spot of the current event, r12: spot stride in bytes,
+    //      r13: numeraire of the current event, rbp: numeraire stride in bytes,
+    //      r15: register file, r14: constants
+    //  The boolean registers are the first REGMAXBOOLS bytes of the stack frame
+    const int REGS = E::R15, CONSTS = E::R14, BOOLS = E::RSP;
+    //  6 pushes and the return address leave rsp 16 bytes aligned after 64 + 8 bytes, as calls require
+    const uint32_t frame = REGMAXBOOLS + 8;
+    static_assert(REGMAXBOOLS % 16 == 0, "Misaligned stack frame");
+
+    vector<double> consts;
+    auto cst = [&consts](const double c) { consts.push_back(c); return int(8 * (consts.size() - 1)); };
+    auto rg = [](const int i) { return 8 * i; };
+
+    //  Prologue
+    e.push(E::RBX); e.push(E::RBP); e.push(E::R12); e.push(E::R13); e.push(E::R14); e.push(E::R15);
+    e.subRsp(frame);
+    e.mov(E::RBX, E::RDI);
+    e.mov(E::R12, E::RSI);
+    e.shl(E::R12, 3);
+    e.mov(E::R13, E::RDX);
+    e.mov(E::RBP, E::RCX);
+    e.shl(E::RBP, 3);
+    e.mov(REGS, E::R8);
+    //  Address of the constants, patched when known
+    e.movImm(CONSTS, 0);
+    const size_t constsPos = e.code.size() - 8;
+
+    //  Position of every instruction, and jumps to patch
+    vector<size_t> pos(code.size() + 1);
+    vector<pair<size_t, size_t>> fixups;
+    auto jumpTo = [&](const size_t disp, const int target) { fixups.push_back(make_pair(disp, size_t(target))); };
+
+    double (*const cLog)(double) = &::log;
+    double (*const cPow)(double, double) = &::pow;
+
+    //  Binary operation dst = a op b, operands [base, disp]
+    auto binary = [&](const uint8_t op, const int dst, const int baseA, const int dispA, const int baseB, const int dispB)
+    {
+        e.sdMem(E::MOVSDLOAD, 0, baseA, dispA);
+        e.sdMem(op, 0, baseB, dispB);
+        e.sdMem(E::MOVSDSTORE, 0, REGS, rg(dst));
+    };
+
+    //  Compare xmm0 to 0
+    auto cmpZero = [&]()
+    {
+        e.xorpd(1, 1);
+        e.ucomisd(0, 1);
+    };
+
+    //  Boolean from the flags of cmpZero(), op is Sup, SupEqual or Equal
+    auto setBool = [&](const int op, const int dst)
+    {
+        if (op == Sup) e.setcc(E::CA);
+        else if (op == SupEqual) e.setcc(E::CAE);
+        else
+        {
+            //  Equal and ordered
+            e.setcc(E::CE);
+            e.setcc(E::CNP, E::RCX);
+            e.andAlCl();
+        }
+        e.storeByte(BOOLS, dst);
+    };
+
+    //  Jump unless the flags of cmpZero() satisfy op, Sup, SupEqual or Equal
+    auto jumpUnless = [&](const int op, const int target)
+    {
+        if (op == Sup) jumpTo(e.jcc(E::CBE), target);
+        else if (op == SupEqual) jumpTo(e.jcc(E::CB), target);
+        else
+        {
+            jumpTo(e.jcc(E::CNE), target);
+            jumpTo(e.jcc(E::CP), target);
+        }
+    };
+
+    //  Call the C library with arguments in xmm0 and xmm1, result in xmm0
+    auto callC = [&](const void* func)
+    {
+        e.movImm(E::RAX, uint64_t(reinterpret_cast<uintptr_t>(func)));
+        e.call(E::RAX);
+    };
+
+    const int negZero = cst(-0.0), half = cst(0.5), negHalf = cst(-0.5);
+
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        pos[i] = e.code.size();
+        const RegInstr& ins = code[i];
+
+        switch (ins.op)
+        {
+        case Add:           binary(E::ADDSD, ins.dst, REGS, rg(ins.a), REGS, rg(ins.b)); break;
+        case AddConst:      binary(E::ADDSD, ins.dst, REGS, rg(ins.a), CONSTS, cst(ins.constVal)); break;
+        case Sub:           binary(E::SUBSD, ins.dst, REGS, rg(ins.a), REGS, rg(ins.b)); break;
+        case SubConst:      binary(E::SUBSD, ins.dst, REGS, rg(ins.a), CONSTS, cst(ins.constVal)); break;
+        case ConstSub:      binary(E::SUBSD, ins.dst, CONSTS, cst(ins.constVal), REGS, rg(ins.a)); break;
+        case Mult:          binary(E::MULSD, ins.dst, REGS, rg(ins.a), REGS, rg(ins.b)); break;
+        case MultConst:     binary(E::MULSD, ins.dst, REGS, rg(ins.a), CONSTS, cst(ins.constVal)); break;
+        case Div:           binary(E::DIVSD, ins.dst, REGS, rg(ins.a), REGS, rg(ins.b)); break;
+        case DivConst:      binary(E::DIVSD, ins.dst, REGS, rg(ins.a), CONSTS, cst(ins.constVal)); break;
+        case ConstDiv:      binary(E::DIVSD, ins.dst, CONSTS, cst(ins.constVal), REGS, rg(ins.a)); break;
+
+        //  y > x ? y : x is maxsd y, x, and y < x ? y : x is minsd y, x, including with NaNs
+        case Max2:          binary(E::MAXSD, ins.dst, REGS, rg(ins.b), REGS, rg(ins.a)); break;
+        case Max2Const:     binary(E::MAXSD, ins.dst, CONSTS, cst(ins.constVal), REGS, rg(ins.a)); break;
+        case Min2:          binary(E::MINSD, ins.dst, REGS, rg(ins.b), REGS, rg(ins.a)); break;
+        case Min2Const:     binary(E::MINSD, ins.dst, CONSTS, cst(ins.constVal), REGS, rg(ins.a)); break;
+
+        case Pow:
+        case PowConst:
+        case ConstPow:
+            if (ins.op == ConstPow) e.sdMem(E::MOVSDLOAD, 0, CONSTS, cst(ins.constVal));
+            else e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            if (ins.op == Pow) e.sdMem(E::MOVSDLOAD, 1, REGS, rg(ins.b));
+            else if (ins.op == PowConst) e.sdMem(E::MOVSDLOAD, 1, CONSTS, cst(ins.constVal));
+            else e.sdMem(E::MOVSDLOAD, 1, REGS, rg(ins.a));
+            callC(reinterpret_cast<const void*>(cPow));
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        case Log:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            callC(reinterpret_cast<const void*>(cLog));
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        case Sqrt:
+            e.sdMem(E::SQRTSD, 0, REGS, rg(ins.a));
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        case Uminus:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::MOVSDLOAD, 1, CONSTS, negZero);
+            e.xorpd(0, 1);
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        case Spot:
+            e.sdMem(E::MOVSDLOAD, 0, E::RBX, 0);
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        case Assign:
+        case AssignConst:
+            if (ins.op == Assign) e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            else e.sdMem(E::MOVSDLOAD, 0, CONSTS, cst(ins.constVal));
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        //  r[dst] += xmm0
+        case Pays:
+        case PaysConst:
+        case PaysScaled:
+        case PaysScaledConst:
+        case MultConstPaysScaled:
+            if (ins.op == PaysConst || ins.op == PaysScaledConst) e.sdMem(E::MOVSDLOAD, 0, CONSTS, cst(ins.constVal));
+            else e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            if (ins.op == Pays || ins.op == PaysConst) e.sdMem(E::DIVSD, 0, E::R13, 0);
+            else if (ins.op == PaysScaled || ins.op == MultConstPaysScaled) e.sdMem(E::MULSD, 0, CONSTS, cst(ins.constVal));
+            if (ins.op == MultConstPaysScaled) e.sdMem(E::MULSD, 0, CONSTS, cst(ins.constVal2));
+            e.sdMem(E::MOVSDLOAD, 1, REGS, rg(ins.dst));
+            e.sdReg(E::ADDSD, 1, 0);
+            e.sdMem(E::MOVSDSTORE, 1, REGS, rg(ins.dst));
+            break;
+
+        case If:
+        case AndJump:
+            e.testByte(BOOLS, ins.a);
+            jumpTo(e.jcc(E::CE), ins.b);
+            break;
+
+        case OrJump:
+            e.testByte(BOOLS, ins.a);
+            jumpTo(e.jcc(E::CNE), ins.b);
+            break;
+
+        case IfAnd:
+            e.testByte(BOOLS, ins.a);
+            jumpTo(e.jcc(E::CE), ins.b);
+            e.testByte(BOOLS, ins.d);
+            jumpTo(e.jcc(E::CE), ins.b);
+            break;
+
+        case Jump:
+            jumpTo(e.jmp(), ins.b);
+            break;
+
+        case Equal:
+        case Sup:
+        case SupEqual:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            cmpZero();
+            setBool(ins.op, ins.dst);
+            break;
+
+        case SubConstSup:
+        case SubConstSupEqual:
+        case SubConstEqual:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::SUBSD, 0, CONSTS, cst(ins.constVal));
+            cmpZero();
+            setBool(ins.op == SubConstSup ? Sup : ins.op == SubConstSupEqual ? SupEqual : Equal, ins.dst);
+            break;
+
+        case ConstSubSup:
+        case ConstSubSupEqual:
+            e.sdMem(E::MOVSDLOAD, 0, CONSTS, cst(ins.constVal));
+            e.sdMem(E::SUBSD, 0, REGS, rg(ins.a));
+            cmpZero();
+            setBool(ins.op == ConstSubSup ? Sup : SupEqual, ins.dst);
+            break;
+
+        case IfSubConstSup:
+        case IfSubConstSupEqual:
+        case IfSubConstEqual:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::SUBSD, 0, CONSTS, cst(ins.constVal));
+            cmpZero();
+            jumpUnless(ins.op == IfSubConstSup ? Sup : ins.op == IfSubConstSupEqual ? SupEqual : Equal, ins.b);
+            break;
+
+        case IfConstSubSup:
+        case IfConstSubSupEqual:
+            e.sdMem(E::MOVSDLOAD, 0, CONSTS, cst(ins.constVal));
+            e.sdMem(E::SUBSD, 0, REGS, rg(ins.a));
+            cmpZero();
+            jumpUnless(ins.op == IfConstSubSup ? Sup : SupEqual, ins.b);
+            break;
+
+        //  Booleans are 0 or 1
+        case And:
+        case Or:
+            e.loadByte(BOOLS, ins.a);
+            if (ins.op == And) e.andByte(BOOLS, ins.b);
+            else e.orByte(BOOLS, ins.b);
+            e.storeByte(BOOLS, ins.dst);
+            break;
+
+        case Not:
+            e.loadByte(BOOLS, ins.a);
+            e.notAl();
+            e.storeByte(BOOLS, ins.dst);
+            break;
+
+        case True:
+        case False:
+            e.storeByteImm(BOOLS, ins.dst, ins.op == True ? 1 : 0);
+            break;
+
+        //  Jump to b if r[a] < -0.5 * r[d]
+        case SmoothBegin:
+            e.sdMem(E::MOVSDLOAD, 1, CONSTS, negHalf);
+            e.sdMem(E::MULSD, 1, REGS, rg(ins.d));
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.ucomisd(1, 0);
+            jumpTo(e.jcc(E::CA), ins.b);
+            break;
+
+        //  r[dst] = r[c] and jump to b if r[a] > 0.5 * r[d]
+        case SmoothMid:
+        {
+            e.sdMem(E::MOVSDLOAD, 1, CONSTS, half);
+            e.sdMem(E::MULSD, 1, REGS, rg(ins.d));
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.ucomisd(0, 1);
+            const size_t skip = e.jcc(E::CBE);
+            e.sdMem(E::MOVSDLOAD, 2, REGS, rg(ins.c));
+            e.sdMem(E::MOVSDSTORE, 2, REGS, rg(ins.dst));
+            jumpTo(e.jmp(), ins.b);
+            e.patch(skip, e.code.size());
+            break;
+        }
+
+        //  x in xmm0, y in xmm1, -y in xmm2
+        case Smooth:
+        {
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::MOVSDLOAD, 1, CONSTS, half);
+            e.sdMem(E::MULSD, 1, REGS, rg(ins.d));
+            e.sdMem(E::MOVSDLOAD, 2, CONSTS, negZero);
+            e.xorpd(2, 1);
+            //  Left
+            e.ucomisd(2, 0);
+            const size_t left = e.jcc(E::CA);
+            //  Right
+            e.ucomisd(0, 1);
+            const size_t right = e.jcc(E::CA);
+            //  Fuzzy: t + 0.5 * (z - t) / y * (x + y)
+            e.sdMem(E::MOVSDLOAD, 3, REGS, rg(ins.b));
+            e.sdMem(E::SUBSD, 3, REGS, rg(ins.c));
+            e.sdMem(E::MULSD, 3, CONSTS, half);
+            e.sdReg(E::DIVSD, 3, 1);
+            e.sdReg(E::ADDSD, 0, 1);
+            e.sdReg(E::MULSD, 3, 0);
+            e.sdMem(E::ADDSD, 3, REGS, rg(ins.c));
+            const size_t done1 = e.jmp();
+            e.patch(left, e.code.size());
+            e.sdMem(E::MOVSDLOAD, 3, REGS, rg(ins.c));
+            const size_t done2 = e.jmp();
+            e.patch(right, e.code.size());
+            e.sdMem(E::MOVSDLOAD, 3, REGS, rg(ins.b));
+            e.patch(done1, e.code.size());
+            e.patch(done2, e.code.size());
+            e.sdMem(E::MOVSDSTORE, 3, REGS, rg(ins.dst));
+            break;
+        }
+
+        case DivConstAdd:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::DIVSD, 0, CONSTS, cst(ins.constVal));
+            e.sdMem(E::MOVSDLOAD, 1, REGS, rg(ins.b));
+            e.sdReg(E::ADDSD, 1, 0);
+            e.sdMem(E::MOVSDSTORE, 1, REGS, rg(ins.dst));
+            break;
+
+        case MultConstDivConst:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::MULSD, 0, CONSTS, cst(ins.constVal));
+            e.sdMem(E::DIVSD, 0, CONSTS, cst(ins.constVal2));
+            e.sdMem(E::MOVSDSTORE, 0, REGS, rg(ins.dst));
+            break;
+
+        case SubConstMax2:
+            e.sdMem(E::MOVSDLOAD, 1, REGS, rg(ins.a));
+            e.sdMem(E::SUBSD, 1, CONSTS, cst(ins.constVal));
+            e.sdMem(E::MAXSD, 1, REGS, rg(ins.b));
+            e.sdMem(E::MOVSDSTORE, 1, REGS, rg(ins.dst));
+            break;
+
+        case SubConstMax2Const:
+            e.sdMem(E::MOVSDLOAD, 0, REGS, rg(ins.a));
+            e.sdMem(E::SUBSD, 0, CONSTS, cst(ins.constVal));
+            e.sdMem(E::MOVSDLOAD, 1, CONSTS, cst(ins.constVal2));
+            e.sdReg(E::MAXSD, 1, 0);
+            e.sdMem(E::MOVSDSTORE, 1, REGS, rg(ins.dst));
+            break;
+
+        //  End of the event, next spot and numeraire
+        case Halt:
+            e.add(E::RBX, E::R12);
+            e.add(E::R13, E::RBP);
+            break;
+
+        //  Not supported
+        default:
+            return nullptr;
+        }
+    }
+
+    //  Epilogue
+    pos[code.size()] = e.code.size();
+    e.addRsp(frame);
+    e.pop(E::R15); e.pop(E::R14); e.pop(E::R13); e.pop(E::R12); e.pop(E::RBP); e.pop(E::RBX);
+    e.ret();
+
+    for (const auto& fix : fixups) e.patch(fix.first, pos[fix.second]);
+
+    unique_ptr<JitCode> jit(new JitCode);
+    if (!jit->load(move(e.code), constsPos, move(consts))) return nullptr;
+
+    return jit;
+
+#else
+
+    return nullptr;
+
+#endif
+}
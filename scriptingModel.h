@@ -17,17 +17,25 @@ As long as this comment is preserved at the top of the file
 #pragma once
 
 #include "scriptingProduct.h"
+#include "scriptingImage.h"
 #include "scriptingScenarios.h"
 
-#include "cpp11basicRanGen.h"
+#include "mrg32k3a.h"
+#include "sobol.h"
+#include "philox.h"
+#include "brownianBridge.h"
+#include "threadPool.h"
 
 #include <algorithm>
 #include <numeric>
+#include <atomic>
 
 //  Base model for Monte-Carlo simulations
 template <class T>
 struct Model
 {
+    virtual ~Model() {}
+
 	//	Clone
 	virtual unique_ptr<Model> clone() const = 0;
 
@@ -36,13 +44,44 @@ struct Model
 
     //  Number of Gaussian numbers required for one path
     virtual size_t dim() const = 0;
+
+    //  Times of the Brownian increments driven by each of the dim() Gaussian numbers
+    //  Required for Brownian bridge construction
+    virtual vector<double> brownianTimes() const
+    {
+        throw runtime_error("Concrete model does not support Brownian bridge construction");
+    }
     
-    //  Apply the model SDE
-    virtual void applySDE(
+    //  Fields of SimulData that don't depend on the path, combination of SimulDataField
+    //  Deterministic fields are populated once with deterministicData(), 
+    //      applySDE() and applySDEBlock() don't populate them
+    virtual unsigned deterministicFields() const { return 0; }
+
+    //  Populate the deterministic fields for each event date, after initSimDates()
+    virtual void deterministicData(
+        vector<T>&,             //  Spots
+        vector<T>&)             //  Numeraires
+            const {}
+
+    //  Apply the model SDE to a block of nPaths paths at once, in structure of arrays layout
+    //      so concrete models may vectorize across paths, and write directly into scenarios
+    //  Deterministic fields are not populated and their pointers may be null
+    virtual void applySDEBlock(
+        const size_t            nPaths,
+        const double*           G,              //  Gaussian numbers, G[step * nPaths + path]
+        T*                      spots,          //  Populate spots[event * nPaths + path]
+        T*                      numeraires)     //  Populate numeraires[event * nPaths + path]
+            const = 0;
+
+    //  Apply the model SDE to one path
+    void applySDE(
         const vector<double>&   G,              //  Gaussian numbers, dimension dim()
         vector<T>&              spots,          //  Populate spots for each event date
         vector<T>&              numeraires)     //  Populate numeraire for each event date
-            const = 0;
+            const
+    {
+        applySDEBlock(1, G.data(), spots.data(), numeraires.data());
+    }
 };
 
 template <class T>
@@ -54,20 +93,16 @@ class SimpleBlackScholes : public Model<T>
     T                   myVol;
     T                   myDrift;
 
-	bool				myTime0;	//	If today is among simul dates
+	bool				myTime0 = false;	//	If today is among simul dates
 	vector<double>		myTimes;
 	vector<double>		myDt;
 	vector<double>		mySqrtDt;
-		
-private:
-
-    //	Calculate all deterministic discount factors
-    void calcDf( vector<T>& dfs) const
-    {
-        for (size_t i = 0; i<myTimes.size(); ++i)
-            dfs[i] = exp(myRate * myTimes[i]);
-    }
 
+    //  Per step constants, precomputed in initSimDates()
+    vector<T>           myExpDriftDt;   //  exp( -drift * dt)
+    vector<T>           myVolSqrtDt;    //  vol * sqrt( dt)
+    vector<T>           myDf;           //  Deterministic numeraires
+		
 public:
 
 	//	Construct with T0, S0, vol and rate
@@ -108,34 +143,78 @@ public:
 		{
 			mySqrtDt[i] = sqrt( myDt[i]);
 		}
+
+        //  Per step constants
+        myExpDriftDt.resize( myTimes.size());
+        myVolSqrtDt.resize( myTimes.size());
+        myDf.resize( myTimes.size());
+        for (size_t i = 0; i<myTimes.size(); ++i)
+        {
+            myExpDriftDt[i] = exp( -myDrift * myDt[i]);
+            myVolSqrtDt[i] = myVol * mySqrtDt[i];
+            myDf[i] = exp( myRate * myTimes[i]);
+        }
 	}
 
     size_t dim() const override { return myTimes.size() - myTime0; }
 
-	//	Simulate one path 
-    //  Apply the model SDE
-    void applySDE(
-        const vector<double>&   G,              //  Gaussian numbers, dimension dim()
-        vector<T>&              spots,          //  Populate spots for each event date
-        vector<T>&              numeraires)     //  Populate numeraire for each event date
+    //  One Gaussian per simulation time, excluding today
+    vector<double> brownianTimes() const override
+    {
+        return vector<double>(myTimes.begin() + myTime0, myTimes.end());
+    }
+
+    //  Numeraires are deterministic discount factors
+    unsigned deterministicFields() const override { return SimulNumeraire; }
+
+    void deterministicData(
+        vector<T>&,             //  Spots are not deterministic
+        vector<T>&              numeraires)
+        const override
+    {
+        copy(myDf.begin(), myDf.end(), numeraires.begin());
+    }
+
+    //  Simulate a block of paths, loops over paths are innermost and vectorized
+    void applySDEBlock(
+        const size_t            nPaths,
+        const double*           G,              //  Gaussian numbers, G[step * nPaths + path]
+        T*                      spots,          //  Populate spots[event * nPaths + path]
+        T*)                                     //  Numeraires are deterministic, not populated
         const override
     {
-        //  Compute discount factors
-        calcDf( numeraires);
-        //  Note the ineffiency: in this case, numeraires could be computed only once
+        //  Numeraires are deterministic, populated once with deterministicData()
 
-        //  Then apply the SDE
-        size_t step = 0;
+        //  Apply the SDE
+        const double* g = G;
 
 		//	First step
-		spots[0] = myTime0? mySpot: 
-			mySpot*exp(-myDrift*myDt[0]+myVol*mySqrtDt[0]*G[step++]);
+        T* s = spots;
+        if (myTime0)
+        {
+            fill( s, s + nPaths, mySpot);
+        }
+        else
+        {
+            const T a = mySpot * myExpDriftDt[0], b = myVolSqrtDt[0];
+            for (size_t p = 0; p<nPaths; ++p)
+            {
+                s[p] = a * exp( b * g[p]);
+            }
+            g += nPaths;
+        }
 
 		//	All steps
 		for(size_t i=1; i<myTimes.size(); ++i)
 		{
-			spots[i] = spots[i-1]
-			*exp(-myDrift*myDt[i]+myVol*mySqrtDt[i]*G[step++]);
+            const T* prev = s;
+            s += nPaths;
+            const T a = myExpDriftDt[i], b = myVolSqrtDt[i];
+            for (size_t p = 0; p<nPaths; ++p)
+            {
+                s[p] = prev[p] * a * exp( b * g[p]);
+            }
+            g += nPaths;
 		}
 	}
 };
@@ -148,19 +227,15 @@ class SimpleBachelier : public Model<T>
     T                   myRate;
     T                   myVol;
 
-    bool				myTime0;	//	If today is among simul dates
+    bool				myTime0 = false;	//	If today is among simul dates
     vector<double>		myTimes;
     vector<double>		myDt;
     vector<double>		mySqrtDt;
 
-private:
-
-    //	Calculate all deterministic discount factors
-    void calcDf(vector<T>& dfs) const
-    {
-        for (size_t i = 0; i<myTimes.size(); ++i)
-            dfs[i] = exp(myRate * myTimes[i]);
-    }
+    //  Per step constants, precomputed in initSimDates()
+    vector<T>           myExpRateDt;    //  exp( rate * dt)
+    vector<T>           myStdDev;       //  Standard deviation of the step
+    vector<T>           myDf;           //  Deterministic numeraires
 
 public:
 
@@ -201,50 +276,88 @@ public:
         {
             mySqrtDt[i] = sqrt(myDt[i]);
         }
+
+        //  Per step constants
+        myExpRateDt.resize(myTimes.size());
+        myStdDev.resize(myTimes.size());
+        myDf.resize(myTimes.size());
+        for (size_t i = 0; i<myTimes.size(); ++i)
+        {
+            //  If rate ~0 the dynamics is simpler 
+            if (fabs(myRate) < 0.0001)
+            {
+                myExpRateDt[i] = 1.0;
+                myStdDev[i] = myVol * mySqrtDt[i];
+            }
+            //  General dynamics with non-zero rates
+            else
+            {
+                myExpRateDt[i] = exp(myRate * myDt[i]);
+                myStdDev[i] = myVol * sqrt((exp(2 * myRate * myDt[i]) - 1) / (2 * myRate));
+            }
+            myDf[i] = exp(myRate * myTimes[i]);
+        }
     }
 
     size_t dim() const override { return myTimes.size() - myTime0; }
 
-    //	Simulate one path 
-    //  Apply the model SDE
-    void applySDE(
-        const vector<double>&   G,              //  Gaussian numbers, dimension dim()
-        vector<T>&              spots,          //  Populate spots for each event date
-        vector<T>&              numeraires)     //  Populate numeraire for each event date
+    //  One Gaussian per simulation time, excluding today
+    vector<double> brownianTimes() const override
+    {
+        return vector<double>(myTimes.begin() + myTime0, myTimes.end());
+    }
+
+    //  Numeraires are deterministic discount factors
+    unsigned deterministicFields() const override { return SimulNumeraire; }
+
+    void deterministicData(
+        vector<T>&,             //  Spots are not deterministic
+        vector<T>&              numeraires)
         const override
     {
-        //  Compute discount factors
-        calcDf(numeraires);
-        //  Note the ineffiency: in this case, numeraires could be computed only once
+        copy(myDf.begin(), myDf.end(), numeraires.begin());
+    }
 
-        //  Then apply the SDE
-        size_t step = 0;
+    //  Simulate a block of paths, loops over paths are innermost and vectorized
+    void applySDEBlock(
+        const size_t            nPaths,
+        const double*           G,              //  Gaussian numbers, G[step * nPaths + path]
+        T*                      spots,          //  Populate spots[event * nPaths + path]
+        T*)                                     //  Numeraires are deterministic, not populated
+        const override
+    {
+        //  Numeraires are deterministic, populated once with deterministicData()
 
-        //  If rate ~0 the dynamics is simpler and can be simulated more efficiently
-        if (fabs(myRate) < 0.0001)
-        {
-            //	First step
-            spots[0] = myTime0 ? mySpot :
-                mySpot + myVol * mySqrtDt[0] * G[step++];
+        //  Apply the SDE
+        const double* g = G;
 
-            //	All steps
-            for (size_t i = 1; i<myTimes.size(); ++i)
-            {
-                spots[i] = spots[i - 1] + myVol * mySqrtDt[i] * G[step++];
-            }
+        //	First step
+        T* s = spots;
+        if (myTime0)
+        {
+            fill(s, s + nPaths, mySpot);
         }
-        //  General dynamics with non-zero rates
         else
         {
-            //	First step
-            spots[0] = myTime0 ? mySpot :
-                mySpot * exp(myRate * myDt[0]) + myVol * sqrt ((exp (2 * myRate * myDt[0]) - 1) / (2 * myRate)) * G[step++];
+            const T a = mySpot * myExpRateDt[0], b = myStdDev[0];
+            for (size_t p = 0; p<nPaths; ++p)
+            {
+                s[p] = a + b * g[p];
+            }
+            g += nPaths;
+        }
 
-            //	All steps
-            for (size_t i = 1; i<myTimes.size(); ++i)
+        //	All steps
+        for (size_t i = 1; i<myTimes.size(); ++i)
+        {
+            const T* prev = s;
+            s += nPaths;
+            const T a = myExpRateDt[i], b = myStdDev[i];
+            for (size_t p = 0; p<nPaths; ++p)
             {
-                spots[i] = spots[i - 1] * exp(myRate * myDt[i]) + myVol * sqrt((exp(2 * myRate * myDt[i]) - 1) / (2 * myRate)) * G[step++];
+                s[p] = prev[p] * a + b * g[p];
             }
+            g += nPaths;
         }
     }
 };
@@ -254,21 +367,112 @@ class MonteCarloSimulator
 {
     RandomGen&          myRandomGen;
     Model<T>&           myModel;
+
+    //  Optional Brownian bridge, so the first Gaussian numbers drive the coarsest features of the path
+    bool                myUseBridge;
+    BrownianBridge      myBridge;
+    vector<double>      myBridgedNorm;
+
+    //  Work space for blocks of paths, Gaussians by path then by step
+    vector<double>      myBlockNorm;
+    vector<double>      myBlockNormT;
     
 public:
 
-    MonteCarloSimulator( Model<T>& model, RandomGen& ranGen) : myRandomGen( ranGen), myModel( model) {}
+    MonteCarloSimulator( Model<T>& model, RandomGen& ranGen, const bool brownianBridge = false) 
+        : myRandomGen( ranGen), myModel( model), myUseBridge( brownianBridge) {}
 
     void init( const vector<Date>& simDates)
     {
         myModel.initSimDates( simDates);
         myRandomGen.init( myModel.dim());
+        if (myUseBridge)
+        {
+            myBridge.init(myModel.brownianTimes());
+            myBridgedNorm.resize(myModel.dim());
+        }
+    }
+
+    //  Fields of SimulData populated once rather than on every path
+    unsigned deterministicFields() const
+    {
+        return myModel.deterministicFields();
+    }
+
+    //  Populate the deterministic fields once, after init()
+    //  The simulation functions below don't populate them
+    void deterministicData( vector<T>& spots, vector<T>& numeraires) const
+    {
+        myModel.deterministicData( spots, numeraires);
     }
 
     void simulateOnePath( vector<T>& spots, vector<T>& numeraires)
     {
         myRandomGen.genNextNormVec();
-        myModel.applySDE(myRandomGen.getNorm(), spots, numeraires);
+        if (myUseBridge)
+        {
+            myBridge.transform(myRandomGen.getNorm(), myBridgedNorm);
+            myModel.applySDE(myBridgedNorm, spots, numeraires);
+        }
+        else
+        {
+            myModel.applySDE(myRandomGen.getNorm(), spots, numeraires);
+        }
+    }
+
+    //  Next path simulated is number path, requires a random generator with random access
+    void setPath( const size_t path)
+    {
+        myRandomGen.setPath( path);
+    }
+
+    //  Simulate path number path directly
+    void simulatePath( const size_t path, vector<T>& spots, vector<T>& numeraires)
+    {
+        setPath( path);
+        simulateOnePath( spots, numeraires);
+    }
+
+    //  Simulate the next nPaths paths at once, same paths as nPaths calls to simulateOnePath()
+    //  Results in structure of arrays layout: spots[event * nPaths + path], same for numeraires
+    //  spots and numeraires must point to number of event dates * nPaths, 
+    //      or may be null when deterministic
+    void simulateBlock( const size_t nPaths, T* spots, T* numeraires)
+    {
+        const size_t dim = myModel.dim();
+        myBlockNorm.resize( nPaths * dim);
+        if (nPaths > 1) myBlockNormT.resize( nPaths * dim);
+
+        myRandomGen.genNextNormBlock( nPaths, myBlockNorm.data());
+
+        //  Bridge path by path, in place
+        if (myUseBridge)
+        {
+            for (size_t p = 0; p<nPaths; ++p)
+            {
+                double* g = myBlockNorm.data() + p * dim;
+                myBridge.transform( g, myBridgedNorm.data());
+                copy( myBridgedNorm.begin(), myBridgedNorm.end(), g);
+            }
+        }
+
+        //  Transpose into step major, so the model vectorizes across paths
+        //  Nothing to do for a single path
+        if (nPaths == 1)
+        {
+            myModel.applySDEBlock( 1, myBlockNorm.data(), spots, numeraires);
+            return;
+        }
+
+        for (size_t p = 0; p<nPaths; ++p)
+        {
+            for (size_t i = 0; i<dim; ++i)
+            {
+                myBlockNormT[i * nPaths + p] = myBlockNorm[p * dim + i];
+            }
+        }
+
+        myModel.applySDEBlock( nPaths, myBlockNormT.data(), spots, numeraires);
     }
 };
 
@@ -278,40 +482,507 @@ struct ScriptModelApi
 {
     virtual void initForScripting(const vector<Date>& eventDates) = 0;
 
+    //  Point the scenario to the next simulated path
+    //  Valid until the next call, the simulator owns the simulated data
     virtual void nextScenario(Scenario<T>& s) = 0;
 };
 
+//  Scenarios are views into the simulator's storage: 
+//      models simulate directly into them and nothing is copied
 template <class T>
 class ScriptSimulator : public MonteCarloSimulator<T>, public ScriptModelApi<T>
 {
+    //  Deterministic data, populated once
+    unsigned       myDetFields;
+    vector<T>      myDetSpots;
+    vector<T>      myDetNumeraires;
+
+    //  Simulated data for a block of paths, structure of arrays
+    size_t         myNumEvents;
+    size_t         myBlockPaths;
+    vector<T>      myBlockSpots;
+    vector<T>      myBlockNumeraires;
+
+    //  Simulate a block of paths into the block storage
+    void simulate( const size_t nPaths)
+    {
+        myBlockPaths = nPaths;
+        const bool detSpots = (myDetFields & SimulSpot) != 0, detNums = (myDetFields & SimulNumeraire) != 0;
+        if (!detSpots) myBlockSpots.resize( myNumEvents * nPaths);
+        if (!detNums) myBlockNumeraires.resize( myNumEvents * nPaths);
+
+        MonteCarloSimulator<T>::simulateBlock( nPaths, 
+            detSpots ? nullptr : myBlockSpots.data(),
+            detNums ? nullptr : myBlockNumeraires.data());
+    }
 
-    vector<T>      myTempSpots;
-    vector<T>      myTempNumeraires;
+    //  Point s to path number path in the block
+    void viewScenario( const size_t path, Scenario<T>& s)
+    {
+        const bool detSpots = (myDetFields & SimulSpot) != 0, detNums = (myDetFields & SimulNumeraire) != 0;
+        s.view( 
+            detSpots ? myDetSpots.data() : myBlockSpots.data() + path, 
+            detSpots ? 1 : myBlockPaths,
+            detNums ? myDetNumeraires.data() : myBlockNumeraires.data() + path,
+            detNums ? 1 : myBlockPaths);
+    }
 
 public:
 
-    ScriptSimulator( Model<T>& model, RandomGen& ranGen) : MonteCarloSimulator<T>( model, ranGen) {}
+    ScriptSimulator( Model<T>& model, RandomGen& ranGen, const bool brownianBridge = false) 
+        : MonteCarloSimulator<T>( model, ranGen, brownianBridge), 
+        myDetFields( 0), myNumEvents( 0), myBlockPaths( 0) {}
 
 	void initForScripting( const vector<Date>& eventDates) override
 	{
         MonteCarloSimulator<T>::init( eventDates);
-        myTempSpots.resize( eventDates.size());
-        myTempNumeraires.resize(eventDates.size());
+        myNumEvents = eventDates.size();
+
+        myDetFields = MonteCarloSimulator<T>::deterministicFields();
+        myDetSpots.resize( myNumEvents);
+        myDetNumeraires.resize( myNumEvents);
+        MonteCarloSimulator<T>::deterministicData( myDetSpots, myDetNumeraires);
     }
 
 	void nextScenario( Scenario<T>& s) override
 	{
-        MonteCarloSimulator<T>::simulateOnePath( myTempSpots, myTempNumeraires);
-		
-        //  Note the inefficiency
-        for(size_t i=0; i<s.size(); ++i)
-		{
-			s[i].spot = myTempSpots[i];
-			s[i].numeraire = myTempNumeraires[i];
-		}
+        simulate( 1);
+        viewScenario( 0, s);
 	}
+
+    //  Scenario for path number path, for example to replay a path out of a simulation
+    //  Requires a random generator with random access
+    //  Subsequent calls to nextScenario() continue from path + 1
+    void pathScenario( const size_t path, Scenario<T>& s)
+    {
+        MonteCarloSimulator<T>::setPath( path);
+        nextScenario( s);
+    }
+
+    //  Simulate the next nPaths scenarios at once
+    //  then access them with blockScenario()
+    void nextScenarioBlock( const size_t nPaths)
+    {
+        simulate( nPaths);
+    }
+
+    //  Point the scenario to path number path in the last block
+    void blockScenario( const size_t path, Scenario<T>& s)
+    {
+        viewScenario( path, s);
+    }
+
+    //  All the scenarios in the last block, for lane-batched evaluation
+    ScenarioBlock<T> scenarioBlock() const
+    {
+        const bool detSpots = (myDetFields & SimulSpot) != 0, detNums = (myDetFields & SimulNumeraire) != 0;
+        ScenarioBlock<T> res;
+        res.numPaths = myBlockPaths;
+        res.spots = detSpots ? myDetSpots.data() : myBlockSpots.data();
+        res.spotEvtStride = detSpots ? 1 : myBlockPaths;
+        res.spotPathStride = detSpots ? 0 : 1;
+        res.numeraires = detNums ? myDetNumeraires.data() : myBlockNumeraires.data();
+        res.numEvtStride = detNums ? 1 : myBlockPaths;
+        res.numPathStride = detNums ? 0 : 1;
+        return res;
+    }
+};
+
+//  Numeraires of model on the event dates when deterministic, empty otherwise
+inline vector<double> deterministicNumeraires(
+    const Model<double>&    model,
+    const vector<Date>&     eventDates)
+{
+    vector<double> numeraires;
+    if (model.deterministicFields() & SimulNumeraire)
+    {
+        unique_ptr<Model<double>> mdl = model.clone();
+        mdl->initSimDates(eventDates);
+        vector<double> spots(eventDates.size());
+        numeraires.resize(eventDates.size());
+        mdl->deterministicData(spots, numeraires);
+    }
+    return numeraires;
+}
+
+//  Compile a pre-processed product for simulation with model
+//  Deterministic numeraires of the model are folded into the compiled code
+//  Fuzzy code with default smoothing factor defEps if fuzzy
+inline void compileForModel(
+    Product&                prd, 
+    const Model<double>&    model, 
+    const bool              fuzzy = false, 
+    const double            defEps = 0.0,
+    const vector<string>&   outputs = vector<string>())
+{
+    prd.compile(deterministicNumeraires(model, prd.eventDates()), fuzzy, defEps, outputs);
+}
+
+//  Random generators for script valuation
+enum RanGenType
+{
+    RanGenMrg32k3a,
+    RanGenSobol,
+    RanGenPhilox
 };
 
+inline unique_ptr<RandomGen> makeRanGen(const RanGenType ranGen, const unsigned seed)
+{
+    switch (ranGen)
+    {
+    case RanGenSobol:
+        return unique_ptr<RandomGen>(new Sobol);
+    case RanGenPhilox:
+        return unique_ptr<RandomGen>(new Philox(seed));
+    default:
+        return unique_ptr<RandomGen>(new Mrg32k3a(seed));
+    }
+}
+
+//  Paths are simulated in batches of fixed size, so results don't depend on the number of threads
+#define BATCHSIZE 1024
+//  Within a batch, scenarios are simulated in blocks of paths that stay in cache
+#define SIMBLOCKSIZE 256
+
+//  Path by path evaluation of a block of scenarios for scriptMcSimul()
+//  evalPath( scen, eval) evaluates the product in a scenario 
+//      and returns the variables after evaluation, 
+//      result v is accumulated from the variable in position slots[v]
+template <class EVALPATH>
+inline auto evalByPath(EVALPATH evalPath, const vector<size_t>& slots)
+{
+    return [evalPath, slots](ScriptSimulator<double>& simulator, const size_t nPaths, Scenario<double>& scen, 
+        auto& eval, vector<double>& res)
+    {
+        for (size_t i = 0; i < nPaths; ++i)
+        {
+            //  Scenario i into scen
+            simulator.blockScenario(i, scen);
+
+            //	Evaluate product and update results
+            const vector<double>& vals = evalPath(scen, eval);
+            for (size_t v = 0; v<res.size(); ++v)
+            {
+                res[v] += vals[slots[v]];
+            }
+        }
+    };
+}
+
+//  Lane by lane evaluation of a block of scenarios for scriptMcSimul()
+//  evalLanes( scen, eval) evaluates the product in a block of at most eval.width() scenarios,
+//      after which eval.varVals(i) points to the values of variable i on all lanes,
+//      result v is accumulated from the variable in position slots[v]
+template <class EVALLANES>
+inline auto evalByLanes(EVALLANES evalLanes, const vector<size_t>& slots)
+{
+    return [evalLanes, slots](ScriptSimulator<double>& simulator, const size_t nPaths, Scenario<double>&,
+        auto& eval, vector<double>& res)
+    {
+        const ScenarioBlock<double> block = simulator.scenarioBlock();
+        for (size_t first = 0; first < nPaths; first += eval.width())
+        {
+            const ScenarioBlock<double> lanes = block.subBlock(first, min(eval.width(), nPaths - first));
+            evalLanes(lanes, eval);
+
+            //  Sum lanes in path order, same results as path by path
+            for (size_t v = 0; v<res.size(); ++v)
+            {
+                const double* vals = eval.varVals(slots[v]);
+                for (size_t l = 0; l<lanes.numPaths; ++l)
+                {
+                    res[v] += vals[l];
+                }
+            }
+        }
+    };
+}
+
+//  Monte-Carlo valuation of a pre-processed product, serial or parallel
+//  Each batch of paths accumulates its own results, then batches are reduced in order,
+//      hence results are bit-identical whatever the number of threads, including serial
+//  In parallel, tasks are spawned on the thread pool, each one with its own copy of 
+//      the model, random generator, scenario and evaluator, 
+//      and they pick batches in order from a shared counter
+//  The random generator must implement skipAhead() for parallel simulations
+//  With brownianBridge, Gaussian numbers are fed to the model in Brownian bridge order
+//  EVAL is the evaluator type (Evaluator, FuzzyEvaluator, BatchEvaluator or EvalState)
+//  evalBlock( simulator, nPaths, scen, eval, res) evaluates the product 
+//      in the last block of nPaths scenarios simulated by simulator
+//      and adds the outputs, summed over the paths in order, into res
+//      scen is a work scenario for path by path evaluation, see evalByPath()
+//  PRD is Product or ProductImage
+template <class PRD, class EVAL, class EVALBLOCK>
+inline void scriptMcSimul(
+    const PRD&              prd,
+    const Model<double>&    model,      //  Not initialized, cloned for each task
+    const RandomGen&        random,     //  Not initialized, cloned for each task
+    const size_t            numSim,
+    const bool              parallel,
+    const bool              brownianBridge,
+    const EVAL&             eval,       //  Cloned for each task
+    EVALBLOCK               evalBlock,
+    //  Results, must be sized to the number of outputs
+    vector<double>&         varVals)
+{
+    const size_t nVar = varVals.size();
+    const size_t nBatch = (numSim + BATCHSIZE - 1) / BATCHSIZE;
+
+    //  Results per batch
+    vector<vector<double>> batchVals(nBatch, vector<double>(nVar, 0.0));
+
+    //  Number of tasks, the main thread runs task 0
+    ThreadPool* pool = ThreadPool::getInstance();
+    if (parallel) pool->start();
+    const size_t nTask = parallel ? min(pool->numThreads() + 1, nBatch) : 1;
+
+    //  Next batch to process
+    atomic<size_t> nextBatch(0);
+
+    //  One task: simulates batches in order until all are taken
+    auto task = [&]()
+    {
+        //  Own copies
+        unique_ptr<Model<double>> mdl = model.clone();
+        unique_ptr<RandomGen> rng = random.clone();
+        ScriptSimulator<double> simulator(*mdl, *rng, brownianBridge);
+        simulator.initForScripting(prd.eventDates());
+        unique_ptr<Scenario<double>> scen = prd.template buildScenario<double>();
+        EVAL ev(eval);
+
+        //  Position of the random generator, in number of paths
+        size_t curPath = 0;
+
+        size_t b;
+        while ((b = nextBatch++) < nBatch)
+        {
+            const size_t first = b * BATCHSIZE, last = min(first + BATCHSIZE, numSim);
+
+            //  Skip the paths simulated by other tasks
+            //  Batches are picked in increasing order, so the skip is never negative
+            if (first > curPath) rng->skipAhead(long(first - curPath));
+
+            vector<double>& res = batchVals[b];
+            for (size_t blockFirst = first; blockFirst < last; blockFirst += SIMBLOCKSIZE)
+            {
+                //	Generate next block of scenarios
+                const size_t nPaths = min(size_t(SIMBLOCKSIZE), last - blockFirst);
+                simulator.nextScenarioBlock(nPaths);
+
+                //	Evaluate product and update results
+                evalBlock(simulator, nPaths, *scen, ev, res);
+            }
+
+            curPath = last;
+        }
+
+        return true;
+    };
+
+    //  Spawn tasks 1 to nTask-1 on the pool and run task 0 on this thread
+    vector<TaskHandle> futures;
+    futures.reserve(nTask);
+    for (size_t t = 1; t < nTask; ++t)
+    {
+        futures.push_back(pool->spawnTask(task));
+    }
+    exception_ptr err;
+    try
+    {
+        task();
+    }
+    catch (...)
+    {
+        err = current_exception();
+    }
+
+    //  Wait, help with queued tasks in the meantime
+    //  All tasks must complete before we leave, since they reference local data
+    for (auto& f : futures)
+    {
+        pool->activeWait(f);
+        try
+        {
+            f.get();
+        }
+        catch (...)
+        {
+            if (!err) err = current_exception();
+        }
+    }
+    if (err) rethrow_exception(err);
+
+    //  Reduce in batch order
+    for (const auto& res : batchVals)
+    {
+        for (size_t v = 0; v<nVar; ++v)
+        {
+            varVals[v] += res[v];
+        }
+    }
+}
+
+//  Monte-Carlo valuation of a pre-processed product, dispatches on the evaluation mode
+//  The product must be compiled first for compiled evaluation
+//  Results are the averages of the outputs over the paths, see Product::outputVars()
+inline void scriptMcVal(
+    const Product&          prd,
+    const Model<double>&    model,
+    const RandomGen&        random,
+    const bool              brownianBridge,
+    const size_t            numSim,
+    const bool              parallel,
+    const bool              fuzzy,
+    const size_t            maxNestedIfs,
+    const double            defEps,
+    const bool              compile,
+    vector<double>&         varVals,
+    //  Lane-batched evaluation: SIMD lanes when compiled, 
+    //      lane-batched tree walks otherwise, not (yet) for fuzzy
+    const bool              batch = false)
+{
+    varVals.assign(prd.outputVars().size(), 0.0);
+
+    //  Compiled fuzzy, stack code
+    //  The state holds the variables, then the work space of fuzzy ifs
+    if (compile && fuzzy)
+    {
+        EvalState<double> state(prd.compiledStateSize());
+
+        scriptMcSimul(prd, model, random, numSim, parallel, brownianBridge, state,
+            evalByPath([&prd](const Scenario<double>& scen, EvalState<double>& st) -> const vector<double>&
+        {
+            prd.evaluateCompiled(scen, st);
+            return st.variables;
+        }, prd.outputSlots()),
+            varVals);
+    }
+
+    //  Compiled on SIMD lanes
+    else if (compile && batch)
+    {
+        EvalStateLanes state(prd.compiledStateSize());
+
+        scriptMcSimul(prd, model, random, numSim, parallel, brownianBridge, state,
+            evalByLanes([&prd](const ScenarioBlock<double>& scen, EvalStateLanes& st)
+        {
+            prd.evaluateCompiledBlock(scen, st);
+        }, prd.outputSlots()),
+            varVals);
+    }
+
+    //  Compiled, native code if loaded, else JIT code if compiled, on the register machine otherwise
+    //  The state is the register file, the slots of the variables come first
+    else if (compile)
+    {
+        EvalState<double> state(prd.numRegisters());
+
+        scriptMcSimul(prd, model, random, numSim, parallel, brownianBridge, state,
+            evalByPath([&prd](const Scenario<double>& scen, EvalState<double>& st) -> const vector<double>&
+        {
+            prd.evaluateNative(scen, st);
+            return st.variables;
+        }, prd.outputSlots()),
+            varVals);
+    }
+
+    //  Fuzzy
+    else if (fuzzy)
+    {
+        FuzzyEvaluator<double> eval(prd.varNames().size(), maxNestedIfs, defEps);
+
+        scriptMcSimul(prd, model, random, numSim, parallel, brownianBridge, eval,
+            evalByPath([&prd](const Scenario<double>& scen, FuzzyEvaluator<double>& ev) -> const vector<double>&
+        {
+            prd.evaluate(scen, ev);
+            return ev.varVals();
+        }, prd.outputVars()),
+            varVals);
+    }
+
+    //  Lane-batched evaluator, one tree walk per block of paths
+    else if (batch)
+    {
+        BatchEvaluator<double> eval(prd.varNames().size(), SIMBLOCKSIZE);
+
+        scriptMcSimul(prd, model, random, numSim, parallel, brownianBridge, eval,
+            evalByLanes([&prd](const ScenarioBlock<double>& scen, BatchEvaluator<double>& ev)
+        {
+            prd.evaluateBlock(scen, ev);
+        }, prd.outputVars()),
+            varVals);
+    }
+
+    //  Evaluator
+    else
+    {
+        Evaluator<double> eval(prd.varNames().size());
+
+        scriptMcSimul(prd, model, random, numSim, parallel, brownianBridge, eval,
+            evalByPath([&prd](const Scenario<double>& scen, Evaluator<double>& ev) -> const vector<double>&
+        {
+            prd.evaluate(scen, ev);
+            return ev.varVals();
+        }, prd.outputVars()),
+            varVals);
+    }
+
+    for (auto& v : varVals) v /= numSim;
+}
+
+//  Monte-Carlo valuation of a product image, see scriptingImage.h
+//  Stack code for fuzzy products, register machine otherwise
+//  The image must be written from a product compiled for model, see compileForModel(),
+//      throws if the numeraires folded into its code are not those of the model
+//  Results are the averages of the outputs over the paths, see ProductImage::outputVars()
+inline void imageMcVal(
+    const ProductImage&     img,
+    const Model<double>&    model,
+    const RandomGen&        random,
+    const bool              brownianBridge,
+    const size_t            numSim,
+    const bool              parallel,
+    vector<double>&         varVals)
+{
+    if (img.foldedNumeraires() && img.numeraires() != deterministicNumeraires(model, img.eventDates()))
+    {
+        throw runtime_error("Product image compiled with numeraires other than those of the model");
+    }
+
+    varVals.assign(img.outputVars().size(), 0.0);
+    const vector<size_t> slots = img.outputSlots();
+
+    //  Fuzzy, stack code
+    if (img.compiledFuzzy())
+    {
+        EvalState<double> state(img.compiledStateSize());
+
+        scriptMcSimul(img, model, random, numSim, parallel, brownianBridge, state,
+            evalByPath([&img](const Scenario<double>& scen, EvalState<double>& st) -> const vector<double>&
+        {
+            img.evaluateCompiled(scen, st);
+            return st.variables;
+        }, slots),
+            varVals);
+    }
+
+    //  Register machine
+    else
+    {
+        EvalState<double> state(img.numRegisters());
+
+        scriptMcSimul(img, model, random, numSim, parallel, brownianBridge, state,
+            evalByPath([&img](const Scenario<double>& scen, EvalState<double>& st) -> const vector<double>&
+        {
+            img.evaluateRegisters(scen, st);
+            return st.variables;
+        }, slots),
+            varVals);
+    }
+
+    for (auto& v : varVals) v /= numSim;
+}
+
 inline void simpleBsScriptVal(
 	const Date&				today,
 	const double			spot,
@@ -329,7 +1000,19 @@ inline void simpleBsScriptVal(
     const bool              compile,
 	//	Results
 	vector<string>&			varNames,
-	vector<double>&			varVals)
+	vector<double>&			varVals,
+    //  Multi-threaded, same results as serial
+    const bool              parallel = false,
+    //  Random generator, Sobol uses Brownian bridge and ignores the seed
+    const RanGenType        ranGen = RanGenMrg32k3a,
+    //  Lane-batched evaluation, when not fuzzy
+    const bool              batch = false,
+    //  Native code when compiled, not fuzzy and not batched, 
+    //      from the cache or compiled in the background while JIT code runs
+    const bool              native = false,
+    //  Names of the variables to report, all by default, 
+    //      compiled code only computes what they depend on
+    const vector<string>&   outputs = vector<string>())
 {
 	if( events.begin()->first < today)
 		throw runtime_error("Events in the past are disallowed");
@@ -338,92 +1021,158 @@ inline void simpleBsScriptVal(
 	Product prd;
 	prd.parseEvents( events.begin(), events.end());
 	size_t maxNestedIfs = prd.preProcess( fuzzy, skipDoms);
+    prd.selectOutputs(outputs);
 
-	//	Build scenarios
-	unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
-
-    //  Initialize model and random generator
-    BasicRanGen random(seed);
+    //  Initialize model
+    //  The model and the random generator are cloned and initialized for each simulation task
     unique_ptr<Model<double>> model;
     if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
     else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
 
-    //	Initialize simulator
-    ScriptSimulator<double> simulator(*model, random);
-    simulator.initForScripting(prd.eventDates());
+    if (compile) compileForModel(prd, *model, fuzzy, defEps, outputs);
+    if (compile && native && !fuzzy && !batch)
+    {
+        prd.compileJit();
+        prd.compileNative();
+    }
 
     //	Initialize results
-    varNames = prd.varNames();
-    varVals.resize(varNames.size(), 0.0);
+    varNames.clear();
+    for (const auto var : prd.outputVars()) varNames.push_back(prd.varNames()[var]);
 
-    //  Compiled - not implemented (yet) for fuzzy
-    if (compile)
-    {
-        EvalState<double> state(prd.varNames().size());
-        prd.compile();
+    unique_ptr<RandomGen> random = makeRanGen(ranGen, seed);
+    scriptMcVal(prd, *model, *random, ranGen == RanGenSobol, numSim, parallel, fuzzy, maxNestedIfs, defEps, compile, varVals, batch);
+}
 
-        //	Loop over simulations
-        for (size_t i = 0; i<numSim; ++i)
-        {
-            //	Generate next scenario into scen
-            simulator.nextScenario(*scen);
+//  Replay path number path of a simulation with simpleBsScriptVal,
+//      with the same random generator, by default the same as simpleBsScriptVal
+//  Returns the values of the variables on this path
+inline void simpleBsScriptPathVal(
+    const Date&				today,
+    const double			spot,
+    const double			vol,
+    const double			rate,
+    const bool              normal,     //  true = normal, false = lognormal
+    const map<Date, string>& events,
+    const size_t			path,       //  0 = first path
+    const unsigned			seed,		//	0 = default
+    //	Fuzzy
+    const bool				fuzzy,		//	Use sharp (false) or fuzzy (true) eval
+    const double			defEps,		//	Default epsilon, may be redefined by node
+    const bool				skipDoms,	//	Skip domains (unless fuzzy)
+    //	Results
+    vector<string>&			varNames,
+    vector<double>&			varVals,
+    const RanGenType        ranGen = RanGenMrg32k3a)
+{
+    if (events.begin()->first < today)
+        throw runtime_error("Events in the past are disallowed");
 
-            //	Evaluate product 
-            prd.evaluateCompiled(*scen, state);
-            //	Update results
-            const size_t n = varVals.size();
-            for (size_t v = 0; v<n; ++v)
-            {
-                varVals[v] += state.variables[v];
-            }
-        }
-    }
+    //	Initialize product
+    Product prd;
+    prd.parseEvents(events.begin(), events.end());
+    size_t maxNestedIfs = prd.preProcess(fuzzy, skipDoms);
 
-    //  Fuzzy
-    else if (fuzzy)
-    {
-        FuzzyEvaluator<double> eval = prd.buildFuzzyEvaluator<double>(maxNestedIfs, defEps);
+    //  Initialize model, random generator and simulator
+    unique_ptr<Model<double>> model;
+    if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
+    else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
+    unique_ptr<RandomGen> random = makeRanGen(ranGen, seed);
+    ScriptSimulator<double> simulator(*model, *random, ranGen == RanGenSobol);
+    simulator.initForScripting(prd.eventDates());
 
-        //	Loop over simulations
-        for (size_t i = 0; i<numSim; ++i)
-        {
-            //	Generate next scenario into scen
-            simulator.nextScenario(*scen);
+    //  Generate the scenario for the path
+    unique_ptr<Scenario<double>> scen = prd.buildScenario<double>();
+    simulator.pathScenario(path, *scen);
 
-            //	Evaluate product 
-            prd.evaluate(*scen, eval);
-            //	Update results
-            const size_t n = varVals.size();
-            for (size_t v = 0; v<n; ++v)
-            {
-                varVals[v] += eval.varVals()[v];
-            }
-        }
+    //  Evaluate
+    varNames = prd.varNames();
+    if (fuzzy)
+    {
+        FuzzyEvaluator<double> eval(varNames.size(), maxNestedIfs, defEps);
+        prd.evaluate(*scen, eval);
+        varVals = eval.varVals();
     }
-
-    //  Evaluator
     else
     {
-        Evaluator<double> eval = prd.buildEvaluator<double>();
+        Evaluator<double> eval(varNames.size());
+        prd.evaluate(*scen, eval);
+        varVals = eval.varVals();
+    }
+}
 
-        //	Loop over simulations
-        for (size_t i = 0; i<numSim; ++i)
-        {
-            //	Generate next scenario into scen
-            simulator.nextScenario(*scen);
+//  Randomized quasi Monte-Carlo: numReplicas independent digitally shifted Sobol sequences
+//      of numSim paths each, with Brownian bridge
+//  Returns the average of the replicas and its standard error
+inline void simpleBsScriptValRqmc(
+    const Date&				today,
+    const double			spot,
+    const double			vol,
+    const double			rate,
+    const bool              normal,     //  true = normal, false = lognormal
+    const map<Date, string>& events,
+    const unsigned			numSim,     //  Per replica
+    const unsigned          numReplicas,
+    const unsigned			seed,		//	0 = default, seeds the scrambling
+    //	Fuzzy
+    const bool				fuzzy,		//	Use sharp (false) or fuzzy (true) eval
+    const double			defEps,		//	Default epsilon, may be redefined by node
+    const bool				skipDoms,	//	Skip domains (unless fuzzy)
+    //  Compile?
+    const bool              compile,
+    //	Results
+    vector<string>&			varNames,
+    vector<double>&			varVals,
+    vector<double>&			varErrs,
+    //  Multi-threaded within each replica, same results as serial
+    const bool              parallel = false)
+{
+    if (events.begin()->first < today)
+        throw runtime_error("Events in the past are disallowed");
+    if (numReplicas < 2)
+        throw runtime_error("At least 2 replicas are required for error estimates");
 
-            //	Evaluate product 
-            prd.evaluate(*scen, eval);
-            //	Update results
-            const size_t n = varVals.size();
-            for (size_t v = 0; v<n; ++v)
-            {
-                varVals[v] += eval.varVals()[v];
-            }
+    //	Initialize product
+    Product prd;
+    prd.parseEvents(events.begin(), events.end());
+    size_t maxNestedIfs = prd.preProcess(fuzzy, skipDoms);
+
+    //  Initialize model
+    unique_ptr<Model<double>> model;
+    if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
+    else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
+
+    if (compile) compileForModel(prd, *model, fuzzy, defEps);
+
+    //	Initialize results
+    varNames = prd.varNames();
+    const size_t nVar = varNames.size();
+    varVals.assign(nVar, 0.0);
+    varErrs.assign(nVar, 0.0);
+
+    //  Scrambling seeds of the replicas
+    mt19937 seeder(seed > 0 ? seed : 12345);
+
+    vector<double> repVals;
+    for (size_t r = 0; r < numReplicas; ++r)
+    {
+        Sobol random(unsigned(seeder()) | 1);
+        scriptMcVal(prd, *model, random, true, numSim, parallel, fuzzy, maxNestedIfs, defEps, compile, repVals);
+
+        for (size_t v = 0; v < nVar; ++v)
+        {
+            varVals[v] += repVals[v];
+            varErrs[v] += repVals[v] * repVals[v];
         }
     }
 
-    for (auto& v : varVals) v /= numSim;
+    //  Mean and standard error of the mean
+    for (size_t v = 0; v < nVar; ++v)
+    {
+        varVals[v] /= numReplicas;
+        const double var = (varErrs[v] / numReplicas - varVals[v] * varVals[v]) * numReplicas / (numReplicas - 1);
+        varErrs[v] = var > 0.0 ? sqrt(var / numReplicas) : 0.0;
+    }
 }
 
 //  Hard coded barrier
@@ -442,7 +1191,7 @@ inline void simpleBsBarVal(
     double&                 val)
 {
     //  Initialize model and random generator
-    BasicRanGen random(seed);
+    Mrg32k3a random(seed);
     unique_ptr<Model<double>> model;
     if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
     else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
@@ -454,6 +1203,7 @@ inline void simpleBsBarVal(
     if (mat > barDates.back()) eventDates.push_back(mat);
     vector<double> spots(eventDates.size()), numeraires(eventDates.size());
     simulator.init(eventDates);
+    simulator.deterministicData(spots, numeraires);
 
     //	Loop over simulations
     double res = 0.0;
@@ -491,7 +1241,7 @@ inline void simpleBsAsianVal(
     double&                 val)
 {
     //  Initialize model and random generator
-    BasicRanGen random(seed);
+    Mrg32k3a random(seed);
     unique_ptr<Model<double>> model;
     if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
     else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
@@ -500,6 +1250,7 @@ inline void simpleBsAsianVal(
     MonteCarloSimulator<double> simulator(*model, random);
     vector<double> spots(asDates.size()), numeraires(asDates.size());
     simulator.init(asDates);
+    simulator.deterministicData(spots, numeraires);
 
     //	Loop over simulations
     double res = 0.0;
@@ -529,7 +1280,7 @@ inline void simpleBsCallsVal(
     vector<double>&         vals)
 {
     //  Initialize model and random generator
-    BasicRanGen random(seed);
+    Mrg32k3a random(seed);
     unique_ptr<Model<double>> model;
     if (normal) model.reset(new SimpleBachelier<double>(today, spot, vol, rate));
     else model.reset(new SimpleBlackScholes<double>(today, spot, vol, rate));
@@ -538,6 +1289,7 @@ inline void simpleBsCallsVal(
     MonteCarloSimulator<double> simulator(*model, random);
     vector<double> spots(1), numeraires(1);
     simulator.init(vector<Date>{mat});
+    simulator.deterministicData(spots, numeraires);
 
     //	Loop over simulations
     const size_t nk = strikes.size();
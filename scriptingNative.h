@@ -0,0 +1,646 @@
+#pragma once
+
+//  Native code for compiled scripts
+//  The register code of a product is translated into a C++ translation unit, one straight function for all events,
+//      with registers as local variables and jumps as gotos, so the C++ compiler allocates machine registers,
+//      schedules instructions and removes the dispatch altogether
+//  The source is compiled with the C++ compiler installed on the machine into a shared object, loaded with dlopen
+//  Shared objects are cached on disk, keyed by a SHA-256 digest of the source and the compiler command,
+//      so the compiler runs once per product and machine
+//  The cache is a private directory of the user, and every shared object exports its digest,
+//      checked after loading, so a foreign or stale object is never run
+//  Compilation runs in the background, the register machine is the fallback until the native code is loaded,
+//      with the same results
+//  POSIX only, the native code is never available on Windows
+
+#include "scriptingRegisters.h"
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+
+#ifndef _WIN32
+#include <dlfcn.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char** environ;
+#endif
+
+//  Entry point of the native code
+//  Evaluates one path: event i reads its spot in spots[i * spotStride] and its numeraire in numeraires[i * numStride],
+//      the values of the variables are written in the first nVar entries of vars
+extern "C" typedef void (*NativeFunc)(
+    const double*   spots,
+    const size_t    spotStride,
+    const double*   numeraires,
+    const size_t    numStride,
+    double*         vars);
+
+//  Name of the entry point in the shared object
+#define NATIVEENTRY "evaluatePath"
+//  Name of the digest of the source in the shared object, a null terminated string of 64 hex digits
+#define NATIVEDIGEST "scriptingDigest"
+
+//  Options for native compilation
+struct NativeOptions
+{
+    //  Compiler command and flags, the result must not depend on the flags,
+    //      so no -ffast-math and no contraction into fused multiply-adds
+    //  Split on white space and run without a shell, so no quotes or redirections
+    string  compiler = "c++ -O2 -shared -fPIC -ffp-contract=off -w";
+    //  Directory of the cache, created if necessary,
+    //      defaults to $SCRIPTING_NATIVE_CACHE, or scripting_native in $XDG_CACHE_HOME or ~/.cache
+    //  It must be a directory owned by the user and not writable by group or others, see nativeCacheDir()
+    string  cacheDir;
+    //  Compile in the background, at most NATIVEMAXBUILDS compilations at a time, see NativeBuilds, 
+    //      or wait for the compiler
+    bool    background = true;
+};
+
+//  Print a constant with all its digits
+inline string nativeConst(const double c)
+{
+    if (c != c) return "numeric_limits<double>::quiet_NaN()";
+    if (c == HUGE_VAL) return "numeric_limits<double>::infinity()";
+    if (c == -HUGE_VAL) return "(-numeric_limits<double>::infinity())";
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", c);
+    string s(buf);
+    if (s.find_first_of(".e") == string::npos) s += ".0";
+    return c < 0 ? "(" + s + ")" : s;
+}
+
+//  Generate the C++ source of register code, see compileRegisters()
+//  regEntries are the indices of the first instruction of each event, and the size of the code
+//  nVar is the number of script variables, numRegs the size of the register file
+inline string generateNativeSource(
+    const vector<RegInstr>& code,
+    const vector<size_t>&   regEntries,
+    const size_t            nVar,
+    const size_t            numRegs)
+{
+    //  Jump targets get a label
+    vector<bool> target(code.size() + 1, false);
+    for (const auto& ins : code)
+    {
+        if (regJumps(ins.op)) target[ins.b] = true;
+    }
+
+    ostringstream src;
+    src << "//  Generated by ScriptingCPP from register code, do not edit\n\n"
+        << "#include <cmath>\n#include <cstddef>\n#include <limits>\n\nusing namespace std;\n\n";
+
+    //  Values of the loops, at file scope
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        if (code[i].op != ForNext) continue;
+        src << "static const double loop" << i << "[] = { ";
+        for (int k = 1; k <= code[i].a; ++k)
+        {
+            src << nativeConst(code[i + k].constVal) << (k < code[i].a ? ", " : " ");
+        }
+        if (code[i].a == 0) src << "0.0 ";
+        src << "};\n";
+        i += code[i].a;
+    }
+
+    src << "\nextern \"C\" void " NATIVEENTRY "(\n"
+        << "    const double* spots, const size_t spotStride, const double* numeraires, const size_t numStride, double* vars)\n{\n"
+        << "    double r[" << max<size_t>(numRegs, 1) << "] = {};\n"
+        << "    bool b[" << REGMAXBOOLS << "];\n"
+        << "    int loops[" << REGMAXLOOPS << "];\n"
+        << "    int lTop = -1;\n"
+        << "    double x, y, z, t;\n";
+
+    //  Register and constant operands
+    auto R = [](const int i) { return "r[" + to_string(i) + "]"; };
+    auto B = [](const int i) { return "b[" + to_string(i) + "]"; };
+    auto L = [](const int i) { return "L" + to_string(i); };
+
+    size_t evt = 0;
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        //  Event of the instruction
+        while (evt + 1 < regEntries.size() && regEntries[evt + 1] <= i) ++evt;
+        if (i == regEntries[evt]) src << "\n    //  Event " << evt << "\n";
+
+        const RegInstr& ins = code[i];
+        const string c = nativeConst(ins.constVal), c2 = nativeConst(ins.constVal2);
+        const string spot = "spots[" + to_string(evt) + " * spotStride]";
+        const string num = "numeraires[" + to_string(evt) + " * numStride]";
+
+        if (target[i]) src << L(int(i)) << ":\n";
+        src << "    ";
+
+        switch (ins.op)
+        {
+        case Add:           src << R(ins.dst) << " = " << R(ins.a) << " + " << R(ins.b) << ";"; break;
+        case AddConst:      src << R(ins.dst) << " = " << R(ins.a) << " + " << c << ";"; break;
+        case Sub:           src << R(ins.dst) << " = " << R(ins.a) << " - " << R(ins.b) << ";"; break;
+        case SubConst:      src << R(ins.dst) << " = " << R(ins.a) << " - " << c << ";"; break;
+        case ConstSub:      src << R(ins.dst) << " = " << c << " - " << R(ins.a) << ";"; break;
+        case Mult:          src << R(ins.dst) << " = " << R(ins.a) << " * " << R(ins.b) << ";"; break;
+        case MultConst:     src << R(ins.dst) << " = " << R(ins.a) << " * " << c << ";"; break;
+        case Div:           src << R(ins.dst) << " = " << R(ins.a) << " / " << R(ins.b) << ";"; break;
+        case DivConst:      src << R(ins.dst) << " = " << R(ins.a) << " / " << c << ";"; break;
+        case ConstDiv:      src << R(ins.dst) << " = " << c << " / " << R(ins.a) << ";"; break;
+        case Pow:           src << R(ins.dst) << " = pow(" << R(ins.a) << ", " << R(ins.b) << ");"; break;
+        case PowConst:      src << R(ins.dst) << " = pow(" << R(ins.a) << ", " << c << ");"; break;
+        case ConstPow:      src << R(ins.dst) << " = pow(" << c << ", " << R(ins.a) << ");"; break;
+
+        case Max2:
+            src << "x = " << R(ins.a) << "; y = " << R(ins.b) << "; " << R(ins.dst) << " = y > x ? y : x;"; break;
+        case Max2Const:
+            src << "x = " << R(ins.a) << "; y = " << c << "; " << R(ins.dst) << " = y > x ? y : x;"; break;
+        case Min2:
+            src << "x = " << R(ins.a) << "; y = " << R(ins.b) << "; " << R(ins.dst) << " = y < x ? y : x;"; break;
+        case Min2Const:
+            src << "x = " << R(ins.a) << "; y = " << c << "; " << R(ins.dst) << " = y < x ? y : x;"; break;
+
+        case Spot:          src << R(ins.dst) << " = " << spot << ";"; break;
+        case Assign:        src << R(ins.dst) << " = " << R(ins.a) << ";"; break;
+        case AssignConst:   src << R(ins.dst) << " = " << c << ";"; break;
+        case Pays:          src << R(ins.dst) << " += " << R(ins.a) << " / " << num << ";"; break;
+        case PaysConst:     src << R(ins.dst) << " += " << c << " / " << num << ";"; break;
+        case PaysScaled:    src << R(ins.dst) << " += " << R(ins.a) << " * " << c << ";"; break;
+        case PaysScaledConst: src << R(ins.dst) << " += " << c << ";"; break;
+
+        case If:
+        case AndJump:       src << "if (!" << B(ins.a) << ") goto " << L(ins.b) << ";"; break;
+        case OrJump:        src << "if (" << B(ins.a) << ") goto " << L(ins.b) << ";"; break;
+        case Jump:          src << "goto " << L(ins.b) << ";"; break;
+
+        case ForBegin:      src << "loops[++lTop] = 0;"; break;
+        case ForNext:
+            src << "if (loops[lTop] == " << ins.a << ") { --lTop; goto " << L(ins.b) << "; } "
+                << R(ins.dst) << " = loop" << i << "[loops[lTop]]; ++loops[lTop];";
+            //  Skip the values
+            i += ins.a;
+            break;
+
+        case SmoothBegin:
+            src << "if (" << R(ins.a) << " < -0.5 * " << R(ins.d) << ") goto " << L(ins.b) << ";"; break;
+        case SmoothMid:
+            src << "if (" << R(ins.a) << " > 0.5 * " << R(ins.d) << ") { "
+                << R(ins.dst) << " = " << R(ins.c) << "; goto " << L(ins.b) << "; }"; break;
+
+        case Equal:         src << B(ins.dst) << " = " << R(ins.a) << " == 0;"; break;
+        case Sup:           src << B(ins.dst) << " = " << R(ins.a) << " > 0;"; break;
+        case SupEqual:      src << B(ins.dst) << " = " << R(ins.a) << " >= 0;"; break;
+        case And:           src << B(ins.dst) << " = " << B(ins.a) << " ? " << B(ins.b) << " : " << B(ins.a) << ";"; break;
+        case Or:            src << B(ins.dst) << " = " << B(ins.a) << " ? " << B(ins.a) << " : " << B(ins.b) << ";"; break;
+        case Not:           src << B(ins.dst) << " = !" << B(ins.a) << ";"; break;
+        case True:          src << B(ins.dst) << " = true;"; break;
+        case False:         src << B(ins.dst) << " = false;"; break;
+
+        case Smooth:
+            src << "x = " << R(ins.a) << "; y = 0.5*" << R(ins.d) << "; z = " << R(ins.b) << "; t = " << R(ins.c) << "; "
+                << R(ins.dst) << " = x < -y ? t : x > y ? z : t + 0.5 * (z - t) / y * (x + y);"; break;
+
+        case Sqrt:          src << R(ins.dst) << " = sqrt(" << R(ins.a) << ");"; break;
+        case Log:           src << R(ins.dst) << " = log(" << R(ins.a) << ");"; break;
+        case Uminus:        src << R(ins.dst) << " = -" << R(ins.a) << ";"; break;
+
+        //  Superinstructions
+
+        case SubConstSup:       src << B(ins.dst) << " = " << R(ins.a) << " - " << c << " > 0;"; break;
+        case SubConstSupEqual:  src << B(ins.dst) << " = " << R(ins.a) << " - " << c << " >= 0;"; break;
+        case SubConstEqual:     src << B(ins.dst) << " = " << R(ins.a) << " - " << c << " == 0;"; break;
+        case ConstSubSup:       src << B(ins.dst) << " = " << c << " - " << R(ins.a) << " > 0;"; break;
+        case ConstSubSupEqual:  src << B(ins.dst) << " = " << c << " - " << R(ins.a) << " >= 0;"; break;
+
+        case IfSubConstSup:
+            src << "if (!(" << R(ins.a) << " - " << c << " > 0)) goto " << L(ins.b) << ";"; break;
+        case IfSubConstSupEqual:
+            src << "if (!(" << R(ins.a) << " - " << c << " >= 0)) goto " << L(ins.b) << ";"; break;
+        case IfSubConstEqual:
+            src << "if (!(" << R(ins.a) << " - " << c << " == 0)) goto " << L(ins.b) << ";"; break;
+        case IfConstSubSup:
+            src << "if (!(" << c << " - " << R(ins.a) << " > 0)) goto " << L(ins.b) << ";"; break;
+        case IfConstSubSupEqual:
+            src << "if (!(" << c << " - " << R(ins.a) << " >= 0)) goto " << L(ins.b) << ";"; break;
+        case IfAnd:
+            src << "if (!" << B(ins.a) << " || !" << B(ins.d) << ") goto " << L(ins.b) << ";"; break;
+
+        case DivConstAdd:
+            src << R(ins.dst) << " = " << R(ins.b) << " + " << R(ins.a) << " / " << c << ";"; break;
+        case MultConstDivConst:
+            src << R(ins.dst) << " = " << R(ins.a) << " * " << c << " / " << c2 << ";"; break;
+        case SubConstMax2:
+            src << "x = " << R(ins.b) << "; y = " << R(ins.a) << " - " << c << "; " << R(ins.dst) << " = y > x ? y : x;"; break;
+        case SubConstMax2Const:
+            src << "x = " << R(ins.a) << " - " << c << "; y = " << c2 << "; " << R(ins.dst) << " = y > x ? y : x;"; break;
+        case MultConstPaysScaled:
+            src << R(ins.dst) << " += " << R(ins.a) << " * " << c << " * " << c2 << ";"; break;
+
+        //  End of the event, fall through to the next one
+        case Halt:          src << ";"; break;
+
+        default:
+            throw runtime_error("Unexpected instruction in register code");
+        }
+
+        src << "\n";
+    }
+
+    //  Jumps to the end of the code
+    if (target[code.size()]) src << L(int(code.size())) << ":;\n";
+
+    //  Variables out
+    src << "\n    for (size_t i = 0; i < " << nVar << "; ++i) vars[i] = r[i];\n}\n";
+
+    return src.str();
+}
+
+//  SHA-256 digest of a string, in 64 hex digits, for the keys of the cache
+inline string nativeDigest(const string& s)
+{
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    auto rot = [](const uint32_t x, const int n) { return (x >> n) | (x << (32 - n)); };
+
+    //  Message padded with 0x80, zeros and the length in bits, big endian, to a multiple of 64 bytes
+    string msg = s;
+    msg += char(0x80);
+    while (msg.size() % 64 != 56) msg += char(0);
+    const uint64_t bits = uint64_t(s.size()) * 8;
+    for (int i = 7; i >= 0; --i) msg += char((bits >> (8 * i)) & 0xff);
+
+    for (size_t blk = 0; blk < msg.size(); blk += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(msg.data() + blk + 4 * i);
+            w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            const uint32_t s0 = rot(w[i - 15], 7) ^ rot(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const uint32_t s1 = rot(w[i - 2], 17) ^ rot(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            const uint32_t t1 = hh + (rot(e, 6) ^ rot(e, 11) ^ rot(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            const uint32_t t2 = (rot(a, 2) ^ rot(a, 13) ^ rot(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+
+    char hex[65];
+    for (int i = 0; i < 8; ++i) snprintf(hex + 8 * i, 9, "%08x", h[i]);
+    return string(hex, 64);
+}
+
+#ifndef _WIN32
+
+//  Directory of the cache, see NativeOptions::cacheDir
+//  Created with mode 0700 if necessary, then only used if it is a directory (not a link) owned by the user,
+//      that group and others cannot write to, so no other user can plant a shared object there
+//  Returns false with the reason in error otherwise
+inline bool nativeCacheDir(const string& cacheDir, string& dir, string& error)
+{
+    dir = cacheDir;
+    if (dir.empty())
+    {
+        const char* env = getenv("SCRIPTING_NATIVE_CACHE");
+        if (env && *env) dir = env;
+    }
+    if (dir.empty())
+    {
+        //  Per user cache, its parent is created too, private as well
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        string parent;
+        if (xdg && *xdg) parent = xdg;
+        else if (home && *home) parent = string(home) + "/.cache";
+        else
+        {
+            error = "No cache directory for native code: HOME is not set";
+            return false;
+        }
+        mkdir(parent.c_str(), 0700);
+        dir = parent + "/scripting_native";
+    }
+
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+    {
+        error = "Cannot create the cache directory " + dir + ": " + strerror(errno);
+        return false;
+    }
+
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0)
+    {
+        error = "Cannot stat the cache directory " + dir + ": " + strerror(errno);
+        return false;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        error = "Unsafe cache directory " + dir + ": must be a directory owned by the user, not writable by group or others";
+        return false;
+    }
+
+    return true;
+}
+
+#endif
+
+//  Native code of a product
+//  The entry point is null until the shared object is loaded,
+//      and remains null if the compiler is not available or fails
+class NativeCode
+{
+    atomic<NativeFunc>  myFunc;
+    void*               myHandle = nullptr;
+    atomic<bool>        myDone;
+    //  Why the native code is not available, written before myDone is set
+    string              myError;
+    //  Signal the end of compilation to wait()
+    mutable mutex               myMutex;
+    mutable condition_variable  myCV;
+
+    //  Compilation is over, error is empty if the native code is loaded
+    void finish(const string& error)
+    {
+        {
+            lock_guard<mutex> lk(myMutex);
+            myError = error;
+            myDone.store(true, memory_order_release);
+        }
+        myCV.notify_all();
+    }
+
+public:
+
+    NativeCode() : myFunc(nullptr), myDone(false) {}
+
+    ~NativeCode()
+    {
+#ifndef _WIN32
+        if (myHandle) dlclose(myHandle);
+#endif
+    }
+
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    //  Entry point, or null when not (yet) available
+    NativeFunc function() const
+    {
+        return myFunc.load(memory_order_acquire);
+    }
+
+    //  Whether compilation is over, successfully or not
+    bool done() const
+    {
+        return myDone.load(memory_order_acquire) || function();
+    }
+
+    //  Why the native code is not available, with the output of the compiler if it failed,
+    //      empty while compiling or when loaded
+    string error() const
+    {
+        return myDone.load(memory_order_acquire) ? myError : string();
+    }
+
+    //  Wait until compilation is over, successfully or not
+    void wait() const
+    {
+        unique_lock<mutex> lk(myMutex);
+        myCV.wait(lk, [this]() { return done(); });
+    }
+
+    //  Give up on native code
+    void fail(const string& error)
+    {
+        finish(error);
+    }
+
+    //  Load a shared object, returns false if it cannot be loaded or if it was not built from the source with digest
+    bool load(const string& path, const string& digest)
+    {
+#ifndef _WIN32
+        void* handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle) return false;
+        NativeFunc func = reinterpret_cast<NativeFunc>(dlsym(handle, NATIVEENTRY));
+        const char* objDigest = static_cast<const char*>(dlsym(handle, NATIVEDIGEST));
+        if (!func || !objDigest || strncmp(objDigest, digest.c_str(), digest.size() + 1) != 0)
+        {
+            dlclose(handle);
+            return false;
+        }
+        myHandle = handle;
+        myFunc.store(func, memory_order_release);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    //  Compile source into the shared object path, then load it
+    //  The compiler runs without a shell, its output is reported by error() if it fails
+    void build(const string& source, const string& digest, const string& path, const string& compiler)
+    {
+#ifndef _WIN32
+        //  Write the source and compile into a temporary file, renamed when complete,
+        //      so concurrent builds of the same product never load a partial object
+        const string tag = path + "." + to_string(getpid()) + "." + to_string(hash<thread::id>()(this_thread::get_id()));
+        const string srcPath = tag + ".cpp", tmpPath = tag + ".tmp", errPath = tag + ".err";
+        {
+            ofstream ofs(srcPath);
+            ofs << source;
+        }
+
+        //  Arguments: the words of the compiler command, then output and source
+        vector<string> args;
+        istringstream words(compiler);
+        for (string word; words >> word;) args.push_back(word);
+        args.push_back("-o");
+        args.push_back(tmpPath);
+        args.push_back(srcPath);
+        vector<char*> argv;
+        for (auto& arg : args) argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+
+        //  Output of the compiler into a file
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, errPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+        string error;
+        pid_t pid;
+        const int spawned = args.size() > 3 
+            ? posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) 
+            : EINVAL;
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (spawned != 0)
+        {
+            error = "Cannot run the compiler " + compiler + ": " + strerror(spawned);
+        }
+        else
+        {
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                ifstream ifs(errPath);
+                ostringstream out;
+                out << ifs.rdbuf();
+                error = "Native compilation failed: " + compiler + "\n" + out.str();
+            }
+            else if (rename(tmpPath.c_str(), path.c_str()) != 0)
+            {
+                error = "Cannot write " + path + ": " + strerror(errno);
+            }
+            else if (!load(path, digest))
+            {
+                const char* dlerr = dlerror();
+                error = "Cannot load " + path + (dlerr ? string(": ") + dlerr : string());
+            }
+        }
+
+        remove(srcPath.c_str());
+        remove(tmpPath.c_str());
+        remove(errPath.c_str());
+
+        finish(error);
+#else
+        finish("Native code is not available on Windows");
+#endif
+    }
+};
+
+//  Maximum number of native compilations running at the same time in the background
+#define NATIVEMAXBUILDS 2
+
+//  Queue of the background compilations, run by at most NATIVEMAXBUILDS worker threads,
+//      started when builds are queued and ended when the queue is empty
+//  The instance is never destroyed, the workers are detached and may outlive static destruction
+class NativeBuilds
+{
+    mutex                       myMutex;
+    deque<function<void()>>     myQueue;
+    size_t                      myNumWorkers = 0;
+
+    NativeBuilds() {}
+
+    //  Run the queued builds until the queue is empty
+    void work()
+    {
+        unique_lock<mutex> lk(myMutex);
+        while (!myQueue.empty())
+        {
+            function<void()> build = move(myQueue.front());
+            myQueue.pop_front();
+            lk.unlock();
+            build();
+            lk.lock();
+        }
+        --myNumWorkers;
+    }
+
+public:
+
+    static NativeBuilds& instance()
+    {
+        static NativeBuilds* builds = new NativeBuilds;
+        return *builds;
+    }
+
+    NativeBuilds(const NativeBuilds&) = delete;
+    NativeBuilds& operator=(const NativeBuilds&) = delete;
+
+    //  Queue a build, and start a worker if fewer than NATIVEMAXBUILDS are running
+    void push(function<void()> build)
+    {
+        lock_guard<mutex> lk(myMutex);
+        myQueue.push_back(move(build));
+        if (myNumWorkers < NATIVEMAXBUILDS)
+        {
+            ++myNumWorkers;
+            thread([this]() { work(); }).detach();
+        }
+    }
+};
+
+//  Native code for register code, see generateNativeSource()
+//  Loaded from the cache immediately when available,
+//      otherwise compiled in the background, see NativeBuilds, or not, as per the options
+inline shared_ptr<NativeCode> compileNative(
+    const vector<RegInstr>& code,
+    const vector<size_t>&   regEntries,
+    const size_t            nVar,
+    const size_t            numRegs,
+    const NativeOptions&    options = NativeOptions())
+{
+    auto native = make_shared<NativeCode>();
+
+#ifndef _WIN32
+    string dir, error;
+    if (!nativeCacheDir(options.cacheDir, dir, error))
+    {
+        native->fail(error);
+        return native;
+    }
+
+    //  Key: digest of the compiler command and the source, exported by the shared object
+    string source = generateNativeSource(code, regEntries, nVar, numRegs);
+    const string digest = nativeDigest(options.compiler + "\n" + source);
+    source += "\nextern \"C\" const char " NATIVEDIGEST "[] = \"" + digest + "\";\n";
+    const string path = dir + "/scr_" + digest + ".so";
+
+    //  Cached
+    if (native->load(path, digest)) return native;
+
+    //  Compile
+    const string compiler = options.compiler;
+    if (options.background)
+    {
+        NativeBuilds::instance().push([native, source, digest, path, compiler]() { native->build(source, digest, path, compiler); });
+    }
+    else
+    {
+        native->build(source, digest, path, compiler);
+    }
+#else
+    native->fail("Native code is not available on Windows");
+#endif
+
+    return native;
+}
@@ -22,6 +22,7 @@ using namespace std;
 #include <memory>
 
 #include "scriptingVisitor.h"
+#include "scriptingArena.h"
 
 //  Typedefs
 
@@ -30,6 +31,8 @@ using ExprTree = unique_ptr<Node>;
 using Expression = ExprTree;
 using Statement = ExprTree;
 using Event = vector<Statement>;
+//  Arguments of a node, in the same arena as the node, see scriptingArena.h
+using Arguments = vector<ExprTree, NodeAllocator<ExprTree>>;
 
 //	Base nodes
 
@@ -37,9 +40,19 @@ struct Node : VisitableBase<VISITORS>
 {
     using VisitableBase<VISITORS>::accept;
 
-	vector<ExprTree>	arguments;
+	Arguments			arguments;
 
     virtual ~Node() {}
+
+    //  Nodes are allocated in the current arena, if any, see NodeArena
+    static void* operator new(const size_t size)
+    {
+        return NodeArena::allocate(size);
+    }
+    static void operator delete(void* p)
+    {
+        NodeArena::deallocate(p);
+    }
 };
 
 //  Hierarchy
@@ -203,6 +216,7 @@ Concrete* downcast(unique_ptr<Node>& node)
 }
 
 //  Factories
+//  Nodes are allocated in the current arena of the thread, if any, see NodeArena
 
 //  Make concrete node
 template <typename ConcreteNode, typename... Args>
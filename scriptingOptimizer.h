@@ -0,0 +1,1024 @@
+#pragma once
+
+//  Dataflow optimization of compiled programs, see CompiledProgram in scriptingCompiler.h
+//  The Compiler translates statements one by one, the optimizer rewrites the linked program after compilation:
+//      constant and copy propagation: reads of variables known to hold a constant, or the value of another variable,
+//          read the constant or the other variable instead, all variables are 0 at the start of the program,
+//      folding: constants next to their operations fold into the constant forms of the operations,
+//      dead store elimination: assignments and payments to variables that are not read afterwards on any path,
+//          and are not outputs, are removed with the computation of their values,
+//          values stored and read back right away, like common subexpressions, stay on the stack instead
+//  After optimization, the variables are allocated to the slots of the state, see allocateSlots()
+//  Variables persist across events: the analysis runs over the whole program,
+//      and the outputs are read after the last event
+//  The outputs have the same values as with the original code, the other variables may not
+//  Sharp code only, fuzzy code is left as is
+
+#include "scriptingCompiler.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+using namespace std;
+
+//  Number of words of the instruction at position i of a sharp compiled node stream
+inline size_t compiledLength(const int* nodeStream, const size_t i)
+{
+    switch (nodeStream[i])
+    {
+    case AddConst:
+    case SubConst:
+    case ConstSub:
+    case MultConst:
+    case DivConst:
+    case ConstDiv:
+    case PowConst:
+    case ConstPow:
+    case Max2Const:
+    case Min2Const:
+    case Var:
+    case Const:
+    case Assign:
+    case Pays:
+    case If:
+    case Jump:
+    case AndJump:
+    case OrJump:
+    case SmoothBegin:
+    case SmoothMid:
+        return 2;
+    case AssignConst:
+    case PaysConst:
+    case PaysScaled:
+    case PaysScaledConst:
+    case IfElse:
+        return 3;
+    case ForNext:
+        return 5;
+    default:
+        return 1;
+    }
+}
+
+//  Effect of an instruction on the data stack, on its fall-through path, see Compiler::track()
+inline int compiledDataEffect(const int op)
+{
+    switch (op)
+    {
+    case Spot:
+    case Var:
+    case Const:
+        return 1;
+    case Add:
+    case Sub:
+    case Mult:
+    case Div:
+    case Pow:
+    case Max2:
+    case Min2:
+    case Assign:
+    case Pays:
+    case PaysScaled:
+    case Equal:
+    case Sup:
+    case SupEqual:
+        return -1;
+    case Smooth:
+    case SmoothEnd:
+        return -3;
+    default:
+        return 0;
+    }
+}
+
+//  Maximum depths of the stacks in the code of every event of a program,
+//      as computed by the Compiler, for code rewritten after compilation
+inline vector<StackDepths> compiledDepths(const CompiledProgram& prg)
+{
+    const int* code = prg.nodeStream.data();
+    const size_t n = prg.nodeStream.size();
+
+    //  IfElse pops its condition at the end of its if-true statements
+    vector<int> boolPops(n + 1, 0);
+
+    vector<StackDepths> depths(prg.numEvents());
+    StackDepths depth;
+    size_t evt = 0;
+    for (size_t i = 0; i < n; i += compiledLength(code, i))
+    {
+        while (evt + 1 < prg.numEvents() && prg.entries[evt + 1] <= i) ++evt;
+        depth.bools -= boolPops[i];
+
+        const int op = code[i];
+        depth.data += compiledDataEffect(op);
+        switch (op)
+        {
+        case Equal:
+        case Sup:
+        case SupEqual:
+        case True:
+        case False:
+            ++depth.bools;
+            break;
+        case And:
+        case Or:
+        case If:
+            --depth.bools;
+            break;
+        case IfElse:
+            ++boolPops[code[i + 1]];
+            break;
+        case ForBegin:
+            ++depth.loops;
+            break;
+        case Jump:
+            --depth.loops;
+            break;
+        }
+        depths[evt].expand(depth);
+    }
+
+    return depths;
+}
+
+//  The optimizer
+//  Instructions are grouped into basic blocks,
+//      facts are propagated forward and liveness backward between blocks, to a fixed point,
+//      then the code is rewritten, and the whole process is repeated until nothing changes
+class CompiledOptimizer
+{
+    CompiledProgram&        myProgram;
+    const size_t            myNumVars;
+    //  Variables read after the program
+    vector<bool>            myOutputs;
+
+    //  Current code
+    size_t                  myN;
+    const int*              myCode;
+
+    //  Instruction starts, in order, and whether a position is one
+    vector<size_t>          myStarts;
+    vector<bool>            myIsStart;
+
+    //  Depth of the data stack before every instruction,
+    //      and start of the statement of every instruction, where the depth was last 0
+    vector<int>             myDepthBefore;
+    vector<size_t>          myStatement;
+
+    //  IfElse at k with if-true statements ending at lastTrue and if-false statements ending at lastFalse:
+    //      positions lastTrue reached from the if-true statements continue at lastFalse, see evalCompiled()
+    struct Redirect
+    {
+        size_t  ifElse;
+        size_t  lastFalse;
+    };
+    vector<vector<Redirect>> myRedirects;
+
+    //  Basic blocks: first instruction, end, successors, the number of blocks for the exit
+    vector<size_t>          myBlockStart;
+    vector<size_t>          myBlockEnd;
+    vector<vector<size_t>>  mySuccs;
+    //  Block of every instruction start
+    vector<size_t>          myBlockOf;
+
+    //  Facts on variables, by block on entry:
+    //      NAC when unknown, a variable index for a copy of that variable, -2 - i for the constant i
+    enum { NAC = -1 };
+    vector<vector<int>>     myFactsIn;
+    vector<bool>            myReached;
+    size_t                  myZeroConst;
+
+    //  Live variables, by block on entry, as bit sets
+    size_t                  myWords;
+    vector<vector<uint64_t>> myLiveIn;
+    //  Live on exit of the program: the outputs
+    vector<uint64_t>        myExitLive;
+
+    //  Edits: deleted instructions, and replacements of the instructions from a start to an end, 0 if none
+    vector<bool>            myDeleted;
+    struct Replacement
+    {
+        size_t      end;
+        vector<int> words;
+    };
+    vector<Replacement>     myReplacements;
+
+    //  Successor of the instruction at from, at position to, through the redirections of IfElse
+    size_t resolve(const size_t from, size_t to) const
+    {
+        bool redirected = true;
+        while (redirected && to < myN)
+        {
+            redirected = false;
+            for (const auto& r : myRedirects[to])
+            {
+                if (r.ifElse < from && from < to && r.lastFalse != to)
+                {
+                    to = r.lastFalse;
+                    redirected = true;
+                    break;
+                }
+            }
+        }
+        return to;
+    }
+
+    //  Successors of the instruction at i
+    vector<size_t> successors(const size_t i) const
+    {
+        const int op = myCode[i];
+        const size_t next = i + compiledLength(myCode, i);
+
+        switch (op)
+        {
+        case If:
+        case AndJump:
+        case OrJump:
+        case SmoothBegin:
+        case SmoothMid:
+            return { resolve(i, next), resolve(i, size_t(myCode[i + 1])) };
+        case IfElse:
+            //  Empty if-true statements continue after the if-false statements
+            return { size_t(myCode[i + 1]) == next ? resolve(i, size_t(myCode[i + 2])) : next, size_t(myCode[i + 1]) };
+        case ForNext:
+            return { resolve(i, next), resolve(i, size_t(myCode[i + 4])) };
+        case Jump:
+            return { resolve(i, size_t(myCode[i + 1])) };
+        default:
+            return { resolve(i, next) };
+        }
+    }
+
+    static bool isBranch(const int op)
+    {
+        return op == If || op == IfElse || op == Jump || op == AndJump || op == OrJump
+            || op == SmoothBegin || op == SmoothMid || op == ForNext;
+    }
+
+    //  Variable written by a store, -1 if not a store
+    int storedVar(const size_t i) const
+    {
+        switch (myCode[i])
+        {
+        case Assign:
+        case Pays:
+            return myCode[i + 1];
+        case AssignConst:
+        case PaysConst:
+        case PaysScaled:
+        case PaysScaledConst:
+            return myCode[i + 2];
+        default:
+            return -1;
+        }
+    }
+
+    //  Decode the code, find the blocks
+    void analyzeCode()
+    {
+        myN = myProgram.nodeStream.size();
+        myCode = myProgram.nodeStream.data();
+
+        myStarts.clear();
+        myIsStart.assign(myN + 1, false);
+        myDepthBefore.assign(myN + 1, 0);
+        myStatement.assign(myN + 1, 0);
+        myRedirects.assign(myN + 1, vector<Redirect>());
+
+        int depth = 0;
+        size_t statement = 0;
+        for (size_t i = 0; i < myN; i += compiledLength(myCode, i))
+        {
+            myStarts.push_back(i);
+            myIsStart[i] = true;
+            if (depth == 0) statement = i;
+            myDepthBefore[i] = depth;
+            myStatement[i] = statement;
+            depth += compiledDataEffect(myCode[i]);
+            if (myCode[i] == IfElse) myRedirects[myCode[i + 1]].push_back({ i, size_t(myCode[i + 2]) });
+        }
+        myIsStart[myN] = true;
+
+        //  Leaders
+        vector<bool> leader(myN + 1, false);
+        leader[0] = true;
+        for (const auto e : myProgram.entries) leader[e] = true;
+        for (const auto i : myStarts)
+        {
+            if (!myRedirects[i].empty()) leader[i] = true;
+            if (myCode[i] == IfElse) leader[myCode[i + 2]] = true;
+            if (isBranch(myCode[i]))
+            {
+                leader[i + compiledLength(myCode, i)] = true;
+                for (const auto s : successors(i)) leader[s] = true;
+            }
+        }
+
+        //  Blocks
+        myBlockStart.clear();
+        myBlockEnd.clear();
+        myBlockOf.assign(myN + 1, 0);
+        for (const auto i : myStarts)
+        {
+            if (leader[i])
+            {
+                if (!myBlockStart.empty()) myBlockEnd.push_back(i);
+                myBlockStart.push_back(i);
+            }
+            myBlockOf[i] = myBlockStart.size() - 1;
+        }
+        if (!myBlockStart.empty()) myBlockEnd.push_back(myN);
+        const size_t nBlocks = myBlockStart.size();
+        myBlockOf[myN] = nBlocks;
+
+        mySuccs.assign(nBlocks, vector<size_t>());
+        for (size_t b = 0; b < nBlocks; ++b)
+        {
+            size_t last = myBlockStart[b];
+            for (size_t i = last; i < myBlockEnd[b]; i += compiledLength(myCode, i)) last = i;
+            for (const auto s : successors(last)) mySuccs[b].push_back(myBlockOf[s]);
+        }
+    }
+
+    //  Facts
+
+    void setFact(vector<int>& facts, const int var, const int fact) const
+    {
+        //  Copy of itself: unchanged
+        if (fact == var) return;
+        for (auto& f : facts) if (f == var) f = NAC;
+        facts[var] = fact;
+    }
+
+    //  Apply the instruction at i to the facts, rewrite reads if rewrite is true
+    void transferFacts(const size_t i, vector<int>& facts, const bool rewrite)
+    {
+        int* code = myProgram.nodeStream.data();
+        const int var = storedVar(i);
+
+        switch (myCode[i])
+        {
+        case Var:
+            if (rewrite)
+            {
+                const int f = facts[myCode[i + 1]];
+                if (f >= 0) code[i + 1] = f;
+                else if (f != NAC)
+                {
+                    const size_t c = size_t(-2 - f);
+                    if (c == myProgram.constStream.size()) myProgram.constStream.push_back(0.0);
+                    code[i] = Const;
+                    code[i + 1] = int(c);
+                }
+            }
+            break;
+        case Assign:
+        {
+            //  Copy, or constant after propagation
+            const size_t prev = i >= 2 && myIsStart[i - 2] && myBlockOf[i - 2] == myBlockOf[i] ? i - 2 : myN;
+            if (prev < myN && myDepthBefore[prev] == 0 && myCode[prev] == Var)
+            {
+                const int src = myCode[prev + 1];
+                setFact(facts, var, facts[src] == NAC ? src : facts[src]);
+            }
+            else if (prev < myN && myDepthBefore[prev] == 0 && myCode[prev] == Const)
+            {
+                setFact(facts, var, -2 - myCode[prev + 1]);
+            }
+            else setFact(facts, var, NAC);
+            break;
+        }
+        case AssignConst:
+            setFact(facts, var, -2 - myCode[i + 1]);
+            break;
+        case ForNext:
+            setFact(facts, myCode[i + 1], NAC);
+            break;
+        default:
+            if (var >= 0) setFact(facts, var, NAC);
+            break;
+        }
+    }
+
+    //  Forward propagation of facts to a fixed point, then rewrite of the reads
+    void propagate()
+    {
+        const size_t nBlocks = myBlockStart.size();
+        myFactsIn.assign(nBlocks, vector<int>());
+        myReached.assign(nBlocks, false);
+        if (!nBlocks) return;
+
+        myFactsIn[0].assign(myNumVars, -2 - int(myZeroConst));
+        myReached[0] = true;
+
+        vector<size_t> work(1, 0);
+        vector<bool> queued(nBlocks, false);
+        queued[0] = true;
+        vector<int> facts;
+        while (!work.empty())
+        {
+            const size_t b = work.back();
+            work.pop_back();
+            queued[b] = false;
+
+            facts = myFactsIn[b];
+            for (size_t i = myBlockStart[b]; i < myBlockEnd[b]; i += compiledLength(myCode, i)) transferFacts(i, facts, false);
+
+            for (const auto s : mySuccs[b])
+            {
+                if (s >= nBlocks) continue;
+                bool changed = false;
+                if (!myReached[s])
+                {
+                    myFactsIn[s] = facts;
+                    myReached[s] = true;
+                    changed = true;
+                }
+                else
+                {
+                    for (size_t v = 0; v < myNumVars; ++v)
+                    {
+                        if (myFactsIn[s][v] != NAC && myFactsIn[s][v] != facts[v])
+                        {
+                            myFactsIn[s][v] = NAC;
+                            changed = true;
+                        }
+                    }
+                }
+                if (changed && !queued[s])
+                {
+                    work.push_back(s);
+                    queued[s] = true;
+                }
+            }
+        }
+
+        for (size_t b = 0; b < nBlocks; ++b)
+        {
+            if (!myReached[b]) continue;
+            facts = myFactsIn[b];
+            for (size_t i = myBlockStart[b]; i < myBlockEnd[b]; i += compiledLength(myCode, i)) transferFacts(i, facts, true);
+        }
+    }
+
+    //  Liveness
+
+    bool isLive(const vector<uint64_t>& live, const int var) const
+    {
+        return (live[var >> 6] >> (var & 63)) & 1;
+    }
+    void setLive(vector<uint64_t>& live, const int var, const bool on) const
+    {
+        if (on) live[var >> 6] |= uint64_t(1) << (var & 63);
+        else live[var >> 6] &= ~(uint64_t(1) << (var & 63));
+    }
+
+    //  Live variables on exit of block b
+    vector<uint64_t> liveOut(const size_t b) const
+    {
+        vector<uint64_t> live(myWords, 0);
+        const size_t nBlocks = myBlockStart.size();
+        const size_t last = lastInstr(b);
+
+        for (size_t k = 0; k < mySuccs[b].size(); ++k)
+        {
+            const size_t s = mySuccs[b][k];
+            const vector<uint64_t>& in = s < nBlocks ? myLiveIn[s] : myExitLive;
+            if (myCode[last] == ForNext && k == 0)
+            {
+                //  The loop variable is assigned before the body
+                vector<uint64_t> body = in;
+                setLive(body, myCode[last + 1], false);
+                for (size_t w = 0; w < myWords; ++w) live[w] |= body[w];
+            }
+            else for (size_t w = 0; w < myWords; ++w) live[w] |= in[w];
+        }
+        return live;
+    }
+
+    size_t lastInstr(const size_t b) const
+    {
+        size_t last = myBlockStart[b];
+        for (size_t i = last; i < myBlockEnd[b]; i += compiledLength(myCode, i)) last = i;
+        return last;
+    }
+
+    //  Backward transfer of the instruction at i, unless deleted
+    void transferLive(const size_t i, vector<uint64_t>& live) const
+    {
+        if (myDeleted[i]) return;
+        const int var = storedVar(i);
+        switch (myCode[i])
+        {
+        case Var:
+            setLive(live, myCode[i + 1], true);
+            break;
+        case Assign:
+        case AssignConst:
+            setLive(live, var, false);
+            break;
+        default:
+            //  Payments read the variable
+            if (var >= 0) setLive(live, var, true);
+            break;
+        }
+    }
+
+    //  Whether the store at i ends a statement, as opposed to a value kept within an expression
+    bool isStatement(const size_t i) const
+    {
+        const int op = myCode[i];
+        return myDepthBefore[i] == (op == Assign || op == Pays || op == PaysScaled ? 1 : 0);
+    }
+
+    //  Backward liveness to a fixed point
+    void computeLiveness()
+    {
+        const size_t nBlocks = myBlockStart.size();
+        myWords = (myNumVars + 63) / 64;
+        myExitLive.assign(myWords, 0);
+        for (size_t v = 0; v < myNumVars; ++v) if (myOutputs[v]) setLive(myExitLive, int(v), true);
+        myLiveIn.assign(nBlocks, vector<uint64_t>(myWords, 0));
+
+        vector<size_t> instrs;
+        bool changed = true;
+        while (changed)
+        {
+            changed = false;
+            for (size_t b = nBlocks; b-- > 0;)
+            {
+                vector<uint64_t> live = liveOut(b);
+                instrs.clear();
+                for (size_t i = myBlockStart[b]; i < myBlockEnd[b]; i += compiledLength(myCode, i)) instrs.push_back(i);
+                for (size_t k = instrs.size(); k-- > 0;) transferLive(instrs[k], live);
+                if (live != myLiveIn[b])
+                {
+                    myLiveIn[b] = live;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    //  Liveness, then deletion of dead stores
+    bool eliminate()
+    {
+        computeLiveness();
+
+        const size_t nBlocks = myBlockStart.size();
+        vector<size_t> instrs;
+
+        //  Dead stores, with the computation of their values
+        bool deleted = false;
+        for (size_t b = 0; b < nBlocks; ++b)
+        {
+            if (!myReached[b]) continue;
+            vector<uint64_t> live = liveOut(b);
+            instrs.clear();
+            for (size_t i = myBlockStart[b]; i < myBlockEnd[b]; i += compiledLength(myCode, i)) instrs.push_back(i);
+            for (size_t k = instrs.size(); k-- > 0;)
+            {
+                const size_t i = instrs[k];
+                const int var = storedVar(i);
+
+                //  Value stored and read back, not read afterwards: left on the stack
+                if (myCode[i] == Var && k > 0 && !myDeleted[i] && !isLive(live, myCode[i + 1]) 
+                    && myCode[instrs[k - 1]] == Assign && myCode[instrs[k - 1] + 1] == myCode[i + 1])
+                {
+                    myDeleted[i] = myDeleted[instrs[k - 1]] = true;
+                    deleted = true;
+                }
+                //  Dead store, with the computation of its value, unless it stores other live values
+                else if (var >= 0 && !myDeleted[i] && !isLive(live, var) && isStatement(i))
+                {
+                    bool storesLive = false;
+                    for (size_t j = myStatement[i]; j < i; j += compiledLength(myCode, j))
+                    {
+                        if (storedVar(j) >= 0 && !myDeleted[j] && isLive(live, storedVar(j))) storesLive = true;
+                    }
+                    if (!storesLive)
+                    {
+                        for (size_t j = myStatement[i]; j <= i; j += compiledLength(myCode, j)) myDeleted[j] = true;
+                        deleted = true;
+                    }
+                }
+                transferLive(i, live);
+            }
+        }
+
+        return deleted;
+    }
+
+    //  Folding of constants into the constant forms of their operations, within blocks
+
+    static int constForm(const int op)
+    {
+        switch (op)
+        {
+        case Add: return AddConst;
+        case Sub: return SubConst;
+        case Mult: return MultConst;
+        case Div: return DivConst;
+        case Pow: return PowConst;
+        case Max2: return Max2Const;
+        case Min2: return Min2Const;
+        default: return -1;
+        }
+    }
+
+    //  Same with the constant on the left
+    static int constLeftForm(const int op)
+    {
+        switch (op)
+        {
+        case Add: return AddConst;
+        case Sub: return ConstSub;
+        case Mult: return MultConst;
+        case Div: return ConstDiv;
+        case Pow: return ConstPow;
+        default: return -1;
+        }
+    }
+
+    //  Instruction at i, not deleted and in the same block as the one at first
+    bool inBlock(const size_t i, const size_t first) const
+    {
+        return i < myN && myIsStart[i] && !myDeleted[i] && myBlockOf[i] == myBlockOf[first] && myBlockStart[myBlockOf[i]] != i;
+    }
+
+    bool fold()
+    {
+        bool folded = false;
+        for (size_t k = 0; k < myStarts.size(); ++k)
+        {
+            const size_t i = myStarts[k];
+            if (myDeleted[i] || myCode[i] != Const) continue;
+            const int c = myCode[i + 1];
+            const size_t j = i + 2;
+            if (!inBlock(j, i)) continue;
+            const int op = myCode[j];
+
+            //  Const, op
+            if (constForm(op) >= 0)
+            {
+                myReplacements[i] = { j + 1, { constForm(op), c } };
+            }
+            else if (op == Assign || op == Pays)
+            {
+                myReplacements[i] = { j + 2, { op == Assign ? AssignConst : PaysConst, c, myCode[j + 1] } };
+            }
+            else if (op == Equal || op == Sup || op == SupEqual)
+            {
+                const double x = myProgram.constStream[c];
+                const bool res = op == Equal ? x == 0.0 : op == Sup ? x > 0.0 : x >= 0.0;
+                myReplacements[i] = { j + 1, { res ? True : False } };
+            }
+            //  Const, single push, op
+            else if ((op == Var || op == Spot || op == Const) && inBlock(j + compiledLength(myCode, j), i))
+            {
+                const size_t l = j + compiledLength(myCode, j);
+                if (constLeftForm(myCode[l]) < 0) continue;
+                vector<int> words(myCode + j, myCode + l);
+                words.push_back(constLeftForm(myCode[l]));
+                words.push_back(c);
+                myReplacements[i] = { l + 1, words };
+            }
+            else continue;
+
+            folded = true;
+            //  Skip the folded instructions
+            while (k + 1 < myStarts.size() && myStarts[k + 1] < myReplacements[i].end) ++k;
+        }
+        return folded;
+    }
+
+    //  Whether all the instructions from first to last are deleted
+    bool emptyRange(const size_t first, const size_t last) const
+    {
+        for (size_t i = first; i < last; i += compiledLength(myCode, i))
+        {
+            if (!myDeleted[i]) return false;
+        }
+        return true;
+    }
+
+    //  Rebuild the program with the edits
+    void rebuild()
+    {
+        const vector<int>& code = myProgram.nodeStream;
+        vector<int> res;
+        res.reserve(myN);
+        vector<size_t> posMap(myN + 1, 0);
+
+        size_t i = 0;
+        while (i < myN)
+        {
+            posMap[i] = res.size();
+            if (myDeleted[i])
+            {
+                const size_t next = i + compiledLength(myCode, i);
+                for (size_t p = i; p < next; ++p) posMap[p] = res.size();
+                i = next;
+            }
+            else if (myReplacements[i].end)
+            {
+                const Replacement& r = myReplacements[i];
+                for (size_t p = i; p < r.end; ++p) posMap[p] = res.size();
+                res.insert(res.end(), r.words.begin(), r.words.end());
+                i = r.end;
+            }
+            else if (myCode[i] == IfElse && emptyRange(myCode[i + 1], myCode[i + 2]))
+            {
+                //  Without if-false statements
+                for (size_t p = i; p < i + 3; ++p) posMap[p] = res.size();
+                res.push_back(If);
+                res.push_back(myCode[i + 1]);
+                i += 3;
+            }
+            else
+            {
+                const size_t next = i + compiledLength(myCode, i);
+                for (size_t p = i; p < next; ++p) posMap[p] = res.size();
+                res.insert(res.end(), code.begin() + i, code.begin() + next);
+                i = next;
+            }
+        }
+        posMap[myN] = res.size();
+
+        //  Targets
+        for (size_t k = 0; k < res.size(); k += compiledLength(res.data(), k))
+        {
+            switch (res[k])
+            {
+            case If:
+            case Jump:
+            case AndJump:
+            case OrJump:
+            case SmoothBegin:
+            case SmoothMid:
+                res[k + 1] = int(posMap[res[k + 1]]);
+                break;
+            case IfElse:
+                res[k + 1] = int(posMap[res[k + 1]]);
+                res[k + 2] = int(posMap[res[k + 2]]);
+                break;
+            case ForNext:
+                res[k + 4] = int(posMap[res[k + 4]]);
+                break;
+            }
+        }
+
+        for (auto& e : myProgram.entries) e = posMap[e];
+        myProgram.nodeStream = move(res);
+    }
+
+    //  Slot allocation
+
+    //  Variable read or written by the instruction at i, -1 if none
+    int accessedVar(const size_t i) const
+    {
+        return myCode[i] == Var || myCode[i] == ForNext ? myCode[i + 1] : storedVar(i);
+    }
+
+    //  Variables live at the same time, as adjacency lists
+    vector<vector<int>> interferences() const
+    {
+        vector<vector<int>> adj(myNumVars);
+        auto interfere = [&](const int x, const vector<uint64_t>& live)
+        {
+            for (size_t w = 0; w < myWords; ++w)
+            {
+                if (!live[w]) continue;
+                for (int k = 0; k < 64; ++k)
+                {
+                    const int y = int(64 * w) + k;
+                    if (((live[w] >> k) & 1) && y != x)
+                    {
+                        adj[x].push_back(y);
+                        adj[y].push_back(x);
+                    }
+                }
+            }
+        };
+
+        //  Variables read before written all hold 0 at the start
+        const size_t nBlocks = myBlockStart.size();
+        const vector<uint64_t>& entry = nBlocks ? myLiveIn[0] : myExitLive;
+        for (size_t v = 0; v < myNumVars; ++v) if (isLive(entry, int(v))) interfere(int(v), entry);
+
+        //  Variables written, with the variables live after
+        vector<size_t> instrs;
+        vector<uint64_t> pending(myWords);
+        for (size_t b = 0; b < nBlocks; ++b)
+        {
+            vector<uint64_t> live = liveOut(b);
+            instrs.clear();
+            for (size_t i = myBlockStart[b]; i < myBlockEnd[b]; i += compiledLength(myCode, i)) instrs.push_back(i);
+            for (size_t k = instrs.size(); k-- > 0;)
+            {
+                const size_t i = instrs[k];
+                const int var = myCode[i] == ForNext ? myCode[i + 1] : storedVar(i);
+                if (var >= 0)
+                {
+                    interfere(var, live);
+
+                    //  Within an expression, the register machine still refers to the variables read before
+                    if (myCode[i] != ForNext && !isStatement(i))
+                    {
+                        pending.assign(myWords, 0);
+                        for (size_t j = myStatement[i]; j < i; j += compiledLength(myCode, j))
+                        {
+                            if (myCode[j] == Var) setLive(pending, myCode[j + 1], true);
+                        }
+                        interfere(var, pending);
+                    }
+                }
+                transferLive(i, live);
+            }
+        }
+
+        for (auto& a : adj)
+        {
+            sort(a.begin(), a.end());
+            a.erase(unique(a.begin(), a.end()), a.end());
+        }
+        return adj;
+    }
+
+    //  Renumber the variables of the code
+    void renumber(const vector<int>& slots)
+    {
+        int* code = myProgram.nodeStream.data();
+        for (const auto i : myStarts)
+        {
+            switch (code[i])
+            {
+            case Var:
+            case Assign:
+            case Pays:
+            case ForNext:
+                code[i + 1] = slots[code[i + 1]];
+                break;
+            case AssignConst:
+            case PaysConst:
+            case PaysScaled:
+            case PaysScaledConst:
+                code[i + 2] = slots[code[i + 2]];
+                break;
+            }
+        }
+    }
+
+public:
+
+    //  Program of a product with nVar variables, outputs[i] is true when variable i is read after evaluation
+    CompiledOptimizer(CompiledProgram& prg, const size_t nVar, const vector<bool>& outputs)
+        : myProgram(prg), myNumVars(nVar), myOutputs(outputs)
+    {
+        myOutputs.resize(nVar, true);
+
+        //  Constant 0, for the initial values of the variables, added when first used
+        myZeroConst = prg.constStream.size();
+        for (size_t c = 0; c < prg.constStream.size(); ++c)
+        {
+            if (prg.constStream[c] == 0.0 && !signbit(prg.constStream[c]))
+            {
+                myZeroConst = c;
+                break;
+            }
+        }
+    }
+
+    //  Optimize to a fixed point, returns false if the code cannot be optimized
+    bool optimize(const size_t maxRounds = 16)
+    {
+        for (size_t k = 0; k < myProgram.nodeStream.size(); k += compiledLength(myProgram.nodeStream.data(), k))
+        {
+            if (myProgram.nodeStream[k] >= CallSpread) return false;
+        }
+
+        for (size_t round = 0; round < maxRounds; ++round)
+        {
+            analyzeCode();
+            propagate();
+
+            myDeleted.assign(myN + 1, false);
+            myReplacements.assign(myN + 1, Replacement());
+            const bool deleted = eliminate();
+            const bool folded = fold();
+            if (!deleted && !folded) break;
+
+            rebuild();
+        }
+
+        myProgram.depths = compiledDepths(myProgram);
+        return true;
+    }
+
+    //  Allocate the slots of the state to the variables, and renumber the code, see allocateSlots()
+    size_t allocate(vector<int>& slots, size_t& numZeroed)
+    {
+        analyzeCode();
+        myDeleted.assign(myN + 1, false);
+        computeLiveness();
+        const vector<vector<int>> adj = interferences();
+        const vector<uint64_t>& entry = myBlockStart.empty() ? myExitLive : myLiveIn[0];
+
+        //  Accesses, weighted by the nesting of loops
+        vector<uint64_t> weights(myNumVars, 0);
+        int loops = 0;
+        for (const auto i : myStarts)
+        {
+            if (myCode[i] == ForBegin) ++loops;
+            else if (myCode[i] == Jump) --loops;
+            const int var = accessedVar(i);
+            if (var >= 0) weights[var] += uint64_t(1) << (3 * min(loops, 10));
+        }
+
+        //  Greedy coloring, most accessed variables first, in the first free slot
+        vector<int> order;
+        for (size_t v = 0; v < myNumVars; ++v) if (weights[v] || isLive(entry, int(v))) order.push_back(int(v));
+        stable_sort(order.begin(), order.end(), [&](const int x, const int y) { return weights[x] > weights[y]; });
+
+        vector<int> color(myNumVars, -1);
+        vector<uint64_t> colorWeights;
+        vector<bool> colorZeroed;
+        vector<int> taken;
+        for (const auto v : order)
+        {
+            for (const auto y : adj[v]) if (color[y] >= 0) taken[color[y]] = v;
+            size_t c = 0;
+            while (c < taken.size() && taken[c] == v) ++c;
+            if (c == taken.size())
+            {
+                taken.push_back(-1);
+                colorWeights.push_back(0);
+                colorZeroed.push_back(false);
+            }
+            color[v] = int(c);
+            colorWeights[c] += weights[v];
+            if (isLive(entry, v)) colorZeroed[c] = true;
+        }
+
+        //  Slots zeroed at the start first, then by accesses
+        vector<int> colors(taken.size());
+        for (size_t c = 0; c < colors.size(); ++c) colors[c] = int(c);
+        stable_sort(colors.begin(), colors.end(), [&](const int x, const int y)
+        {
+            return colorZeroed[x] != colorZeroed[y] ? colorZeroed[x] : colorWeights[x] > colorWeights[y];
+        });
+        vector<int> slotOf(colors.size());
+        numZeroed = 0;
+        for (size_t k = 0; k < colors.size(); ++k)
+        {
+            slotOf[colors[k]] = int(k);
+            if (colorZeroed[colors[k]]) ++numZeroed;
+        }
+
+        slots.assign(myNumVars, -1);
+        for (size_t v = 0; v < myNumVars; ++v) if (color[v] >= 0) slots[v] = slotOf[color[v]];
+
+        renumber(slots);
+        return colors.size();
+    }
+};
+
+//  Optimize the compiled program of a product with nVar variables,
+//      outputs[i] is true when variable i is read after evaluation, all variables are outputs by default
+//  Returns false, and leaves the program unchanged, for fuzzy code
+inline bool optimizeCompiled(CompiledProgram& prg, const size_t nVar, const vector<bool>& outputs = vector<bool>())
+{
+    CompiledOptimizer opt(prg, nVar, outputs);
+    return opt.optimize();
+}
+
+//  Allocate the slots of the state to the variables of an optimized program, and renumber its code:
+//      variables live at the same time get different slots, others, like temporaries, may share one,
+//      the slots of the variables read before written, which must be 0 at the start, come first,
+//      then the slots are ordered by decreasing number of accesses, weighted by the nesting of loops
+//  slots[i] gets the slot of variable i, -1 when the variable is not kept, 
+//      outputs[i] is true when variable i is read after evaluation, all variables are outputs by default
+//  numZeroed gets the number of slots to set to 0 before evaluation
+//  Returns the number of slots, the program is left unchanged for fuzzy code, with one slot per variable
+inline size_t allocateSlots(
+    CompiledProgram&        prg, 
+    const size_t            nVar, 
+    const vector<bool>&     outputs, 
+    vector<int>&            slots, 
+    size_t&                 numZeroed)
+{
+    for (size_t k = 0; k < prg.nodeStream.size(); k += compiledLength(prg.nodeStream.data(), k))
+    {
+        if (prg.nodeStream[k] >= CallSpread)
+        {
+            slots.resize(nVar);
+            for (size_t v = 0; v < nVar; ++v) slots[v] = int(v);
+            numZeroed = nVar;
+            return nVar;
+        }
+    }
+
+    CompiledOptimizer opt(prg, nVar, outputs);
+    return opt.allocate(slots, numZeroed);
+}
@@ -34,7 +34,7 @@ vector<string> tokenize( const string& str)
 		//	Copy match into results
 		v.push_back( (*it)[0]);
 		//	Uppercase
-		transform( v.back().begin(), v.back().end(), v.back().begin(), toupper);
+		transform( v.back().begin(), v.back().end(), v.back().begin(), ::toupper);
 	}
 
 	//	C++11 move semantics means no copy
@@ -289,7 +289,7 @@ class Parser
         static Expression parseList(TokIt& cur, const TokIt end)
         {
                 TokIt closeIt = findMatch<'[',']'>(cur, end);
-                vector<Expression> vals;
+                Arguments vals;
                 ++cur;
                 while(cur != closeIt)
                 {
@@ -305,7 +305,7 @@ class Parser
         }
 
 
-	static vector<Expression> parseFuncArg( TokIt& cur, const TokIt end)
+	static Arguments parseFuncArg( TokIt& cur, const TokIt end)
 	{
 		//	Check that we have a '(' and something after that
 		if( (*cur)[0] != '(')
@@ -315,7 +315,7 @@ class Parser
 		TokIt closeIt = findMatch<'(',')'>( cur, end);
 
 		//	Parse expressions between parentheses
-		vector<Expression> args;
+		Arguments args;
 		++cur;	//	Over '('
 		while( cur != closeIt)
 		{
@@ -423,7 +423,7 @@ class Parser
 	static Expression buildEqual(Expression& lhs, Expression& rhs, const double eps)
 	{
 		auto expr = make_base_binary<NodeSub>( lhs,rhs);
-		auto top = make_base_node<NodeEqual>();
+		auto top = make_node<NodeEqual>();
 		top->arguments.resize( 1);
 		top->arguments[0] = move( expr);
 		top->eps = eps;
@@ -440,7 +440,7 @@ class Parser
 	static Expression buildSuperior(Expression& lhs, Expression& rhs, const double eps)
 	{
 		auto expr = make_base_binary<NodeSub>( lhs,rhs);
-		auto top = make_base_node<NodeSup>();
+		auto top = make_node<NodeSup>();
 		top->arguments.resize( 1);
 		top->arguments[0] = move( expr);
 		top->eps = eps;
@@ -449,7 +449,7 @@ class Parser
 	static Expression buildSupEqual(Expression& lhs, Expression& rhs, const double eps)
 	{
 		auto expr = make_base_binary<NodeSub>( lhs,rhs);
-		auto top = make_base_node<NodeSupEqual>();
+		auto top = make_node<NodeSupEqual>();
 		top->arguments.resize( 1);
 		top->arguments[0] = move( expr);
 		top->eps = eps;
@@ -536,7 +536,7 @@ class Parser
 		}
 
 		//	Finally build the top node
-		auto top = make_base_node<NodeIf>();
+		auto top = make_node<NodeIf>();
 		top->arguments.resize( 1 + stats.size() + elseStats.size());
 		top->arguments[0] = move( cond);			//	Arg[0] = condition
 		for( size_t i=0; i<stats.size(); ++i)		//	Copy statements, Arg[1..n-1]
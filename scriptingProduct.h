@@ -25,11 +25,30 @@ As long as this comment is preserved at the top of the file
 //  Parser
 #include "scriptingParser.h"
 
+//  SIMD execution of compiled scripts
+#include "scriptingSimd.h"
+
+//  Pre-decoded compiled scripts
+#include "scriptingDecoded.h"
+
+//  Register machine code
+#include "scriptingRegisters.h"
+
+//  Native code
+#include "scriptingNative.h"
+
+//  JIT
+#include "scriptingJit.h"
+
+//  Dataflow optimization of compiled code
+#include "scriptingOptimizer.h"
+
 //  Scenarios
 #include "scriptingScenarios.h"
 
 using namespace std;
 #include <vector>
+#include <algorithm>
 
 //	Date class from your date library
 //	class Date;
@@ -40,32 +59,203 @@ using Date = int;
 
 class Product
 {
+    //  Arena of the nodes of the trees, declared first so it is released last, after the trees
+    NodeArena                   myArena;
+
 	vector<Date>		        myEventDates;
 	vector<Event>		        myEvents;
     vector<string>		        myVariables;
 
-    //  Compiled form
-    vector<vector<int>>         myNodeStreams;
-    vector<vector<double>>      myConstStreams;
-    vector<vector<const void*>> myDataStreams;
+    //  Compiled form, all events linked into one program
+    CompiledProgram             myProgram;
+
+    //  Pre-decoded form of the program, and the index of the first instruction of each event
+    vector<DecodedInstr>        myDecodedCode;
+    vector<size_t>              myDecodedEntries;
+
+    //  Register machine form of the program, and the index of the first instruction of each event
+    vector<RegInstr>            myRegCode;
+    vector<size_t>              myRegEntries;
+    //  Size of the register file: slots of the state, spot and temporaries
+    size_t                      myNumRegisters = 0;
+
+    //  Native code of the register machine form, loaded or compiling, null if not requested
+    shared_ptr<NativeCode>      myNative;
+    //  JIT compiled machine code of the register machine form, null if not requested or not supported
+    unique_ptr<JitCode>         myJit;
+
+    //  Size of the state of the compiled streams: slots of the variables, and work space of fuzzy ifs
+    size_t                      myCompiledStateSize = 0;
+    //  Number of slots of the state, or registers, read before written, zeroed before evaluation
+    size_t                      myNumZeroed = 0;
+
+    //  Indices of the variables read after evaluation, all by default, 
+    //      and their slots in the state of the compiled streams and in the register file
+    vector<size_t>              myOutputs;
+    vector<size_t>              myOutputSlots;
+
+    //  Processing metadata: maximum number of nested ifs, fuzzy compilation and its default smoothing factor,
+    //      numeraires folded into the compiled code, empty if none
+    size_t                      myMaxNestedIfs = 0;
+    bool                        myFuzzy = false;
+    double                      myDefEps = 0.0;
+    vector<double>              myFoldedNumeraires;
+
+    //  Bound on the depth of the stacks of the tree evaluators, see treeDepth()
+    size_t                      myTreeDepth = 0;
+
+    //  Bound on the depth of the stacks of the tree evaluators over a statement or an expression:
+    //      the arguments of an expression are evaluated in turn, on top of the results of the previous ones,
+    //      and statements nest
+    static size_t treeDepth(const Node& node)
+    {
+        const bool isValue = dynamic_cast<const exprNode*>(&node) || dynamic_cast<const boolNode*>(&node);
+        size_t depth = 1;
+        for (size_t j = 0; j < node.arguments.size(); ++j)
+        {
+            const size_t argDepth = treeDepth(*node.arguments[j]);
+            depth = max(depth, isValue ? j + argDepth : 1 + argDepth);
+        }
+        return depth;
+    }
+
+    //  The stacks of the tree evaluators are of fixed size EVALSTACKSIZE, 
+    //      deeper scripts are evaluated compiled, with stacks sized from the code
+    void checkTreeDepth() const
+    {
+        if (myTreeDepth > EVALSTACKSIZE) throw runtime_error("Script too deep for the tree evaluators, evaluate compiled");
+    }
 
 public:
 
 	//	Accessors
 
 	//	Access event dates
-	const vector<Date>& eventDates()
+	const vector<Date>& eventDates() const
 	{
 		return myEventDates;
 	}
 	//	Events are not accessed, remain encapsulated in the product
 
+    //  Memory of the trees, in bytes, see NodeArena
+    size_t treeBytes() const
+    {
+        return myArena.bytes();
+    }
+
 	//	Access number of variables (vector size) and names
 	const vector<string>& varNames() const
 	{
 		return myVariables;
 	}
 
+    //  Size of the register file for evaluateRegisters(), after compilation
+    size_t numRegisters() const
+    {
+        return myNumRegisters;
+    }
+
+    //  Size of the state for evaluateCompiled(), after compilation
+    //  The number of variables, plus the work space of fuzzy ifs when compiled fuzzy,
+    //      or the number of slots shared by the variables and the common subexpressions otherwise,
+    //      see allocateSlots() in scriptingOptimizer.h
+    size_t compiledStateSize() const
+    {
+        return myCompiledStateSize;
+    }
+
+    //  Number of slots of the state, or registers, set to 0 before evaluation, after compilation
+    size_t numZeroedSlots() const
+    {
+        return myNumZeroed;
+    }
+
+    //  Indices of the output variables, see selectOutputs()
+    const vector<size_t>& outputVars() const
+    {
+        return myOutputs;
+    }
+
+    //  Slots of the output variables in the state of evaluateCompiled(),
+    //      and in the register file of evaluateRegisters(), after compilation
+    const vector<size_t>& outputSlots() const
+    {
+        return myOutputSlots;
+    }
+
+    //  Compiled forms, after compilation
+    const CompiledProgram& program() const
+    {
+        return myProgram;
+    }
+    const vector<RegInstr>& regCode() const
+    {
+        return myRegCode;
+    }
+    const vector<size_t>& regEntries() const
+    {
+        return myRegEntries;
+    }
+
+    //  Processing metadata
+    size_t maxNestedIfs() const
+    {
+        return myMaxNestedIfs;
+    }
+    bool compiledFuzzy() const
+    {
+        return myFuzzy;
+    }
+    double defEps() const
+    {
+        return myDefEps;
+    }
+    bool foldedNumeraires() const
+    {
+        return !myFoldedNumeraires.empty();
+    }
+    //  Numeraires folded into the compiled code, by event, empty if none
+    const vector<double>& numeraires() const
+    {
+        return myFoldedNumeraires;
+    }
+
+    //  Whether native code is loaded, see compileNative()
+    bool nativeReady() const
+    {
+        return myNative && myNative->function();
+    }
+
+    //  Wait until the native code is loaded or has failed, see compileNative()
+    void waitNative() const
+    {
+        if (myNative) myNative->wait();
+    }
+
+    //  Why native code is not available, with the output of the compiler if it failed, see NativeCode::error()
+    string nativeError() const
+    {
+        return myNative ? myNative->error() : string();
+    }
+
+    //  Whether JIT compiled code is available, see compileJit()
+    bool jitReady() const
+    {
+        return myJit != nullptr;
+    }
+
+    //  Count the pairs of consecutive register instructions where the second one consumes the result of the first,
+    //      before fusion into superinstructions, see countRegPairs(), after compilation
+    void countInstrPairs(map<pair<int, int>, size_t>& counts) const
+    {
+        size_t numRegs = 0;
+        vector<size_t> entries;
+        countRegPairs(
+            compileRegisters(myProgram.nodeStream, myProgram.constStream, myProgram.entries, entries, 
+                myCompiledStateSize, numRegs, false),
+            myCompiledStateSize, counts);
+    }
+
 	//	Factories
 
 	//	Evaluator factory
@@ -83,7 +273,7 @@ public:
 
 	//	Scenario factory
 	template <class T>
-    unique_ptr<Scenario<T>> buildScenario()
+    unique_ptr<Scenario<T>> buildScenario() const
 	{
 		//	Move
 		return unique_ptr<Scenario<T>>( new Scenario<T>( myEventDates.size()));
@@ -97,6 +287,9 @@ public:
 	//		as from a map<Date,string>
 	void parseEvents( EvtIt begin, EvtIt end)
 	{
+        //  Nodes in the arena of the product
+        NodeArena::Scope scope(myArena);
+
 		//	Copy event dates and parses event strings sequentially
 		for( EvtIt evtIt = begin; evtIt != end; ++evtIt)
 		{
@@ -104,6 +297,9 @@ public:
 			myEventDates.push_back( evtIt->first);
 			//	Parse event string
 			myEvents.push_back( parse( evtIt->second)); 
+
+            //  Depth of the stacks of the tree evaluators
+            for (const auto& stat : myEvents.back()) myTreeDepth = max(myTreeDepth, treeDepth(*stat));
 		}
 	}
 
@@ -146,6 +342,8 @@ public:
     template <class T, class Eval>
 	void evaluate( const Scenario<T>& scen, Eval& eval) const
 	{
+        checkTreeDepth();
+
 		//	Set scenario
 		eval.setScenario( &scen);
 
@@ -167,7 +365,37 @@ public:
 		}
 	}
 
+    //	Evaluate the product in a block of scenarios with a lane-batched evaluator
+    //  The product must be pre-processed first
+    template <class T, class Eval>
+    void evaluateBlock( const ScenarioBlock<T>& scen, Eval& eval) const
+    {
+        checkTreeDepth();
+
+        //	Set scenarios
+        eval.setScenarioBlock( &scen);
+
+        //	Initialize all variables
+        eval.init();
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            //	Set current event
+            eval.setCurEvt( i);
+
+            //	Loop over statements in event
+            for (const auto& stat : myEvents[i])
+            {
+                //	Visit statement, once for all lanes
+                stat->accept( eval);
+            }
+        }
+    }
+
     //	Evaluate all compiled statements in all events
+    //  The state must be of size compiledStateSize(),
+    //      the values of the outputs are in the entries outputSlots()
     //  The product must be pre-processed and compiled first
     template <class T>
     void evaluateCompiled(
@@ -175,14 +403,118 @@ public:
         EvalState<T>& state) const
     {
         //	Initialize state
-        state.init();
+        state.init(myNumZeroed);
+
+        //	Evaluate the program, all events in one call
+        evalCompiled(myProgram, scen, state);
+    }
+
+	//	Evaluate all pre-decoded statements in all events
+    //  Same results as evaluateCompiled(), faster
+    //  Evaluated compiled when the code is too deep for the stacks of the decoded interpreter
+    //  The product must be pre-processed and compiled first
+    void evaluateDecoded(
+        const Scenario<double>& scen,
+        EvalState<double>& state) const
+    {
+        if (myDecodedCode.empty())
+        {
+            evaluateCompiled(scen, state);
+            return;
+        }
+
+        //	Initialize state
+        state.init(myNumZeroed);
+
+        //	Loop over events
+        for (size_t i = 0; i<myEvents.size(); ++i)
+        {
+            //	Evaluate the decoded events
+            evalDecoded(myDecodedCode, scen[i], state, myDecodedEntries[i]);
+        }
+    }
+
+    //	Evaluate all statements in all events on the register machine
+    //  Same results as evaluateCompiled(), which is called instead when there is no register code, see compile()
+    //  The state holds the register file and must be of size numRegisters(),
+    //      the values of the outputs are in the registers outputSlots()
+    //  The product must be pre-processed and compiled first
+    void evaluateRegisters(
+        const Scenario<double>& scen,
+        EvalState<double>& state) const
+    {
+        if (myRegCode.empty())
+        {
+            evaluateCompiled(scen, state);
+            return;
+        }
+
+        //	Initialize state
+        state.init(myNumZeroed);
 
         //	Loop over events
         for (size_t i = 0; i<myEvents.size(); ++i)
         {
-            //	Evaluate the compiled events
-            evalCompiled(myNodeStreams[i], myConstStreams[i], myDataStreams[i], scen[i], state);
+            //	Evaluate the register code
+            evalRegisters(myRegCode, scen[i], state, myRegEntries[i]);
+        }
+    }
+
+    //	Evaluate all statements in all events with JIT compiled code
+    //  Same results as evaluateRegisters(), which is called instead when the code could not be JIT compiled
+    //  The state must be of size numRegisters(), 
+    //      the values of the outputs are in the entries outputSlots()
+    //  The product must be pre-processed and compiled first, and compileJit() called for JIT code
+    void evaluateJit(
+        const Scenario<double>& scen,
+        EvalState<double>&      state) const
+    {
+        if (!myJit)
+        {
+            evaluateRegisters(scen, state);
+            return;
+        }
+
+        //	Initialize state, the JIT code works on the register file
+        state.init(myNumZeroed);
+
+        //  Evaluate the path, all events in one call
+        myJit->function()(&scen.spot(0), scen.spotStride(), &scen.numeraire(0), scen.numStride(), state.variables.data());
+    }
+
+    //	Evaluate all statements in all events with native code
+    //  Same results as evaluateRegisters(), 
+    //      evaluateJit() is called instead while the native code is not available
+    //  The state must be of size numRegisters(), 
+    //      the values of the outputs are in the entries outputSlots()
+    //  The product must be pre-processed and compiled first, and compileNative() called for native code
+    void evaluateNative(
+        const Scenario<double>& scen,
+        EvalState<double>&      state) const
+    {
+        const NativeFunc func = myNative ? myNative->function() : nullptr;
+        if (!func)
+        {
+            evaluateJit(scen, state);
+            return;
         }
+
+        //  Evaluate the path, all events in one call
+        func(&scen.spot(0), scen.spotStride(), &scen.numeraire(0), scen.numStride(), state.variables.data());
+    }
+
+    //	Evaluate all compiled statements in all events
+    //      on a block of at most state.width() scenarios, one per SIMD lane
+    //  The product must be pre-processed and compiled first
+    void evaluateCompiledBlock(
+        const ScenarioBlock<double>& scen,
+        EvalStateLanes& state) const
+    {
+        //	Initialize state
+        state.init(myNumZeroed);
+
+        //	Evaluate the program, all events in one call
+        evalCompiledLanes(myProgram, scen, state);
     }
     
     //  Processors
@@ -198,8 +530,30 @@ public:
 
 		//	Get result moved in myVariables
 		myVariables = indexer.getVarNames();
+
+        //  All outputs
+        selectOutputs();
 	}
 
+    //  Select the variables read after evaluation, by name, all variables if empty
+    //  Monte-Carlo valuations only report the outputs, see scriptMcVal(), 
+    //      and compiled code only keeps the variables the outputs depend on, see compile()
+    void selectOutputs(const vector<string>& outputs = vector<string>())
+    {
+        myOutputs.clear();
+        if (outputs.empty())
+        {
+            for (size_t i = 0; i < myVariables.size(); ++i) myOutputs.push_back(i);
+        }
+        for (const auto& name : outputs)
+        {
+            auto it = find(myVariables.begin(), myVariables.end(), name);
+            if (it == myVariables.end()) throw runtime_error("Unknown output variable " + name);
+            myOutputs.push_back(it - myVariables.begin());
+        }
+        myOutputSlots = myOutputs;
+    }
+
 	//	If processing, returns max number of nested ifs
 	size_t ifProcess()
 	{
@@ -238,6 +592,9 @@ public:
 		//	The const cond processor
 		ConstCondProcessor ccProc;
 
+        //  Replacement nodes in the arena of the product
+        NodeArena::Scope scope(myArena);
+
 		//	Visit
 		//	Note that changes the structure of the tree, hence a special function must be called 
 		//		from the top of each tree
@@ -253,40 +610,116 @@ public:
 		}
 	}
 
-    //	Compile into streams of instructions, constants and data, one per event date
-    void compile()
+    //	Compile into one program: streams of instructions, constants and data, with the entry point of every event
+    //  Deterministic numeraires on the event dates, if provided, are folded into the code,
+    //      then the compiled product is only valid with those numeraires
+    //  Fuzzy code, with default smoothing factor defEps, is evaluated with evaluateCompiled() only,
+    //      and the product must be pre-processed for fuzzy evaluation
+    //  Sharp code is optimized, see scriptingOptimizer.h, 
+    //      only the variables named in outputs, all variables by default, are kept, see selectOutputs(),
+    //      and the variables are allocated to the slots of the state, see outputSlots()
+    void compile( 
+        const vector<double>&   numeraires = vector<double>(), 
+        const bool              fuzzy = false, 
+        const double            defEps = 0.0,
+        const vector<string>&   outputs = vector<string>())
     {
         //  First, identify constants
         constProcess();
 
         //  Clear
-        myNodeStreams.clear();
-        myConstStreams.clear();
-        myDataStreams.clear();
-        
-        //  One per event date
-        myNodeStreams.reserve(myEvents.size());
-        myConstStreams.reserve(myEvents.size());
-        myDataStreams.reserve(myEvents.size());
+        myDecodedCode.clear();
+        myDecodedEntries.clear();
+        myRegCode.clear();
+        myRegEntries.clear();
+        myNumRegisters = myVariables.size();
+        myNative.reset();
+        myJit.reset();
+        myFuzzy = fuzzy;
+        myDefEps = defEps;
+        myFoldedNumeraires = numeraires;
+
+        //  Outputs
+        selectOutputs(outputs);
+
+        //	The compiler, all events in the same streams
+        Compiler comp(nullptr, fuzzy, defEps, myVariables.size());
 
         //	Visit
-        for (auto& evt : myEvents)
+        for (size_t i = 0; i<myEvents.size(); ++i)
         {
-            //	The compiler
-            Compiler comp;
+            //  Entry point and numeraire of the event, and its statements for common subexpressions
+            comp.nextEvent(numeraires.empty() ? nullptr : &numeraires[i], &myEvents[i]);
 
             //	Loop over statements in event
-            for (auto& stat : evt)
+            for (auto& stat : myEvents[i])
             {
                 //	Visit statement
                 stat->accept(comp);
             }
+        }
+
+        //  Get compiled 
+        myProgram = comp.program();
+        myCompiledStateSize = comp.stateSize();
+        myNumZeroed = myCompiledStateSize;
+        myNumRegisters = myCompiledStateSize;
+
+        //  No other form for fuzzy code
+        if (fuzzy) return;
 
-            //  Get compiled 
-            myNodeStreams.push_back(comp.nodeStream());
-            myConstStreams.push_back(comp.constStream());
-            myDataStreams.push_back(comp.dataStream());
+        //  Optimize, the hidden slots of common subexpressions are not outputs
+        vector<bool> isOutput(myCompiledStateSize, false);
+        for (const auto var : myOutputs) isOutput[var] = true;
+        optimizeCompiled(myProgram, myCompiledStateSize, isOutput);
+
+        //  Allocate the slots
+        vector<int> slots;
+        myCompiledStateSize = allocateSlots(myProgram, myCompiledStateSize, isOutput, slots, myNumZeroed);
+        for (auto& slot : myOutputSlots) slot = size_t(slots[slot]);
+
+        //  Pre-decode, unless too deep for the fixed size stacks of the decoded interpreter
+        const StackDepths depths = myProgram.maxDepths();
+        if (depths.deepest() <= EVALSTACKSIZE)
+        {
+            myDecodedCode = decodeCompiled<double>(myProgram.nodeStream, myProgram.constStream, myProgram.entries, myDecodedEntries);
         }
+
+        //  Translate to register code, same register file for all events, the slots of the state first
+        //  None when the loops nest deeper than the loop counters of the register machine, 
+        //      or the conditions than its boolean registers, then the register, JIT and native forms evaluate the stack code
+        myNumRegisters = myCompiledStateSize;
+        if (depths.loops <= REGMAXLOOPS)
+        {
+            myRegCode = compileRegisters(
+                myProgram.nodeStream, myProgram.constStream, myProgram.entries, myRegEntries, myCompiledStateSize, myNumRegisters);
+        }
+    }
+
+    //  Generate native code from the register machine form, compiled with the C++ compiler of the machine,
+    //      or loaded from the cache, see scriptingNative.h
+    //  Compiled in the background by default, evaluateNative() evaluates on the register machine meanwhile, see waitNative()
+    //  Nothing to compile without register code, see compile(), evaluateNative() evaluates the stack code then
+    //  The product must be compiled first, not fuzzy
+    void compileNative(const NativeOptions& options = NativeOptions())
+    {
+        if (myFuzzy || myProgram.entries.empty()) throw runtime_error("Native code requires a product compiled, not fuzzy");
+        if (myRegCode.empty()) return;
+
+        myNative = ::compileNative(myRegCode, myRegEntries, myCompiledStateSize, myNumRegisters, options);
+    }
+
+    //  JIT compile the register machine form into machine code, see scriptingJit.h
+    //  Returns false when the code cannot be JIT compiled, then evaluateJit() runs on the register machine,
+    //      or on the stack code without register code, see compile()
+    //  The product must be compiled first, not fuzzy
+    bool compileJit()
+    {
+        if (myFuzzy || myProgram.entries.empty()) throw runtime_error("JIT requires a product compiled, not fuzzy");
+        if (myRegCode.empty()) return false;
+
+        myJit = ::compileJit(myRegCode, myRegEntries);
+        return myJit != nullptr;
     }
 
 	//	All preprocessing
@@ -303,6 +736,7 @@ public:
 			constCondProcess();
 		}
 
+        myMaxNestedIfs = maxNestedIfs;
 		return maxNestedIfs;
 	}
 
@@ -0,0 +1,1300 @@
+#pragma once
+
+//  Register machine target for compiled scripts
+//  The stack code of the Compiler is translated into three-address instructions on virtual registers,
+//      for instance r3 = r1 - c or v2 += r3 * invNum
+//  The register file is the state: the script variables first, then the spot, then the temporaries,
+//      so Var, Spot and Const leave no instruction, and assignments write the variable directly
+//  Temporaries follow the depth of the stack in the original code, so their number is known at compile time
+//  Conditions go to a separate file of boolean registers
+//  The interpreter dispatches with computed goto on GCC and Clang, like runDecoded(), with a switch elsewhere
+//  Same results as evalCompiled()
+
+#include "scriptingCompiler.h"
+
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(SCRIPTING_THREADED)
+#define SCRIPTING_THREADED
+#endif
+
+//  One three-address instruction
+//  The opcodes are those of the Compiler with register operands:
+//      Assign and AssignConst are moves, Spot loads the spot register,
+//      conditions, And, Or, Not, True and False write boolean registers,
+//      If and AndJump jump to b when boolean register a is false, OrJump when it is true, 
+//      Jump jumps to b, Halt ends,
+//      SmoothBegin jumps to b when a < -d / 2, SmoothMid copies c into dst and jumps to b when a > d / 2,
+//          then Smooth ends a lazy smooth,
+//      ForBegin starts a loop counter, ForNext assigns the next value to variable dst or exits to b,
+//          and is followed by a data slot per value, see compileRegisters()
+//  Superinstructions are listed in fuseRegisters()
+struct RegInstr
+{
+    //  NodeType
+    int     op;
+    //  Destination register
+    int     dst;
+    //  Source registers, or jump target in b
+    int     a;
+    int     b;
+    //  Smooth only: x in a, value if positive in b, value if negative in c, epsilon in d
+    int     c;
+    int     d;
+    //  Immediate constant
+    double  constVal;
+    //  Second immediate constant, superinstructions only
+    double  constVal2;
+};
+
+//  Maximum number of boolean registers, and of nested loops, 
+//      products that nest deeper are evaluated on the stack code, see Product::compile()
+#define REGMAXBOOLS 64
+#define REGMAXLOOPS 64
+
+//  Fusion into superinstructions, defined below
+inline void fuseRegisters(vector<RegInstr>& code, const size_t nVar, vector<size_t>* entries = nullptr);
+
+//  Translate stack code into register code
+//  The events start at positions entries[0] (= 0), entries[1], ... in the node stream,
+//      the last entry is the end of the stream, see CompiledProgram
+//  Every event loads its spot first and ends with Halt, 
+//      regEntries gets the index of the first instruction of each event, and the size of the code
+//  nVar is the number of script variables, the register of the spot is nVar
+//  numRegs is updated to the maximum number of registers used so far
+//  Superinstructions are fused unless fuse is false
+//  Returns an empty code, and leaves numRegs and regEntries alone, 
+//      when the conditions nest deeper than the boolean registers, see REGMAXBOOLS
+inline vector<RegInstr> compileRegisters(
+    const vector<int>&          nodeStream,
+    const vector<double>&       constStream,
+    const vector<size_t>&       entries,
+    vector<size_t>&             regEntries,
+    const size_t                nVar,
+    size_t&                     numRegs,
+    const bool                  fuse = true)
+{
+    const int spotReg = int(nVar);
+    const int firstTemp = spotReg + 1;
+    const size_t n = nodeStream.size();
+
+    //  Kept for code that does not fit
+    const size_t numRegs0 = numRegs;
+    const vector<size_t> regEntries0 = regEntries;
+
+    vector<RegInstr> code;
+    code.reserve(n + 2 * entries.size());
+    regEntries.resize(entries.size());
+    size_t nextEvt = 0;
+
+    //  Symbolic stack: registers or constants
+    struct Operand
+    {
+        bool        isConst;
+        int         reg;
+        double      val;
+    };
+    vector<Operand> stack;
+    int nTemps = 0;
+    int nBools = 0;
+    bool tooManyBools = false;
+
+    //  Index of the last instruction that wrote a temporary, -1 if the last instruction was anything else
+    int lastTempWrite = -1;
+    //  Index of the SmoothMid that writes the same temporary on another path, when it ends a lazy smooth, -1 otherwise
+    int lastTempWrite2 = -1;
+
+    auto emit = [&](const int op, const int dst, const int a = 0, const int b = 0, const double val = 0.0)
+    {
+        RegInstr ins;
+        ins.op = op;
+        ins.dst = dst;
+        ins.a = a;
+        ins.b = b;
+        ins.c = 0;
+        ins.d = 0;
+        ins.constVal = val;
+        ins.constVal2 = 0.0;
+        code.push_back(ins);
+        lastTempWrite = dst >= firstTemp && op != If && op != Jump && op != Halt
+            && op != Equal && op != Sup && op != SupEqual && op != And && op != Or && op != Not
+            && op != True && op != False && op != SmoothMid
+            ? int(code.size() - 1) : -1;
+        lastTempWrite2 = -1;
+    };
+
+    auto useRegs = [&](const int last)
+    {
+        numRegs = max(numRegs, size_t(last + 1));
+    };
+
+    auto pop = [&]()
+    {
+        const Operand opnd = stack.back();
+        stack.pop_back();
+        if (!opnd.isConst && opnd.reg >= firstTemp) --nTemps;
+        return opnd;
+    };
+
+    //  New temporary on top of the stack
+    auto pushTemp = [&]()
+    {
+        const int reg = firstTemp + nTemps++;
+        useRegs(reg);
+        stack.push_back({ false, reg, 0.0 });
+        return reg;
+    };
+
+    //  Register of an operand, constants are moved into the scratch register
+    auto toReg = [&](const Operand& opnd, const int scratch)
+    {
+        if (!opnd.isConst) return opnd.reg;
+        useRegs(scratch);
+        emit(AssignConst, scratch, 0, 0, opnd.val);
+        return scratch;
+    };
+
+    //  Constants that must survive the code that follows are moved into a new temporary
+    auto toTemp = [&](Operand& opnd)
+    {
+        if (!opnd.isConst) return;
+        const int reg = firstTemp + nTemps++;
+        useRegs(reg);
+        emit(AssignConst, reg, 0, 0, opnd.val);
+        opnd = { false, reg, 0.0 };
+    };
+
+    //  Number of temporaries among the operands on top of the stack
+    auto topTemps = [&](const size_t n)
+    {
+        int count = 0;
+        for (size_t k = stack.size() - n; k < stack.size(); ++k)
+        {
+            if (!stack[k].isConst && stack[k].reg >= firstTemp) ++count;
+        }
+        return count;
+    };
+
+    //  Boolean registers, the code is dropped at the end when they run out
+    auto pushBool = [&]()
+    {
+        if (nBools >= REGMAXBOOLS) tooManyBools = true;
+        return nBools++;
+    };
+
+    //  Jumps and targets, as in decodeCompiled()
+    vector<size_t> posToInstr(n + 1);
+    vector<vector<size_t>> jumpsAt(n + 1);
+    struct Fixup
+    {
+        size_t      instr;
+        size_t      pos;
+        bool        skipJumps;
+    };
+    vector<Fixup> fixups;
+
+    //  And and Or made redundant by the short-circuit before them
+    vector<char> elided(n, false);
+    //  Pending lazy smooths, index of their SmoothMid
+    vector<int> smoothMids;
+
+    size_t i = 0;
+    for (;;)
+    {
+        posToInstr[i] = code.size();
+
+        //  End of if-true statements, jump over if-false statements
+        for (const size_t target : jumpsAt[i])
+        {
+            fixups.push_back({ code.size(), target, false });
+            emit(Jump, 0);
+        }
+
+        //  End of the previous event, start of the next one(s)
+        while (nextEvt + 1 < entries.size() && entries[nextEvt] == i)
+        {
+            if (nextEvt) emit(Halt, 0);
+            regEntries[nextEvt] = code.size();
+
+            //  Load the spot once per event
+            if (find(nodeStream.begin() + entries[nextEvt], nodeStream.begin() + entries[nextEvt + 1], int(Spot)) 
+                != nodeStream.begin() + entries[nextEvt + 1])
+            {
+                useRegs(spotReg);
+                emit(Spot, spotReg);
+            }
+
+            ++nextEvt;
+        }
+
+        if (i == n) break;
+
+        const int op = nodeStream[i];
+        //  Scratch registers for constants, above all the temporaries in use
+        const int scratch = firstTemp + nTemps;
+
+        switch (op)
+        {
+
+        //  Binaries
+        case Add:
+        case Sub:
+        case Mult:
+        case Div:
+        case Pow:
+        case Max2:
+        case Min2:
+        {
+            const Operand rhs = pop(), lhs = pop();
+            const int a = toReg(lhs, scratch);
+            const int b = toReg(rhs, scratch + 1);
+            emit(op, pushTemp(), a, b);
+            ++i;
+            break;
+        }
+
+        //  Binaries with immediate constant
+        case AddConst:
+        case SubConst:
+        case ConstSub:
+        case MultConst:
+        case DivConst:
+        case ConstDiv:
+        case PowConst:
+        case ConstPow:
+        case Max2Const:
+        case Min2Const:
+        {
+            const Operand arg = pop();
+            const int a = toReg(arg, scratch);
+            emit(op, pushTemp(), a, 0, constStream[nodeStream[i + 1]]);
+            i += 2;
+            break;
+        }
+
+        //  Unaries
+        case Sqrt:
+        case Log:
+        case Uminus:
+        {
+            const Operand arg = pop();
+            const int a = toReg(arg, scratch);
+            emit(op, pushTemp(), a);
+            ++i;
+            break;
+        }
+
+        case Smooth:
+        {
+            const Operand eps = pop(), vNeg = pop(), vPos = pop(), x = pop();
+            const int a = toReg(x, scratch);
+            const int b = toReg(vPos, scratch + 1);
+            const int c = toReg(vNeg, scratch + 2);
+            const int d = toReg(eps, scratch + 3);
+            emit(Smooth, pushTemp(), a, b);
+            code.back().c = c;
+            code.back().d = d;
+            ++i;
+            break;
+        }
+
+        //  Lazy smooth: x and epsilon stay in registers until SmoothEnd
+        case SmoothBegin:
+
+            toTemp(stack[stack.size() - 2]);
+            toTemp(stack.back());
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+            emit(SmoothBegin, 0, stack[stack.size() - 2].reg);
+            code.back().d = stack.back().reg;
+            i += 2;
+            break;
+
+        //  The result goes to the register that SmoothEnd writes, 
+        //      that of the first temporary among x, epsilon and the value if positive
+        case SmoothMid:
+        {
+            toTemp(stack.back());
+            const int dst = firstTemp + nTemps - topTemps(3);
+            useRegs(dst);
+            smoothMids.push_back(int(code.size()));
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+            emit(SmoothMid, dst, stack[stack.size() - 3].reg);
+            code.back().c = stack.back().reg;
+            code.back().d = stack[stack.size() - 2].reg;
+            i += 2;
+            break;
+        }
+
+        //  Smooth, without the right case, handled by SmoothMid
+        case SmoothEnd:
+        {
+            const Operand vNeg = pop(), vPos = pop(), eps = pop(), x = pop();
+            const int c = toReg(vNeg, scratch);
+            emit(Smooth, pushTemp(), x.reg, vPos.reg);
+            code.back().c = c;
+            code.back().d = eps.reg;
+            lastTempWrite2 = smoothMids.back();
+            smoothMids.pop_back();
+            ++i;
+            break;
+        }
+
+        //  Leaves, no instruction
+        case Spot:
+
+            stack.push_back({ false, spotReg, 0.0 });
+            ++i;
+            break;
+
+        case Var:
+
+            stack.push_back({ false, nodeStream[i + 1], 0.0 });
+            i += 2;
+            break;
+
+        case Const:
+
+            stack.push_back({ true, 0, constStream[nodeStream[i + 1]] });
+            i += 2;
+            break;
+
+        //  Assign: retarget the instruction that computed the value when possible, move otherwise
+        case Assign:
+        {
+            const Operand rhs = pop();
+            const int var = nodeStream[i + 1];
+            if (rhs.isConst)
+            {
+                emit(AssignConst, var, 0, 0, rhs.val);
+            }
+            else if (rhs.reg >= firstTemp && lastTempWrite >= 0 && code[lastTempWrite].dst == rhs.reg)
+            {
+                code[lastTempWrite].dst = var;
+                if (lastTempWrite2 >= 0) code[lastTempWrite2].dst = var;
+                lastTempWrite = -1;
+            }
+            else
+            {
+                emit(Assign, var, rhs.reg);
+            }
+            i += 2;
+            break;
+        }
+
+        case AssignConst:
+
+            emit(AssignConst, nodeStream[i + 2], 0, 0, constStream[nodeStream[i + 1]]);
+            i += 3;
+            break;
+
+        //  Payments
+        case Pays:
+        {
+            const Operand rhs = pop();
+            if (rhs.isConst)
+            {
+                emit(PaysConst, nodeStream[i + 1], 0, 0, rhs.val);
+            }
+            else
+            {
+                emit(Pays, nodeStream[i + 1], rhs.reg);
+            }
+            i += 2;
+            break;
+        }
+
+        case PaysScaled:
+        {
+            const Operand rhs = pop();
+            const int a = toReg(rhs, scratch);
+            emit(PaysScaled, nodeStream[i + 2], a, 0, constStream[nodeStream[i + 1]]);
+            i += 3;
+            break;
+        }
+
+        case PaysConst:
+        case PaysScaledConst:
+
+            emit(op, nodeStream[i + 2], 0, 0, constStream[nodeStream[i + 1]]);
+            i += 3;
+            break;
+
+        //  Conditions
+        case Equal:
+        case Sup:
+        case SupEqual:
+        {
+            const Operand arg = pop();
+            const int a = toReg(arg, scratch);
+            emit(op, pushBool(), a);
+            ++i;
+            break;
+        }
+
+        case And:
+        case Or:
+
+            if (elided[i])
+            {
+                ++i;
+                break;
+            }
+            nBools -= 2;
+            emit(op, pushBool(), nBools, nBools + 1);
+            ++i;
+            break;
+
+        //  Short-circuits
+        //  When the And or Or is the condition of an if, possibly through more of the same short-circuits,
+        //      jump directly to the if-false statements (And) or the if-true statements (Or), 
+        //      and evaluate the rhs as the condition
+        //  Otherwise jump to the end with the lhs as the result, and combine the rhs with the lhs 
+        case AndJump:
+        case OrJump:
+        {
+            size_t end = nodeStream[i + 1];
+            while (end < n && nodeStream[end] == op) end = nodeStream[end + 1];
+            const int ifOp = end < n ? nodeStream[end] : -1;
+
+            if (ifOp == If || ifOp == IfElse)
+            {
+                --nBools;
+                elided[nodeStream[i + 1] - 1] = true;
+                if (op == AndJump)
+                {
+                    fixups.push_back({ code.size(), size_t(nodeStream[end + 1]), ifOp == IfElse });
+                    emit(If, 0, nBools);
+                }
+                else
+                {
+                    fixups.push_back({ code.size(), end + (ifOp == IfElse ? 3 : 2), false });
+                    emit(OrJump, 0, nBools);
+                }
+            }
+            else
+            {
+                fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+                emit(op, 0, nBools - 1);
+            }
+            i += 2;
+            break;
+        }
+
+        case Not:
+
+            emit(Not, nBools - 1, nBools - 1);
+            ++i;
+            break;
+
+        case True:
+        case False:
+
+            emit(op, pushBool());
+            ++i;
+            break;
+
+        //  Jump to the end when false
+        case If:
+
+            --nBools;
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+            emit(If, 0, nBools);
+            i += 2;
+            break;
+
+        //  Jump to the if-false statements, after the jump over them, when false
+        case IfElse:
+
+            --nBools;
+            jumpsAt[nodeStream[i + 1]].push_back(nodeStream[i + 2]);
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), true });
+            emit(If, 0, nBools);
+            i += 3;
+            break;
+
+        //  Loops
+        case ForBegin:
+
+            emit(ForBegin, 0);
+            ++i;
+            break;
+
+        //  ForNext with the number of values in a, followed by the values in data slots, never executed
+        case ForNext:
+        {
+            const int nVal = nodeStream[i + 3];
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 4]), false });
+            emit(ForNext, nodeStream[i + 1], nVal);
+            for (int k = 0; k < nVal; ++k)
+            {
+                emit(Const, 0, 0, 0, constStream[nodeStream[i + 2] + k]);
+            }
+            i += 5;
+            break;
+        }
+
+        case Jump:
+
+            fixups.push_back({ code.size(), size_t(nodeStream[i + 1]), false });
+            emit(Jump, 0);
+            i += 2;
+            break;
+
+        default:
+
+            throw runtime_error("Unknown instruction in compiled code");
+        }
+    }
+
+    emit(Halt, 0);
+    regEntries.back() = code.size();
+
+    if (tooManyBools)
+    {
+        numRegs = numRegs0;
+        regEntries = regEntries0;
+        return vector<RegInstr>();
+    }
+
+    //  Resolve jump targets
+    for (const auto& fix : fixups)
+    {
+        code[fix.instr].b = int(posToInstr[fix.pos] + (fix.skipJumps ? jumpsAt[fix.pos].size() : 0));
+    }
+
+    if (fuse) fuseRegisters(code, nVar, &regEntries);
+
+    return code;
+}
+
+//  Translate the stack code of one event
+inline vector<RegInstr> compileRegisters(
+    const vector<int>&          nodeStream,
+    const vector<double>&       constStream,
+    const size_t                nVar,
+    size_t&                     numRegs,
+    const bool                  fuse = true)
+{
+    vector<size_t> regEntries;
+    return compileRegisters(nodeStream, constStream, { 0, nodeStream.size() }, regEntries, nVar, numRegs, fuse);
+}
+
+//  Instructions that write a boolean register
+inline bool regWritesBool(const int op)
+{
+    return op == Equal || op == Sup || op == SupEqual || op == And || op == Or || op == Not || op == True || op == False
+        || op == SubConstSup || op == SubConstSupEqual || op == SubConstEqual || op == ConstSubSup || op == ConstSubSupEqual;
+}
+
+//  Boolean registers read by an instruction, returns their number
+inline size_t regBoolSources(const RegInstr& ins, int* src)
+{
+    switch (ins.op)
+    {
+    case And:
+    case Or:
+        src[0] = ins.a;
+        src[1] = ins.b;
+        return 2;
+    case IfAnd:
+        src[0] = ins.a;
+        src[1] = ins.d;
+        return 2;
+    case If:
+    case Not:
+    case AndJump:
+    case OrJump:
+        src[0] = ins.a;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+//  Value registers read by an instruction, returns their number
+inline size_t regSources(const RegInstr& ins, int* src)
+{
+    switch (ins.op)
+    {
+    case Add:
+    case Sub:
+    case Mult:
+    case Div:
+    case Pow:
+    case Max2:
+    case Min2:
+    case DivConstAdd:
+    case SubConstMax2:
+        src[0] = ins.a;
+        src[1] = ins.b;
+        return 2;
+    case Smooth:
+        src[0] = ins.a;
+        src[1] = ins.b;
+        src[2] = ins.c;
+        src[3] = ins.d;
+        return 4;
+    case SmoothMid:
+        src[0] = ins.a;
+        src[1] = ins.c;
+        src[2] = ins.d;
+        return 3;
+    case SmoothBegin:
+        src[0] = ins.a;
+        src[1] = ins.d;
+        return 2;
+    case AddConst:
+    case SubConst:
+    case ConstSub:
+    case MultConst:
+    case DivConst:
+    case ConstDiv:
+    case PowConst:
+    case ConstPow:
+    case Max2Const:
+    case Min2Const:
+    case Sqrt:
+    case Log:
+    case Uminus:
+    case Assign:
+    case Pays:
+    case PaysScaled:
+    case Equal:
+    case Sup:
+    case SupEqual:
+    case SubConstSup:
+    case SubConstSupEqual:
+    case SubConstEqual:
+    case ConstSubSup:
+    case ConstSubSupEqual:
+    case IfSubConstSup:
+    case IfSubConstSupEqual:
+    case IfSubConstEqual:
+    case IfConstSubSup:
+    case IfConstSubSupEqual:
+    case MultConstDivConst:
+    case SubConstMax2Const:
+    case MultConstPaysScaled:
+        src[0] = ins.a;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+//  Instructions that may jump to b
+inline bool regJumps(const int op)
+{
+    return op == If || op == Jump || op == IfAnd || op == ForNext
+        || op == AndJump || op == OrJump || op == SmoothBegin || op == SmoothMid
+        || (op >= IfSubConstSup && op <= IfConstSubSupEqual);
+}
+
+//  Whether the second instruction reads the temporary or boolean register written by the first one
+//  firstTemp is the first temporary register, nVar + 1
+inline bool regConsumes(const RegInstr& first, const RegInstr& second, const int firstTemp)
+{
+    int src[4];
+    if (regWritesBool(first.op))
+    {
+        const size_t n = regBoolSources(second, src);
+        return find(src, src + n, first.dst) != src + n;
+    }
+    if (first.dst < firstTemp || regJumps(first.op) || first.op == Halt) return false;
+    const size_t n = regSources(second, src);
+    return find(src, src + n, first.dst) != src + n;
+}
+
+//  Count the pairs of consecutive instructions where the second one consumes the result of the first one
+//  Statistics over a corpus of products identify the candidates for superinstructions
+inline void countRegPairs(
+    const vector<RegInstr>&         code,
+    const size_t                    nVar,
+    map<pair<int, int>, size_t>&    counts)
+{
+    for (size_t i = 1; i < code.size(); ++i)
+    {
+        if (regConsumes(code[i - 1], code[i], int(nVar) + 1))
+        {
+            ++counts[make_pair(code[i - 1].op, code[i].op)];
+        }
+    }
+}
+
+//  Superinstruction for two consecutive instructions where the second one consumes the result of the first one,
+//      returns false when there is none
+//  Candidates selected from the statistics of countRegPairs() on a corpus of barriers, asians, autocallables,
+//      cliquets, digitals, range accruals and vanillas, where they cover most of the consuming pairs
+//  All of them compute exactly the same as the pair
+inline bool regFuse(const RegInstr& first, const RegInstr& second, RegInstr& fused)
+{
+    //  Value of first consumed as a or b of second
+    const bool inA = second.a == first.dst;
+
+    fused = second;
+
+    switch (first.op)
+    {
+    //  Comparisons against a constant: r - c > 0, r - c >= 0, r - c == 0 and c - r > 0, c - r >= 0
+    case SubConst:
+
+        fused.a = first.a;
+        fused.constVal = first.constVal;
+        switch (second.op)
+        {
+        case Sup: fused.op = SubConstSup; return true;
+        case SupEqual: fused.op = SubConstSupEqual; return true;
+        case Equal: fused.op = SubConstEqual; return true;
+
+        //  max(x, r - c), as in MAX(X, SPOT() - K)
+        case Max2: 
+            if (inA) return false;
+            fused.op = SubConstMax2;
+            fused.b = second.a;
+            return true;
+
+        //  max(r - c, c2), as in MAX(SPOT() - K, 0)
+        case Max2Const:
+            fused.op = SubConstMax2Const;
+            fused.constVal2 = second.constVal;
+            return true;
+
+        default: return false;
+        }
+
+    case ConstSub:
+
+        fused.a = first.a;
+        fused.constVal = first.constVal;
+        switch (second.op)
+        {
+        case Sup: fused.op = ConstSubSup; return true;
+        case SupEqual: fused.op = ConstSubSupEqual; return true;
+        default: return false;
+        }
+
+    //  Conditional jumps on comparisons, plain comparisons are against 0, r - 0 compares like r
+    case Sup:
+    case SupEqual:
+    case Equal:
+    case SubConstSup:
+    case SubConstSupEqual:
+    case SubConstEqual:
+    case ConstSubSup:
+    case ConstSubSupEqual:
+
+        if (second.op != If) return false;
+        fused.a = first.a;
+        fused.constVal = first.op == Sup || first.op == SupEqual || first.op == Equal ? 0.0 : first.constVal;
+        switch (first.op)
+        {
+        case Sup:
+        case SubConstSup: fused.op = IfSubConstSup; return true;
+        case SupEqual:
+        case SubConstSupEqual: fused.op = IfSubConstSupEqual; return true;
+        case Equal:
+        case SubConstEqual: fused.op = IfSubConstEqual; return true;
+        case ConstSubSup: fused.op = IfConstSubSup; return true;
+        default: fused.op = IfConstSubSupEqual; return true;
+        }
+
+    //  Conditional jump on a conjunction
+    case And:
+
+        if (second.op != If) return false;
+        fused.op = IfAnd;
+        fused.a = first.a;
+        fused.d = first.b;
+        return true;
+
+    //  x + r / c, as in A = A + SPOT() / N
+    case DivConst:
+
+        if (second.op != Add) return false;
+        fused.op = DivConstAdd;
+        fused.a = first.a;
+        fused.b = inA ? second.b : second.a;
+        fused.constVal = first.constVal;
+        return true;
+
+    case MultConst:
+
+        //  r * c / c2
+        if (second.op == DivConst)
+        {
+            fused.op = MultConstDivConst;
+        }
+        //  Payment of r times a constant notional
+        else if (second.op == PaysScaled)
+        {
+            fused.op = MultConstPaysScaled;
+        }
+        else return false;
+        fused.a = first.a;
+        fused.constVal = first.constVal;
+        fused.constVal2 = second.constVal;
+        return true;
+
+    default:
+
+        return false;
+    }
+}
+
+//  Peephole pass that fuses consecutive instructions into superinstructions, repeatedly,
+//      so SubConst, Sup, If becomes SubConstSup, If then IfSubConstSup
+//  Instructions that are jump targets are not fused with the previous one
+//  The entry points of the events, if given, are remapped, events start after a Halt so they are never fused
+inline void fuseRegisters(vector<RegInstr>& code, const size_t nVar, vector<size_t>* entries)
+{
+    const int firstTemp = int(nVar) + 1;
+
+    vector<char> isTarget(code.size() + 1, false);
+    for (const auto& ins : code)
+    {
+        if (regJumps(ins.op)) isTarget[ins.b] = true;
+    }
+
+    vector<RegInstr> fusedCode;
+    fusedCode.reserve(code.size());
+    //  Old index to new index
+    vector<int> newIndex(code.size());
+
+    for (size_t i = 0; i < code.size(); ++i)
+    {
+        RegInstr fused;
+        if (!fusedCode.empty() && !isTarget[i] 
+            && regConsumes(fusedCode.back(), code[i], firstTemp)
+            && regFuse(fusedCode.back(), code[i], fused))
+        {
+            fusedCode.back() = fused;
+            newIndex[i] = int(fusedCode.size() - 1);
+        }
+        else
+        {
+            newIndex[i] = int(fusedCode.size());
+            fusedCode.push_back(code[i]);
+        }
+    }
+
+    //  Remap jump targets
+    for (auto& ins : fusedCode)
+    {
+        if (regJumps(ins.op)) ins.b = newIndex[ins.b];
+    }
+
+    //  Remap entry points
+    if (entries)
+    {
+        for (auto& entry : *entries)
+        {
+            entry = entry < code.size() ? newIndex[entry] : fusedCode.size();
+        }
+    }
+
+    code.swap(fusedCode);
+}
+
+//  Evaluate register code
+//  The state holds the register file: variables, spot and temporaries
+//  The code is accessed by pointer, so it may live in a vector or in mapped memory, see scriptingImage.h
+template <class T>
+inline void evalRegisters(
+    //  Code to eval, from entry to the next Halt
+    const RegInstr*             code,
+    //  Scenario
+    const SimulDataRef<const T> scen,
+    //  State
+    EvalState<T>&               state,
+    //  Index of the first instruction
+    const size_t                entry = 0)
+{
+#ifdef SCRIPTING_THREADED
+
+    //  In NodeType order, Var, Const, IfElse and SmoothEnd do not exist in register code
+    static const void* const handlers[] =
+    {
+        &&LAdd, &&LAddConst, &&LSub, &&LSubConst, &&LConstSub, &&LMult, &&LMultConst,
+        &&LDiv, &&LDivConst, &&LConstDiv, &&LPow, &&LPowConst, &&LConstPow,
+        &&LMax2, &&LMax2Const, &&LMin2, &&LMin2Const, &&LSpot, &&LHalt, &&LHalt,
+        &&LAssign, &&LAssignConst, &&LPays, &&LPaysConst, &&LPaysScaled, &&LPaysScaledConst,
+        &&LIf, &&LHalt,
+        &&LEqual, &&LSup, &&LSupEqual, &&LAnd, &&LOr, &&LSmooth, &&LSqrt, &&LLog, &&LNot, &&LUminus,
+        &&LTrue, &&LFalse, &&LForBegin, &&LForNext, 
+        &&LAndJump, &&LOrJump, &&LSmoothBegin, &&LSmoothMid, &&LHalt, &&LJump, &&LHalt,
+        &&LSubConstSup, &&LSubConstSupEqual, &&LSubConstEqual, &&LConstSubSup, &&LConstSubSupEqual,
+        &&LIfSubConstSup, &&LIfSubConstSupEqual, &&LIfSubConstEqual, &&LIfConstSubSup, &&LIfConstSubSupEqual, &&LIfAnd,
+        &&LDivConstAdd, &&LMultConstDivConst, &&LSubConstMax2, &&LSubConstMax2Const, &&LMultConstPaysScaled
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == MultConstPaysScaled + 1, "Handler table out of sync with NodeType");
+
+#define REG_OP(OP)          L##OP:
+#define REG_NEXT            goto *handlers[(++ip)->op]
+#define REG_GOTO(TARGET)    ip = code + (TARGET); goto *handlers[ip->op]
+#define REG_BEGIN           goto *handlers[ip->op];
+#define REG_END
+
+#else
+
+#define REG_OP(OP)          case OP:
+#define REG_NEXT            ++ip; continue
+#define REG_GOTO(TARGET)    ip = code + (TARGET); continue
+#define REG_BEGIN           for (;;) switch (ip->op) {
+#define REG_END             }
+
+#endif
+
+    T* r = state.variables.data();
+    char b[REGMAXBOOLS];
+
+    //  Loop counters
+    int loops[REGMAXLOOPS];
+    int lTop = -1;
+
+    //  Work space
+    T x, y, z, t;
+
+    const RegInstr* ip = code + entry;
+
+    REG_BEGIN
+
+    REG_OP(Add)
+        r[ip->dst] = r[ip->a] + r[ip->b];
+        REG_NEXT;
+
+    REG_OP(AddConst)
+        r[ip->dst] = r[ip->a] + ip->constVal;
+        REG_NEXT;
+
+    REG_OP(Sub)
+        r[ip->dst] = r[ip->a] - r[ip->b];
+        REG_NEXT;
+
+    REG_OP(SubConst)
+        r[ip->dst] = r[ip->a] - ip->constVal;
+        REG_NEXT;
+
+    REG_OP(ConstSub)
+        r[ip->dst] = ip->constVal - r[ip->a];
+        REG_NEXT;
+
+    REG_OP(Mult)
+        r[ip->dst] = r[ip->a] * r[ip->b];
+        REG_NEXT;
+
+    REG_OP(MultConst)
+        r[ip->dst] = r[ip->a] * ip->constVal;
+        REG_NEXT;
+
+    REG_OP(Div)
+        r[ip->dst] = r[ip->a] / r[ip->b];
+        REG_NEXT;
+
+    REG_OP(DivConst)
+        r[ip->dst] = r[ip->a] / ip->constVal;
+        REG_NEXT;
+
+    REG_OP(ConstDiv)
+        r[ip->dst] = ip->constVal / r[ip->a];
+        REG_NEXT;
+
+    REG_OP(Pow)
+        r[ip->dst] = pow(r[ip->a], r[ip->b]);
+        REG_NEXT;
+
+    REG_OP(PowConst)
+        r[ip->dst] = pow(r[ip->a], ip->constVal);
+        REG_NEXT;
+
+    REG_OP(ConstPow)
+        r[ip->dst] = pow(ip->constVal, r[ip->a]);
+        REG_NEXT;
+
+    REG_OP(Max2)
+        x = r[ip->a];
+        y = r[ip->b];
+        r[ip->dst] = y > x ? y : x;
+        REG_NEXT;
+
+    REG_OP(Max2Const)
+        x = r[ip->a];
+        y = ip->constVal;
+        r[ip->dst] = y > x ? y : x;
+        REG_NEXT;
+
+    REG_OP(Min2)
+        x = r[ip->a];
+        y = r[ip->b];
+        r[ip->dst] = y < x ? y : x;
+        REG_NEXT;
+
+    REG_OP(Min2Const)
+        x = r[ip->a];
+        y = ip->constVal;
+        r[ip->dst] = y < x ? y : x;
+        REG_NEXT;
+
+    REG_OP(Spot)
+        r[ip->dst] = scen.spot;
+        REG_NEXT;
+
+    REG_OP(Assign)
+        r[ip->dst] = r[ip->a];
+        REG_NEXT;
+
+    REG_OP(AssignConst)
+        r[ip->dst] = ip->constVal;
+        REG_NEXT;
+
+    REG_OP(Pays)
+        r[ip->dst] += r[ip->a] / scen.numeraire;
+        REG_NEXT;
+
+    REG_OP(PaysConst)
+        r[ip->dst] += ip->constVal / scen.numeraire;
+        REG_NEXT;
+
+    REG_OP(PaysScaled)
+        r[ip->dst] += r[ip->a] * ip->constVal;
+        REG_NEXT;
+
+    REG_OP(PaysScaledConst)
+        r[ip->dst] += ip->constVal;
+        REG_NEXT;
+
+    REG_OP(If)
+        if (!b[ip->a])
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(ForBegin)
+        loops[++lTop] = 0;
+        REG_NEXT;
+
+    REG_OP(ForNext)
+        //  Done
+        if (loops[lTop] == ip->a)
+        {
+            --lTop;
+            REG_GOTO(ip->b);
+        }
+        //  Next value, then skip the table
+        r[ip->dst] = ip[1 + loops[lTop]].constVal;
+        ++loops[lTop];
+        ip += ip->a;
+        REG_NEXT;
+
+    REG_OP(Jump)
+        REG_GOTO(ip->b);
+
+    REG_OP(AndJump)
+        if (!b[ip->a])
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(OrJump)
+        if (b[ip->a])
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(SmoothBegin)
+        if (r[ip->a] < -0.5 * r[ip->d])
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(SmoothMid)
+        if (r[ip->a] > 0.5 * r[ip->d])
+        {
+            r[ip->dst] = r[ip->c];
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(Equal)
+        b[ip->dst] = r[ip->a] == 0;
+        REG_NEXT;
+
+    REG_OP(Sup)
+        b[ip->dst] = r[ip->a] > 0;
+        REG_NEXT;
+
+    REG_OP(SupEqual)
+        b[ip->dst] = r[ip->a] >= 0;
+        REG_NEXT;
+
+    REG_OP(And)
+        b[ip->dst] = b[ip->a] ? b[ip->b] : b[ip->a];
+        REG_NEXT;
+
+    REG_OP(Or)
+        b[ip->dst] = b[ip->a] ? b[ip->a] : b[ip->b];
+        REG_NEXT;
+
+    REG_OP(Smooth)
+        //	Eval the condition
+        x = r[ip->a];
+        y = 0.5*r[ip->d];
+        z = r[ip->b];
+        t = r[ip->c];
+
+        //	Left
+        if (x < -y) r[ip->dst] = t;
+
+        //	Right
+        else if (x > y) r[ip->dst] = z;
+
+        //	Fuzzy
+        else
+        {
+            r[ip->dst] = t + 0.5 * (z - t) / y * (x + y);
+        }
+        REG_NEXT;
+
+    REG_OP(Sqrt)
+        r[ip->dst] = sqrt(r[ip->a]);
+        REG_NEXT;
+
+    REG_OP(Log)
+        r[ip->dst] = log(r[ip->a]);
+        REG_NEXT;
+
+    REG_OP(Not)
+        b[ip->dst] = !b[ip->a];
+        REG_NEXT;
+
+    REG_OP(Uminus)
+        r[ip->dst] = -r[ip->a];
+        REG_NEXT;
+
+    REG_OP(True)
+        b[ip->dst] = true;
+        REG_NEXT;
+
+    REG_OP(False)
+        b[ip->dst] = false;
+        REG_NEXT;
+
+    //  Superinstructions
+
+    REG_OP(SubConstSup)
+        b[ip->dst] = r[ip->a] - ip->constVal > 0;
+        REG_NEXT;
+
+    REG_OP(SubConstSupEqual)
+        b[ip->dst] = r[ip->a] - ip->constVal >= 0;
+        REG_NEXT;
+
+    REG_OP(SubConstEqual)
+        b[ip->dst] = r[ip->a] - ip->constVal == 0;
+        REG_NEXT;
+
+    REG_OP(ConstSubSup)
+        b[ip->dst] = ip->constVal - r[ip->a] > 0;
+        REG_NEXT;
+
+    REG_OP(ConstSubSupEqual)
+        b[ip->dst] = ip->constVal - r[ip->a] >= 0;
+        REG_NEXT;
+
+    REG_OP(IfSubConstSup)
+        if (!(r[ip->a] - ip->constVal > 0))
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(IfSubConstSupEqual)
+        if (!(r[ip->a] - ip->constVal >= 0))
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(IfSubConstEqual)
+        if (!(r[ip->a] - ip->constVal == 0))
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(IfConstSubSup)
+        if (!(ip->constVal - r[ip->a] > 0))
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(IfConstSubSupEqual)
+        if (!(ip->constVal - r[ip->a] >= 0))
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(IfAnd)
+        if (!b[ip->a] || !b[ip->d])
+        {
+            REG_GOTO(ip->b);
+        }
+        REG_NEXT;
+
+    REG_OP(DivConstAdd)
+        r[ip->dst] = r[ip->b] + r[ip->a] / ip->constVal;
+        REG_NEXT;
+
+    REG_OP(MultConstDivConst)
+        r[ip->dst] = r[ip->a] * ip->constVal / ip->constVal2;
+        REG_NEXT;
+
+    REG_OP(SubConstMax2)
+        x = r[ip->b];
+        y = r[ip->a] - ip->constVal;
+        r[ip->dst] = y > x ? y : x;
+        REG_NEXT;
+
+    REG_OP(SubConstMax2Const)
+        x = r[ip->a] - ip->constVal;
+        y = ip->constVal2;
+        r[ip->dst] = y > x ? y : x;
+        REG_NEXT;
+
+    REG_OP(MultConstPaysScaled)
+        r[ip->dst] += r[ip->a] * ip->constVal * ip->constVal2;
+        REG_NEXT;
+
+    REG_OP(Halt)
+        return;
+
+    REG_END
+
+#undef REG_OP
+#undef REG_NEXT
+#undef REG_GOTO
+#undef REG_BEGIN
+#undef REG_END
+}
+
+//  Same, code in a vector
+template <class T>
+inline void evalRegisters(
+    //  Code to eval, from entry to the next Halt
+    const vector<RegInstr>&     code,
+    //  Scenario
+    const SimulDataRef<const T> scen,
+    //  State
+    EvalState<T>&               state,
+    //  Index of the first instruction
+    const size_t                entry = 0)
+{
+    evalRegisters(code.data(), scen, state, entry);
+}
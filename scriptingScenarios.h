@@ -26,5 +26,111 @@ struct SimulData
 	T           numeraire;
 };
 
+//  Reference to the simulated data on one event date of a scenario
 template <class T>
-using Scenario = vector<SimulData<T>>;
\ No newline at end of file
+struct SimulDataRef
+{
+	T&          spot;
+	T&          numeraire;
+};
+
+//  Simulated data on the event dates of one path, structure of arrays:
+//      spot and numeraire of event i are spots()[i * spotStride()] and numeraires()[i * numStride()]
+//  A scenario either owns its storage, or is a view into storage owned by a simulator,
+//      for example one path in a block of paths, so models simulate directly into scenarios
+//      and deterministic data is stored once for all paths
+template <class T>
+class Scenario
+{
+	size_t		mySize;
+
+	//	Own storage, spots then numeraires
+	vector<T>	myStorage;
+
+	//	Current storage, own or viewed
+	T*			mySpots;
+	T*			myNumeraires;
+	size_t		mySpotStride;
+	size_t		myNumStride;
+
+public:
+
+	//	Own storage for n event dates
+	explicit Scenario( const size_t n = 0) 
+		: mySize( n), myStorage( 2 * n), 
+		mySpots( myStorage.data()), myNumeraires( myStorage.data() + n), 
+		mySpotStride( 1), myNumStride( 1) {}
+
+	//	Not copyable, may point to own storage
+	Scenario( const Scenario&) = delete;
+	Scenario& operator=( const Scenario&) = delete;
+
+	//	View into external storage, which must outlive the view
+	void view( T* spots, const size_t spotStride, T* numeraires, const size_t numStride)
+	{
+		mySpots = spots;
+		mySpotStride = spotStride;
+		myNumeraires = numeraires;
+		myNumStride = numStride;
+	}
+
+	//	Number of event dates
+	size_t size() const
+	{
+		return mySize;
+	}
+
+	//	Access
+	T& spot( const size_t i) { return mySpots[i * mySpotStride]; }
+	const T& spot( const size_t i) const { return mySpots[i * mySpotStride]; }
+	T& numeraire( const size_t i) { return myNumeraires[i * myNumStride]; }
+	const T& numeraire( const size_t i) const { return myNumeraires[i * myNumStride]; }
+
+	SimulDataRef<T> operator[]( const size_t i) 
+	{ 
+		return SimulDataRef<T>{ spot( i), numeraire( i) };
+	}
+	SimulDataRef<const T> operator[]( const size_t i) const
+	{
+		return SimulDataRef<const T>{ spot( i), numeraire( i) };
+	}
+
+	//	Raw storage
+	T* spots() { return mySpots; }
+	T* numeraires() { return myNumeraires; }
+	size_t spotStride() const { return mySpotStride; }
+	size_t numStride() const { return myNumStride; }
+};
+
+//  Simulated data on the event dates of a block of paths, for lane-batched evaluation
+//  Spot of event i on path p is spots[i * spotEvtStride + p * spotPathStride], same for numeraires
+//  The path stride is 0 for deterministic data, shared by all paths
+template <class T>
+struct ScenarioBlock
+{
+	size_t		numPaths;
+	const T*	spots;
+	size_t		spotEvtStride;
+	size_t		spotPathStride;
+	const T*	numeraires;
+	size_t		numEvtStride;
+	size_t		numPathStride;
+
+	//	Paths first to first + n - 1
+	ScenarioBlock subBlock( const size_t first, const size_t n) const
+	{
+		ScenarioBlock res = *this;
+		res.numPaths = n;
+		res.spots += first * spotPathStride;
+		res.numeraires += first * numPathStride;
+		return res;
+	}
+};
+
+//  Fields of SimulData, models declare which ones are deterministic (path independent)
+//  Those are populated once in the scenario, not on every path
+enum SimulDataField
+{
+    SimulSpot = 1,
+    SimulNumeraire = 2
+};
\ No newline at end of file
@@ -0,0 +1,287 @@
+#pragma once
+
+//  SIMD execution of compiled scripts over path lanes
+//  The compiled streams of scriptingCompiler.h are interpreted on 4 (AVX2) or 8 (AVX-512) paths at once,
+//      one path per lane of the machine vectors, see scriptingSimdKernel.h
+//  The instruction set is detected at run time,
+//      and the paths are evaluated one by one with evalCompiled() when neither is available
+//  The kernels are compiled with function level target attributes on GCC and Clang,
+//      so no compiler flag is required, and the code runs on any machine
+
+#include "scriptingCompiler.h"
+#include "scriptingScenarios.h"
+
+#include <vector>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define SCRIPTING_SIMD
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#endif
+
+//  Supported instruction sets, in increasing order
+enum SimdIsa
+{
+    SimdNone,
+    SimdAvx2,
+    SimdAvx512
+};
+
+//  Best instruction set supported by the CPU and the OS
+inline SimdIsa detectSimdIsa()
+{
+#ifdef SCRIPTING_SIMD
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return SimdNone;
+
+    //  OS saves the ymm registers
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28))) return SimdNone;
+    const unsigned long long xcr0 = _xgetbv(0);
+    if ((xcr0 & 0x06) != 0x06) return SimdNone;
+
+    __cpuidex(info, 7, 0);
+    //  AVX-512F, and OS saves the zmm registers and mask registers
+    if ((info[1] & (1 << 16)) && (xcr0 & 0xe6) == 0xe6) return SimdAvx512;
+    if (info[1] & (1 << 5)) return SimdAvx2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdAvx512;
+    if (__builtin_cpu_supports("avx2")) return SimdAvx2;
+#endif
+#endif
+    return SimdNone;
+}
+
+//  Detected once
+inline SimdIsa simdIsa()
+{
+    static const SimdIsa isa = detectSimdIsa();
+    return isa;
+}
+
+//  Number of lanes
+inline size_t simdWidth(const SimdIsa isa)
+{
+    return isa == SimdAvx512 ? 8 : isa == SimdAvx2 ? 4 : 1;
+}
+
+#ifdef SCRIPTING_SIMD
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#endif
+
+//  Vector types and operations for the kernels
+//  No FMA, so results are identical to the scalar code
+//  select( m, a, b) = m ? a : b lane by lane
+//  max( a, b) = a > b ? a : b and min( a, b) = a < b ? a : b, like the scalar code for NaNs
+
+namespace simdAvx2
+{
+#define LANES_TARGET SIMD_TARGET_AVX2
+
+    struct Lanes
+    {
+        enum { width = 4 };
+
+        //  Values
+        typedef __m256d D;
+        //  Masks, all bits set on true lanes
+        typedef __m256d M;
+
+        static LANES_TARGET D load(const double* p) { return _mm256_loadu_pd(p); }
+        static LANES_TARGET void store(double* p, const D x) { _mm256_storeu_pd(p, x); }
+        static LANES_TARGET D set1(const double x) { return _mm256_set1_pd(x); }
+
+        static LANES_TARGET D add(const D x, const D y) { return _mm256_add_pd(x, y); }
+        static LANES_TARGET D sub(const D x, const D y) { return _mm256_sub_pd(x, y); }
+        static LANES_TARGET D mul(const D x, const D y) { return _mm256_mul_pd(x, y); }
+        static LANES_TARGET D div(const D x, const D y) { return _mm256_div_pd(x, y); }
+        static LANES_TARGET D max(const D x, const D y) { return _mm256_max_pd(x, y); }
+        static LANES_TARGET D min(const D x, const D y) { return _mm256_min_pd(x, y); }
+        static LANES_TARGET D sqrt(const D x) { return _mm256_sqrt_pd(x); }
+        static LANES_TARGET D neg(const D x) { return _mm256_xor_pd(x, _mm256_set1_pd(-0.0)); }
+
+        static LANES_TARGET M lt(const D x, const D y) { return _mm256_cmp_pd(x, y, _CMP_LT_OQ); }
+        static LANES_TARGET M gt(const D x, const D y) { return _mm256_cmp_pd(x, y, _CMP_GT_OQ); }
+        static LANES_TARGET M ge(const D x, const D y) { return _mm256_cmp_pd(x, y, _CMP_GE_OQ); }
+        static LANES_TARGET M eq(const D x, const D y) { return _mm256_cmp_pd(x, y, _CMP_EQ_OQ); }
+
+        static LANES_TARGET M allTrue() { return _mm256_castsi256_pd(_mm256_set1_epi64x(-1)); }
+        static LANES_TARGET M allFalse() { return _mm256_setzero_pd(); }
+        //  First n lanes true
+        static LANES_TARGET M firstLanes(const size_t n)
+        {
+            return _mm256_cmp_pd(_mm256_set_pd(3.0, 2.0, 1.0, 0.0), _mm256_set1_pd(double(n)), _CMP_LT_OQ);
+        }
+        static LANES_TARGET M and_(const M a, const M b) { return _mm256_and_pd(a, b); }
+        static LANES_TARGET M or_(const M a, const M b) { return _mm256_or_pd(a, b); }
+        //  a and not b
+        static LANES_TARGET M andNot(const M a, const M b) { return _mm256_andnot_pd(b, a); }
+        static LANES_TARGET bool any(const M m) { return _mm256_movemask_pd(m) != 0; }
+        static LANES_TARGET bool same(const M a, const M b) { return _mm256_movemask_pd(a) == _mm256_movemask_pd(b); }
+
+        static LANES_TARGET D select(const M m, const D x, const D y) { return _mm256_blendv_pd(y, x, m); }
+
+        //  Before returning to code compiled without AVX
+        static LANES_TARGET void zeroUpper() { _mm256_zeroupper(); }
+    };
+
+#include "scriptingSimdKernel.h"
+
+#undef LANES_TARGET
+}
+
+namespace simdAvx512
+{
+#define LANES_TARGET SIMD_TARGET_AVX512
+
+    struct Lanes
+    {
+        enum { width = 8 };
+
+        //  Values
+        typedef __m512d D;
+        //  Masks, one bit per lane
+        typedef __mmask8 M;
+
+        static LANES_TARGET D load(const double* p) { return _mm512_loadu_pd(p); }
+        static LANES_TARGET void store(double* p, const D x) { _mm512_storeu_pd(p, x); }
+        static LANES_TARGET D set1(const double x) { return _mm512_set1_pd(x); }
+
+        static LANES_TARGET D add(const D x, const D y) { return _mm512_add_pd(x, y); }
+        static LANES_TARGET D sub(const D x, const D y) { return _mm512_sub_pd(x, y); }
+        static LANES_TARGET D mul(const D x, const D y) { return _mm512_mul_pd(x, y); }
+        static LANES_TARGET D div(const D x, const D y) { return _mm512_div_pd(x, y); }
+        static LANES_TARGET D max(const D x, const D y) { return _mm512_max_pd(x, y); }
+        static LANES_TARGET D min(const D x, const D y) { return _mm512_min_pd(x, y); }
+        static LANES_TARGET D sqrt(const D x) { return _mm512_sqrt_pd(x); }
+        //  Flip the sign bit, AVX-512F has no floating point xor
+        static LANES_TARGET D neg(const D x)
+        {
+            return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(x), _mm512_castpd_si512(_mm512_set1_pd(-0.0))));
+        }
+
+        static LANES_TARGET M lt(const D x, const D y) { return _mm512_cmp_pd_mask(x, y, _CMP_LT_OQ); }
+        static LANES_TARGET M gt(const D x, const D y) { return _mm512_cmp_pd_mask(x, y, _CMP_GT_OQ); }
+        static LANES_TARGET M ge(const D x, const D y) { return _mm512_cmp_pd_mask(x, y, _CMP_GE_OQ); }
+        static LANES_TARGET M eq(const D x, const D y) { return _mm512_cmp_pd_mask(x, y, _CMP_EQ_OQ); }
+
+        static LANES_TARGET M allTrue() { return M(0xff); }
+        static LANES_TARGET M allFalse() { return M(0); }
+        //  First n lanes true
+        static LANES_TARGET M firstLanes(const size_t n) { return M((1u << n) - 1); }
+        static LANES_TARGET M and_(const M a, const M b) { return M(a & b); }
+        static LANES_TARGET M or_(const M a, const M b) { return M(a | b); }
+        //  a and not b
+        static LANES_TARGET M andNot(const M a, const M b) { return M(a & ~b); }
+        static LANES_TARGET bool any(const M m) { return m != 0; }
+        static LANES_TARGET bool same(const M a, const M b) { return a == b; }
+
+        static LANES_TARGET D select(const M m, const D x, const D y) { return _mm512_mask_blend_pd(m, y, x); }
+
+        //  Before returning to code compiled without AVX
+        static LANES_TARGET void zeroUpper() { _mm256_zeroupper(); }
+    };
+
+#include "scriptingSimdKernel.h"
+
+#undef LANES_TARGET
+}
+
+#endif
+
+//  State of the lane interpreter
+//  Variable i on lane l in variables[i * width() + l]
+struct EvalStateLanes : public EvalState<double>
+{
+    //  Instruction set in use
+    const SimdIsa       isa;
+
+    //  Constructor, the instruction set defaults to the best available one
+    //      and is capped to what the machine supports
+    EvalStateLanes(const size_t nVar, const SimdIsa requested = simdIsa())
+        : EvalState<double>(nVar * simdWidth(min(requested, simdIsa()))),
+        isa(min(requested, simdIsa())) {}
+
+    //  Maximum number of lanes
+    size_t width() const
+    {
+        return simdWidth(isa);
+    }
+
+    //  Initializer, all variables or the first n ones, on all lanes
+    using EvalState<double>::init;
+    void init(const size_t n)
+    {
+        EvalState<double>::init(n * width());
+    }
+
+    //	Values of variable i on all lanes, after evaluation
+    const double* varVals(const size_t i) const
+    {
+        return &variables[i * width()];
+    }
+};
+
+//  Evaluate a compiled program, all events, on a block of at most state.width() scenarios
+inline void evalCompiledLanes(
+    //  Program to eval
+    const CompiledProgram&          prg,
+    //  Scenarios
+    const ScenarioBlock<double>&    scen,
+    //  State
+    EvalStateLanes&                 state)
+{
+    const StackDepths depths = prg.maxDepths();
+
+#ifdef SCRIPTING_SIMD
+    //  The lane stacks are of fixed size EVALSTACKSIZE, deeper code is evaluated one lane at a time
+    if (state.isa == SimdAvx512 && depths.deepest() <= EVALSTACKSIZE)
+    {
+        simdAvx512::evalCompiledLanes(prg, scen, state.variables.data());
+        return;
+    }
+    if (state.isa == SimdAvx2 && depths.deepest() <= EVALSTACKSIZE)
+    {
+        simdAvx2::evalCompiledLanes(prg, scen, state.variables.data());
+        return;
+    }
+#endif
+
+    //  Scalar fallback, one lane at a time, 
+    //      on the state itself when it has one lane, on a copy of the variables of the lane otherwise
+    const size_t width = state.width();
+    const size_t nVar = state.variables.size() / width;
+    EvalState<double> laneState(width == 1 ? 0 : nVar);
+    EvalState<double>& evalState = width == 1 ? static_cast<EvalState<double>&>(state) : laneState;
+
+    withEvalStacks<double>(depths, [&](auto& stacks)
+    {
+        for (size_t l = 0; l < scen.numPaths; ++l)
+        {
+            if (width > 1) for (size_t v = 0; v < nVar; ++v) laneState.variables[v] = state.variables[v * width + l];
+
+            for (size_t evt = 0; evt < prg.numEvents(); ++evt)
+            {
+                evalCompiled(prg.nodeStream.data(), prg.constStream.data(), prg.dataStream.data(),
+                    SimulDataRef<const double>{ 
+                        scen.spots[evt * scen.spotEvtStride + l * scen.spotPathStride], 
+                        scen.numeraires[evt * scen.numEvtStride + l * scen.numPathStride] },
+                    evalState, prg.entries[evt], prg.entries[evt + 1], stacks);
+            }
+
+            if (width > 1) for (size_t v = 0; v < nVar; ++v) state.variables[v * width + l] = laneState.variables[v];
+        }
+    });
+}
@@ -0,0 +1,567 @@
+//  Lane interpreter of compiled scripts
+//  No include guard: this file is included once per instruction set by scriptingSimd.h,
+//      inside a namespace that defines the vector types and operations in Lanes,
+//      and the target attribute LANES_TARGET for the functions that use them
+//  Same instructions and same results as evalCompiled() in scriptingCompiler.h,
+//      on Lanes::width paths at once, lane l being path l
+//  Instructions write on the active lanes only,
+//      if statements restrict the active lanes to those that take the branch,
+//      and skip a branch when no active lane takes it
+
+//  Evaluate instructions first to last (excluded) on the active lanes
+LANES_TARGET inline void evalCompiledLanes(
+    //  Stream to eval
+    const vector<int>&          nodeStream,
+    const vector<double>&       constStream,
+    //  Scenario lanes
+    const Lanes::D              spot,
+    const Lanes::D              numeraire,
+    //  State, variable i on lane l in variables[i * Lanes::width + l]
+    double*                     variables,
+    //  Active lanes
+    const Lanes::M              active,
+    //  First (included), last (excluded)
+    const size_t                first,
+    const size_t                last)
+{
+    typedef Lanes::D D;
+    typedef Lanes::M M;
+
+    size_t i = first;
+
+    //  Work space
+    D x, y, z, t;
+    M c, cf;
+    double* v;
+    alignas(64) double w[Lanes::width];
+
+    //  Stacks, plain arrays of machine vectors, of the default size of the stacks of evalCompiled(),
+    //      deeper code is not evaluated here, see evalCompiledLanes() in scriptingSimd.h
+    D dStack[EVALSTACKSIZE];
+    M bStack[EVALSTACKSIZE];
+    int dTop = -1, bTop = -1;
+
+    //  Loop counters, the same on all lanes
+    int lStack[EVALSTACKSIZE];
+    int lTop = -1;
+
+    //  Loop on instructions
+    while (i < last)
+    {
+        //  Big switch
+        switch (nodeStream[i])
+        {
+
+        case Add:
+
+            dStack[dTop - 1] = Lanes::add(dStack[dTop - 1], dStack[dTop]);
+            --dTop;
+
+            ++i;
+            break;
+
+        case AddConst:
+
+            dStack[dTop] = Lanes::add(dStack[dTop], Lanes::set1(constStream[nodeStream[++i]]));
+
+            ++i;
+            break;
+
+        case Sub:
+
+            dStack[dTop - 1] = Lanes::sub(dStack[dTop - 1], dStack[dTop]);
+            --dTop;
+
+            ++i;
+            break;
+
+        case SubConst:
+
+            dStack[dTop] = Lanes::sub(dStack[dTop], Lanes::set1(constStream[nodeStream[++i]]));
+
+            ++i;
+            break;
+
+        case ConstSub:
+
+            dStack[dTop] = Lanes::sub(Lanes::set1(constStream[nodeStream[++i]]), dStack[dTop]);
+
+            ++i;
+            break;
+
+        case Mult:
+
+            dStack[dTop - 1] = Lanes::mul(dStack[dTop - 1], dStack[dTop]);
+            --dTop;
+
+            ++i;
+            break;
+
+        case MultConst:
+
+            dStack[dTop] = Lanes::mul(dStack[dTop], Lanes::set1(constStream[nodeStream[++i]]));
+
+            ++i;
+            break;
+
+        case Div:
+
+            dStack[dTop - 1] = Lanes::div(dStack[dTop - 1], dStack[dTop]);
+            --dTop;
+
+            ++i;
+            break;
+
+        case DivConst:
+
+            dStack[dTop] = Lanes::div(dStack[dTop], Lanes::set1(constStream[nodeStream[++i]]));
+
+            ++i;
+            break;
+
+        case ConstDiv:
+
+            dStack[dTop] = Lanes::div(Lanes::set1(constStream[nodeStream[++i]]), dStack[dTop]);
+
+            ++i;
+            break;
+
+        //  No vector pow or log, lane by lane
+
+        case Pow:
+
+            Lanes::store(w, dStack[dTop - 1]);
+            {
+                alignas(64) double e[Lanes::width];
+                Lanes::store(e, dStack[dTop]);
+                for (size_t l = 0; l < Lanes::width; ++l) w[l] = pow(w[l], e[l]);
+            }
+            dStack[dTop - 1] = Lanes::load(w);
+            --dTop;
+
+            ++i;
+            break;
+
+        case PowConst:
+
+            Lanes::store(w, dStack[dTop]);
+            {
+                const double e = constStream[nodeStream[++i]];
+                for (size_t l = 0; l < Lanes::width; ++l) w[l] = pow(w[l], e);
+            }
+            dStack[dTop] = Lanes::load(w);
+
+            ++i;
+            break;
+
+        case ConstPow:
+
+            Lanes::store(w, dStack[dTop]);
+            {
+                const double b = constStream[nodeStream[++i]];
+                for (size_t l = 0; l < Lanes::width; ++l) w[l] = pow(b, w[l]);
+            }
+            dStack[dTop] = Lanes::load(w);
+
+            ++i;
+            break;
+
+        case Max2:
+
+            dStack[dTop - 1] = Lanes::max(dStack[dTop], dStack[dTop - 1]);
+            --dTop;
+
+            ++i;
+            break;
+
+        case Max2Const:
+
+            dStack[dTop] = Lanes::max(Lanes::set1(constStream[nodeStream[++i]]), dStack[dTop]);
+
+            ++i;
+            break;
+
+        case Min2:
+
+            dStack[dTop - 1] = Lanes::min(dStack[dTop], dStack[dTop - 1]);
+            --dTop;
+
+            ++i;
+            break;
+
+        case Min2Const:
+
+            dStack[dTop] = Lanes::min(Lanes::set1(constStream[nodeStream[++i]]), dStack[dTop]);
+
+            ++i;
+            break;
+
+        case Spot:
+
+            dStack[++dTop] = spot;
+
+            ++i;
+            break;
+
+        case Var:
+
+            dStack[++dTop] = Lanes::load(variables + nodeStream[++i] * Lanes::width);
+
+            ++i;
+            break;
+
+        case Const:
+
+            dStack[++dTop] = Lanes::set1(constStream[nodeStream[++i]]);
+
+            ++i;
+            break;
+
+        case Assign:
+
+            v = variables + nodeStream[++i] * Lanes::width;
+            Lanes::store(v, Lanes::select(active, dStack[dTop], Lanes::load(v)));
+            --dTop;
+
+            ++i;
+            break;
+
+        case AssignConst:
+
+            x = Lanes::set1(constStream[nodeStream[++i]]);
+            v = variables + nodeStream[++i] * Lanes::width;
+            Lanes::store(v, Lanes::select(active, x, Lanes::load(v)));
+
+            ++i;
+            break;
+
+        case Pays:
+
+            v = variables + nodeStream[++i] * Lanes::width;
+            x = Lanes::load(v);
+            Lanes::store(v, Lanes::select(active, Lanes::add(x, Lanes::div(dStack[dTop], numeraire)), x));
+            --dTop;
+
+            ++i;
+            break;
+
+        case PaysConst:
+
+            y = Lanes::set1(constStream[nodeStream[++i]]);
+            v = variables + nodeStream[++i] * Lanes::width;
+            x = Lanes::load(v);
+            Lanes::store(v, Lanes::select(active, Lanes::add(x, Lanes::div(y, numeraire)), x));
+
+            ++i;
+            break;
+
+        case PaysScaled:
+
+            y = Lanes::set1(constStream[nodeStream[++i]]);
+            v = variables + nodeStream[++i] * Lanes::width;
+            x = Lanes::load(v);
+            Lanes::store(v, Lanes::select(active, Lanes::add(x, Lanes::mul(dStack[dTop], y)), x));
+            --dTop;
+
+            ++i;
+            break;
+
+        case PaysScaledConst:
+
+            y = Lanes::set1(constStream[nodeStream[++i]]);
+            v = variables + nodeStream[++i] * Lanes::width;
+            x = Lanes::load(v);
+            Lanes::store(v, Lanes::select(active, Lanes::add(x, y), x));
+
+            ++i;
+            break;
+
+        case If:
+
+            c = Lanes::and_(bStack[bTop], active);
+            --bTop;
+
+            //  No lane: skip
+            if (!Lanes::any(c))
+            {
+                i = nodeStream[i + 1];
+            }
+            //  All active lanes: carry on
+            else if (Lanes::same(c, active))
+            {
+                i += 2;
+            }
+            //  Some lanes: nested call on those
+            else
+            {
+                evalCompiledLanes(nodeStream, constStream, spot, numeraire, variables, c, i + 2, nodeStream[i + 1]);
+                i = nodeStream[i + 1];
+            }
+
+            break;
+
+        case IfElse:
+
+            c = Lanes::and_(bStack[bTop], active);
+            cf = Lanes::andNot(active, bStack[bTop]);
+            --bTop;
+
+            //  If-true statements on the lanes that take them, if any
+            if (Lanes::any(c))
+            {
+                evalCompiledLanes(nodeStream, constStream, spot, numeraire, variables, c, i + 3, nodeStream[i + 1]);
+            }
+
+            //  If-false statements
+            if (!Lanes::any(cf))
+            {
+                i = nodeStream[i + 2];
+            }
+            else if (Lanes::same(cf, active))
+            {
+                i = nodeStream[i + 1];
+            }
+            else
+            {
+                evalCompiledLanes(nodeStream, constStream, spot, numeraire, variables, cf, nodeStream[i + 1], nodeStream[i + 2]);
+                i = nodeStream[i + 2];
+            }
+
+            break;
+
+        case Equal:
+
+            bStack[++bTop] = Lanes::eq(dStack[dTop], Lanes::set1(0.0));
+            --dTop;
+
+            ++i;
+            break;
+
+        case Sup:
+
+            bStack[++bTop] = Lanes::gt(dStack[dTop], Lanes::set1(0.0));
+            --dTop;
+
+            ++i;
+            break;
+
+        case SupEqual:
+
+            bStack[++bTop] = Lanes::ge(dStack[dTop], Lanes::set1(0.0));
+            --dTop;
+
+            ++i;
+            break;
+
+        case And:
+
+            bStack[bTop - 1] = Lanes::and_(bStack[bTop - 1], bStack[bTop]);
+            --bTop;
+
+            ++i;
+            break;
+
+        case Or:
+
+            bStack[bTop - 1] = Lanes::or_(bStack[bTop - 1], bStack[bTop]);
+            --bTop;
+
+            ++i;
+            break;
+
+        case Smooth:
+
+            //	Eval the condition
+            x = dStack[dTop - 3];
+            y = Lanes::mul(Lanes::set1(0.5), dStack[dTop]);
+            z = dStack[dTop - 2];
+            t = dStack[dTop - 1];
+
+            dTop -= 3;
+
+            //  Fuzzy, then left and right
+            dStack[dTop] = Lanes::add(t,
+                Lanes::mul(Lanes::div(Lanes::mul(Lanes::set1(0.5), Lanes::sub(z, t)), y), Lanes::add(x, y)));
+            dStack[dTop] = Lanes::select(Lanes::gt(x, y), z, dStack[dTop]);
+            dStack[dTop] = Lanes::select(Lanes::lt(x, Lanes::neg(y)), t, dStack[dTop]);
+
+            ++i;
+            break;
+
+        case Sqrt:
+
+            dStack[dTop] = Lanes::sqrt(dStack[dTop]);
+
+            ++i;
+            break;
+
+        case Log:
+
+            Lanes::store(w, dStack[dTop]);
+            for (size_t l = 0; l < Lanes::width; ++l) w[l] = log(w[l]);
+            dStack[dTop] = Lanes::load(w);
+
+            ++i;
+            break;
+
+        case Not:
+
+            bStack[bTop] = Lanes::andNot(Lanes::allTrue(), bStack[bTop]);
+
+            ++i;
+            break;
+
+        case Uminus:
+
+            dStack[dTop] = Lanes::neg(dStack[dTop]);
+
+            ++i;
+            break;
+
+        case True:
+
+            bStack[++bTop] = Lanes::allTrue();
+
+            ++i;
+            break;
+
+        case False:
+
+            bStack[++bTop] = Lanes::allFalse();
+
+            ++i;
+            break;
+
+        case ForBegin:
+
+            lStack[++lTop] = 0;
+
+            ++i;
+            break;
+
+        case ForNext:
+
+            //  Done
+            if (lStack[lTop] == nodeStream[i + 3])
+            {
+                --lTop;
+                i = nodeStream[i + 4];
+            }
+            //  Next value, on the active lanes
+            else
+            {
+                v = variables + nodeStream[i + 1] * Lanes::width;
+                x = Lanes::set1(constStream[nodeStream[i + 2] + lStack[lTop]]);
+                Lanes::store(v, Lanes::select(active, x, Lanes::load(v)));
+                ++lStack[lTop];
+                i += 5;
+            }
+
+            break;
+
+        //  Short-circuits when the lhs decides on all active lanes
+        case AndJump:
+
+            if (!Lanes::any(Lanes::and_(bStack[bTop], active))) i = nodeStream[i + 1];
+            else i += 2;
+
+            break;
+
+        case OrJump:
+
+            if (Lanes::same(Lanes::and_(bStack[bTop], active), active)) i = nodeStream[i + 1];
+            else i += 2;
+
+            break;
+
+        //  Lazy smooth, branches skipped when no active lane needs them
+        case SmoothBegin:
+
+            y = Lanes::mul(Lanes::set1(0.5), dStack[dTop]);
+            c = Lanes::and_(Lanes::lt(dStack[dTop - 1], Lanes::neg(y)), active);
+            if (Lanes::same(c, active))
+            {
+                dStack[dTop + 1] = dStack[dTop];
+                ++dTop;
+                i = nodeStream[i + 1];
+            }
+            else i += 2;
+
+            break;
+
+        case SmoothMid:
+
+            y = Lanes::mul(Lanes::set1(0.5), dStack[dTop - 1]);
+            c = Lanes::and_(Lanes::gt(dStack[dTop - 2], y), active);
+            if (Lanes::same(c, active))
+            {
+                dStack[dTop - 2] = dStack[dTop];
+                dTop -= 2;
+                i = nodeStream[i + 1];
+            }
+            else i += 2;
+
+            break;
+
+        //  x, epsilon, value if positive, value if negative
+        case SmoothEnd:
+
+            x = dStack[dTop - 3];
+            y = Lanes::mul(Lanes::set1(0.5), dStack[dTop - 2]);
+            z = dStack[dTop - 1];
+            t = dStack[dTop];
+
+            dTop -= 3;
+
+            //  Fuzzy, then left and right
+            dStack[dTop] = Lanes::add(t,
+                Lanes::mul(Lanes::div(Lanes::mul(Lanes::set1(0.5), Lanes::sub(z, t)), y), Lanes::add(x, y)));
+            dStack[dTop] = Lanes::select(Lanes::gt(x, y), z, dStack[dTop]);
+            dStack[dTop] = Lanes::select(Lanes::lt(x, Lanes::neg(y)), t, dStack[dTop]);
+
+            ++i;
+            break;
+
+        case Jump:
+
+            i = nodeStream[i + 1];
+
+            break;
+        }
+    }
+}
+
+//  Scenario lanes, path stride 0 (deterministic data) is broadcast,
+//      missing lanes are set to 1 so they stay finite
+LANES_TARGET inline Lanes::D loadScenarioLanes(const double* data, const size_t pathStride, const size_t n)
+{
+    if (pathStride == 0) return Lanes::set1(*data);
+    if (pathStride == 1 && n == Lanes::width) return Lanes::load(data);
+
+    alignas(64) double x[Lanes::width];
+    for (size_t l = 0; l < Lanes::width; ++l) x[l] = l < n ? data[l * pathStride] : 1.0;
+    return Lanes::load(x);
+}
+
+//  Evaluate a compiled program on a block of at most Lanes::width scenarios, all events in one call
+LANES_TARGET inline void evalCompiledLanes(
+    //  Program to eval
+    const CompiledProgram&          prg,
+    //  Scenarios
+    const ScenarioBlock<double>&    scen,
+    //  State, variable i on lane l in variables[i * Lanes::width + l]
+    double*                         variables)
+{
+    for (size_t evt = 0; evt < prg.numEvents(); ++evt)
+    {
+        evalCompiledLanes(prg.nodeStream, prg.constStream,
+            loadScenarioLanes(scen.spots + evt * scen.spotEvtStride, scen.spotPathStride, scen.numPaths),
+            loadScenarioLanes(scen.numeraires + evt * scen.numEvtStride, scen.numPathStride, scen.numPaths),
+            variables, Lanes::firstLanes(scen.numPaths), prg.entries[evt], prg.entries[evt + 1]);
+    }
+
+    //  The compiler does not clear the upper halves of the registers on return 
+    //      from functions with vector arguments, and the caller may run SSE code,
+    //      which is heavily penalized on some CPUs while they are dirty
+    Lanes::zeroUpper();
+}
@@ -47,7 +47,11 @@ public:
 	{
 		auto varIt = myVarMap.find( node.name);
 		if( varIt == myVarMap.end()) 
-			node.index = myVarMap[node.name] = myVarMap.size();
+		{
+			//	Size before insertion: the order of evaluation of an assignment is unspecified before C++17
+			const size_t index = myVarMap.size();
+			node.index = myVarMap[node.name] = index;
+		}
 		else node.index = varIt->second;
 	}
 };
\ No newline at end of file
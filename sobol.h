@@ -0,0 +1,233 @@
+#pragma once
+
+/*	Sobol quasi-random generator
+	Dimension 1 is Van der Corput's, dimension d>1 uses the (d-1)-th primitive polynomial over GF(2),
+		polynomials being enumerated by increasing degree, then increasing coefficients
+	Primitive polynomials and direction numbers are computed on initialization for any dimension
+	Initial direction numbers are odd pseudo-random integers (Jaeckel's regularity breaking initialisation)
+	Points are generated in Gray code order, one XOR per coordinate
+	Skip ahead to any point index is O(32 * dim)
+	Optionally, points are scrambled with a random digital shift,
+		so independent replicas provide error estimates */
+
+#include "cpp11basicRanGen.h"
+#include "gaussians.h"
+
+#include <cstdint>
+
+class Sobol : public RandomGen
+{
+	//	Direction numbers [dim][bit]
+	vector<vector<uint32_t>>	myDirNums;
+
+	//	Current point, in integer form
+	vector<uint32_t>			myState;
+
+	//	Digital shift, 0 unless scrambled
+	vector<uint32_t>			myShift;
+
+	//	Index of the current point
+	uint32_t					myIndex;
+
+	//	Scrambling seed, 0 = not scrambled
+	unsigned					myScramble;
+
+	size_t						myDim;
+
+	vector<double>				myNormVec;
+
+	//	Work space, uniforms
+	vector<double>				myUnifBlock;
+
+	//	Polynomials over GF(2) are represented by the bits of their coefficients
+
+	//	a * b mod p, p of degree deg
+	static uint64_t polyMulMod(uint64_t a, uint64_t b, const uint64_t p, const unsigned deg)
+	{
+		uint64_t res = 0;
+		while (b)
+		{
+			if (b & 1) res ^= a;
+			b >>= 1;
+			a <<= 1;
+			if (a >> deg & 1) a ^= p;
+		}
+		return res;
+	}
+
+	//	x^e mod p, p of degree deg
+	static uint64_t polyPowX(uint64_t e, const uint64_t p, const unsigned deg)
+	{
+		uint64_t res = 1, x = deg > 1 ? 2 : 2 ^ p;
+		while (e)
+		{
+			if (e & 1) res = polyMulMod(res, x, p, deg);
+			x = polyMulMod(x, x, p, deg);
+			e >>= 1;
+		}
+		return res;
+	}
+
+	//	p is primitive iff x has order exactly 2^deg - 1 modulo p
+	static bool isPrimitive(const uint64_t p, const unsigned deg)
+	{
+		const uint64_t order = (uint64_t(1) << deg) - 1;
+		if (polyPowX(order, p, deg) != 1) return false;
+
+		//	x^(order/q) != 1 for all prime factors q of the order
+		uint64_t n = order;
+		for (uint64_t q = 2; q * q <= n; ++q)
+		{
+			if (n % q) continue;
+			if (polyPowX(order / q, p, deg) == 1) return false;
+			while (n % q == 0) n /= q;
+		}
+		if (n > 1 && n < order && polyPowX(order / n, p, deg) == 1) return false;
+
+		return true;
+	}
+
+	//	Compute direction numbers for dimensions 1 to dim
+	void initDirNums(const size_t dim)
+	{
+		myDirNums.assign(dim, vector<uint32_t>(32));
+
+		//	Van der Corput
+		for (unsigned k = 0; k<32; ++k) myDirNums[0][k] = uint32_t(1) << (31 - k);
+
+		//	Fixed seed: direction numbers are part of the sequence definition
+		mt19937 eng(20180101);
+
+		size_t d = 1;
+		for (unsigned deg = 1; d < dim; ++deg)
+		{
+			if (deg > 31) throw randomgen_error("Sobol: dimension too large");
+
+			//	Polynomials of degree deg with constant term 1
+			for (uint64_t p = (uint64_t(1) << deg) | 1; d < dim && p < (uint64_t(2) << deg); p += 2)
+			{
+				if (!isPrimitive(p, deg)) continue;
+
+				vector<uint32_t>& v = myDirNums[d];
+
+				//	Initial direction numbers m_k, odd and < 2^k, scaled to v_k = m_k / 2^k
+				for (unsigned k = 0; k < deg && k < 32; ++k)
+				{
+					const uint32_t m = (eng() >> (31 - k) | 1) & ((uint32_t(2) << k) - 1);
+					v[k] = m << (31 - k);
+				}
+
+				//	Recursion v_k = v_(k-deg) ^ v_(k-deg) >> deg ^ sum a_j v_(k-j)
+				for (unsigned k = deg; k<32; ++k)
+				{
+					uint32_t vk = v[k - deg] ^ (v[k - deg] >> deg);
+					for (unsigned j = 1; j < deg; ++j)
+					{
+						if (p >> (deg - j) & 1) vk ^= v[k - j];
+					}
+					v[k] = vk;
+				}
+
+				++d;
+			}
+		}
+	}
+
+	//	Next point, Gray code order: flip the direction number of the lowest zero bit of the index
+	//	Writes the (shifted) uniforms into unif
+	void nextPoint(double* unif)
+	{
+		static const double ONEOVER2POW32 = 1.0 / 4294967296.0;
+
+		if (myIndex == 0xFFFFFFFF) throw randomgen_error("Sobol: sequence exhausted");
+
+		unsigned c = 0;
+		for (uint32_t n = myIndex; n & 1; n >>= 1) ++c;
+		++myIndex;
+
+		for (size_t i = 0; i<myDim; ++i)
+		{
+			myState[i] ^= myDirNums[i][c];
+			unif[i] = ((myState[i] ^ myShift[i]) + 0.5) * ONEOVER2POW32;
+		}
+	}
+
+public:
+
+	//	Scramble 0 = plain Sobol, otherwise seed of the random digital shift
+	Sobol(const unsigned scramble = 0) : myIndex(0), myScramble(scramble), myDim(0) {}
+
+	void init(const size_t dim) override
+	{
+		myDim = dim;
+		myNormVec.resize(dim);
+		initDirNums(dim);
+
+		//	Start at point 0, which is never returned
+		myIndex = 0;
+		myState.assign(dim, 0);
+
+		myShift.assign(dim, 0);
+		if (myScramble)
+		{
+			mt19937 eng(myScramble);
+			for (auto& s : myShift) s = uint32_t(eng());
+		}
+	}
+
+	void genNextNormVec() override
+	{
+		genNextNormBlock(1, myNormVec.data());
+	}
+
+	//	Points are sequential, but the inverse CDF is vectorized over the block
+	void genNextNormBlock(const size_t nPaths, double* out) override
+	{
+		const size_t n = nPaths * myDim;
+		if (myUnifBlock.size() < n) myUnifBlock.resize(n);
+
+		for (size_t p = 0; p<nPaths; ++p)
+		{
+			nextPoint(myUnifBlock.data() + p * myDim);
+		}
+
+		invNormalCdfBlock(myUnifBlock.data(), out, n);
+	}
+
+	const vector<double>& getNorm() const override
+	{
+		return myNormVec;
+	}
+
+	//  Clone
+	unique_ptr<RandomGen> clone() const override
+	{
+		return unique_ptr<RandomGen>(new Sobol(*this));
+	}
+
+	//	Skip ahead: jump to point index + skip directly from its Gray code
+	void skipAhead(const long skip) override
+	{
+		if (skip <= 0) return;
+		setPath(size_t(myIndex) + size_t(skip));
+	}
+
+	//	Random access: the next point is path + 1, since point 0 is never returned
+	void setPath(const size_t path) override
+	{
+		if (uint64_t(path) >= 0xFFFFFFFF) throw randomgen_error("Sobol: sequence exhausted");
+		myIndex = uint32_t(path);
+
+		const uint32_t gray = myIndex ^ (myIndex >> 1);
+
+		for (size_t i = 0; i<myDim; ++i)
+		{
+			uint32_t x = 0;
+			for (unsigned k = 0; k<32; ++k)
+			{
+				if (gray >> k & 1) x ^= myDirNums[i][k];
+			}
+			myState[i] = x;
+		}
+	}
+};
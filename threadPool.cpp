@@ -0,0 +1,64 @@
+#include "threadPool.h"
+
+#include <algorithm>
+#include <functional>
+
+//  The one and only instance
+ThreadPool ThreadPool::myInstance;
+
+void ThreadPool::threadFunc()
+{
+    Task t;
+
+    //  "Infinite" loop, only broken on interruption
+    while (!myInterrupt)
+    {
+        //  Pop and execute tasks
+        if (myQueue.pop(t) && !myInterrupt) t();
+    }
+}
+
+void ThreadPool::start(const size_t nThread)
+{
+    lock_guard<mutex> lk(myMutex);
+
+    //  Only start once
+    if (myActive) return;
+
+    myThreads.reserve(nThread);
+
+    //  Launch threads on threadFunc and keep handles in a vector
+    for (size_t i = 0; i < nThread; ++i)
+    {
+        myThreads.push_back(thread(&ThreadPool::threadFunc, this));
+    }
+
+    myActive = true;
+}
+
+void ThreadPool::stop()
+{
+    lock_guard<mutex> lk(myMutex);
+
+    if (!myActive) return;
+
+    //  Interrupt mode
+    myInterrupt = true;
+
+    //  Interrupt all waiting threads
+    myQueue.interrupt();
+
+    //  Wait for all threads to complete
+    for_each(myThreads.begin(), myThreads.end(), mem_fn(&thread::join));
+
+    //  Clear all threads
+    myThreads.clear();
+
+    //  Clear the queue and reset interrupt
+    myQueue.clear();
+    myQueue.resetInterrupt();
+
+    //  Mark as inactive
+    myActive = false;
+    myInterrupt = false;
+}
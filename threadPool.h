@@ -0,0 +1,103 @@
+#pragma once
+
+//  Persistent thread pool
+//  Threads are started once and wait on a concurrent queue of tasks
+//  Client code spawns tasks and waits on their handles
+//  A single instance is shared by all valuations in the process
+
+#include <future>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include "concurrentQueue.h"
+using namespace std;
+
+using Task = packaged_task<bool(void)>;
+using TaskHandle = future<bool>;
+
+class ThreadPool
+{
+    //  The one and only instance
+    static ThreadPool       myInstance;
+
+    //  The task queue
+    ConcurrentQueue<Task>   myQueue;
+
+    //  The threads
+    vector<thread>          myThreads;
+
+    //  Active indicator
+    bool                    myActive;
+
+    //  Interruption indicator
+    atomic<bool>            myInterrupt;
+
+    //  Protects start and stop
+    mutex                   myMutex;
+
+    //  The function executed on every thread: pop and execute tasks until interrupted
+    void threadFunc();
+
+    //  The constructor stays private, ensuring single instance
+    ThreadPool() : myActive(false), myInterrupt(false) {}
+
+public:
+
+    //  Access the instance
+    static ThreadPool* getInstance() { return &myInstance; }
+
+    //  Number of worker threads, excluding the main thread
+    size_t numThreads() const { return myThreads.size(); }
+
+    //  Start the worker threads, only the first call has an effect
+    //  Default: one thread per hardware core, minus the main thread
+    void start(const size_t nThread = thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() - 1 : 0);
+
+    //  Interrupt and join all threads
+    void stop();
+
+    ~ThreadPool() { stop(); }
+
+    //  Forbid copies etc
+    ThreadPool(const ThreadPool& rhs) = delete;
+    ThreadPool& operator=(const ThreadPool& rhs) = delete;
+    ThreadPool(ThreadPool&& rhs) = delete;
+    ThreadPool& operator=(ThreadPool&& rhs) = delete;
+
+    //  Spawn a task, callable must return a bool
+    template <typename Callable>
+    TaskHandle spawnTask(Callable c)
+    {
+        Task t(move(c));
+        TaskHandle f = t.get_future();
+        myQueue.push(move(t));
+        return f;
+    }
+
+    //  Run queued tasks on the caller thread while waiting on a future
+    //  Returns true if at least one task was run
+    bool activeWait(const TaskHandle& f)
+    {
+        Task t;
+        bool b = false;
+
+        //  Check if the future is ready without blocking
+        while (f.wait_for(chrono::seconds(0)) != future_status::ready)
+        {
+            //  Non blocking
+            if (myQueue.tryPop(t))
+            {
+                t();
+                b = true;
+            }
+            //  Nothing in the queue: go to sleep
+            else
+            {
+                f.wait();
+            }
+        }
+
+        return b;
+    }
+};
@@ -7,6 +7,7 @@
 #include "scriptingEvaluator.h"
 #include "scriptingCompiler.h"
 #include "scriptingFuzzyEval.h"
+#include "scriptingBatchEvaluator.h"
 #include "scriptingDomainProc.h"
 #include "scriptingConstCondProc.h"
 #include "scriptingConstProcessor.h"
@@ -10,14 +10,15 @@ class ConstCondProcessor;
 class IfProcessor;
 class DomainProcessor;
 template <class T> class FuzzyEvaluator;
+template <class T> class BatchEvaluator;
 
 //  List
 
 //  Modifying visitors
-#define MVISITORS VarIndexer
+#define MVISITORS VarIndexer, ConstProcessor, ConstCondProcessor, IfProcessor, DomainProcessor
 
 //  Const visitors
-#define CVISITORS Evaluator<double>
+#define CVISITORS Evaluator<double>, BatchEvaluator<double>, Debugger, Compiler, FuzzyEvaluator<double>
 
 //  All visitors
 #define VISITORS MVISITORS , CVISITORS
@@ -46,7 +46,11 @@ extern "C" __declspec(dllexport) myXlOper* TestScript(
 	myXlOper *xEps,
 	myXlOper *xSkipDoms,
     myXlOper *xComp,
-    myXlOper *xNormal){
+    myXlOper *xNormal,
+    myXlOper *xParallel,
+    myXlOper *xRanGen,
+    myXlOper *xReplicas,
+    myXlOper *xBatch){
 	
 	try{
 
@@ -79,10 +83,37 @@ extern "C" __declspec(dllexport) myXlOper* TestScript(
 
         bool normal = bool( *xNormal);
 
+        bool parallel = bool( *xParallel);
+
+        RanGenType ranGen = RanGenType( int( *xRanGen));
+
+        unsigned replicas = (unsigned) int( *xReplicas);
+
+        bool batch = bool( *xBatch);
+
 		vector<string>			varNames;
 		vector<double>			varVals;
 
-		simpleBsScriptVal( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, varNames, varVals);
+        //  Randomized Sobol replicas, with error estimates
+        if( replicas > 1)
+        {
+            vector<double>      varErrs;
+
+            simpleBsScriptValRqmc( today, spot, vol, rate, normal, events, numSim, replicas, seed, fuzzy, eps, skipDoms, comp, varNames, varVals, varErrs, parallel);
+
+            myXlOper res( unsigned(varNames.size()), 3);
+
+            for( unsigned i=0; i<varNames.size(); ++i)
+            {
+                res(i,0) = myXlOper( varNames[i]);
+                res(i,1) = myXlOper( varVals[i]);
+                res(i,2) = myXlOper( varErrs[i]);
+            }
+
+            return return_xloper_raw_ptr (res);
+        }
+
+		simpleBsScriptVal( today, spot, vol, rate, normal, events, numSim, seed, fuzzy, eps, skipDoms, comp, varNames, varVals, parallel, ranGen, batch);
 
 		myXlOper res( unsigned(varNames.size()), 2);
 
@@ -291,9 +322,9 @@ extern "C" __declspec(dllexport) int xlAutoOpen(void)
 
 	Excel12f(xlfRegister, 0, 11, (LPXLOPER12)&xDLL,
 		(LPXLOPER12)TempStr12(L"TestScript"),
-		(LPXLOPER12)TempStr12(L"QQQQQQQQQQQQQQ"),
+		(LPXLOPER12)TempStr12(L"QQQQQQQQQQQQQQQQQQ"),
 		(LPXLOPER12)TempStr12(L"TestScript"),
-		(LPXLOPER12)TempStr12(L"today,spot,vol,rate,{evtDates},{events},numSim,[Seed],[FuzzyEval],[FuzzyEps],[SkipDomains],[Compile],[Normal]"),
+		(LPXLOPER12)TempStr12(L"today,spot,vol,rate,{evtDates},{events},numSim,[Seed],[FuzzyEval],[FuzzyEps],[SkipDomains],[Compile],[Normal],[Parallel],[RanGen],[Replicas],[Batch]"),
 		(LPXLOPER12)TempStr12(L"1"),
 		(LPXLOPER12)TempStr12(L"myOwnCppFunctions"),
 		(LPXLOPER12)TempStr12(L""),